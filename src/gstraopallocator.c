@@ -0,0 +1,353 @@
+/*
+ * gstraopallocator.c: Slab allocator for RAOP packets
+ *
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "gstraopallocator.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_raop_allocator_debug);
+#define GST_CAT_DEFAULT gst_raop_allocator_debug
+
+/* Blocks are allocated by slabs: the first one is allocated with the allocator
+ * and others are added on demand, up to the maximum number of blocks.
+ */
+#define SLAB_BLOCKS 128
+#define MAX_SLABS 32
+
+/* The memory header is stored at start of its block, followed by data which
+ * is aligned on 16 bytes (g_malloc() alignment).
+ */
+#define HEADER_SIZE 128
+#define DATA_SIZE (GST_RAOP_ALLOCATOR_BLOCK_SIZE - HEADER_SIZE)
+#define DATA_ALIGN 15
+
+typedef enum {
+  GST_RAOP_MEMORY_BLOCK = 0,
+  GST_RAOP_MEMORY_SHARE,
+  GST_RAOP_MEMORY_SLICE,
+} GstRaopMemoryKind;
+
+typedef struct _GstRaopMemory GstRaopMemory;
+
+struct _GstRaopMemory {
+  GstMemory mem;
+
+  GstRaopMemoryKind kind;
+  guint8 *data;
+  GstRaopMemory *next;
+};
+
+G_STATIC_ASSERT (sizeof (GstRaopMemory) <= HEADER_SIZE);
+
+typedef struct {
+  guint8 *blocks;
+  gboolean locked;
+  GstRaopMemory shares[SLAB_BLOCKS];
+} GstRaopSlab;
+
+struct _GstRaopAllocator {
+  GstAllocator parent;
+
+  GMutex lock;
+  GstRaopSlab *slabs[MAX_SLABS];
+  guint slab_count;
+  guint max_slabs;
+  GstRaopMemory *free_blocks;
+  GstRaopMemory *free_shares;
+  gboolean mlock;
+  guint locked;
+
+  /* Statistics */
+  guint used;
+  guint peak;
+  guint64 hits;
+  guint64 fallbacks;
+  guint64 shares;
+  guint64 share_fallbacks;
+};
+
+struct _GstRaopAllocatorClass {
+  GstAllocatorClass parent_class;
+};
+
+#define gst_raop_allocator_parent_class parent_class
+G_DEFINE_TYPE (GstRaopAllocator, gst_raop_allocator, GST_TYPE_ALLOCATOR);
+
+static GstMemory *gst_raop_allocator_alloc (
+    GstAllocator *allocator, gsize size, GstAllocationParams *params);
+static void gst_raop_allocator_free (GstAllocator *allocator, GstMemory *mem);
+static void gst_raop_allocator_finalize (GObject *object);
+
+static gpointer gst_raop_memory_map (GstMemory *mem, gsize maxsize,
+    GstMapFlags flags);
+static void gst_raop_memory_unmap (GstMemory *mem);
+static GstMemory *gst_raop_memory_share (
+    GstMemory *mem, gssize offset, gssize size);
+
+static void
+gst_raop_allocator_class_init (GstRaopAllocatorClass *klass)
+{
+  GstAllocatorClass *allocator_class = GST_ALLOCATOR_CLASS (klass);
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  allocator_class->alloc = gst_raop_allocator_alloc;
+  allocator_class->free = gst_raop_allocator_free;
+  gobject_class->finalize = gst_raop_allocator_finalize;
+
+  GST_DEBUG_CATEGORY_INIT (
+      gst_raop_allocator_debug, "raopallocator", 0, "RAOP slab allocator");
+}
+
+static void
+gst_raop_allocator_init (GstRaopAllocator *raop)
+{
+  GstAllocator *allocator = GST_ALLOCATOR_CAST (raop);
+
+  allocator->mem_type = GST_RAOP_ALLOCATOR_MEMORY_TYPE;
+  allocator->mem_map = gst_raop_memory_map;
+  allocator->mem_unmap = gst_raop_memory_unmap;
+  allocator->mem_share = gst_raop_memory_share;
+
+  g_mutex_init (&raop->lock);
+  raop->max_slabs = 1;
+}
+
+static void
+gst_raop_allocator_finalize (GObject *object)
+{
+  GstRaopAllocator *raop = GST_RAOP_ALLOCATOR (object);
+  guint i;
+
+  /* All memories are released since each of them holds a reference */
+  GST_DEBUG_OBJECT (raop, "release %u slabs", raop->slab_count);
+  for (i = 0; i < raop->slab_count; i++) {
+    if (raop->slabs[i]->locked)
+      munlock (raop->slabs[i]->blocks,
+          SLAB_BLOCKS * GST_RAOP_ALLOCATOR_BLOCK_SIZE);
+    g_free (raop->slabs[i]->blocks);
+    g_free (raop->slabs[i]);
+  }
+  g_mutex_clear (&raop->lock);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+/* Must be called with lock held */
+static gboolean
+gst_raop_allocator_add_slab (GstRaopAllocator *raop)
+{
+  GstRaopSlab *slab;
+  gint i;
+
+  if (raop->slab_count >= raop->max_slabs)
+    return FALSE;
+
+  /* Allocate a new slab */
+  slab = g_new0 (GstRaopSlab, 1);
+  slab->blocks = g_malloc (SLAB_BLOCKS * GST_RAOP_ALLOCATOR_BLOCK_SIZE);
+  raop->slabs[raop->slab_count++] = slab;
+
+  /* Keep packet memory in RAM to avoid page faults while streaming */
+  if (raop->mlock) {
+    if (mlock (slab->blocks, SLAB_BLOCKS * GST_RAOP_ALLOCATOR_BLOCK_SIZE))
+      GST_WARNING_OBJECT (raop, "failed to lock slab");
+    else {
+      slab->locked = TRUE;
+      raop->locked++;
+    }
+  }
+
+  /* Add its blocks and share headers to free lists */
+  for (i = SLAB_BLOCKS - 1; i >= 0; i--) {
+    GstRaopMemory *mem;
+
+    mem = (GstRaopMemory *) (slab->blocks +
+                             i * GST_RAOP_ALLOCATOR_BLOCK_SIZE);
+    mem->kind = GST_RAOP_MEMORY_BLOCK;
+    mem->data = (guint8 *) mem + HEADER_SIZE;
+    mem->next = raop->free_blocks;
+    raop->free_blocks = mem;
+
+    mem = &slab->shares[i];
+    mem->kind = GST_RAOP_MEMORY_SHARE;
+    mem->next = raop->free_shares;
+    raop->free_shares = mem;
+  }
+
+  GST_DEBUG_OBJECT (raop, "new slab %u/%u", raop->slab_count, raop->max_slabs);
+
+  return TRUE;
+}
+
+static GstMemory *
+gst_raop_allocator_alloc (
+    GstAllocator *allocator, gsize size, GstAllocationParams *params)
+{
+  GstRaopAllocator *raop = GST_RAOP_ALLOCATOR (allocator);
+  GstRaopMemory *mem = NULL;
+  gsize maxsize;
+
+  /* Get a free block */
+  maxsize = size + params->prefix + params->padding;
+  g_mutex_lock (&raop->lock);
+  if (maxsize <= DATA_SIZE && params->align <= DATA_ALIGN &&
+      (raop->free_blocks || gst_raop_allocator_add_slab (raop))) {
+    mem = raop->free_blocks;
+    raop->free_blocks = mem->next;
+    if (++raop->used > raop->peak)
+      raop->peak = raop->used;
+    raop->hits++;
+  } else
+    raop->fallbacks++;
+  g_mutex_unlock (&raop->lock);
+
+  /* Too big or no more blocks: use system memory */
+  if (!mem) {
+    GST_LOG_OBJECT (raop, "fallback for %" G_GSIZE_FORMAT " bytes", size);
+    return gst_allocator_alloc (NULL, size, params);
+  }
+
+  /* Initialize memory */
+  gst_memory_init (GST_MEMORY_CAST (mem), params->flags, allocator, NULL,
+      maxsize, params->align, params->prefix, size);
+
+  /* Clear prefix and padding when requested */
+  if (params->prefix && (params->flags & GST_MEMORY_FLAG_ZERO_PREFIXED))
+    memset (mem->data, 0, params->prefix);
+  if (params->padding && (params->flags & GST_MEMORY_FLAG_ZERO_PADDED))
+    memset (mem->data + params->prefix + size, 0, params->padding);
+
+  return GST_MEMORY_CAST (mem);
+}
+
+static void
+gst_raop_allocator_free (GstAllocator *allocator, GstMemory *memory)
+{
+  GstRaopAllocator *raop = GST_RAOP_ALLOCATOR (allocator);
+  GstRaopMemory *mem = (GstRaopMemory *) memory;
+
+  switch (mem->kind) {
+  case GST_RAOP_MEMORY_BLOCK:
+    g_mutex_lock (&raop->lock);
+    mem->next = raop->free_blocks;
+    raop->free_blocks = mem;
+    raop->used--;
+    g_mutex_unlock (&raop->lock);
+    break;
+  case GST_RAOP_MEMORY_SHARE:
+    g_mutex_lock (&raop->lock);
+    mem->next = raop->free_shares;
+    raop->free_shares = mem;
+    g_mutex_unlock (&raop->lock);
+    break;
+  default:
+    g_slice_free (GstRaopMemory, mem);
+  }
+}
+
+static gpointer
+gst_raop_memory_map (GstMemory *mem, gsize maxsize, GstMapFlags flags)
+{
+  return ((GstRaopMemory *) mem)->data;
+}
+
+static void
+gst_raop_memory_unmap (GstMemory *mem)
+{
+}
+
+static GstMemory *
+gst_raop_memory_share (GstMemory *memory, gssize offset, gssize size)
+{
+  GstRaopAllocator *raop = GST_RAOP_ALLOCATOR (memory->allocator);
+  GstRaopMemory *mem = (GstRaopMemory *) memory;
+  GstRaopMemory *sub;
+  GstMemory *parent;
+
+  /* Get a share header from slabs */
+  g_mutex_lock (&raop->lock);
+  sub = raop->free_shares;
+  if (sub) {
+    raop->free_shares = sub->next;
+    raop->shares++;
+  } else
+    raop->share_fallbacks++;
+  g_mutex_unlock (&raop->lock);
+
+  /* No more header available */
+  if (!sub) {
+    sub = g_slice_new (GstRaopMemory);
+    sub->kind = GST_RAOP_MEMORY_SLICE;
+  }
+
+  /* Find the real parent */
+  parent = memory->parent ? memory->parent : memory;
+  if (size == -1)
+    size = memory->size - offset;
+
+  /* Share data of parent block */
+  gst_memory_init (GST_MEMORY_CAST (sub),
+      GST_MINI_OBJECT_FLAGS (parent) | GST_MINI_OBJECT_FLAG_LOCK_READONLY,
+      memory->allocator, parent, memory->maxsize, memory->align,
+      memory->offset + offset, size);
+  sub->data = mem->data;
+
+  return GST_MEMORY_CAST (sub);
+}
+
+GstAllocator *
+gst_raop_allocator_new (guint max_blocks, gboolean lock)
+{
+  GstRaopAllocator *raop;
+
+  raop = g_object_new (GST_TYPE_RAOP_ALLOCATOR, NULL);
+  gst_object_ref_sink (raop);
+  raop->mlock = lock;
+
+  /* Allocate first slab */
+  raop->max_slabs = (max_blocks + SLAB_BLOCKS - 1) / SLAB_BLOCKS;
+  raop->max_slabs = CLAMP (raop->max_slabs, 1, MAX_SLABS);
+  gst_raop_allocator_add_slab (raop);
+
+  return GST_ALLOCATOR_CAST (raop);
+}
+
+void
+gst_raop_allocator_dump (GstRaopAllocator *raop, GString *str)
+{
+  guint64 total;
+
+  g_mutex_lock (&raop->lock);
+  total = raop->hits + raop->fallbacks;
+  g_string_append_printf (str,
+      "slabs: %u/%u (%u KiB) locked=%u\n"
+      "blocks: used=%u peak=%u\n"
+      "hits: %" G_GUINT64_FORMAT " (%.1f%%) fallbacks=%" G_GUINT64_FORMAT "\n"
+      "shares: %" G_GUINT64_FORMAT " fallbacks=%" G_GUINT64_FORMAT "\n",
+      raop->slab_count, raop->max_slabs,
+      raop->slab_count * SLAB_BLOCKS * GST_RAOP_ALLOCATOR_BLOCK_SIZE / 1024,
+      raop->locked,
+      raop->used, raop->peak, raop->hits,
+      total ? raop->hits * 100.0 / total : 0.0, raop->fallbacks, raop->shares,
+      raop->share_fallbacks);
+  g_mutex_unlock (&raop->lock);
+}
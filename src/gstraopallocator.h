@@ -0,0 +1,52 @@
+/*
+ * gstraopallocator.h: Slab allocator for RAOP packets
+ *
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __GST_RAOP_ALLOCATOR_H__
+#define __GST_RAOP_ALLOCATOR_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_RAOP_ALLOCATOR (gst_raop_allocator_get_type ())
+#define GST_RAOP_ALLOCATOR(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_TYPE_RAOP_ALLOCATOR, \
+      GstRaopAllocator))
+#define GST_IS_RAOP_ALLOCATOR(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GST_TYPE_RAOP_ALLOCATOR))
+
+#define GST_RAOP_ALLOCATOR_MEMORY_TYPE "RaopMemory"
+
+/* A block can hold any RAOP packet (MTU sized) with its RTP header */
+#define GST_RAOP_ALLOCATOR_BLOCK_SIZE 2048
+
+typedef struct _GstRaopAllocator GstRaopAllocator;
+typedef struct _GstRaopAllocatorClass GstRaopAllocatorClass;
+
+GType gst_raop_allocator_get_type (void);
+
+GstAllocator *gst_raop_allocator_new (guint max_blocks, gboolean lock);
+
+void gst_raop_allocator_dump (GstRaopAllocator *allocator, GString *str);
+
+G_END_DECLS
+
+#endif /* __GST_RAOP_ALLOCATOR_H__ */
@@ -0,0 +1,610 @@
+/*
+ * gstraopeq.c: Biquad equalizer for RAOP streams
+ *
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <gst/gst.h>
+#include <gst/audio/audio.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "gstraopeq.h"
+
+#define MAX_CHANNELS 8
+#define MAX_SECTIONS 16
+
+/* Frames converted to float at once */
+#define CHUNK_FRAMES 256
+
+GST_DEBUG_CATEGORY_STATIC (gst_raop_eq_debug);
+#define GST_CAT_DEFAULT gst_raop_eq_debug
+
+typedef enum {
+  SECTION_PEAK = 0,
+  SECTION_LOW_SHELF,
+  SECTION_HIGH_SHELF,
+  SECTION_LOW_PASS,
+  SECTION_HIGH_PASS,
+} SectionType;
+
+static const gchar *section_types[] = {
+    "peak",
+    "lowshelf",
+    "highshelf",
+    "lowpass",
+    "highpass",
+};
+
+typedef struct {
+  SectionType type;
+  gdouble freq;
+  gdouble gain;
+  gdouble q;
+} Section;
+
+/* Two sections on stereo frames, in 4 lanes: lanes 0-1 run the first section
+ * on frame n while lanes 2-3 run the second section on frame n - 1, so one
+ * vector operation advances both channels of both sections.
+ */
+typedef struct {
+  gfloat b0[4], b1[4], b2[4], a1[4], a2[4];
+  gfloat z1[4], z2[4];
+} SectionPair;
+
+struct _GstRaopEqPrivate {
+  /* Sections from property, protected by object lock */
+  gchar *bands;
+  Section sections[MAX_SECTIONS];
+  guint count;
+  gboolean dirty;
+
+  /* Coefficients, duplicated in section pairs for stereo */
+  gfloat coefs[MAX_SECTIONS][5];
+  gfloat state[MAX_SECTIONS][MAX_CHANNELS][2];
+  SectionPair pairs[MAX_SECTIONS / 2];
+  guint pair_count;
+  guint active;
+
+  /* Processing cost (time in ns) */
+  guint64 time;
+  guint64 samples;
+};
+
+enum {
+  PROP_0,
+  PROP_BANDS,
+  PROP_COST,
+};
+
+#define gst_raop_eq_parent_class parent_class
+G_DEFINE_TYPE_WITH_PRIVATE (GstRaopEq, gst_raop_eq, GST_TYPE_AUDIO_FILTER);
+
+static void gst_raop_eq_finalize (GObject *object);
+static void gst_raop_eq_set_property (
+    GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec);
+static void gst_raop_eq_get_property (
+    GObject *object, guint prop_id, GValue *value, GParamSpec *pspec);
+
+static gboolean gst_raop_eq_setup (
+    GstAudioFilter *filter, const GstAudioInfo *info);
+static GstFlowReturn gst_raop_eq_transform_ip (
+    GstBaseTransform *trans, GstBuffer *buf);
+
+static void
+gst_raop_eq_class_init (GstRaopEqClass *klass)
+{
+  GObjectClass *gobject_class;
+  GstElementClass *gstelement_class;
+  GstBaseTransformClass *trans_class;
+  GstAudioFilterClass *filter_class;
+  GstCaps *caps;
+
+  gobject_class = (GObjectClass *) klass;
+  gstelement_class = (GstElementClass *) klass;
+  trans_class = (GstBaseTransformClass *) klass;
+  filter_class = (GstAudioFilterClass *) klass;
+
+  gobject_class->finalize = gst_raop_eq_finalize;
+  gobject_class->set_property = gst_raop_eq_set_property;
+  gobject_class->get_property = gst_raop_eq_get_property;
+
+  g_object_class_install_property (gobject_class, PROP_BANDS,
+      g_param_spec_string ("bands", "Bands",
+          "Comma separated list of sections as type:freq:gain:q, with type "
+          "one of peak, lowshelf, highshelf, lowpass or highpass",
+          NULL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING |
+              G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_COST,
+      g_param_spec_double ("cost", "Cost",
+          "Average processing time per sample and section (in ns)", 0,
+          G_MAXDOUBLE, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  gst_element_class_set_details_simple (gstelement_class,
+      "RAOP equalizer", "Filter/Effect/Audio",
+      "A cascade of biquad filters for speaker and room correction",
+      "Alexandre Dilly <alexandre.dilly@sparod.com>");
+
+  caps = gst_caps_from_string (GST_AUDIO_CAPS_MAKE (
+      "{ " GST_AUDIO_NE (S16) ", " GST_AUDIO_NE (F32) " }"));
+  gst_audio_filter_class_add_pad_templates (filter_class, caps);
+  gst_caps_unref (caps);
+
+  filter_class->setup = GST_DEBUG_FUNCPTR (gst_raop_eq_setup);
+  trans_class->transform_ip = GST_DEBUG_FUNCPTR (gst_raop_eq_transform_ip);
+  trans_class->transform_ip_on_passthrough = FALSE;
+}
+
+static void
+gst_raop_eq_init (GstRaopEq *eq)
+{
+  eq->priv = gst_raop_eq_get_instance_private (eq);
+  gst_base_transform_set_in_place (GST_BASE_TRANSFORM (eq), TRUE);
+}
+
+static void
+gst_raop_eq_finalize (GObject *object)
+{
+  GstRaopEq *eq = GST_RAOP_EQ (object);
+
+  g_free (eq->priv->bands);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static guint
+gst_raop_eq_parse (const gchar *bands, Section *sections)
+{
+  gchar **list;
+  guint count = 0;
+  guint i, t;
+
+  if (!bands)
+    return 0;
+
+  list = g_strsplit (bands, ",", -1);
+  for (i = 0; list[i] && count < MAX_SECTIONS; i++) {
+    Section *s = &sections[count];
+    gchar **fields;
+
+    /* type:freq:gain:q */
+    fields = g_strsplit (g_strstrip (list[i]), ":", 4);
+    if (g_strv_length (fields) != 4) {
+      if (*list[i])
+        GST_WARNING ("invalid section: %s", list[i]);
+      g_strfreev (fields);
+      continue;
+    }
+
+    for (t = 0; t < G_N_ELEMENTS (section_types); t++)
+      if (!g_ascii_strcasecmp (fields[0], section_types[t]))
+        break;
+    s->type = t;
+    s->freq = g_ascii_strtod (fields[1], NULL);
+    s->gain = g_ascii_strtod (fields[2], NULL);
+    s->q = g_ascii_strtod (fields[3], NULL);
+    g_strfreev (fields);
+
+    if (t == G_N_ELEMENTS (section_types) || s->freq <= 0 || s->q <= 0) {
+      GST_WARNING ("invalid section: %s", list[i]);
+      continue;
+    }
+    count++;
+  }
+  g_strfreev (list);
+
+  return count;
+}
+
+static void
+gst_raop_eq_set_property (
+    GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+  GstRaopEq *eq = GST_RAOP_EQ (object);
+  GstRaopEqPrivate *priv = eq->priv;
+  const gchar *bands;
+
+  switch (prop_id) {
+  case PROP_BANDS:
+    bands = g_value_get_string (value);
+    GST_OBJECT_LOCK (eq);
+    if (g_strcmp0 (bands, priv->bands)) {
+      g_free (priv->bands);
+      priv->bands = g_strdup (bands);
+      priv->count = gst_raop_eq_parse (bands, priv->sections);
+      priv->dirty = TRUE;
+    }
+    GST_OBJECT_UNLOCK (eq);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
+static void
+gst_raop_eq_get_property (
+    GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+  GstRaopEq *eq = GST_RAOP_EQ (object);
+  GstRaopEqPrivate *priv = eq->priv;
+
+  switch (prop_id) {
+  case PROP_BANDS:
+    GST_OBJECT_LOCK (eq);
+    g_value_set_string (value, priv->bands);
+    GST_OBJECT_UNLOCK (eq);
+    break;
+  case PROP_COST:
+    GST_OBJECT_LOCK (eq);
+    g_value_set_double (value,
+        priv->samples ? (gdouble) priv->time / priv->samples : 0.0);
+    GST_OBJECT_UNLOCK (eq);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
+static void
+gst_raop_eq_compute (const Section *s, gdouble rate, gfloat *coefs)
+{
+  gdouble w0, cw, alpha, a, sa, b0, b1, b2, a0, a1, a2;
+
+  /* Audio EQ cookbook (R. Bristow-Johnson) */
+  w0 = 2.0 * G_PI * MIN (s->freq, rate * 0.49) / rate;
+  cw = cos (w0);
+  alpha = sin (w0) / (2.0 * s->q);
+  a = pow (10.0, s->gain / 40.0);
+  sa = 2.0 * sqrt (a) * alpha;
+
+  switch (s->type) {
+  case SECTION_LOW_SHELF:
+    b0 = a * ((a + 1) - (a - 1) * cw + sa);
+    b1 = 2 * a * ((a - 1) - (a + 1) * cw);
+    b2 = a * ((a + 1) - (a - 1) * cw - sa);
+    a0 = (a + 1) + (a - 1) * cw + sa;
+    a1 = -2 * ((a - 1) + (a + 1) * cw);
+    a2 = (a + 1) + (a - 1) * cw - sa;
+    break;
+  case SECTION_HIGH_SHELF:
+    b0 = a * ((a + 1) + (a - 1) * cw + sa);
+    b1 = -2 * a * ((a - 1) + (a + 1) * cw);
+    b2 = a * ((a + 1) + (a - 1) * cw - sa);
+    a0 = (a + 1) - (a - 1) * cw + sa;
+    a1 = 2 * ((a - 1) - (a + 1) * cw);
+    a2 = (a + 1) - (a - 1) * cw - sa;
+    break;
+  case SECTION_LOW_PASS:
+    b0 = (1 - cw) / 2;
+    b1 = 1 - cw;
+    b2 = (1 - cw) / 2;
+    a0 = 1 + alpha;
+    a1 = -2 * cw;
+    a2 = 1 - alpha;
+    break;
+  case SECTION_HIGH_PASS:
+    b0 = (1 + cw) / 2;
+    b1 = -(1 + cw);
+    b2 = (1 + cw) / 2;
+    a0 = 1 + alpha;
+    a1 = -2 * cw;
+    a2 = 1 - alpha;
+    break;
+  case SECTION_PEAK:
+  default:
+    b0 = 1 + alpha * a;
+    b1 = -2 * cw;
+    b2 = 1 - alpha * a;
+    a0 = 1 + alpha / a;
+    a1 = -2 * cw;
+    a2 = 1 - alpha / a;
+    break;
+  }
+
+  /* Normalize */
+  coefs[0] = b0 / a0;
+  coefs[1] = b1 / a0;
+  coefs[2] = b2 / a0;
+  coefs[3] = a1 / a0;
+  coefs[4] = a2 / a0;
+}
+
+static void
+gst_raop_eq_update (GstRaopEqPrivate *priv, guint rate)
+{
+  static const gfloat identity[5] = {1.f, 0.f, 0.f, 0.f, 0.f};
+  guint i, l;
+
+  /* Compute coefficients of each section */
+  for (i = 0; i < priv->count; i++)
+    gst_raop_eq_compute (&priv->sections[i], rate, priv->coefs[i]);
+  priv->active = priv->count;
+
+  /* Pack sections by pairs, last one with identity if odd */
+  priv->pair_count = (priv->count + 1) / 2;
+  for (i = 0; i < priv->pair_count; i++) {
+    SectionPair *p = &priv->pairs[i];
+
+    for (l = 0; l < 4; l++) {
+      guint s = i * 2 + l / 2;
+      const gfloat *c = s < priv->count ? priv->coefs[s] : identity;
+
+      p->b0[l] = c[0];
+      p->b1[l] = c[1];
+      p->b2[l] = c[2];
+      p->a1[l] = c[3];
+      p->a2[l] = c[4];
+    }
+  }
+  priv->dirty = FALSE;
+}
+
+static gboolean
+gst_raop_eq_setup (GstAudioFilter *filter, const GstAudioInfo *info)
+{
+  GstRaopEq *eq = GST_RAOP_EQ (filter);
+  GstRaopEqPrivate *priv = eq->priv;
+  guint i;
+
+  if (GST_AUDIO_INFO_CHANNELS (info) > MAX_CHANNELS)
+    return FALSE;
+
+  /* Coefficients depend on sample rate */
+  GST_OBJECT_LOCK (eq);
+  gst_raop_eq_update (priv, GST_AUDIO_INFO_RATE (info));
+  memset (priv->state, 0, sizeof (priv->state));
+  for (i = 0; i < G_N_ELEMENTS (priv->pairs); i++) {
+    memset (priv->pairs[i].z1, 0, sizeof (priv->pairs[i].z1));
+    memset (priv->pairs[i].z2, 0, sizeof (priv->pairs[i].z2));
+  }
+  GST_OBJECT_UNLOCK (eq);
+
+  return TRUE;
+}
+
+static inline gfloat
+gst_raop_eq_tick (SectionPair *p, guint l, gfloat x)
+{
+  gfloat y = p->b0[l] * x + p->z1[l];
+
+  /* Transposed direct form II */
+  p->z1[l] = p->b1[l] * x - p->a1[l] * y + p->z2[l];
+  p->z2[l] = p->b2[l] * x - p->a2[l] * y;
+
+  return y;
+}
+
+static void
+gst_raop_eq_process_pair (SectionPair *p, gfloat *buf, guint frames)
+{
+  gfloat c0, c1;
+  guint i = 1;
+
+  if (!frames)
+    return;
+
+  /* Head: first section on first frame */
+  c0 = gst_raop_eq_tick (p, 0, buf[0]);
+  c1 = gst_raop_eq_tick (p, 1, buf[1]);
+
+#if defined(__SSE2__)
+  {
+    const __m128 b0 = _mm_loadu_ps (p->b0), b1 = _mm_loadu_ps (p->b1);
+    const __m128 b2 = _mm_loadu_ps (p->b2), a1 = _mm_loadu_ps (p->a1);
+    const __m128 a2 = _mm_loadu_ps (p->a2);
+    __m128 z1 = _mm_loadu_ps (p->z1), z2 = _mm_loadu_ps (p->z2);
+    __m128 y = _mm_setr_ps (c0, c1, 0.f, 0.f);
+    gfloat out[4];
+
+    for (; i < frames; i++) {
+      __m128 x;
+
+      /* Frame n on lanes 0-1, first section output of n - 1 on lanes 2-3 */
+      x = _mm_loadl_pi (_mm_setzero_ps (), (const __m64 *) (buf + i * 2));
+      x = _mm_movelh_ps (x, y);
+
+      y = _mm_add_ps (_mm_mul_ps (b0, x), z1);
+      z1 = _mm_add_ps (_mm_sub_ps (_mm_mul_ps (b1, x), _mm_mul_ps (a1, y)), z2);
+      z2 = _mm_sub_ps (_mm_mul_ps (b2, x), _mm_mul_ps (a2, y));
+
+      _mm_storeh_pi ((__m64 *) (buf + (i - 1) * 2), y);
+    }
+    _mm_storeu_ps (p->z1, z1);
+    _mm_storeu_ps (p->z2, z2);
+    _mm_storeu_ps (out, y);
+    c0 = out[0];
+    c1 = out[1];
+  }
+#elif defined(__ARM_NEON)
+  {
+    const float32x4_t b0 = vld1q_f32 (p->b0), b1 = vld1q_f32 (p->b1);
+    const float32x4_t b2 = vld1q_f32 (p->b2), a1 = vld1q_f32 (p->a1);
+    const float32x4_t a2 = vld1q_f32 (p->a2);
+    float32x4_t z1 = vld1q_f32 (p->z1), z2 = vld1q_f32 (p->z2);
+    float32x2_t c = {c0, c1};
+    float32x4_t y;
+
+    for (; i < frames; i++) {
+      float32x4_t x;
+
+      /* Frame n on lanes 0-1, first section output of n - 1 on lanes 2-3 */
+      x = vcombine_f32 (vld1_f32 (buf + i * 2), c);
+
+      y = vmlaq_f32 (z1, b0, x);
+      z1 = vmlsq_f32 (vmlaq_f32 (z2, b1, x), a1, y);
+      z2 = vmlsq_f32 (vmulq_f32 (b2, x), a2, y);
+
+      vst1_f32 (buf + (i - 1) * 2, vget_high_f32 (y));
+      c = vget_low_f32 (y);
+    }
+    vst1q_f32 (p->z1, z1);
+    vst1q_f32 (p->z2, z2);
+    c0 = vget_lane_f32 (c, 0);
+    c1 = vget_lane_f32 (c, 1);
+  }
+#endif
+
+  /* Remaining frames */
+  for (; i < frames; i++) {
+    gfloat x0 = buf[i * 2], x1 = buf[i * 2 + 1];
+
+    buf[(i - 1) * 2] = gst_raop_eq_tick (p, 2, c0);
+    buf[(i - 1) * 2 + 1] = gst_raop_eq_tick (p, 3, c1);
+    c0 = gst_raop_eq_tick (p, 0, x0);
+    c1 = gst_raop_eq_tick (p, 1, x1);
+  }
+
+  /* Tail: second section on last frame */
+  buf[(frames - 1) * 2] = gst_raop_eq_tick (p, 2, c0);
+  buf[(frames - 1) * 2 + 1] = gst_raop_eq_tick (p, 3, c1);
+}
+
+static void
+gst_raop_eq_process_generic (
+    GstRaopEqPrivate *priv, gfloat *buf, guint frames, guint channels)
+{
+  guint s, i, c;
+
+  for (s = 0; s < priv->active; s++) {
+    const gfloat *k = priv->coefs[s];
+
+    for (c = 0; c < channels; c++) {
+      gfloat z1 = priv->state[s][c][0], z2 = priv->state[s][c][1];
+
+      for (i = 0; i < frames; i++) {
+        gfloat x = buf[i * channels + c];
+        gfloat y = k[0] * x + z1;
+
+        z1 = k[1] * x - k[3] * y + z2;
+        z2 = k[2] * x - k[4] * y;
+        buf[i * channels + c] = y;
+      }
+      priv->state[s][c][0] = z1;
+      priv->state[s][c][1] = z2;
+    }
+  }
+}
+
+static void
+gst_raop_eq_process (
+    GstRaopEqPrivate *priv, gfloat *buf, guint frames, guint channels)
+{
+  guint i;
+
+  if (channels != 2) {
+    gst_raop_eq_process_generic (priv, buf, frames, channels);
+    return;
+  }
+
+  for (i = 0; i < priv->pair_count; i++)
+    gst_raop_eq_process_pair (&priv->pairs[i], buf, frames);
+}
+
+static guint64
+gst_raop_eq_now (void)
+{
+  struct timespec ts;
+
+  /* a buffer is processed in a few us: microseconds are too coarse */
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (guint64) ts.tv_sec * G_GUINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
+static GstFlowReturn
+gst_raop_eq_transform_ip (GstBaseTransform *trans, GstBuffer *buf)
+{
+  GstRaopEq *eq = GST_RAOP_EQ (trans);
+  GstAudioFilter *filter = GST_AUDIO_FILTER (trans);
+  GstRaopEqPrivate *priv = eq->priv;
+  GstAudioInfo *info = &filter->info;
+  gfloat chunk[CHUNK_FRAMES * MAX_CHANNELS];
+  guint channels, frames, i, j, n, len;
+  gboolean is_s16;
+  GstMapInfo map;
+  guint64 start;
+
+  channels = GST_AUDIO_INFO_CHANNELS (info);
+  is_s16 = GST_AUDIO_INFO_FORMAT (info) == GST_AUDIO_FORMAT_S16;
+  if (!channels || channels > MAX_CHANNELS)
+    return GST_FLOW_NOT_NEGOTIATED;
+
+  /* Recompute coefficients only when bands changed */
+  GST_OBJECT_LOCK (eq);
+  if (priv->dirty)
+    gst_raop_eq_update (priv, GST_AUDIO_INFO_RATE (info));
+  GST_OBJECT_UNLOCK (eq);
+
+  if (!priv->active)
+    return GST_FLOW_OK;
+
+  if (!gst_buffer_map (buf, &map, GST_MAP_READWRITE))
+    return GST_FLOW_ERROR;
+  frames = map.size / GST_AUDIO_INFO_BPF (info);
+  start = gst_raop_eq_now ();
+
+  if (!is_s16) {
+    /* Process in place */
+    gst_raop_eq_process (priv, (gfloat *) map.data, frames, channels);
+  } else {
+    gint16 *data = (gint16 *) map.data;
+
+    /* Process by chunks of float samples */
+    for (i = 0; i < frames; i += n) {
+      n = MIN (frames - i, CHUNK_FRAMES);
+      len = n * channels;
+
+      for (j = 0; j < len; j++)
+        chunk[j] = data[j];
+      gst_raop_eq_process (priv, chunk, n, channels);
+      for (j = 0; j < len; j++)
+        data[j] = (gint16) CLAMP (lrintf (chunk[j]), G_MININT16, G_MAXINT16);
+      data += len;
+    }
+  }
+
+  /* Account processing time */
+  GST_OBJECT_LOCK (eq);
+  priv->time += gst_raop_eq_now () - start;
+  priv->samples += (guint64) frames * channels * priv->active;
+  GST_OBJECT_UNLOCK (eq);
+
+  gst_buffer_unmap (buf, &map);
+
+  return GST_FLOW_OK;
+}
+
+gboolean
+gst_raop_eq_plugin_init (GstPlugin *plugin)
+{
+  GST_DEBUG_CATEGORY_INIT (gst_raop_eq_debug, "raopeq", 0, "RAOP equalizer");
+
+  return gst_element_register (
+      plugin, "raopeq", GST_RANK_NONE, GST_TYPE_RAOP_EQ);
+}
@@ -0,0 +1,518 @@
+/*
+ * gstraoploudness.c: EBU R128 loudness normalization for RAOP streams
+ *
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <gst/gst.h>
+#include <gst/audio/audio.h>
+
+#include "gstraoploudness.h"
+
+#define DEFAULT_TARGET -18.0
+#define DEFAULT_MAX_GAIN 12.0
+
+#define MAX_CHANNELS 8
+
+/* Gating blocks of 400 ms, with a step of 100 ms (75% overlap) */
+#define BLOCK_MS 100
+#define GATE_BLOCKS 4
+
+/* Gates (in LUFS and LU) */
+#define ABSOLUTE_GATE -70.0
+#define RELATIVE_GATE -10.0
+
+/* Gated blocks are counted in a histogram of 0.1 LU bins, from the absolute
+ * gate to +5 LUFS, so integration is done in a fixed memory.
+ */
+#define HISTOGRAM_STEP 0.1
+#define HISTOGRAM_BINS 750
+
+/* Gain is applied after 3 seconds and follows loudness at 1 dB/s */
+#define MIN_BLOCKS 30
+#define GAIN_SLEW 1.0
+
+GST_DEBUG_CATEGORY_STATIC (gst_raop_loudness_debug);
+#define GST_CAT_DEFAULT gst_raop_loudness_debug
+
+/* Energy of each histogram bin, at its center */
+static gdouble histogram_energy[HISTOGRAM_BINS];
+
+struct _GstRaopLoudnessPrivate {
+  /* Settings, protected by object lock */
+  gdouble target;
+  gdouble max_gain;
+
+  /* K-weighting filter: high shelf and high pass */
+  gdouble coefs[2][5];
+  gdouble state[MAX_CHANNELS][2][2];
+
+  /* Current 100 ms block */
+  guint block_frames;
+  guint block_pos;
+  gdouble block_sum;
+
+  /* Last 4 blocks and histogram of gated blocks */
+  gdouble blocks[GATE_BLOCKS];
+  guint block_index;
+  guint block_count;
+  guint32 histogram[HISTOGRAM_BINS];
+  guint64 gated;
+
+  /* Measures (in LUFS), protected by object lock */
+  gdouble momentary;
+  gdouble integrated;
+
+  /* Applied gain (in dB) and linear gain ramp on current block */
+  gdouble gain;
+  gdouble lin_gain;
+  gdouble lin_step;
+
+  /* Processing cost */
+  guint64 time;
+  guint64 samples;
+};
+
+enum {
+  PROP_0,
+  PROP_TARGET,
+  PROP_MAX_GAIN,
+  PROP_MOMENTARY,
+  PROP_INTEGRATED,
+  PROP_GAIN,
+  PROP_COST,
+};
+
+#define gst_raop_loudness_parent_class parent_class
+G_DEFINE_TYPE_WITH_PRIVATE (
+    GstRaopLoudness, gst_raop_loudness, GST_TYPE_AUDIO_FILTER);
+
+static void gst_raop_loudness_set_property (
+    GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec);
+static void gst_raop_loudness_get_property (
+    GObject *object, guint prop_id, GValue *value, GParamSpec *pspec);
+
+static gboolean gst_raop_loudness_setup (
+    GstAudioFilter *filter, const GstAudioInfo *info);
+static gboolean gst_raop_loudness_sink_event (
+    GstBaseTransform *trans, GstEvent *event);
+static GstFlowReturn gst_raop_loudness_transform_ip (
+    GstBaseTransform *trans, GstBuffer *buf);
+
+static void
+gst_raop_loudness_class_init (GstRaopLoudnessClass *klass)
+{
+  GObjectClass *gobject_class;
+  GstElementClass *gstelement_class;
+  GstBaseTransformClass *trans_class;
+  GstAudioFilterClass *filter_class;
+  GstCaps *caps;
+  guint i;
+
+  gobject_class = (GObjectClass *) klass;
+  gstelement_class = (GstElementClass *) klass;
+  trans_class = (GstBaseTransformClass *) klass;
+  filter_class = (GstAudioFilterClass *) klass;
+
+  gobject_class->set_property = gst_raop_loudness_set_property;
+  gobject_class->get_property = gst_raop_loudness_get_property;
+
+  g_object_class_install_property (gobject_class, PROP_TARGET,
+      g_param_spec_double ("target", "Target",
+          "Target integrated loudness (in LUFS)", -70.0, 0.0, DEFAULT_TARGET,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING |
+              G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MAX_GAIN,
+      g_param_spec_double ("max-gain", "Maximum gain",
+          "Maximum gain or attenuation applied (in dB)", 0.0, 40.0,
+          DEFAULT_MAX_GAIN,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING |
+              G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MOMENTARY,
+      g_param_spec_double ("momentary", "Momentary loudness",
+          "Loudness of last 400 ms (in LUFS)", -G_MAXDOUBLE, G_MAXDOUBLE,
+          -HUGE_VAL, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_INTEGRATED,
+      g_param_spec_double ("integrated", "Integrated loudness",
+          "Gated loudness since start (in LUFS)", -G_MAXDOUBLE, G_MAXDOUBLE,
+          -HUGE_VAL, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_GAIN,
+      g_param_spec_double ("gain", "Gain", "Applied gain (in dB)",
+          -G_MAXDOUBLE, G_MAXDOUBLE, 0.0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_COST,
+      g_param_spec_double ("cost", "Cost",
+          "Average processing time per sample (in ns)", 0, G_MAXDOUBLE, 0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  gst_element_class_set_details_simple (gstelement_class,
+      "RAOP loudness normalizer", "Filter/Effect/Audio",
+      "An EBU R128 loudness meter driving a slow gain",
+      "Alexandre Dilly <alexandre.dilly@sparod.com>");
+
+  caps = gst_caps_from_string (GST_AUDIO_CAPS_MAKE (
+      "{ " GST_AUDIO_NE (S16) ", " GST_AUDIO_NE (F32) " }"));
+  gst_audio_filter_class_add_pad_templates (filter_class, caps);
+  gst_caps_unref (caps);
+
+  filter_class->setup = GST_DEBUG_FUNCPTR (gst_raop_loudness_setup);
+  trans_class->sink_event = GST_DEBUG_FUNCPTR (gst_raop_loudness_sink_event);
+  trans_class->transform_ip =
+      GST_DEBUG_FUNCPTR (gst_raop_loudness_transform_ip);
+
+  /* Compute histogram energies */
+  for (i = 0; i < HISTOGRAM_BINS; i++)
+    histogram_energy[i] = pow (10.0,
+        (ABSOLUTE_GATE + (i + 0.5) * HISTOGRAM_STEP + 0.691) / 10.0);
+}
+
+static void
+gst_raop_loudness_reset (GstRaopLoudnessPrivate *priv)
+{
+  /* Restart measure, keep gain */
+  memset (priv->state, 0, sizeof (priv->state));
+  memset (priv->blocks, 0, sizeof (priv->blocks));
+  memset (priv->histogram, 0, sizeof (priv->histogram));
+  priv->block_pos = 0;
+  priv->block_sum = 0;
+  priv->block_index = 0;
+  priv->block_count = 0;
+  priv->gated = 0;
+  priv->momentary = -HUGE_VAL;
+  priv->integrated = -HUGE_VAL;
+}
+
+static void
+gst_raop_loudness_init (GstRaopLoudness *loudness)
+{
+  GstRaopLoudnessPrivate *priv =
+      gst_raop_loudness_get_instance_private (loudness);
+
+  loudness->priv = priv;
+  priv->target = DEFAULT_TARGET;
+  priv->max_gain = DEFAULT_MAX_GAIN;
+  priv->lin_gain = 1.0;
+  gst_raop_loudness_reset (priv);
+  gst_base_transform_set_in_place (GST_BASE_TRANSFORM (loudness), TRUE);
+}
+
+static void
+gst_raop_loudness_set_property (
+    GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+  GstRaopLoudness *loudness = GST_RAOP_LOUDNESS (object);
+  GstRaopLoudnessPrivate *priv = loudness->priv;
+
+  switch (prop_id) {
+  case PROP_TARGET:
+    GST_OBJECT_LOCK (loudness);
+    priv->target = g_value_get_double (value);
+    GST_OBJECT_UNLOCK (loudness);
+    break;
+  case PROP_MAX_GAIN:
+    GST_OBJECT_LOCK (loudness);
+    priv->max_gain = g_value_get_double (value);
+    GST_OBJECT_UNLOCK (loudness);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
+static void
+gst_raop_loudness_get_property (
+    GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+  GstRaopLoudness *loudness = GST_RAOP_LOUDNESS (object);
+  GstRaopLoudnessPrivate *priv = loudness->priv;
+
+  GST_OBJECT_LOCK (loudness);
+  switch (prop_id) {
+  case PROP_TARGET:
+    g_value_set_double (value, priv->target);
+    break;
+  case PROP_MAX_GAIN:
+    g_value_set_double (value, priv->max_gain);
+    break;
+  case PROP_MOMENTARY:
+    g_value_set_double (value, priv->momentary);
+    break;
+  case PROP_INTEGRATED:
+    g_value_set_double (value, priv->integrated);
+    break;
+  case PROP_GAIN:
+    g_value_set_double (value, priv->gain);
+    break;
+  case PROP_COST:
+    g_value_set_double (value,
+        priv->samples ? priv->time * 1000.0 / priv->samples : 0.0);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+  GST_OBJECT_UNLOCK (loudness);
+}
+
+static gboolean
+gst_raop_loudness_setup (GstAudioFilter *filter, const GstAudioInfo *info)
+{
+  GstRaopLoudness *loudness = GST_RAOP_LOUDNESS (filter);
+  GstRaopLoudnessPrivate *priv = loudness->priv;
+  gdouble rate = GST_AUDIO_INFO_RATE (info);
+  gdouble f0, g, q, k, vh, vb, a0;
+
+  if (GST_AUDIO_INFO_CHANNELS (info) > MAX_CHANNELS || rate <= 0)
+    return FALSE;
+
+  /* Pre-filter: high shelf of ITU-R BS.1770, for any sample rate */
+  f0 = 1681.974450955533;
+  g = 3.999843853973347;
+  q = 0.7071752369554196;
+  k = tan (G_PI * f0 / rate);
+  vh = pow (10.0, g / 20.0);
+  vb = pow (vh, 0.4996667741545416);
+  a0 = 1.0 + k / q + k * k;
+  priv->coefs[0][0] = (vh + vb * k / q + k * k) / a0;
+  priv->coefs[0][1] = 2.0 * (k * k - vh) / a0;
+  priv->coefs[0][2] = (vh - vb * k / q + k * k) / a0;
+  priv->coefs[0][3] = 2.0 * (k * k - 1.0) / a0;
+  priv->coefs[0][4] = (1.0 - k / q + k * k) / a0;
+
+  /* RLB weighting: high pass */
+  f0 = 38.13547087602444;
+  q = 0.5003270373238773;
+  k = tan (G_PI * f0 / rate);
+  a0 = 1.0 + k / q + k * k;
+  priv->coefs[1][0] = 1.0;
+  priv->coefs[1][1] = -2.0;
+  priv->coefs[1][2] = 1.0;
+  priv->coefs[1][3] = 2.0 * (k * k - 1.0) / a0;
+  priv->coefs[1][4] = (1.0 - k / q + k * k) / a0;
+
+  /* Restart measure */
+  GST_OBJECT_LOCK (loudness);
+  priv->block_frames = GST_AUDIO_INFO_RATE (info) * BLOCK_MS / 1000;
+  gst_raop_loudness_reset (priv);
+  GST_OBJECT_UNLOCK (loudness);
+
+  return TRUE;
+}
+
+static gboolean
+gst_raop_loudness_sink_event (GstBaseTransform *trans, GstEvent *event)
+{
+  GstRaopLoudness *loudness = GST_RAOP_LOUDNESS (trans);
+
+  /* New stream: restart measure */
+  if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP) {
+    GST_OBJECT_LOCK (loudness);
+    gst_raop_loudness_reset (loudness->priv);
+    GST_OBJECT_UNLOCK (loudness);
+  }
+
+  return GST_BASE_TRANSFORM_CLASS (parent_class)->sink_event (trans, event);
+}
+
+static gdouble
+gst_raop_loudness_integrate (const GstRaopLoudnessPrivate *priv)
+{
+  gdouble sum = 0, threshold;
+  guint64 count = 0;
+  guint i, start;
+
+  /* Mean energy of blocks above absolute gate */
+  for (i = 0; i < HISTOGRAM_BINS; i++) {
+    sum += priv->histogram[i] * histogram_energy[i];
+    count += priv->histogram[i];
+  }
+  if (!count)
+    return -HUGE_VAL;
+
+  /* Mean energy of blocks above relative gate */
+  threshold = -0.691 + 10.0 * log10 (sum / count) + RELATIVE_GATE;
+  start = threshold > ABSOLUTE_GATE
+              ? (guint) ceil ((threshold - ABSOLUTE_GATE) / HISTOGRAM_STEP)
+              : 0;
+  sum = 0;
+  count = 0;
+  for (i = start; i < HISTOGRAM_BINS; i++) {
+    sum += priv->histogram[i] * histogram_energy[i];
+    count += priv->histogram[i];
+  }
+  if (!count)
+    return -HUGE_VAL;
+
+  return -0.691 + 10.0 * log10 (sum / count);
+}
+
+static void
+gst_raop_loudness_end_block (GstRaopLoudnessPrivate *priv)
+{
+  gdouble momentary, sum = 0;
+  guint i;
+
+  /* Save block mean square */
+  priv->blocks[priv->block_index] = priv->block_sum / priv->block_frames;
+  priv->block_index = (priv->block_index + 1) % GATE_BLOCKS;
+  priv->block_sum = 0;
+  priv->block_pos = 0;
+  if (priv->block_count < GATE_BLOCKS)
+    priv->block_count++;
+
+  /* Loudness of 400 ms gating block */
+  if (priv->block_count == GATE_BLOCKS) {
+    for (i = 0; i < GATE_BLOCKS; i++)
+      sum += priv->blocks[i];
+    momentary =
+        sum > 0 ? -0.691 + 10.0 * log10 (sum / GATE_BLOCKS) : -HUGE_VAL;
+
+    /* Add to histogram when above absolute gate */
+    if (momentary >= ABSOLUTE_GATE) {
+      i = (momentary - ABSOLUTE_GATE) / HISTOGRAM_STEP;
+      priv->histogram[MIN (i, HISTOGRAM_BINS - 1)]++;
+      priv->gated++;
+    }
+    priv->momentary = momentary;
+    priv->integrated = gst_raop_loudness_integrate (priv);
+  }
+
+  /* Move gain slowly towards target */
+  if (priv->gated >= MIN_BLOCKS && isfinite (priv->integrated)) {
+    gdouble step = GAIN_SLEW * BLOCK_MS / 1000.0;
+    gdouble gain;
+
+    gain = CLAMP (
+        priv->target - priv->integrated, -priv->max_gain, priv->max_gain);
+    priv->gain = CLAMP (gain, priv->gain - step, priv->gain + step);
+  }
+
+  /* Ramp linear gain over next block */
+  priv->lin_step =
+      (pow (10.0, priv->gain / 20.0) - priv->lin_gain) / priv->block_frames;
+}
+
+static inline gdouble
+gst_raop_loudness_weight (
+    GstRaopLoudnessPrivate *priv, guint channel, gdouble x)
+{
+  guint s;
+
+  /* Cascade of both K-weighting sections */
+  for (s = 0; s < 2; s++) {
+    const gdouble *k = priv->coefs[s];
+    gdouble *z = priv->state[channel][s];
+    gdouble y = k[0] * x + z[0];
+
+    z[0] = k[1] * x - k[3] * y + z[1];
+    z[1] = k[2] * x - k[4] * y;
+    x = y;
+  }
+
+  return x;
+}
+
+static GstFlowReturn
+gst_raop_loudness_transform_ip (GstBaseTransform *trans, GstBuffer *buf)
+{
+  GstRaopLoudness *loudness = GST_RAOP_LOUDNESS (trans);
+  GstAudioFilter *filter = GST_AUDIO_FILTER (trans);
+  GstRaopLoudnessPrivate *priv = loudness->priv;
+  GstAudioInfo *info = &filter->info;
+  guint channels, frames, i, c;
+  gboolean is_s16;
+  GstMapInfo map;
+  gint64 start;
+
+  channels = GST_AUDIO_INFO_CHANNELS (info);
+  is_s16 = GST_AUDIO_INFO_FORMAT (info) == GST_AUDIO_FORMAT_S16;
+  if (!channels || channels > MAX_CHANNELS || !priv->block_frames)
+    return GST_FLOW_NOT_NEGOTIATED;
+
+  if (!gst_buffer_map (buf, &map, GST_MAP_READWRITE))
+    return GST_FLOW_ERROR;
+  frames = map.size / GST_AUDIO_INFO_BPF (info);
+  start = g_get_monotonic_time ();
+
+  GST_OBJECT_LOCK (loudness);
+  if (is_s16) {
+    gint16 *data = (gint16 *) map.data;
+
+    for (i = 0; i < frames; i++, data += channels) {
+      /* Measure input, in full scale */
+      for (c = 0; c < channels; c++) {
+        gdouble x = gst_raop_loudness_weight (priv, c, data[c] / 32768.0);
+
+        priv->block_sum += x * x;
+      }
+
+      /* Apply gain */
+      if (priv->lin_gain != 1.0)
+        for (c = 0; c < channels; c++)
+          data[c] = (gint16) CLAMP (
+              lrint (data[c] * priv->lin_gain), G_MININT16, G_MAXINT16);
+
+      priv->lin_gain += priv->lin_step;
+      if (++priv->block_pos == priv->block_frames)
+        gst_raop_loudness_end_block (priv);
+    }
+  } else {
+    gfloat *data = (gfloat *) map.data;
+
+    for (i = 0; i < frames; i++, data += channels) {
+      /* Measure input */
+      for (c = 0; c < channels; c++) {
+        gdouble x = gst_raop_loudness_weight (priv, c, data[c]);
+
+        priv->block_sum += x * x;
+      }
+
+      /* Apply gain */
+      if (priv->lin_gain != 1.0)
+        for (c = 0; c < channels; c++)
+          data[c] *= priv->lin_gain;
+
+      priv->lin_gain += priv->lin_step;
+      if (++priv->block_pos == priv->block_frames)
+        gst_raop_loudness_end_block (priv);
+    }
+  }
+
+  /* Account processing time */
+  priv->time += g_get_monotonic_time () - start;
+  priv->samples += (guint64) frames * channels;
+  GST_OBJECT_UNLOCK (loudness);
+
+  gst_buffer_unmap (buf, &map);
+
+  return GST_FLOW_OK;
+}
+
+gboolean
+gst_raop_loudness_plugin_init (GstPlugin *plugin)
+{
+  GST_DEBUG_CATEGORY_INIT (
+      gst_raop_loudness_debug, "raoploudness", 0, "RAOP loudness normalizer");
+
+  return gst_element_register (
+      plugin, "raoploudness", GST_RANK_NONE, GST_TYPE_RAOP_LOUDNESS);
+}
@@ -0,0 +1,103 @@
+/*
+ * gstraopmeta.c: RAOP buffer metadata
+ *
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include "gstraopmeta.h"
+
+GType
+gst_raop_latency_meta_api_get_type (void)
+{
+  static volatile GType type;
+  /* tag as audio meta in order to be kept by audio decoders */
+  static const gchar *tags[] = {GST_META_TAG_AUDIO_STR, NULL};
+
+  if (g_once_init_enter (&type)) {
+    GType _type = gst_meta_api_type_register ("GstRaopLatencyMetaAPI", tags);
+    g_once_init_leave (&type, _type);
+  }
+  return type;
+}
+
+static gboolean
+gst_raop_latency_meta_init (GstMeta *meta, gpointer params, GstBuffer *buffer)
+{
+  GstRaopLatencyMeta *lmeta = (GstRaopLatencyMeta *) meta;
+
+  lmeta->arrival = 0;
+  lmeta->stamp = 0;
+
+  return TRUE;
+}
+
+static gboolean
+gst_raop_latency_meta_transform (GstBuffer *dest, GstMeta *meta,
+    GstBuffer *buffer, GQuark type, gpointer data)
+{
+  GstRaopLatencyMeta *lmeta = (GstRaopLatencyMeta *) meta;
+  GstRaopLatencyMeta *dmeta;
+
+  /* only copy is supported */
+  if (!GST_META_TRANSFORM_IS_COPY (type))
+    return FALSE;
+
+  /* keep only first meta when buffers are merged */
+  if (gst_buffer_get_raop_latency_meta (dest))
+    return TRUE;
+
+  dmeta = gst_buffer_add_raop_latency_meta (dest, lmeta->arrival);
+  if (!dmeta)
+    return FALSE;
+  dmeta->stamp = lmeta->stamp;
+
+  return TRUE;
+}
+
+const GstMetaInfo *
+gst_raop_latency_meta_get_info (void)
+{
+  static const GstMetaInfo *meta_info = NULL;
+
+  if (g_once_init_enter ((GstMetaInfo **) &meta_info)) {
+    const GstMetaInfo *mi = gst_meta_register (GST_RAOP_LATENCY_META_API_TYPE,
+        "GstRaopLatencyMeta", sizeof (GstRaopLatencyMeta),
+        gst_raop_latency_meta_init, (GstMetaFreeFunction) NULL,
+        gst_raop_latency_meta_transform);
+    g_once_init_leave ((GstMetaInfo **) &meta_info, (GstMetaInfo *) mi);
+  }
+  return meta_info;
+}
+
+GstRaopLatencyMeta *
+gst_buffer_add_raop_latency_meta (GstBuffer *buffer, gint64 arrival)
+{
+  GstRaopLatencyMeta *meta;
+
+  g_return_val_if_fail (GST_IS_BUFFER (buffer), NULL);
+
+  meta = (GstRaopLatencyMeta *) gst_buffer_add_meta (
+      buffer, GST_RAOP_LATENCY_META_INFO, NULL);
+  if (!meta)
+    return NULL;
+
+  meta->arrival = arrival;
+  meta->stamp = arrival;
+
+  return meta;
+}
@@ -0,0 +1,62 @@
+/*
+ * gstraopmeta.h: RAOP buffer metadata
+ *
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __GST_RAOP_META_H__
+#define __GST_RAOP_META_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_RAOP_LATENCY_META_API_TYPE (gst_raop_latency_meta_api_get_type ())
+#define GST_RAOP_LATENCY_META_INFO (gst_raop_latency_meta_get_info ())
+
+typedef struct _GstRaopLatencyMeta GstRaopLatencyMeta;
+
+/**
+ * GstRaopLatencyMeta:
+ * @meta: parent #GstMeta
+ * @arrival: monotonic time of packet arrival (in us)
+ * @stamp: monotonic time of last pipeline stage crossed (in us)
+ *
+ * Metadata attached to RAOP packets at arrival, and carried up to the sink, in
+ * order to measure the time spent in each stage of the pipeline.
+ */
+struct _GstRaopLatencyMeta {
+  GstMeta meta;
+
+  gint64 arrival;
+  gint64 stamp;
+};
+
+GType gst_raop_latency_meta_api_get_type (void);
+const GstMetaInfo *gst_raop_latency_meta_get_info (void);
+
+#define gst_buffer_get_raop_latency_meta(b) \
+  ((GstRaopLatencyMeta *) gst_buffer_get_meta ( \
+      (b), GST_RAOP_LATENCY_META_API_TYPE))
+
+GstRaopLatencyMeta *gst_buffer_add_raop_latency_meta (
+    GstBuffer *buffer, gint64 arrival);
+
+G_END_DECLS
+
+#endif /* __GST_RAOP_META_H__ */
@@ -0,0 +1,567 @@
+/*
+ * gstraopqueue.c: Lock-free single producer, single consumer queue
+ *
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <gst/gst.h>
+
+#include "gstraopqueue.h"
+
+#define DEFAULT_SIZE 32
+#define MAX_SIZE 1024
+
+/* Keep producer and consumer indexes on separate cache lines */
+#define CACHE_LINE 64
+
+GST_DEBUG_CATEGORY_STATIC (gst_raop_queue_debug);
+#define GST_CAT_DEFAULT gst_raop_queue_debug
+
+static GstStaticPadTemplate gst_raop_queue_sink_template =
+    GST_STATIC_PAD_TEMPLATE (
+        "sink", GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS_ANY);
+
+static GstStaticPadTemplate gst_raop_queue_src_template =
+    GST_STATIC_PAD_TEMPLATE (
+        "src", GST_PAD_SRC, GST_PAD_ALWAYS, GST_STATIC_CAPS_ANY);
+
+/* The ring is only written by the upstream streaming thread (head) and read by
+ * the source pad task (tail): both sides only touch their own index and read
+ * the other one, so no lock is taken while the ring is neither full nor empty.
+ * The mutex and conditions are only used to sleep and are signaled when the
+ * other side is flagged as waiting.
+ *
+ * Serialized queries are not queued: the upstream thread waits until all
+ * queued items have been pushed downstream (pushed reaches head), then
+ * forwards the query itself.
+ */
+struct _GstRaopQueuePrivate {
+  GstPad *sinkpad, *srcpad;
+
+  GstMiniObject **items;
+  guint size;
+  guint mask;
+
+  /* Producer side */
+  guint head;
+  gint producer_waiting;
+  gint drain_waiting;
+  guint peak;
+  guint64 full_waits;
+  guint8 producer_pad[CACHE_LINE];
+
+  /* Consumer side */
+  guint tail;
+  guint pushed;
+  gint consumer_waiting;
+  guint64 empty_waits;
+  guint8 consumer_pad[CACHE_LINE];
+
+  /* Flow returned by source pad, FLUSHING when stopped */
+  gint srcresult;
+
+  GMutex lock;
+  GCond item_add;
+  GCond item_del;
+};
+
+enum {
+  PROP_0,
+  PROP_SIZE,
+  PROP_LEVEL,
+  PROP_PEAK,
+  PROP_FULL_WAITS,
+  PROP_EMPTY_WAITS,
+};
+
+#define gst_raop_queue_parent_class parent_class
+G_DEFINE_TYPE_WITH_PRIVATE (GstRaopQueue, gst_raop_queue, GST_TYPE_ELEMENT);
+
+static void gst_raop_queue_set_property (
+    GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec);
+static void gst_raop_queue_get_property (
+    GObject *object, guint prop_id, GValue *value, GParamSpec *pspec);
+static void gst_raop_queue_finalize (GObject *object);
+
+static GstFlowReturn gst_raop_queue_chain (
+    GstPad *pad, GstObject *parent, GstBuffer *buf);
+static gboolean gst_raop_queue_sink_event (
+    GstPad *pad, GstObject *parent, GstEvent *event);
+static gboolean gst_raop_queue_sink_query (
+    GstPad *pad, GstObject *parent, GstQuery *query);
+static gboolean gst_raop_queue_sink_activate_mode (
+    GstPad *pad, GstObject *parent, GstPadMode mode, gboolean active);
+static gboolean gst_raop_queue_src_activate_mode (
+    GstPad *pad, GstObject *parent, GstPadMode mode, gboolean active);
+static void gst_raop_queue_loop (GstRaopQueue *queue);
+
+static void
+gst_raop_queue_class_init (GstRaopQueueClass *klass)
+{
+  GObjectClass *gobject_class;
+  GstElementClass *gstelement_class;
+
+  gobject_class = (GObjectClass *) klass;
+  gstelement_class = (GstElementClass *) klass;
+
+  gobject_class->set_property = gst_raop_queue_set_property;
+  gobject_class->get_property = gst_raop_queue_get_property;
+  gobject_class->finalize = gst_raop_queue_finalize;
+
+  g_object_class_install_property (gobject_class, PROP_SIZE,
+      g_param_spec_uint ("size", "Size",
+          "Maximum number of buffers and events in queue (power of two)", 2,
+          MAX_SIZE, DEFAULT_SIZE,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY |
+              G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_LEVEL,
+      g_param_spec_uint ("level", "Level",
+          "Current number of buffers and events in queue", 0, MAX_SIZE, 0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_PEAK,
+      g_param_spec_uint ("peak", "Peak level",
+          "Maximum number of buffers and events reached in queue", 0, MAX_SIZE,
+          0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_FULL_WAITS,
+      g_param_spec_uint64 ("full-waits", "Full waits",
+          "Number of times upstream waited for a free slot", 0, G_MAXUINT64, 0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_EMPTY_WAITS,
+      g_param_spec_uint64 ("empty-waits", "Empty waits",
+          "Number of times the output thread waited for data", 0, G_MAXUINT64,
+          0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  gst_element_class_set_details_simple (gstelement_class, "RAOP queue",
+      "Generic",
+      "A bounded lock-free queue running downstream elements in a new thread",
+      "Alexandre Dilly <alexandre.dilly@sparod.com>");
+
+  gst_element_class_add_pad_template (gstelement_class,
+      gst_static_pad_template_get (&gst_raop_queue_sink_template));
+  gst_element_class_add_pad_template (gstelement_class,
+      gst_static_pad_template_get (&gst_raop_queue_src_template));
+}
+
+static void
+gst_raop_queue_init (GstRaopQueue *queue)
+{
+  GstRaopQueuePrivate *priv = gst_raop_queue_get_instance_private (queue);
+
+  queue->priv = priv;
+  priv->size = DEFAULT_SIZE;
+  priv->srcresult = GST_FLOW_FLUSHING;
+  g_mutex_init (&priv->lock);
+  g_cond_init (&priv->item_add);
+  g_cond_init (&priv->item_del);
+
+  priv->sinkpad =
+      gst_pad_new_from_static_template (&gst_raop_queue_sink_template, "sink");
+  gst_pad_set_chain_function (
+      priv->sinkpad, GST_DEBUG_FUNCPTR (gst_raop_queue_chain));
+  gst_pad_set_event_function (
+      priv->sinkpad, GST_DEBUG_FUNCPTR (gst_raop_queue_sink_event));
+  gst_pad_set_query_function (
+      priv->sinkpad, GST_DEBUG_FUNCPTR (gst_raop_queue_sink_query));
+  gst_pad_set_activatemode_function (
+      priv->sinkpad, GST_DEBUG_FUNCPTR (gst_raop_queue_sink_activate_mode));
+  GST_PAD_SET_PROXY_CAPS (priv->sinkpad);
+  GST_PAD_SET_PROXY_ALLOCATION (priv->sinkpad);
+  gst_element_add_pad (GST_ELEMENT (queue), priv->sinkpad);
+
+  priv->srcpad =
+      gst_pad_new_from_static_template (&gst_raop_queue_src_template, "src");
+  gst_pad_set_activatemode_function (
+      priv->srcpad, GST_DEBUG_FUNCPTR (gst_raop_queue_src_activate_mode));
+  GST_PAD_SET_PROXY_CAPS (priv->srcpad);
+  gst_element_add_pad (GST_ELEMENT (queue), priv->srcpad);
+}
+
+/* Must be called when source pad task is stopped */
+static void
+gst_raop_queue_flush (GstRaopQueue *queue)
+{
+  GstRaopQueuePrivate *priv = queue->priv;
+  guint head, tail;
+
+  head = g_atomic_int_get (&priv->head);
+  for (tail = priv->tail; tail != head; tail++) {
+    GstMiniObject *item = priv->items[tail & priv->mask];
+
+    priv->items[tail & priv->mask] = NULL;
+    if (GST_IS_EVENT (item) && GST_EVENT_IS_STICKY (item) &&
+        GST_EVENT_TYPE (item) != GST_EVENT_SEGMENT &&
+        GST_EVENT_TYPE (item) != GST_EVENT_EOS)
+      gst_pad_store_sticky_event (priv->srcpad, GST_EVENT_CAST (item));
+    gst_mini_object_unref (item);
+  }
+  g_atomic_int_set (&priv->tail, head);
+  g_atomic_int_set (&priv->pushed, head);
+}
+
+static void
+gst_raop_queue_finalize (GObject *object)
+{
+  GstRaopQueue *queue = GST_RAOP_QUEUE (object);
+  GstRaopQueuePrivate *priv = queue->priv;
+
+  if (priv->items) {
+    gst_raop_queue_flush (queue);
+    g_free (priv->items);
+  }
+  g_cond_clear (&priv->item_del);
+  g_cond_clear (&priv->item_add);
+  g_mutex_clear (&priv->lock);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static void
+gst_raop_queue_set_property (
+    GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+  GstRaopQueue *queue = GST_RAOP_QUEUE (object);
+  GstRaopQueuePrivate *priv = queue->priv;
+
+  switch (prop_id) {
+  case PROP_SIZE:
+    /* round up to a power of two for index masking */
+    priv->size = 2;
+    while (priv->size < g_value_get_uint (value))
+      priv->size <<= 1;
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
+static void
+gst_raop_queue_get_property (
+    GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+  GstRaopQueue *queue = GST_RAOP_QUEUE (object);
+  GstRaopQueuePrivate *priv = queue->priv;
+
+  switch (prop_id) {
+  case PROP_SIZE:
+    g_value_set_uint (value, priv->size);
+    break;
+  case PROP_LEVEL:
+    g_value_set_uint (value,
+        g_atomic_int_get (&priv->head) - g_atomic_int_get (&priv->tail));
+    break;
+  case PROP_PEAK:
+    g_value_set_uint (value, priv->peak);
+    break;
+  case PROP_FULL_WAITS:
+    g_value_set_uint64 (value, priv->full_waits);
+    break;
+  case PROP_EMPTY_WAITS:
+    g_value_set_uint64 (value, priv->empty_waits);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
+static inline gboolean
+gst_raop_queue_is_full (GstRaopQueuePrivate *priv)
+{
+  return priv->head - g_atomic_int_get (&priv->tail) >= priv->size;
+}
+
+static inline gboolean
+gst_raop_queue_is_empty (GstRaopQueuePrivate *priv)
+{
+  return priv->tail == (guint) g_atomic_int_get (&priv->head);
+}
+
+static inline void
+gst_raop_queue_wake (GstRaopQueuePrivate *priv, gint *waiting, GCond *cond)
+{
+  /* the waiting flag is set before the last check of the sleeping side, and
+   * the index is published before this check, so no wake-up can be lost
+   */
+  if (g_atomic_int_get (waiting)) {
+    g_mutex_lock (&priv->lock);
+    g_cond_signal (cond);
+    g_mutex_unlock (&priv->lock);
+  }
+}
+
+static void
+gst_raop_queue_wake_all (GstRaopQueuePrivate *priv)
+{
+  g_mutex_lock (&priv->lock);
+  g_cond_broadcast (&priv->item_add);
+  g_cond_broadcast (&priv->item_del);
+  g_mutex_unlock (&priv->lock);
+}
+
+static GstFlowReturn
+gst_raop_queue_push (GstRaopQueue *queue, GstMiniObject *item)
+{
+  GstRaopQueuePrivate *priv = queue->priv;
+  GstFlowReturn ret;
+  guint level;
+
+  /* wait for a free slot */
+  if (gst_raop_queue_is_full (priv)) {
+    priv->full_waits++;
+
+    g_mutex_lock (&priv->lock);
+    g_atomic_int_set (&priv->producer_waiting, 1);
+    while (gst_raop_queue_is_full (priv) &&
+           g_atomic_int_get (&priv->srcresult) == GST_FLOW_OK)
+      g_cond_wait (&priv->item_del, &priv->lock);
+    g_atomic_int_set (&priv->producer_waiting, 0);
+    g_mutex_unlock (&priv->lock);
+  }
+
+  /* source pad is stopped or flushing */
+  ret = g_atomic_int_get (&priv->srcresult);
+  if (ret != GST_FLOW_OK) {
+    GST_LOG_OBJECT (queue, "dropping item: %s", gst_flow_get_name (ret));
+    gst_mini_object_unref (item);
+    return ret;
+  }
+
+  /* publish item */
+  priv->items[priv->head & priv->mask] = item;
+  g_atomic_int_set (&priv->head, priv->head + 1);
+
+  /* update occupancy */
+  level = priv->head - g_atomic_int_get (&priv->tail);
+  if (level > priv->peak)
+    priv->peak = level;
+
+  gst_raop_queue_wake (priv, &priv->consumer_waiting, &priv->item_add);
+
+  return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+gst_raop_queue_chain (GstPad *pad, GstObject *parent, GstBuffer *buf)
+{
+  return gst_raop_queue_push (
+      GST_RAOP_QUEUE (parent), GST_MINI_OBJECT_CAST (buf));
+}
+
+static inline gboolean
+gst_raop_queue_is_drained (GstRaopQueuePrivate *priv)
+{
+  return priv->head == (guint) g_atomic_int_get (&priv->pushed);
+}
+
+static gboolean
+gst_raop_queue_sink_query (GstPad *pad, GstObject *parent, GstQuery *query)
+{
+  GstRaopQueue *queue = GST_RAOP_QUEUE (parent);
+  GstRaopQueuePrivate *priv = queue->priv;
+
+  if (!GST_QUERY_IS_SERIALIZED (query))
+    return gst_pad_query_default (pad, parent, query);
+
+  GST_DEBUG_OBJECT (queue, "draining for %s", GST_QUERY_TYPE_NAME (query));
+
+  /* keep serialized queries in order with buffers: wait for queued items to
+   * be pushed downstream
+   */
+  if (!gst_raop_queue_is_drained (priv)) {
+    g_mutex_lock (&priv->lock);
+    g_atomic_int_set (&priv->drain_waiting, 1);
+    while (!gst_raop_queue_is_drained (priv) &&
+           g_atomic_int_get (&priv->srcresult) == GST_FLOW_OK)
+      g_cond_wait (&priv->item_del, &priv->lock);
+    g_atomic_int_set (&priv->drain_waiting, 0);
+    g_mutex_unlock (&priv->lock);
+  }
+
+  /* source pad is stopped or flushing */
+  if (g_atomic_int_get (&priv->srcresult) != GST_FLOW_OK)
+    return FALSE;
+
+  return gst_pad_peer_query (priv->srcpad, query);
+}
+
+static gboolean
+gst_raop_queue_sink_event (GstPad *pad, GstObject *parent, GstEvent *event)
+{
+  GstRaopQueue *queue = GST_RAOP_QUEUE (parent);
+  GstRaopQueuePrivate *priv = queue->priv;
+  gboolean ret = TRUE;
+
+  GST_DEBUG_OBJECT (queue, "received %s", GST_EVENT_TYPE_NAME (event));
+
+  switch (GST_EVENT_TYPE (event)) {
+  case GST_EVENT_FLUSH_START:
+    /* unblock both threads and stop task */
+    g_atomic_int_set (&priv->srcresult, GST_FLOW_FLUSHING);
+    gst_raop_queue_wake_all (priv);
+    ret = gst_pad_push_event (priv->srcpad, event);
+    gst_pad_pause_task (priv->srcpad);
+    break;
+  case GST_EVENT_FLUSH_STOP:
+    /* drop pending items and restart task */
+    gst_raop_queue_flush (queue);
+    ret = gst_pad_push_event (priv->srcpad, event);
+    g_atomic_int_set (&priv->srcresult, GST_FLOW_OK);
+    gst_pad_start_task (
+        priv->srcpad, (GstTaskFunction) gst_raop_queue_loop, queue, NULL);
+    break;
+  default:
+    if (GST_EVENT_IS_SERIALIZED (event)) {
+      /* keep serialized events in order with buffers */
+      if (gst_raop_queue_push (queue, GST_MINI_OBJECT_CAST (event)) !=
+          GST_FLOW_OK)
+        ret = FALSE;
+    } else
+      ret = gst_pad_push_event (priv->srcpad, event);
+    break;
+  }
+
+  return ret;
+}
+
+static void
+gst_raop_queue_loop (GstRaopQueue *queue)
+{
+  GstRaopQueuePrivate *priv = queue->priv;
+  GstFlowReturn ret = GST_FLOW_OK;
+  GstMiniObject *item;
+
+  /* wait for an item */
+  if (gst_raop_queue_is_empty (priv)) {
+    priv->empty_waits++;
+
+    g_mutex_lock (&priv->lock);
+    g_atomic_int_set (&priv->consumer_waiting, 1);
+    while (gst_raop_queue_is_empty (priv) &&
+           g_atomic_int_get (&priv->srcresult) == GST_FLOW_OK)
+      g_cond_wait (&priv->item_add, &priv->lock);
+    g_atomic_int_set (&priv->consumer_waiting, 0);
+    g_mutex_unlock (&priv->lock);
+  }
+
+  /* stopped or flushing */
+  ret = g_atomic_int_get (&priv->srcresult);
+  if (ret != GST_FLOW_OK)
+    goto pause;
+
+  /* release slot */
+  item = priv->items[priv->tail & priv->mask];
+  priv->items[priv->tail & priv->mask] = NULL;
+  g_atomic_int_set (&priv->tail, priv->tail + 1);
+  gst_raop_queue_wake (priv, &priv->producer_waiting, &priv->item_del);
+
+  /* push item downstream */
+  if (GST_IS_BUFFER (item))
+    ret = gst_pad_push (priv->srcpad, GST_BUFFER_CAST (item));
+  else {
+    gboolean eos = GST_EVENT_TYPE (item) == GST_EVENT_EOS;
+
+    gst_pad_push_event (priv->srcpad, GST_EVENT_CAST (item));
+    if (eos)
+      ret = GST_FLOW_EOS;
+  }
+
+  /* unblock a pending serialized query */
+  g_atomic_int_inc (&priv->pushed);
+  gst_raop_queue_wake (priv, &priv->drain_waiting, &priv->item_del);
+
+  if (ret == GST_FLOW_OK)
+    return;
+
+  /* stop accepting data from upstream */
+  g_atomic_int_set (&priv->srcresult, ret);
+  gst_raop_queue_wake_all (priv);
+
+  if (ret == GST_FLOW_NOT_LINKED || ret < GST_FLOW_EOS)
+    GST_ELEMENT_ERROR (queue, STREAM, FAILED, ("Internal data stream error."),
+        ("streaming stopped, reason %s (%d)", gst_flow_get_name (ret), ret));
+
+pause:
+  GST_DEBUG_OBJECT (queue, "pausing task: %s", gst_flow_get_name (ret));
+  gst_pad_pause_task (priv->srcpad);
+}
+
+static gboolean
+gst_raop_queue_sink_activate_mode (
+    GstPad *pad, GstObject *parent, GstPadMode mode, gboolean active)
+{
+  GstRaopQueue *queue = GST_RAOP_QUEUE (parent);
+
+  if (mode != GST_PAD_MODE_PUSH)
+    return FALSE;
+
+  /* unblock upstream thread */
+  if (!active) {
+    g_atomic_int_set (&queue->priv->srcresult, GST_FLOW_FLUSHING);
+    gst_raop_queue_wake_all (queue->priv);
+  }
+
+  return TRUE;
+}
+
+static gboolean
+gst_raop_queue_src_activate_mode (
+    GstPad *pad, GstObject *parent, GstPadMode mode, gboolean active)
+{
+  GstRaopQueue *queue = GST_RAOP_QUEUE (parent);
+  GstRaopQueuePrivate *priv = queue->priv;
+  gboolean ret;
+
+  if (mode != GST_PAD_MODE_PUSH)
+    return FALSE;
+
+  if (active) {
+    /* allocate ring */
+    if (!priv->items || priv->mask + 1 != priv->size) {
+      g_free (priv->items);
+      priv->items = g_new0 (GstMiniObject *, priv->size);
+      priv->mask = priv->size - 1;
+    }
+    priv->head = priv->tail = priv->pushed = 0;
+    priv->peak = 0;
+    priv->full_waits = priv->empty_waits = 0;
+
+    /* start output thread */
+    g_atomic_int_set (&priv->srcresult, GST_FLOW_OK);
+    ret = gst_pad_start_task (
+        pad, (GstTaskFunction) gst_raop_queue_loop, queue, NULL);
+  } else {
+    /* stop output thread and drop pending items */
+    g_atomic_int_set (&priv->srcresult, GST_FLOW_FLUSHING);
+    gst_raop_queue_wake_all (priv);
+    ret = gst_pad_stop_task (pad);
+    gst_raop_queue_flush (queue);
+  }
+
+  return ret;
+}
+
+gboolean
+gst_raop_queue_plugin_init (GstPlugin *plugin)
+{
+  GST_DEBUG_CATEGORY_INIT (
+      gst_raop_queue_debug, "raopqueue", 0, "RAOP lock-free queue");
+
+  return gst_element_register (
+      plugin, "raopqueue", GST_RANK_NONE, GST_TYPE_RAOP_QUEUE);
+}
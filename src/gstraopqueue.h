@@ -0,0 +1,61 @@
+/*
+ * gstraopqueue.h: Lock-free single producer, single consumer queue
+ *
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __GST_RAOP_QUEUE_H__
+#define __GST_RAOP_QUEUE_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_RAOP_QUEUE (gst_raop_queue_get_type ())
+#define GST_RAOP_QUEUE(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_TYPE_RAOP_QUEUE, GstRaopQueue))
+#define GST_RAOP_QUEUE_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST ((klass), GST_TYPE_RAOP_QUEUE, GstRaopQueueClass))
+#define GST_RAOP_QUEUE_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj), GST_TYPE_RAOP_QUEUE, GstRaopQueueClass))
+#define GST_IS_RAOP_QUEUE(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GST_TYPE_RAOP_QUEUE))
+#define GST_IS_RAOP_QUEUE_CLASS(obj) \
+  (G_TYPE_CHECK_CLASS_TYPE ((klass), GST_TYPE_RAOP_QUEUE))
+
+typedef struct _GstRaopQueue GstRaopQueue;
+typedef struct _GstRaopQueueClass GstRaopQueueClass;
+typedef struct _GstRaopQueuePrivate GstRaopQueuePrivate;
+
+struct _GstRaopQueue {
+  GstElement element;
+
+  /*< private >*/
+  GstRaopQueuePrivate *priv;
+};
+
+struct _GstRaopQueueClass {
+  GstElementClass parent_class;
+};
+
+GType gst_raop_queue_get_type (void);
+gboolean gst_raop_queue_plugin_init (GstPlugin *plugin);
+
+G_END_DECLS
+
+#endif /* __GST_RAOP_QUEUE_H__ */
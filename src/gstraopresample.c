@@ -0,0 +1,402 @@
+/*
+ * gstraopresample.c: Fractional resampler for RAOP clock drift
+ *
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <gst/gst.h>
+#include <gst/audio/audio.h>
+
+#include "gstraopresample.h"
+
+#define DEFAULT_RATIO 1.0
+#define MIN_RATIO 0.99
+#define MAX_RATIO 1.01
+
+#define MAX_CHANNELS 8
+
+/* Frames needed before current position by cubic interpolation */
+#define HISTORY 3
+
+GST_DEBUG_CATEGORY_STATIC (gst_raop_resample_debug);
+#define GST_CAT_DEFAULT gst_raop_resample_debug
+
+struct _GstRaopResamplePrivate {
+  gdouble ratio;
+
+  /* Position of next output frame, relative to current input buffer */
+  gdouble pos;
+  gfloat history[HISTORY * MAX_CHANNELS];
+
+  /* Output timestamps */
+  gboolean started;
+  GstClockTime base_pts;
+  guint64 out_frames;
+
+  /* Input frames consumed before current input buffer, and offset of next
+   * output frame in input frames
+   */
+  guint64 in_frames;
+  gdouble offset;
+};
+
+enum {
+  PROP_0,
+  PROP_RATIO,
+  PROP_OFFSET,
+};
+
+#define gst_raop_resample_parent_class parent_class
+G_DEFINE_TYPE_WITH_PRIVATE (
+    GstRaopResample, gst_raop_resample, GST_TYPE_AUDIO_FILTER);
+
+static void gst_raop_resample_set_property (
+    GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec);
+static void gst_raop_resample_get_property (
+    GObject *object, guint prop_id, GValue *value, GParamSpec *pspec);
+
+static gboolean gst_raop_resample_start (GstBaseTransform *trans);
+static gboolean gst_raop_resample_sink_event (
+    GstBaseTransform *trans, GstEvent *event);
+static gboolean gst_raop_resample_transform_size (GstBaseTransform *trans,
+    GstPadDirection direction, GstCaps *caps, gsize size, GstCaps *othercaps,
+    gsize *othersize);
+static GstFlowReturn gst_raop_resample_transform (
+    GstBaseTransform *trans, GstBuffer *inbuf, GstBuffer *outbuf);
+
+static void
+gst_raop_resample_class_init (GstRaopResampleClass *klass)
+{
+  GObjectClass *gobject_class;
+  GstElementClass *gstelement_class;
+  GstBaseTransformClass *trans_class;
+  GstCaps *caps;
+
+  gobject_class = (GObjectClass *) klass;
+  gstelement_class = (GstElementClass *) klass;
+  trans_class = (GstBaseTransformClass *) klass;
+
+  gobject_class->set_property = gst_raop_resample_set_property;
+  gobject_class->get_property = gst_raop_resample_get_property;
+
+  g_object_class_install_property (gobject_class, PROP_RATIO,
+      g_param_spec_double ("ratio", "Resampling ratio",
+          "Count of output samples for each input sample", MIN_RATIO,
+          MAX_RATIO, DEFAULT_RATIO,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING |
+              G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_OFFSET,
+      g_param_spec_double ("offset", "Input offset",
+          "Input frames consumed minus output frames produced since last "
+          "discontinuity",
+          -G_MAXDOUBLE, G_MAXDOUBLE, 0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  gst_element_class_set_details_simple (gstelement_class,
+      "RAOP drift resampler", "Filter/Converter/Audio",
+      "A fractional resampler to compensate clock drift of RAOP senders",
+      "Alexandre Dilly <alexandre.dilly@sparod.com>");
+
+  caps = gst_caps_from_string (GST_AUDIO_CAPS_MAKE (
+      "{ " GST_AUDIO_NE (S16) ", " GST_AUDIO_NE (F32) " }"));
+  gst_audio_filter_class_add_pad_templates (
+      GST_AUDIO_FILTER_CLASS (klass), caps);
+  gst_caps_unref (caps);
+
+  trans_class->start = GST_DEBUG_FUNCPTR (gst_raop_resample_start);
+  trans_class->sink_event = GST_DEBUG_FUNCPTR (gst_raop_resample_sink_event);
+  trans_class->transform_size =
+      GST_DEBUG_FUNCPTR (gst_raop_resample_transform_size);
+  trans_class->transform = GST_DEBUG_FUNCPTR (gst_raop_resample_transform);
+}
+
+static void
+gst_raop_resample_reset (GstRaopResamplePrivate *priv)
+{
+  priv->pos = 0;
+  priv->started = FALSE;
+  priv->base_pts = GST_CLOCK_TIME_NONE;
+  priv->out_frames = 0;
+  priv->in_frames = 0;
+}
+
+static void
+gst_raop_resample_set_offset (GstRaopResample *resample, gdouble offset)
+{
+  GST_OBJECT_LOCK (resample);
+  resample->priv->offset = offset;
+  GST_OBJECT_UNLOCK (resample);
+}
+
+static void
+gst_raop_resample_init (GstRaopResample *resample)
+{
+  GstRaopResamplePrivate *priv =
+      gst_raop_resample_get_instance_private (resample);
+
+  resample->priv = priv;
+  priv->ratio = DEFAULT_RATIO;
+  gst_raop_resample_reset (priv);
+}
+
+static void
+gst_raop_resample_set_property (
+    GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+  GstRaopResample *resample = GST_RAOP_RESAMPLE (object);
+  GstRaopResamplePrivate *priv = resample->priv;
+
+  switch (prop_id) {
+  case PROP_RATIO:
+    GST_OBJECT_LOCK (resample);
+    priv->ratio = g_value_get_double (value);
+    GST_OBJECT_UNLOCK (resample);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
+static void
+gst_raop_resample_get_property (
+    GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+  GstRaopResample *resample = GST_RAOP_RESAMPLE (object);
+  GstRaopResamplePrivate *priv = resample->priv;
+
+  switch (prop_id) {
+  case PROP_RATIO:
+    GST_OBJECT_LOCK (resample);
+    g_value_set_double (value, priv->ratio);
+    GST_OBJECT_UNLOCK (resample);
+    break;
+  case PROP_OFFSET:
+    GST_OBJECT_LOCK (resample);
+    g_value_set_double (value, priv->offset);
+    GST_OBJECT_UNLOCK (resample);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
+static gboolean
+gst_raop_resample_start (GstBaseTransform *trans)
+{
+  GstRaopResample *resample = GST_RAOP_RESAMPLE (trans);
+
+  gst_raop_resample_reset (resample->priv);
+  gst_raop_resample_set_offset (resample, 0);
+
+  return TRUE;
+}
+
+static gboolean
+gst_raop_resample_sink_event (GstBaseTransform *trans, GstEvent *event)
+{
+  GstRaopResample *resample = GST_RAOP_RESAMPLE (trans);
+
+  /* restart from next buffer */
+  if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP ||
+      GST_EVENT_TYPE (event) == GST_EVENT_SEGMENT) {
+    gst_raop_resample_reset (resample->priv);
+    gst_raop_resample_set_offset (resample, 0);
+  }
+
+  return GST_BASE_TRANSFORM_CLASS (parent_class)->sink_event (trans, event);
+}
+
+static gboolean
+gst_raop_resample_transform_size (GstBaseTransform *trans,
+    GstPadDirection direction, GstCaps *caps, gsize size, GstCaps *othercaps,
+    gsize *othersize)
+{
+  GstAudioFilter *filter = GST_AUDIO_FILTER (trans);
+  gsize bpf = GST_AUDIO_INFO_BPF (&filter->info);
+  gsize frames;
+
+  if (!bpf)
+    return FALSE;
+
+  /* worst case: maximum ratio and pending frames of previous buffer */
+  frames = size / bpf;
+  *othersize = (frames + frames / 64 + HISTORY + 1) * bpf;
+
+  return TRUE;
+}
+
+static inline gfloat
+gst_raop_resample_get (const GstRaopResamplePrivate *priv, const guint8 *data,
+    gboolean is_s16, guint channels, gint frame, guint channel)
+{
+  /* previous buffer frames */
+  if (frame < 0)
+    return priv->history[(frame + HISTORY) * channels + channel];
+
+  if (is_s16)
+    return ((const gint16 *) data)[frame * channels + channel];
+  return ((const gfloat *) data)[frame * channels + channel];
+}
+
+static guint
+gst_raop_resample_process (GstRaopResamplePrivate *priv, const guint8 *in,
+    guint in_frames, guint8 *out, guint out_frames, gboolean is_s16,
+    guint channels, gdouble step)
+{
+  gdouble pos = priv->pos;
+  guint count = 0;
+  guint c, n;
+
+  while (count < out_frames) {
+    gint i = (gint) floor (pos);
+    gfloat f, f2, f3, w0, w1, w2, w3;
+
+    /* next frames are not available yet */
+    if (i + 2 >= (gint) in_frames)
+      break;
+
+    /* Catmull-Rom weights, shared by all channels */
+    f = pos - i;
+    f2 = f * f;
+    f3 = f2 * f;
+    w0 = 0.5f * (-f3 + 2.f * f2 - f);
+    w1 = 0.5f * (3.f * f3 - 5.f * f2 + 2.f);
+    w2 = 0.5f * (-3.f * f3 + 4.f * f2 + f);
+    w3 = 0.5f * (f3 - f2);
+
+    for (c = 0; c < channels; c++) {
+      gfloat v;
+
+      v = w0 * gst_raop_resample_get (priv, in, is_s16, channels, i - 1, c) +
+          w1 * gst_raop_resample_get (priv, in, is_s16, channels, i, c) +
+          w2 * gst_raop_resample_get (priv, in, is_s16, channels, i + 1, c) +
+          w3 * gst_raop_resample_get (priv, in, is_s16, channels, i + 2, c);
+
+      if (is_s16)
+        ((gint16 *) out)[count * channels + c] =
+            (gint16) CLAMP (lrintf (v), G_MININT16, G_MAXINT16);
+      else
+        ((gfloat *) out)[count * channels + c] = v;
+    }
+
+    count++;
+    pos += step;
+  }
+
+  /* keep last frames for next buffer */
+  for (n = 0; n < in_frames && n < HISTORY; n++) {
+    memmove (priv->history, priv->history + channels,
+        (HISTORY - 1) * channels * sizeof (gfloat));
+    for (c = 0; c < channels; c++)
+      priv->history[(HISTORY - 1) * channels + c] = gst_raop_resample_get (
+          priv, in, is_s16, channels, in_frames - MIN (in_frames, HISTORY) + n,
+          c);
+  }
+  priv->pos = pos - in_frames;
+
+  return count;
+}
+
+static GstFlowReturn
+gst_raop_resample_transform (
+    GstBaseTransform *trans, GstBuffer *inbuf, GstBuffer *outbuf)
+{
+  GstRaopResample *resample = GST_RAOP_RESAMPLE (trans);
+  GstAudioFilter *filter = GST_AUDIO_FILTER (trans);
+  GstRaopResamplePrivate *priv = resample->priv;
+  GstAudioInfo *info = &filter->info;
+  guint channels, rate, bpf, in_frames, count, c, n;
+  GstClockTime start, end;
+  GstMapInfo in_map, out_map;
+  gboolean is_s16;
+  gdouble step;
+
+  channels = GST_AUDIO_INFO_CHANNELS (info);
+  rate = GST_AUDIO_INFO_RATE (info);
+  bpf = GST_AUDIO_INFO_BPF (info);
+  is_s16 = GST_AUDIO_INFO_FORMAT (info) == GST_AUDIO_FORMAT_S16;
+  if (!bpf || !rate || channels > MAX_CHANNELS)
+    return GST_FLOW_NOT_NEGOTIATED;
+
+  /* get input frames per output frame */
+  GST_OBJECT_LOCK (resample);
+  step = 1.0 / priv->ratio;
+  GST_OBJECT_UNLOCK (resample);
+
+  if (!gst_buffer_map (inbuf, &in_map, GST_MAP_READ))
+    return GST_FLOW_ERROR;
+  if (!gst_buffer_map (outbuf, &out_map, GST_MAP_WRITE)) {
+    gst_buffer_unmap (inbuf, &in_map);
+    return GST_FLOW_ERROR;
+  }
+  in_frames = in_map.size / bpf;
+
+  /* restart on discontinuity: repeat first frame as history */
+  if (GST_BUFFER_IS_DISCONT (inbuf) || !priv->started) {
+    gst_raop_resample_reset (priv);
+    priv->started = TRUE;
+    priv->base_pts = GST_BUFFER_PTS (inbuf);
+    for (n = 0; n < HISTORY && in_frames; n++)
+      for (c = 0; c < channels; c++)
+        priv->history[n * channels + c] = gst_raop_resample_get (
+            priv, in_map.data, is_s16, channels, 0, c);
+  }
+
+  /* resample */
+  count = gst_raop_resample_process (priv, in_map.data, in_frames,
+      out_map.data, out_map.size / bpf, is_s16, channels, step);
+
+  gst_buffer_unmap (outbuf, &out_map);
+  gst_buffer_unmap (inbuf, &in_map);
+  gst_buffer_set_size (outbuf, count * bpf);
+
+  /* input frames skipped or repeated, for the RTP time of rendered frames */
+  priv->in_frames += in_frames;
+  gst_raop_resample_set_offset (resample,
+      priv->in_frames + priv->pos - (gdouble) (priv->out_frames + count));
+
+  /* not enough input frames yet */
+  if (!count)
+    return GST_BASE_TRANSFORM_FLOW_DROPPED;
+
+  /* timestamps follow output sample count */
+  start = gst_util_uint64_scale (priv->out_frames, GST_SECOND, rate);
+  priv->out_frames += count;
+  end = gst_util_uint64_scale (priv->out_frames, GST_SECOND, rate);
+  if (GST_CLOCK_TIME_IS_VALID (priv->base_pts)) {
+    GST_BUFFER_PTS (outbuf) = priv->base_pts + start;
+    GST_BUFFER_DURATION (outbuf) = end - start;
+  }
+
+  return GST_FLOW_OK;
+}
+
+gboolean
+gst_raop_resample_plugin_init (GstPlugin *plugin)
+{
+  GST_DEBUG_CATEGORY_INIT (
+      gst_raop_resample_debug, "raopresample", 0, "RAOP drift resampler");
+
+  return gst_element_register (
+      plugin, "raopresample", GST_RANK_NONE, GST_TYPE_RAOP_RESAMPLE);
+}
@@ -0,0 +1,246 @@
+/*
+ * gstraoptracer.c: Lightweight tracer for RAOP pipelines
+ *
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/* The tracer API is still flagged as unstable on older releases */
+#define GST_USE_UNSTABLE_API
+
+#include <string.h>
+
+#include <gst/gst.h>
+#include <gst/gsttracer.h>
+
+#include "gstraoptracer.h"
+
+#define GST_TYPE_RAOP_TRACER (gst_raop_tracer_get_type ())
+#define GST_RAOP_TRACER(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_TYPE_RAOP_TRACER, GstRaopTracer))
+
+#define MAX_DEPTH 16
+
+/* counters are updated from several streaming threads: they are only accessed
+ * atomically, so 64-bit time never tears on 32-bit targets
+ */
+typedef struct {
+  GstElement *element;
+  gchar name[32];
+  guint64 time;
+  guint buffers;
+} GstRaopTracerEntry;
+
+/* per-thread stack of pushes in progress */
+typedef struct {
+  guint depth;
+  struct {
+    GstPad *pad;
+    gint slot;
+    GstClockTime start;
+    GstClockTime child;
+  } frames[MAX_DEPTH];
+} GstRaopTracerStack;
+
+struct _GstRaopTracer {
+  GstTracer parent;
+
+  GstRaopTracerEntry entries[GST_RAOP_TRACER_MAX_ELEMENTS];
+  gint count;
+};
+
+typedef struct {
+  GstTracerClass parent_class;
+} GstRaopTracerClass;
+
+static GType gst_raop_tracer_get_type (void);
+G_DEFINE_TYPE (GstRaopTracer, gst_raop_tracer, GST_TYPE_TRACER);
+
+static GPrivate gst_raop_tracer_stack = G_PRIVATE_INIT (g_free);
+
+static gint
+gst_raop_tracer_lookup (GstRaopTracer *tracer, GstPad *pad)
+{
+  GstObject *parent;
+  GstPad *peer;
+  gint i, count;
+
+  /* no element registered */
+  count = g_atomic_int_get (&tracer->count);
+  if (!count)
+    return -1;
+
+  /* get element receiving buffer */
+  peer = GST_PAD_PEER (pad);
+  if (!peer)
+    return -1;
+  parent = GST_OBJECT_PARENT (peer);
+
+  /* find element in table */
+  for (i = 0; i < count; i++)
+    if (g_atomic_pointer_get (&tracer->entries[i].element) ==
+        (GstElement *) parent)
+      return i;
+
+  return -1;
+}
+
+static void
+gst_raop_tracer_push_pre (GObject *self, GstClockTime ts, GstPad *pad,
+    GstBuffer *buffer)
+{
+  GstRaopTracer *tracer = GST_RAOP_TRACER (self);
+  GstRaopTracerStack *stack;
+  gint slot;
+
+  /* not an element of our pipelines */
+  slot = gst_raop_tracer_lookup (tracer, pad);
+  if (slot < 0)
+    return;
+
+  /* get thread stack */
+  stack = g_private_get (&gst_raop_tracer_stack);
+  if (!stack) {
+    stack = g_new0 (GstRaopTracerStack, 1);
+    g_private_set (&gst_raop_tracer_stack, stack);
+  }
+  if (stack->depth >= MAX_DEPTH)
+    return;
+
+  /* push new frame */
+  stack->frames[stack->depth].pad = pad;
+  stack->frames[stack->depth].slot = slot;
+  stack->frames[stack->depth].start = ts;
+  stack->frames[stack->depth].child = 0;
+  stack->depth++;
+
+  g_atomic_int_inc (&tracer->entries[slot].buffers);
+}
+
+static void
+gst_raop_tracer_push_post (
+    GObject *self, GstClockTime ts, GstPad *pad, GstFlowReturn res)
+{
+  GstRaopTracerStack *stack;
+  GstRaopTracer *tracer = GST_RAOP_TRACER (self);
+  GstClockTime elapsed;
+  guint depth;
+
+  /* no push in progress on this pad */
+  stack = g_private_get (&gst_raop_tracer_stack);
+  if (!stack || !stack->depth)
+    return;
+  depth = stack->depth - 1;
+  if (stack->frames[depth].pad != pad)
+    return;
+  stack->depth = depth;
+
+  /* add time spent in element, without downstream elements */
+  elapsed = ts - stack->frames[depth].start;
+  __atomic_fetch_add (&tracer->entries[stack->frames[depth].slot].time,
+      elapsed - MIN (elapsed, stack->frames[depth].child), __ATOMIC_RELAXED);
+  if (depth)
+    stack->frames[depth - 1].child += elapsed;
+}
+
+static void
+gst_raop_tracer_class_init (GstRaopTracerClass *klass)
+{
+}
+
+static void
+gst_raop_tracer_init (GstRaopTracer *self)
+{
+  GstTracer *tracer = GST_TRACER (self);
+
+  gst_tracing_register_hook (
+      tracer, "pad-push-pre", G_CALLBACK (gst_raop_tracer_push_pre));
+  gst_tracing_register_hook (
+      tracer, "pad-push-post", G_CALLBACK (gst_raop_tracer_push_post));
+}
+
+GstRaopTracer *
+gst_raop_tracer_get (void)
+{
+  static GstRaopTracer *tracer;
+
+  /* hooks keep a reference on tracer, so a single instance is never freed */
+  if (g_once_init_enter (&tracer)) {
+    GstRaopTracer *t = g_object_new (GST_TYPE_RAOP_TRACER, NULL);
+    g_once_init_leave (&tracer, t);
+  }
+
+  return tracer;
+}
+
+gboolean
+gst_raop_tracer_add_element (GstRaopTracer *tracer, GstElement *element)
+{
+  GstRaopTracerEntry *entry;
+  gint count;
+
+  g_return_val_if_fail (tracer != NULL, FALSE);
+
+  /* table is full */
+  count = g_atomic_int_get (&tracer->count);
+  if (count >= GST_RAOP_TRACER_MAX_ELEMENTS)
+    return FALSE;
+
+  /* fill entry before publishing it */
+  entry = &tracer->entries[count];
+  g_strlcpy (entry->name, GST_OBJECT_NAME (element), sizeof (entry->name));
+  __atomic_store_n (&entry->time, 0, __ATOMIC_RELAXED);
+  g_atomic_int_set (&entry->buffers, 0);
+  g_atomic_pointer_set (&entry->element, element);
+  g_atomic_int_set (&tracer->count, count + 1);
+
+  return TRUE;
+}
+
+void
+gst_raop_tracer_clear (GstRaopTracer *tracer)
+{
+  gint i;
+
+  g_return_if_fail (tracer != NULL);
+
+  /* must be called when no buffer flows in registered elements */
+  g_atomic_int_set (&tracer->count, 0);
+  for (i = 0; i < GST_RAOP_TRACER_MAX_ELEMENTS; i++)
+    g_atomic_pointer_set (&tracer->entries[i].element, NULL);
+}
+
+void
+gst_raop_tracer_dump (GstRaopTracer *tracer, GString *str)
+{
+  gint i, count;
+
+  g_return_if_fail (tracer != NULL);
+
+  count = g_atomic_int_get (&tracer->count);
+  for (i = 0; i < count; i++) {
+    GstRaopTracerEntry *entry = &tracer->entries[i];
+    guint64 time = __atomic_load_n (&entry->time, __ATOMIC_RELAXED);
+    guint buffers = g_atomic_int_get (&entry->buffers);
+
+    g_string_append_printf (str,
+        "%s: buffers=%u time=%" G_GUINT64_FORMAT " us avg=%" G_GUINT64_FORMAT
+        " ns\n",
+        entry->name, buffers, time / GST_USECOND,
+        buffers ? time / buffers : 0);
+  }
+}
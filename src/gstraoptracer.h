@@ -0,0 +1,43 @@
+/*
+ * gstraoptracer.h: Lightweight tracer for RAOP pipelines
+ *
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __GST_RAOP_TRACER_H__
+#define __GST_RAOP_TRACER_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_RAOP_TRACER_MAX_ELEMENTS 32
+
+typedef struct _GstRaopTracer GstRaopTracer;
+
+GstRaopTracer *gst_raop_tracer_get (void);
+
+gboolean gst_raop_tracer_add_element (
+    GstRaopTracer *tracer, GstElement *element);
+void gst_raop_tracer_clear (GstRaopTracer *tracer);
+
+void gst_raop_tracer_dump (GstRaopTracer *tracer, GString *str);
+
+G_END_DECLS
+
+#endif /* __GST_RAOP_TRACER_H__ */
@@ -55,6 +55,7 @@ struct _GstRtpRaopPrivate {
   GstPad *ctrl_srcpad;
 
   guint random_drop;
+  GstAllocator *allocator;
 };
 
 enum {
@@ -62,6 +63,13 @@ enum {
   PROP_RANDOM_DROP,
 };
 
+enum {
+  SIGNAL_SYNC,
+  LAST_SIGNAL,
+};
+
+static guint gst_rtp_raop_signals[LAST_SIGNAL] = {0};
+
 #define gst_rtp_raop_parent_class parent_class
 G_DEFINE_TYPE_WITH_PRIVATE (GstRtpRaop, gst_rtp_raop, GST_TYPE_ELEMENT);
 
@@ -69,12 +77,15 @@ static void gst_rtp_raop_set_property (
     GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec);
 static void gst_rtp_raop_get_property (
     GObject *object, guint prop_id, GValue *value, GParamSpec *pspec);
+static void gst_rtp_raop_finalize (GObject *object);
 
 static gboolean gst_rtp_raop_src_event (
     GstPad *pad, GstObject *parent, GstEvent *event);
 
 static gboolean gst_rtp_raop_sink_event (
     GstPad *pad, GstObject *parent, GstEvent *event);
+static gboolean gst_rtp_raop_sink_query (
+    GstPad *pad, GstObject *parent, GstQuery *query);
 static GstFlowReturn gst_rtp_raop_chain (
     GstPad *pad, GstObject *parent, GstBuffer *buf);
 
@@ -93,6 +104,7 @@ gst_rtp_raop_class_init (GstRtpRaopClass *klass)
 
   gobject_class->set_property = gst_rtp_raop_set_property;
   gobject_class->get_property = gst_rtp_raop_get_property;
+  gobject_class->finalize = gst_rtp_raop_finalize;
 
   g_object_class_install_property (gobject_class, PROP_RANDOM_DROP,
       g_param_spec_uint ("random-drop",
@@ -100,6 +112,19 @@ gst_rtp_raop_class_init (GstRtpRaopClass *klass)
           "Probability of drop (greater is less drop, 0 disable drop)", 0,
           G_MAXUINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  /**
+   * GstRtpRaop::sync:
+   * @raop: the #GstRtpRaop
+   * @rtptime: the current RTP time of the sender
+   * @ntp: the current NTP time of the sender
+   * @time: the element clock time at reception
+   *
+   * Emitted from the control streaming thread for each sync packet received.
+   */
+  gst_rtp_raop_signals[SIGNAL_SYNC] = g_signal_new ("sync",
+      G_TYPE_FROM_CLASS (klass), G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL,
+      G_TYPE_NONE, 3, G_TYPE_UINT, G_TYPE_UINT64, G_TYPE_UINT64);
+
   gst_element_class_set_details_simple (gstelement_class, "RTP ROAP Muxer",
       "Filter/Network/RTP",
       "A multiple RTP stream muxer to handle sync packets and"
@@ -134,6 +159,8 @@ gst_rtp_raop_init (GstRtpRaop *raop)
       priv->sinkpad, GST_DEBUG_FUNCPTR (gst_rtp_raop_sink_event));
   gst_pad_set_chain_function (
       priv->sinkpad, GST_DEBUG_FUNCPTR (gst_rtp_raop_chain));
+  gst_pad_set_query_function (
+      priv->sinkpad, GST_DEBUG_FUNCPTR (gst_rtp_raop_sink_query));
   GST_PAD_SET_PROXY_CAPS (priv->sinkpad);
 
   priv->srcpad =
@@ -181,6 +208,17 @@ gst_rtp_raop_get_property (
   }
 }
 
+static void
+gst_rtp_raop_finalize (GObject *object)
+{
+  GstRtpRaop *raop = GST_RTP_RAOP (object);
+
+  if (raop->priv->allocator)
+    gst_object_unref (raop->priv->allocator);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
 static gboolean
 gst_rtp_raop_src_event (GstPad *pad, GstObject *parent, GstEvent *event)
 {
@@ -257,6 +295,37 @@ gst_rtp_raop_sink_event (GstPad *pad, GstObject *parent, GstEvent *event)
   return ret;
 }
 
+static gboolean
+gst_rtp_raop_sink_query (GstPad *pad, GstObject *parent, GstQuery *query)
+{
+  GstRtpRaopPrivate *priv;
+  GstRtpRaop *raop;
+  gboolean ret;
+
+  raop = GST_RTP_RAOP (parent);
+  priv = raop->priv;
+
+  switch (GST_QUERY_TYPE (query)) {
+  case GST_QUERY_ALLOCATION:
+    /* propose packet allocator to UDP sources */
+    GST_OBJECT_LOCK (raop);
+    if (priv->allocator) {
+      gst_query_add_allocation_param (query, priv->allocator, NULL);
+      ret = TRUE;
+    } else
+      ret = FALSE;
+    GST_OBJECT_UNLOCK (raop);
+    if (ret)
+      break;
+    /* fall through */
+  default:
+    ret = gst_pad_query_default (pad, parent, query);
+    break;
+  }
+
+  return ret;
+}
+
 static GstFlowReturn
 gst_rtp_raop_chain (GstPad *pad, GstObject *parent, GstBuffer *buf)
 {
@@ -303,6 +372,8 @@ gst_rtp_raop_ctrl_chain (GstPad *pad, GstObject *parent, GstBuffer *buf)
   GstBuffer *out_buf = NULL;
   GstRtpRaopPrivate *priv;
   GstRtpRaop *raop;
+  GstMapInfo map;
+  GstClock *clock;
   guint plen;
   guint8 pt;
 
@@ -325,11 +396,27 @@ gst_rtp_raop_ctrl_chain (GstPad *pad, GstObject *parent, GstBuffer *buf)
 
   switch (pt) {
   case 84:
-    /* time sync packet */
-    /* this packet should be send to GstClock based on RAOP timings packets */
+    /* time sync packet: get reception time as soon as possible */
+    clock = gst_element_get_clock (GST_ELEMENT (raop));
+    if (!clock)
+      break;
+
+    if (gst_buffer_map (buf, &map, GST_MAP_READ)) {
+      if (map.size >= 20) {
+        GstClockTime now = gst_clock_get_time (clock);
+        guint64 ntp = GST_READ_UINT64_BE (map.data + 8);
+        guint32 rtptime = GST_READ_UINT32_BE (map.data + 16);
+
+        GST_LOG_OBJECT (raop, "sync: rtptime = %u", rtptime);
+        g_signal_emit (
+            raop, gst_rtp_raop_signals[SIGNAL_SYNC], 0, rtptime, ntp, now);
+      }
+      gst_buffer_unmap (buf, &map);
+    }
+    gst_object_unref (clock);
     break;
   case 86:
-    /* retransmit reply packet: get payload */
+    /* retransmit reply packet: get payload (shared with packet memory) */
     plen = gst_buffer_get_size (buf);
     out_buf = gst_buffer_copy_region (buf, GST_BUFFER_COPY_ALL, 4, plen - 4);
     break;
@@ -376,6 +463,7 @@ gst_rtp_raop_request_new_pad (GstElement *element, GstPadTemplate *template,
         &gst_rtp_raop_sink_ctrl_template, "sink_ctrl");
 
     gst_pad_set_chain_function (pad, gst_rtp_raop_ctrl_chain);
+    gst_pad_set_query_function (pad, gst_rtp_raop_sink_query);
     gst_pad_set_event_function (
         pad, (GstPadEventFunction) gst_rtp_raop_ctrl_sink_event);
     gst_pad_set_active (pad, TRUE);
@@ -431,6 +519,15 @@ gst_rtp_raop_release_pad (GstElement *element, GstPad *pad)
     priv->ctrl_srcpad = NULL;
 }
 
+void
+gst_rtp_raop_set_allocator (GstRtpRaop *raop, GstAllocator *allocator)
+{
+  GST_OBJECT_LOCK (raop);
+  gst_object_replace ((GstObject **) &raop->priv->allocator,
+      (GstObject *) allocator);
+  GST_OBJECT_UNLOCK (raop);
+}
+
 gboolean
 gst_rtp_raop_plugin_init (GstPlugin *plugin)
 {
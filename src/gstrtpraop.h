@@ -56,6 +56,8 @@ struct _GstRtpRaopClass {
 GType gst_rtp_raop_get_type (void);
 gboolean gst_rtp_raop_plugin_init (GstPlugin *plugin);
 
+void gst_rtp_raop_set_allocator (GstRtpRaop *raop, GstAllocator *allocator);
+
 G_END_DECLS
 
 #endif /* __GST_RTP_RAOP_H__ */
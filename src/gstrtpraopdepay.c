@@ -50,6 +50,7 @@ struct _GstRtpRaopDepayPrivate {
   guchar iv[16];
   guint32 last_rtptime;
   gint sample_size;
+  GstAllocator *allocator;
 };
 
 enum {
@@ -69,16 +70,21 @@ static GstBuffer *gst_rtp_raop_depay_process (
 
 static GstStateChangeReturn gst_rtp_raop_depay_change_state (
     GstElement *element, GstStateChange transition);
+static void gst_rtp_raop_depay_finalize (GObject *object);
 
 static void
 gst_rtp_raop_depay_class_init (GstRtpRaopDepayClass *klass)
 {
+  GObjectClass *gobject_class;
   GstElementClass *gstelement_class;
   GstRTPBaseDepayloadClass *gstrtpbasedepayload_class;
 
+  gobject_class = (GObjectClass *) klass;
   gstelement_class = (GstElementClass *) klass;
   gstrtpbasedepayload_class = (GstRTPBaseDepayloadClass *) klass;
 
+  gobject_class->finalize = gst_rtp_raop_depay_finalize;
+
   gstelement_class->change_state = gst_rtp_raop_depay_change_state;
 
   gstrtpbasedepayload_class->process = gst_rtp_raop_depay_process;
@@ -107,6 +113,17 @@ gst_rtp_raop_depay_init (GstRtpRaopDepay *rtpraopdepay)
   rtpraopdepay->priv = priv;
 }
 
+static void
+gst_rtp_raop_depay_finalize (GObject *object)
+{
+  GstRtpRaopDepay *rtpraopdepay = GST_RTP_RAOP_DEPAY (object);
+
+  if (rtpraopdepay->priv->allocator)
+    gst_object_unref (rtpraopdepay->priv->allocator);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
 #ifndef DECODE_PCM_AS_ALAC
 static gboolean
 gst_rtp_raop_depay_parse_pcm_config (
@@ -205,6 +222,14 @@ gst_rtp_raop_depay_set_key (GstRtpRaopDepay *rtpraopdepay, const guchar *key,
   return TRUE;
 }
 
+void
+gst_rtp_raop_depay_set_allocator (
+    GstRtpRaopDepay *rtpraopdepay, GstAllocator *allocator)
+{
+  gst_object_replace ((GstObject **) &rtpraopdepay->priv->allocator,
+      (GstObject *) allocator);
+}
+
 static gboolean
 gst_rtp_raop_depay_setcaps (GstRTPBaseDepayload *depayload, GstCaps *caps)
 {
@@ -398,6 +423,7 @@ gst_rtp_raop_depay_process (GstRTPBaseDepayload *depayload, GstBuffer *buf)
   GstRtpRaopDepayPrivate *priv;
   GstRTPBuffer rtp = {NULL};
   GstBuffer *in_buf, *out_buf;
+  guint32 rtptime;
   gint payload_len;
 
   rtpraopdepay = GST_RTP_RAOP_DEPAY (depayload);
@@ -407,7 +433,8 @@ gst_rtp_raop_depay_process (GstRTPBaseDepayload *depayload, GstBuffer *buf)
   gst_rtp_buffer_map (buf, GST_MAP_READ, &rtp);
 
   /* Get RTP time */
-  priv->last_rtptime = gst_rtp_buffer_get_timestamp (&rtp);
+  rtptime = gst_rtp_buffer_get_timestamp (&rtp);
+  g_atomic_int_set (&priv->last_rtptime, rtptime);
 
   /* Get packet len */
   payload_len = gst_rtp_buffer_get_payload_len (&rtp);
@@ -427,8 +454,9 @@ gst_rtp_raop_depay_process (GstRTPBaseDepayload *depayload, GstBuffer *buf)
     gst_buffer_map (in_buf, &in, 0);
     in_data = in.data;
 
-    /* Allocate a new buffer */
-    out_buf = gst_buffer_new_allocate (NULL, payload_len + 4, NULL);
+    /* Allocate a new buffer and keep packet metadata */
+    out_buf = gst_buffer_new_allocate (priv->allocator, payload_len + 4, NULL);
+    gst_buffer_copy_into (out_buf, in_buf, GST_BUFFER_COPY_META, 0, -1);
     gst_buffer_map (out_buf, &out, GST_MAP_WRITE);
     out_data = out.data;
 
@@ -455,6 +483,9 @@ gst_rtp_raop_depay_process (GstRTPBaseDepayload *depayload, GstBuffer *buf)
   /* Free RTP buffer */
   gst_buffer_unref (in_buf);
 
+  /* Keep RTP time in offset: used downstream to map timestamps to RTP time */
+  GST_BUFFER_OFFSET (out_buf) = rtptime;
+
   return out_buf;
 }
 
@@ -462,10 +493,13 @@ gboolean
 gst_rtp_raop_depay_query_rtptime (
     GstRtpRaopDepay *rtpraopdepay, guint32 *rtptime)
 {
-  if (!rtptime || !rtpraopdepay->priv->last_rtptime)
+  guint32 last_rtptime;
+
+  last_rtptime = g_atomic_int_get (&rtpraopdepay->priv->last_rtptime);
+  if (!rtptime || !last_rtptime)
     return FALSE;
 
-  *rtptime = rtpraopdepay->priv->last_rtptime;
+  *rtptime = last_rtptime;
   return TRUE;
 }
 
@@ -59,6 +59,8 @@ gboolean gst_rtp_raop_depay_plugin_init (GstPlugin *plugin);
 
 gboolean gst_rtp_raop_depay_set_key (GstRtpRaopDepay *rtpraopdepay,
     const guchar *key, gsize key_len, const guchar *iv, gsize iv_len);
+void gst_rtp_raop_depay_set_allocator (
+    GstRtpRaopDepay *rtpraopdepay, GstAllocator *allocator);
 gboolean gst_rtp_raop_depay_query_rtptime (
     GstRtpRaopDepay *rtpraopdepay, guint32 *rtptime);
 
@@ -47,11 +47,13 @@ struct _GstTcpRaopPrivate {
   guint32 rtptime;
   guint16 seq;
   gboolean first;
+  GstAllocator *allocator;
 };
 
 #define gst_tcp_raop_parent_class parent_class
 G_DEFINE_TYPE_WITH_PRIVATE (GstTcpRaop, gst_tcp_raop, GST_TYPE_BASE_PARSE);
 
+static void gst_tcp_raop_finalize (GObject *object);
 static gboolean gst_tcp_raop_set_sink_caps (GstBaseParse *parse, GstCaps *caps);
 static GstFlowReturn gst_tcp_raop_handle_frame (
     GstBaseParse *parse, GstBaseParseFrame *frame, gint *skipsize);
@@ -59,9 +61,12 @@ static GstFlowReturn gst_tcp_raop_handle_frame (
 static void
 gst_tcp_raop_class_init (GstTcpRaopClass *klass)
 {
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
   GstElementClass *gstelement_class = GST_ELEMENT_CLASS (klass);
   GstBaseParseClass *parse_class = GST_BASE_PARSE_CLASS (klass);
 
+  gobject_class->finalize = gst_tcp_raop_finalize;
+
   gst_element_class_add_pad_template (gstelement_class,
       gst_static_pad_template_get (&gst_tcp_raop_src_template));
   gst_element_class_add_pad_template (gstelement_class,
@@ -91,6 +96,17 @@ gst_tcp_raop_init (GstTcpRaop *raop)
   gst_base_parse_set_min_frame_size (GST_BASE_PARSE (raop), 16);
 }
 
+static void
+gst_tcp_raop_finalize (GObject *object)
+{
+  GstTcpRaop *raop = GST_TCP_RAOP (object);
+
+  if (raop->priv->allocator)
+    gst_object_unref (raop->priv->allocator);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
 static gboolean
 gst_tcp_raop_set_sink_caps (GstBaseParse *parse, GstCaps *caps)
 {
@@ -140,6 +156,7 @@ gst_tcp_raop_handle_frame (
   GstTcpRaop *raop;
   GstTcpRaopPrivate *priv;
   guint8 header[16];
+  GstMapInfo map;
   gsize buf_size;
   guint16 size;
 
@@ -183,13 +200,28 @@ gst_tcp_raop_handle_frame (
     gst_buffer_fill (frame->buffer, 0, header, 16);
   }
 
-  /* get only RTP buffer */
-  frame->out_buffer =
-      gst_buffer_copy_region (frame->buffer, GST_BUFFER_COPY_ALL, 4, size);
+  /* get only RTP buffer: copy it in a packet block to release stream data */
+  if (priv->allocator) {
+    frame->out_buffer = gst_buffer_new_allocate (priv->allocator, size, NULL);
+    gst_buffer_copy_into (
+        frame->out_buffer, frame->buffer, GST_BUFFER_COPY_METADATA, 0, -1);
+    gst_buffer_map (frame->out_buffer, &map, GST_MAP_WRITE);
+    gst_buffer_extract (frame->buffer, 4, map.data, size);
+    gst_buffer_unmap (frame->out_buffer, &map);
+  } else
+    frame->out_buffer =
+        gst_buffer_copy_region (frame->buffer, GST_BUFFER_COPY_ALL, 4, size);
 
   return gst_base_parse_finish_frame (parse, frame, size + 4);
 }
 
+void
+gst_tcp_raop_set_allocator (GstTcpRaop *raop, GstAllocator *allocator)
+{
+  gst_object_replace (
+      (GstObject **) &raop->priv->allocator, (GstObject *) allocator);
+}
+
 gboolean
 gst_tcp_raop_plugin_init (GstPlugin *plugin)
 {
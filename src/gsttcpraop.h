@@ -57,6 +57,8 @@ struct _GstTcpRaopClass {
 GType gst_tcp_raop_get_type (void);
 gboolean gst_tcp_raop_plugin_init (GstPlugin *plugin);
 
+void gst_tcp_raop_set_allocator (GstTcpRaop *raop, GstAllocator *allocator);
+
 G_END_DECLS
 
 #endif /* __GST_TCP_RAOP_H__ */
@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#include <string.h>
+
+#include "melo_airplay_arena.h"
+
+#define MELO_AIRPLAY_ARENA_ALIGN sizeof (void *)
+
+struct _MeloAirplayArenaBlock {
+  MeloAirplayArenaBlock *next;
+  size_t size;
+  unsigned char data[];
+};
+
+static MeloAirplayArenaBlock *
+melo_airplay_arena_block_new (MeloAirplayArena *arena, size_t size)
+{
+  MeloAirplayArenaBlock *block;
+
+  block = g_malloc (sizeof (*block) + size);
+  block->size = size;
+  arena->block_allocs++;
+
+  return block;
+}
+
+/**
+ * melo_airplay_arena_alloc:
+ * @arena: the arena
+ * @size: the size to allocate
+ *
+ * Allocate memory from the arena. A new block is allocated when the current
+ * one is full, and allocations bigger than a quarter of a block get their own
+ * block, inserted behind the current one so it can still be filled.
+ *
+ * Returns: the allocated memory, aligned on a pointer, which is valid until
+ *     the arena is reset or cleared.
+ */
+void *
+melo_airplay_arena_alloc (MeloAirplayArena *arena, size_t size)
+{
+  MeloAirplayArenaBlock *block;
+  void *ptr;
+
+  size = (size + MELO_AIRPLAY_ARENA_ALIGN - 1) &
+         ~(MELO_AIRPLAY_ARENA_ALIGN - 1);
+  arena->allocs++;
+  arena->bytes += size;
+
+  /* Big allocation: use a dedicated block */
+  if (size > MELO_AIRPLAY_ARENA_BLOCK_SIZE / 4) {
+    block = melo_airplay_arena_block_new (arena, size);
+    if (arena->blocks) {
+      block->next = arena->blocks->next;
+      arena->blocks->next = block;
+    } else {
+      block->next = NULL;
+      arena->blocks = block;
+      arena->used = size;
+    }
+    return block->data;
+  }
+
+  /* Current block is full */
+  if (!arena->blocks || arena->used + size > arena->blocks->size) {
+    block = melo_airplay_arena_block_new (
+        arena, MELO_AIRPLAY_ARENA_BLOCK_SIZE);
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->used = 0;
+  }
+
+  /* Take memory from current block */
+  ptr = arena->blocks->data + arena->used;
+  arena->used += size;
+
+  return ptr;
+}
+
+/**
+ * melo_airplay_arena_memdup:
+ * @arena: the arena
+ * @data: the data to copy
+ * @size: the size of the data
+ *
+ * Copy data into the arena.
+ *
+ * Returns: the copy, or %NULL if @data is %NULL.
+ */
+void *
+melo_airplay_arena_memdup (
+    MeloAirplayArena *arena, const void *data, size_t size)
+{
+  void *ptr;
+
+  if (!data)
+    return NULL;
+
+  ptr = melo_airplay_arena_alloc (arena, size);
+  memcpy (ptr, data, size);
+
+  return ptr;
+}
+
+/**
+ * melo_airplay_arena_strndup:
+ * @arena: the arena
+ * @str: the string to copy
+ * @len: the length of the string
+ *
+ * Copy the first @len bytes of a string into the arena, terminated with a
+ * NUL character.
+ *
+ * Returns: the copy, or %NULL if @str is %NULL.
+ */
+char *
+melo_airplay_arena_strndup (
+    MeloAirplayArena *arena, const char *str, size_t len)
+{
+  char *ptr;
+
+  if (!str)
+    return NULL;
+
+  ptr = melo_airplay_arena_alloc (arena, len + 1);
+  memcpy (ptr, str, len);
+  ptr[len] = '\0';
+
+  return ptr;
+}
+
+/**
+ * melo_airplay_arena_strdup:
+ * @arena: the arena
+ * @str: the string to copy
+ *
+ * Copy a string into the arena.
+ *
+ * Returns: the copy, or %NULL if @str is %NULL.
+ */
+char *
+melo_airplay_arena_strdup (MeloAirplayArena *arena, const char *str)
+{
+  return str ? melo_airplay_arena_strndup (arena, str, strlen (str)) : NULL;
+}
+
+/**
+ * melo_airplay_arena_reset:
+ * @arena: the arena
+ *
+ * Release all memory allocated from the arena but keep the last standard
+ * block, so an arena reset between requests does not allocate again.
+ */
+void
+melo_airplay_arena_reset (MeloAirplayArena *arena)
+{
+  MeloAirplayArenaBlock *block = arena->blocks, *keep = NULL;
+
+  while (block) {
+    MeloAirplayArenaBlock *next = block->next;
+
+    if (!keep && block->size == MELO_AIRPLAY_ARENA_BLOCK_SIZE)
+      keep = block;
+    else
+      g_free (block);
+    block = next;
+  }
+
+  if (keep)
+    keep->next = NULL;
+  arena->blocks = keep;
+  arena->used = 0;
+}
+
+/**
+ * melo_airplay_arena_clear:
+ * @arena: the arena
+ *
+ * Release all memory of the arena. The arena can be used again.
+ */
+void
+melo_airplay_arena_clear (MeloAirplayArena *arena)
+{
+  melo_airplay_arena_reset (arena);
+  g_free (arena->blocks);
+  arena->blocks = NULL;
+}
+
+/**
+ * melo_airplay_arena_dump:
+ * @arena: the arena
+ * @name: the name of the arena
+ * @str: the string to append to
+ *
+ * Append allocation statistics of the arena to a string.
+ */
+void
+melo_airplay_arena_dump (
+    MeloAirplayArena *arena, const char *name, GString *str)
+{
+  g_string_append_printf (str,
+      "  %s: %u allocations, %zu bytes, %u blocks allocated\n", name,
+      arena->allocs, arena->bytes, arena->block_allocs);
+}
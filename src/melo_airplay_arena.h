@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#ifndef _MELO_AIRPLAY_ARENA_H_
+#define _MELO_AIRPLAY_ARENA_H_
+
+#include <stddef.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define MELO_AIRPLAY_ARENA_BLOCK_SIZE 1024
+
+typedef struct _MeloAirplayArenaBlock MeloAirplayArenaBlock;
+
+/**
+ * MeloAirplayArena:
+ *
+ * A bump allocator for data sharing the lifetime of a session or a request:
+ * memory is taken from blocks of #MELO_AIRPLAY_ARENA_BLOCK_SIZE bytes, or
+ * from a dedicated block for bigger allocations, and is never freed
+ * individually. All memory is released at once with melo_airplay_arena_reset()
+ * or melo_airplay_arena_clear().
+ *
+ * A zero-filled arena is ready to use.
+ */
+typedef struct {
+  /*< private >*/
+  MeloAirplayArenaBlock *blocks;
+  size_t used;
+
+  /* Statistics */
+  unsigned int allocs;
+  unsigned int block_allocs;
+  size_t bytes;
+} MeloAirplayArena;
+
+void *melo_airplay_arena_alloc (MeloAirplayArena *arena, size_t size);
+void *melo_airplay_arena_memdup (
+    MeloAirplayArena *arena, const void *data, size_t size);
+char *melo_airplay_arena_strndup (
+    MeloAirplayArena *arena, const char *str, size_t len);
+char *melo_airplay_arena_strdup (MeloAirplayArena *arena, const char *str);
+
+void melo_airplay_arena_reset (MeloAirplayArena *arena);
+void melo_airplay_arena_clear (MeloAirplayArena *arena);
+
+void melo_airplay_arena_dump (
+    MeloAirplayArena *arena, const char *name, GString *str);
+
+G_END_DECLS
+
+#endif /* !_MELO_AIRPLAY_ARENA_H_ */
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#include <string.h>
+
+#include "melo_airplay_dmap.h"
+
+/**
+ * melo_airplay_dmap_parser_reset:
+ * @parser: the DMAP parser
+ *
+ * Reset the parser for a new body.
+ */
+void
+melo_airplay_dmap_parser_reset (MeloAirplayDmapParser *parser)
+{
+  parser->header_len = 0;
+  parser->in_value = false;
+}
+
+static bool
+melo_airplay_dmap_is_container (uint32_t code)
+{
+  return code == MELO_AIRPLAY_DMAP_MLIT;
+}
+
+/**
+ * melo_airplay_dmap_parser_feed:
+ * @parser: the DMAP parser
+ * @data: the next chunk of the body
+ * @size: the size of the chunk
+ * @func: the function to call for each item
+ * @user_data: the data to pass to @func
+ *
+ * Parse the next chunk of a DMAP body. Items of containers are parsed as
+ * top-level items, and @func is called once per item, as soon as its value is
+ * complete.
+ */
+void
+melo_airplay_dmap_parser_feed (MeloAirplayDmapParser *parser,
+    const unsigned char *data, size_t size, MeloAirplayDmapFunc func,
+    void *user_data)
+{
+  while (size) {
+    size_t n;
+
+    /* Complete item header */
+    if (!parser->in_value) {
+      n = MIN (size, 8 - parser->header_len);
+      memcpy (parser->header + parser->header_len, data, n);
+      parser->header_len += n;
+      data += n;
+      size -= n;
+      if (parser->header_len < 8)
+        break;
+      parser->header_len = 0;
+
+      /* Get code and length */
+      parser->code = (uint32_t) melo_airplay_dmap_get_uint (parser->header, 4);
+      parser->len = melo_airplay_dmap_get_uint (parser->header + 4, 4);
+
+      /* Parse container content as next items */
+      if (melo_airplay_dmap_is_container (parser->code))
+        continue;
+
+      /* Empty value: complete it now, the body may end with its header */
+      if (!parser->len) {
+        func (parser->code, data, 0, user_data);
+        continue;
+      }
+
+      parser->in_value = true;
+      parser->offset = 0;
+    }
+
+    /* Whole value in chunk: pass a view */
+    if (!parser->offset && parser->len <= size) {
+      func (parser->code, data, parser->len, user_data);
+      data += parser->len;
+      size -= parser->len;
+      parser->in_value = false;
+      continue;
+    }
+
+    /* Split value: keep it if possible */
+    n = MIN (size, parser->len - parser->offset);
+    if (parser->len <= MELO_AIRPLAY_DMAP_MAX_VALUE)
+      memcpy (parser->value + parser->offset, data, n);
+    parser->offset += n;
+    data += n;
+    size -= n;
+
+    /* Value completed */
+    if (parser->offset == parser->len) {
+      if (parser->len <= MELO_AIRPLAY_DMAP_MAX_VALUE)
+        func (parser->code, parser->value, parser->len, user_data);
+      parser->in_value = false;
+    }
+  }
+}
+
+/**
+ * melo_airplay_dmap_parser_is_complete:
+ * @parser: the DMAP parser
+ *
+ * Check if the parser is between two items, which is expected at the end of a
+ * body. A truncated body leaves the parser in the middle of an item.
+ *
+ * Returns: %true if no item is partially parsed.
+ */
+bool
+melo_airplay_dmap_parser_is_complete (MeloAirplayDmapParser *parser)
+{
+  return !parser->in_value && !parser->header_len;
+}
+
+/**
+ * melo_airplay_dmap_get_uint:
+ * @data: the item value
+ * @len: the length of the value
+ *
+ * Read a big endian unsigned integer of any length up to 8 bytes, with no
+ * alignment constraint. Only the last 8 bytes of longer values are read.
+ *
+ * Returns: the integer value.
+ */
+uint64_t
+melo_airplay_dmap_get_uint (const unsigned char *data, size_t len)
+{
+  uint64_t value = 0;
+
+  if (len > 8) {
+    data += len - 8;
+    len = 8;
+  }
+  while (len--)
+    value = value << 8 | *data++;
+
+  return value;
+}
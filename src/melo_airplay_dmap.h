@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#ifndef _MELO_AIRPLAY_DMAP_H_
+#define _MELO_AIRPLAY_DMAP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define MELO_AIRPLAY_DMAP_CODE(a, b, c, d) \
+  ((uint32_t) (a) << 24 | (uint32_t) (b) << 16 | (uint32_t) (c) << 8 | \
+      (uint32_t) (d))
+
+/* Containers */
+#define MELO_AIRPLAY_DMAP_MLIT MELO_AIRPLAY_DMAP_CODE ('m', 'l', 'i', 't')
+
+/* Item fields */
+#define MELO_AIRPLAY_DMAP_MINM MELO_AIRPLAY_DMAP_CODE ('m', 'i', 'n', 'm')
+#define MELO_AIRPLAY_DMAP_MPER MELO_AIRPLAY_DMAP_CODE ('m', 'p', 'e', 'r')
+#define MELO_AIRPLAY_DMAP_ASAR MELO_AIRPLAY_DMAP_CODE ('a', 's', 'a', 'r')
+#define MELO_AIRPLAY_DMAP_ASAL MELO_AIRPLAY_DMAP_CODE ('a', 's', 'a', 'l')
+#define MELO_AIRPLAY_DMAP_ASGN MELO_AIRPLAY_DMAP_CODE ('a', 's', 'g', 'n')
+#define MELO_AIRPLAY_DMAP_ASTM MELO_AIRPLAY_DMAP_CODE ('a', 's', 't', 'm')
+#define MELO_AIRPLAY_DMAP_ASTN MELO_AIRPLAY_DMAP_CODE ('a', 's', 't', 'n')
+#define MELO_AIRPLAY_DMAP_ASDK MELO_AIRPLAY_DMAP_CODE ('a', 's', 'd', 'k')
+#define MELO_AIRPLAY_DMAP_CAPS MELO_AIRPLAY_DMAP_CODE ('c', 'a', 'p', 's')
+
+/* Largest value kept when split between two chunks */
+#define MELO_AIRPLAY_DMAP_MAX_VALUE 1024
+
+/**
+ * MeloAirplayDmapFunc:
+ * @code: the 4-byte code of the item, as a big endian integer
+ * @data: the item value, only valid during the call
+ * @len: the length of the value
+ * @user_data: the data passed to melo_airplay_dmap_parser_feed()
+ *
+ * Called for each item which is not a container.
+ */
+typedef void (*MeloAirplayDmapFunc) (
+    uint32_t code, const unsigned char *data, size_t len, void *user_data);
+
+/**
+ * MeloAirplayDmapParser:
+ *
+ * An incremental DMAP parser: the body can be fed in any number of chunks and
+ * values are passed as views into the chunks. Only a value split between two
+ * chunks is copied into the parser, and skipped when it is bigger than
+ * #MELO_AIRPLAY_DMAP_MAX_VALUE.
+ */
+typedef struct {
+  /*< private >*/
+  unsigned char header[8];
+  size_t header_len;
+
+  /* Current item value */
+  bool in_value;
+  uint32_t code;
+  size_t len;
+  size_t offset;
+  unsigned char value[MELO_AIRPLAY_DMAP_MAX_VALUE];
+} MeloAirplayDmapParser;
+
+void melo_airplay_dmap_parser_reset (MeloAirplayDmapParser *parser);
+void melo_airplay_dmap_parser_feed (MeloAirplayDmapParser *parser,
+    const unsigned char *data, size_t size, MeloAirplayDmapFunc func,
+    void *user_data);
+bool melo_airplay_dmap_parser_is_complete (MeloAirplayDmapParser *parser);
+
+uint64_t melo_airplay_dmap_get_uint (const unsigned char *data, size_t len);
+
+G_END_DECLS
+
+#endif /* !_MELO_AIRPLAY_DMAP_H_ */
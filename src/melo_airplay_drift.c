@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#include <string.h>
+
+#include "melo_airplay_drift.h"
+
+/* Sync packets are sent every second: keep one point every 8 seconds */
+#define MELO_AIRPLAY_DRIFT_GROUP 8
+
+/* Minimum kept points before estimating the drift */
+#define MELO_AIRPLAY_DRIFT_MIN_POINTS 4
+
+/* Maximum delay variation (in us) before restarting estimation */
+#define MELO_AIRPLAY_DRIFT_MAX_JUMP 1000000
+
+/* Maximum correction (in ppm): greater drift are considered as errors */
+#define MELO_AIRPLAY_DRIFT_MAX_PPM 1000
+
+/* Phase error is corrected over this time (in s), at most by this rate (in
+ * ppm) to stay inaudible
+ */
+#define MELO_AIRPLAY_DRIFT_PHASE_TIME 30
+#define MELO_AIRPLAY_DRIFT_PHASE_MAX_PPM 100
+
+/* Maximum phase error (in us) before taking a new reference (flush) */
+#define MELO_AIRPLAY_DRIFT_PHASE_MAX_ERROR 200000
+
+/**
+ * melo_airplay_drift_reset:
+ * @drift: the drift estimator
+ * @samplerate: the nominal sample rate of the sender
+ *
+ * Reset the drift estimator for a new session.
+ */
+void
+melo_airplay_drift_reset (MeloAirplayDrift *drift, unsigned int samplerate)
+{
+  memset (drift, 0, sizeof (*drift));
+  drift->samplerate = samplerate;
+  drift->freq = 1.0;
+}
+
+static bool
+melo_airplay_drift_fit (MeloAirplayDrift *drift, double *ratio)
+{
+  double mx = 0, my = 0, sxx = 0, sxy = 0, rate, r;
+  unsigned int i, j, n;
+
+  if (drift->count < MELO_AIRPLAY_DRIFT_MIN_POINTS)
+    return false;
+
+  /* Center values relative to oldest point to keep precision */
+  i = (drift->head + MELO_AIRPLAY_DRIFT_POINTS - drift->count) %
+      MELO_AIRPLAY_DRIFT_POINTS;
+  for (n = 0; n < drift->count; n++) {
+    j = (i + n) % MELO_AIRPLAY_DRIFT_POINTS;
+    mx += drift->x[j] - drift->x[i];
+    my += drift->y[j] - drift->y[i];
+  }
+  mx /= drift->count;
+  my /= drift->count;
+
+  /* Least squares slope */
+  for (n = 0; n < drift->count; n++) {
+    double dx, dy;
+
+    j = (i + n) % MELO_AIRPLAY_DRIFT_POINTS;
+    dx = drift->x[j] - drift->x[i] - mx;
+    dy = drift->y[j] - drift->y[i] - my;
+    sxx += dx * dx;
+    sxy += dx * dy;
+  }
+  if (sxx <= 0)
+    return false;
+
+  /* Sender rate in samples per local second */
+  rate = sxy / sxx * 1000000.0;
+  if (rate <= 0)
+    return false;
+
+  /* Output samples to produce for each sender sample */
+  r = drift->samplerate / rate;
+  if (r > 1.0 + MELO_AIRPLAY_DRIFT_MAX_PPM / 1000000.0 ||
+      r < 1.0 - MELO_AIRPLAY_DRIFT_MAX_PPM / 1000000.0)
+    return false;
+
+  *ratio = r;
+  return true;
+}
+
+static double
+melo_airplay_drift_correct_phase (MeloAirplayDrift *drift)
+{
+  int64_t max = (int64_t) drift->samplerate *
+                MELO_AIRPLAY_DRIFT_PHASE_MAX_ERROR / 1000000;
+  double c;
+
+  /* First phase or rendering restarted: take a new reference */
+  if (!drift->has_phase || drift->group_phase > drift->phase_ref + max ||
+      drift->group_phase < drift->phase_ref - max) {
+    drift->has_phase = true;
+    drift->phase_ref = drift->group_phase;
+  }
+  drift->phase = drift->group_phase - drift->phase_ref;
+
+  /* Render ahead of sender: produce more samples to slow down */
+  c = (double) drift->phase /
+      ((double) drift->samplerate * MELO_AIRPLAY_DRIFT_PHASE_TIME);
+  if (c > MELO_AIRPLAY_DRIFT_PHASE_MAX_PPM / 1000000.0)
+    c = MELO_AIRPLAY_DRIFT_PHASE_MAX_PPM / 1000000.0;
+  else if (c < -MELO_AIRPLAY_DRIFT_PHASE_MAX_PPM / 1000000.0)
+    c = -MELO_AIRPLAY_DRIFT_PHASE_MAX_PPM / 1000000.0;
+
+  return 1.0 + c;
+}
+
+/**
+ * melo_airplay_drift_add:
+ * @drift: the drift estimator
+ * @rtptime: the RTP time of the sync packet
+ * @time: the local reception time of the sync packet (in us)
+ * @position: the RTP time rendered at reception, or %NULL if unknown
+ * @ratio: a pointer to store the new resampling ratio
+ *
+ * Add a sync packet reception to the estimator. When a new estimation is
+ * available, @ratio is set to the count of local samples to play for each
+ * sender sample, including the phase error correction when @position is set.
+ *
+ * Returns: %true if @ratio has been updated, %false otherwise.
+ */
+bool
+melo_airplay_drift_add (MeloAirplayDrift *drift, uint32_t rtptime,
+    int64_t time, const uint32_t *position, double *ratio)
+{
+  double freq, phase = 1.0;
+  bool ret;
+  int64_t delay;
+
+  if (!drift->samplerate)
+    return false;
+
+  /* Unwrap RTP time */
+  if (drift->started)
+    drift->rtptime += (int32_t) (rtptime - drift->last_rtptime);
+  else
+    drift->rtptime = rtptime;
+  drift->last_rtptime = rtptime;
+
+  /* Get reception delay relative to sender timeline */
+  delay = time - drift->rtptime * 1000000 / drift->samplerate;
+
+  /* RTP time jumped (flush or new stream): restart estimation */
+  if (drift->started &&
+      (delay > drift->delay + MELO_AIRPLAY_DRIFT_MAX_JUMP ||
+          delay < drift->delay - MELO_AIRPLAY_DRIFT_MAX_JUMP)) {
+    drift->group_count = 0;
+    drift->count = 0;
+    drift->has_phase = false;
+  }
+  drift->started = true;
+  drift->delay = delay;
+
+  /* Keep reception with lowest delay in group */
+  if (!drift->group_count || delay < drift->group_delay) {
+    drift->group_delay = delay;
+    drift->group_x = time;
+    drift->group_y = drift->rtptime;
+    drift->group_has_phase = position != NULL;
+    if (position)
+      drift->group_phase = (int32_t) (*position - rtptime);
+  }
+  if (++drift->group_count < MELO_AIRPLAY_DRIFT_GROUP)
+    return false;
+  drift->group_count = 0;
+
+  /* Add point to window */
+  drift->x[drift->head] = drift->group_x;
+  drift->y[drift->head] = drift->group_y;
+  drift->head = (drift->head + 1) % MELO_AIRPLAY_DRIFT_POINTS;
+  if (drift->count < MELO_AIRPLAY_DRIFT_POINTS)
+    drift->count++;
+
+  /* Update frequency ratio */
+  ret = melo_airplay_drift_fit (drift, &freq);
+  if (ret)
+    drift->freq = freq;
+
+  /* Add phase error correction */
+  if (drift->group_has_phase) {
+    phase = melo_airplay_drift_correct_phase (drift);
+    ret = true;
+  }
+  if (ret)
+    *ratio = drift->freq * phase;
+
+  return ret;
+}
+
+/**
+ * melo_airplay_drift_get_phase:
+ * @drift: the drift estimator
+ *
+ * Get the last phase error between the rendered RTP time and the sender RTP
+ * time, relative to the first kept reception.
+ *
+ * Returns: the phase error (in samples), positive when rendering is ahead.
+ */
+int64_t
+melo_airplay_drift_get_phase (MeloAirplayDrift *drift)
+{
+  return drift->phase;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#ifndef _MELO_AIRPLAY_DRIFT_H_
+#define _MELO_AIRPLAY_DRIFT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define MELO_AIRPLAY_DRIFT_POINTS 32
+
+/**
+ * MeloAirplayDrift:
+ *
+ * A clock drift estimator between the sender sample clock and the local
+ * clock, fed with the RTP time of sync packets and their local reception time.
+ *
+ * To reject network jitter, only the reception with the lowest delay of each
+ * group of sync packets is kept and the rate is given by a least squares fit
+ * over the last #MELO_AIRPLAY_DRIFT_POINTS kept receptions.
+ *
+ * The local clock is not the output clock, and a fit lags behind: when the
+ * rendered RTP time is known, a phase error term slowly brings it back to its
+ * offset from the sender RTP time at first kept reception.
+ */
+typedef struct {
+  /*< private >*/
+  unsigned int samplerate;
+
+  /* Unwrapped RTP time */
+  bool started;
+  uint32_t last_rtptime;
+  int64_t rtptime;
+  int64_t delay;
+
+  /* Best reception of current group */
+  unsigned int group_count;
+  int64_t group_delay;
+  int64_t group_x;
+  int64_t group_y;
+  bool group_has_phase;
+  int64_t group_phase;
+
+  /* Frequency ratio and phase error from reference (in samples) */
+  double freq;
+  bool has_phase;
+  int64_t phase_ref;
+  int64_t phase;
+
+  /* Window of kept receptions (time in us, RTP time in samples) */
+  int64_t x[MELO_AIRPLAY_DRIFT_POINTS];
+  int64_t y[MELO_AIRPLAY_DRIFT_POINTS];
+  unsigned int count;
+  unsigned int head;
+} MeloAirplayDrift;
+
+void melo_airplay_drift_reset (
+    MeloAirplayDrift *drift, unsigned int samplerate);
+bool melo_airplay_drift_add (MeloAirplayDrift *drift, uint32_t rtptime,
+    int64_t time, const uint32_t *position, double *ratio);
+int64_t melo_airplay_drift_get_phase (MeloAirplayDrift *drift);
+
+G_END_DECLS
+
+#endif /* !_MELO_AIRPLAY_DRIFT_H_ */
@@ -0,0 +1,518 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <gio/gio.h>
+
+#define MELO_LOG_TAG "airplay_http"
+#include <melo/melo_log.h>
+
+#include "melo_airplay_http.h"
+#include "melo_airplay_recorder.h"
+
+/* Count of buffers shared by all clients (about 2 seconds with ALAC) */
+#define MELO_AIRPLAY_HTTP_RING_SIZE 256
+
+/* A client lagging more than this count of buffers is dropped */
+#define MELO_AIRPLAY_HTTP_MAX_LAG (MELO_AIRPLAY_HTTP_RING_SIZE / 2)
+
+#define MELO_AIRPLAY_HTTP_MAX_CLIENTS 512
+#define MELO_AIRPLAY_HTTP_REQUEST_SIZE 1024
+
+typedef struct _MeloAirplayHttpClient MeloAirplayHttpClient;
+
+struct _MeloAirplayHttp {
+  GSocketService *service;
+  GMainContext *context;
+  GList *clients;
+
+  /* Shared ring of buffers, protected by mutex */
+  GMutex mutex;
+  GstBuffer *ring[MELO_AIRPLAY_HTTP_RING_SIZE];
+  guint64 seq;
+  GSource *kick;
+
+  /* Format */
+  unsigned int rate;
+  unsigned int channels;
+  unsigned int bits;
+  bool is_float;
+  int has_format;
+
+  /* Statistics */
+  unsigned int client_count;
+  unsigned int served;
+  unsigned int dropped;
+};
+
+struct _MeloAirplayHttpClient {
+  MeloAirplayHttp *http;
+  GSocketConnection *conn;
+  GCancellable *cancellable;
+
+  /* Request */
+  char request[MELO_AIRPLAY_HTTP_REQUEST_SIZE];
+  size_t len;
+
+  /* Response header */
+  char header[256 + MELO_AIRPLAY_WAV_HEADER_SIZE];
+  size_t header_len;
+
+  /* Stream */
+  bool streaming;
+  bool writing;
+  guint64 next;
+  GstBuffer *buffer;
+  GstMapInfo map;
+};
+
+static void client_next (MeloAirplayHttpClient *client);
+
+static void
+client_free (MeloAirplayHttpClient *client)
+{
+  MeloAirplayHttp *http = client->http;
+
+  /* Remove from list */
+  if (http) {
+    http->clients = g_list_remove (http->clients, client);
+    g_atomic_int_add (&http->client_count, -1);
+  }
+
+  /* Release current buffer */
+  if (client->buffer) {
+    gst_buffer_unmap (client->buffer, &client->map);
+    gst_buffer_unref (client->buffer);
+  }
+
+  /* Close connection */
+  g_io_stream_close (G_IO_STREAM (client->conn), NULL, NULL);
+  g_object_unref (client->conn);
+  g_object_unref (client->cancellable);
+  g_slice_free (MeloAirplayHttpClient, client);
+}
+
+static void
+client_write_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  MeloAirplayHttpClient *client = user_data;
+  GError *error = NULL;
+
+  client->writing = false;
+
+  /* Release written buffer */
+  if (client->buffer) {
+    gst_buffer_unmap (client->buffer, &client->map);
+    gst_buffer_unref (client->buffer);
+    client->buffer = NULL;
+  }
+
+  /* Client disconnected, too slow or server stopped */
+  if (!g_output_stream_write_all_finish (
+          G_OUTPUT_STREAM (source), res, NULL, &error) ||
+      !client->http || !client->streaming) {
+    if (client->http &&
+        g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      client->http->dropped++;
+    g_clear_error (&error);
+    client_free (client);
+    return;
+  }
+
+  client_next (client);
+}
+
+static void
+client_next (MeloAirplayHttpClient *client)
+{
+  MeloAirplayHttp *http = client->http;
+  GOutputStream *out;
+  GstBuffer *buffer;
+
+  if (client->writing)
+    return;
+
+  /* Get next buffer */
+  g_mutex_lock (&http->mutex);
+  if (client->next == http->seq) {
+    g_mutex_unlock (&http->mutex);
+    return;
+  }
+  if (http->seq - client->next > MELO_AIRPLAY_HTTP_MAX_LAG) {
+    g_mutex_unlock (&http->mutex);
+    MELO_LOGD ("drop slow client");
+    http->dropped++;
+    client_free (client);
+    return;
+  }
+  buffer = gst_buffer_ref (
+      http->ring[client->next % MELO_AIRPLAY_HTTP_RING_SIZE]);
+  client->next++;
+  g_mutex_unlock (&http->mutex);
+
+  /* Send shared buffer as is */
+  if (!gst_buffer_map (buffer, &client->map, GST_MAP_READ)) {
+    gst_buffer_unref (buffer);
+    client_free (client);
+    return;
+  }
+  client->buffer = buffer;
+  client->writing = true;
+
+  out = g_io_stream_get_output_stream (G_IO_STREAM (client->conn));
+  g_output_stream_write_all_async (out, client->map.data, client->map.size,
+      G_PRIORITY_DEFAULT, client->cancellable, client_write_cb, client);
+}
+
+static void
+client_respond (MeloAirplayHttpClient *client)
+{
+  MeloAirplayHttp *http = client->http;
+  const char *status = "200 OK", *type = NULL;
+  char path[64];
+  GOutputStream *out;
+  bool wav = false;
+  size_t len;
+
+  /* Parse request line */
+  if (sscanf (client->request, "GET %63s HTTP/", path) != 1) {
+    status = "400 Bad Request";
+  } else if (!strcmp (path, "/stream.wav")) {
+    type = "audio/wav";
+    wav = true;
+  } else if (!strcmp (path, "/stream.raw")) {
+    type = "application/octet-stream";
+    wav = false;
+  } else
+    status = "404 Not Found";
+
+  /* Format is not known yet */
+  if (type && !g_atomic_int_get (&http->has_format)) {
+    status = "503 Service Unavailable";
+    type = NULL;
+  }
+
+  /* Generate response */
+  len = g_snprintf (client->header,
+      sizeof (client->header) - MELO_AIRPLAY_WAV_HEADER_SIZE,
+      "HTTP/1.0 %s\r\nConnection: close\r\nCache-Control: no-cache\r\n",
+      status);
+  if (type) {
+    len += g_snprintf (client->header + len, sizeof (client->header) - len,
+        "Content-Type: %s\r\nX-Audio-Format: rate=%u;channels=%u;bits=%u;%s\r\n"
+        "\r\n",
+        type, http->rate, http->channels, http->bits,
+        http->is_float ? "float" : "integer");
+
+    /* Add a WAV header with an unknown size */
+    if (wav) {
+      melo_airplay_wav_header ((uint8_t *) client->header + len, http->rate,
+          http->channels, http->bits, http->is_float,
+          G_MAXUINT32 - MELO_AIRPLAY_WAV_HEADER_SIZE);
+      len += MELO_AIRPLAY_WAV_HEADER_SIZE;
+    }
+
+    /* Start from live position */
+    g_mutex_lock (&http->mutex);
+    client->next = http->seq;
+    g_mutex_unlock (&http->mutex);
+    client->streaming = true;
+    http->served++;
+  } else
+    len += g_snprintf (
+        client->header + len, sizeof (client->header) - len, "\r\n");
+  client->header_len = len;
+
+  /* Send header, then stream */
+  client->writing = true;
+  out = g_io_stream_get_output_stream (G_IO_STREAM (client->conn));
+  g_output_stream_write_all_async (out, client->header, client->header_len,
+      G_PRIORITY_DEFAULT, client->cancellable, client_write_cb, client);
+}
+
+static void
+client_read_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  MeloAirplayHttpClient *client = user_data;
+  gssize len;
+
+  /* Client disconnected or server stopped */
+  len = g_input_stream_read_finish (G_INPUT_STREAM (source), res, NULL);
+  if (len <= 0 || !client->http) {
+    client_free (client);
+    return;
+  }
+  client->len += len;
+  client->request[client->len] = '\0';
+
+  /* Wait for end of request header */
+  if (!strstr (client->request, "\r\n\r\n")) {
+    if (client->len >= sizeof (client->request) - 1) {
+      client_free (client);
+      return;
+    }
+    g_input_stream_read_async (G_INPUT_STREAM (source),
+        client->request + client->len,
+        sizeof (client->request) - 1 - client->len, G_PRIORITY_DEFAULT,
+        client->cancellable, client_read_cb, client);
+    return;
+  }
+
+  client_respond (client);
+}
+
+static gboolean
+incoming_cb (GSocketService *service, GSocketConnection *conn,
+    GObject *source_object, gpointer user_data)
+{
+  MeloAirplayHttp *http = user_data;
+  MeloAirplayHttpClient *client;
+  GInputStream *in;
+
+  /* Too many clients */
+  if (http->client_count >= MELO_AIRPLAY_HTTP_MAX_CLIENTS)
+    return FALSE;
+
+  /* Create client */
+  client = g_slice_new0 (MeloAirplayHttpClient);
+  client->http = http;
+  client->conn = g_object_ref (conn);
+  client->cancellable = g_cancellable_new ();
+  http->clients = g_list_prepend (http->clients, client);
+  g_atomic_int_inc (&http->client_count);
+
+  /* Read request */
+  in = g_io_stream_get_input_stream (G_IO_STREAM (conn));
+  g_input_stream_read_async (in, client->request, sizeof (client->request) - 1,
+      G_PRIORITY_DEFAULT, client->cancellable, client_read_cb, client);
+
+  return TRUE;
+}
+
+static gboolean
+kick_cb (gpointer user_data)
+{
+  MeloAirplayHttp *http = user_data;
+  GList *l, *next;
+  guint64 seq;
+
+  /* Allow a new kick */
+  g_mutex_lock (&http->mutex);
+  g_source_unref (http->kick);
+  http->kick = NULL;
+  seq = http->seq;
+  g_mutex_unlock (&http->mutex);
+
+  for (l = http->clients; l; l = next) {
+    MeloAirplayHttpClient *client = l->data;
+
+    next = l->next;
+    if (!client->streaming)
+      continue;
+
+    /* Abort blocked write of a slow client, or send new buffers */
+    if (client->writing) {
+      if (seq - client->next > MELO_AIRPLAY_HTTP_MAX_LAG)
+        g_cancellable_cancel (client->cancellable);
+    } else
+      client_next (client);
+  }
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * melo_airplay_http_new:
+ * @port: the TCP port to listen on
+ *
+ * Create a new HTTP server to restream decoded audio. The stream is available
+ * as WAV on "/stream.wav" and as raw samples on "/stream.raw". All clients
+ * send the same buffers, without copy, from a shared ring: a client too slow
+ * to follow the live stream is disconnected.
+ *
+ * The server runs on the thread-default main context of the caller.
+ *
+ * Clients hold references on pushed buffers for up to the ring length, so
+ * the buffers are not writable anymore and in-place elements placed after
+ * the tap (equalizer, loudness, volume) have to copy them.
+ *
+ * Returns: (transfer full): a new #MeloAirplayHttp or %NULL.
+ */
+MeloAirplayHttp *
+melo_airplay_http_new (unsigned int port)
+{
+  MeloAirplayHttp *http;
+  GError *error = NULL;
+
+  /* Allocate server */
+  http = g_slice_new0 (MeloAirplayHttp);
+  if (!http)
+    return NULL;
+  g_mutex_init (&http->mutex);
+  http->context = g_main_context_ref_thread_default ();
+
+  /* Create service */
+  http->service = g_socket_service_new ();
+  if (!g_socket_listener_add_inet_port (
+          G_SOCKET_LISTENER (http->service), port, NULL, &error)) {
+    MELO_LOGE ("failed to listen on port %u: %s", port, error->message);
+    g_error_free (error);
+    melo_airplay_http_free (http);
+    return NULL;
+  }
+  g_signal_connect (http->service, "incoming", G_CALLBACK (incoming_cb), http);
+  g_socket_service_start (http->service);
+
+  return http;
+}
+
+static gboolean
+free_cb (gpointer user_data)
+{
+  MeloAirplayHttp *http = user_data;
+  unsigned int i;
+  GList *l;
+
+  /* Stop service */
+  g_socket_service_stop (http->service);
+  g_socket_listener_close (G_SOCKET_LISTENER (http->service));
+  g_object_unref (http->service);
+
+  /* Detach clients: idle streaming clients are freed now, others on pending
+   * operation completion.
+   */
+  for (l = http->clients; l; l = l->next) {
+    MeloAirplayHttpClient *client = l->data;
+
+    client->http = NULL;
+    if (client->streaming && !client->writing)
+      client_free (client);
+    else
+      g_cancellable_cancel (client->cancellable);
+  }
+  g_list_free (http->clients);
+
+  /* Remove pending kick */
+  if (http->kick) {
+    g_source_destroy (http->kick);
+    g_source_unref (http->kick);
+  }
+
+  /* Release buffers */
+  for (i = 0; i < MELO_AIRPLAY_HTTP_RING_SIZE; i++)
+    if (http->ring[i])
+      gst_buffer_unref (http->ring[i]);
+
+  g_main_context_unref (http->context);
+  g_mutex_clear (&http->mutex);
+  g_slice_free (MeloAirplayHttp, http);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * melo_airplay_http_free:
+ * @http: the HTTP server
+ *
+ * Stop the server, disconnect all clients and free it, once
+ * melo_airplay_http_push() is not called anymore. Since clients are handled
+ * from the server main context, the server is freed from this context: now if
+ * it is not running or if the caller owns it, later otherwise.
+ */
+void
+melo_airplay_http_free (MeloAirplayHttp *http)
+{
+  if (!http)
+    return;
+
+  /* Free server from its context */
+  g_main_context_invoke (http->context, free_cb, http);
+}
+
+/**
+ * melo_airplay_http_set_format:
+ * @http: the HTTP server
+ * @rate: the sample rate
+ * @channels: the channel count
+ * @bits: the sample size, in bits
+ * @is_float: set to %true for float samples
+ *
+ * Set format of the interleaved samples to stream. Only the first format is
+ * kept since it is sent to clients in the stream header.
+ */
+void
+melo_airplay_http_set_format (MeloAirplayHttp *http, unsigned int rate,
+    unsigned int channels, unsigned int bits, bool is_float)
+{
+  if (g_atomic_int_get (&http->has_format))
+    return;
+
+  http->rate = rate;
+  http->channels = channels;
+  http->bits = bits;
+  http->is_float = is_float;
+  g_atomic_int_set (&http->has_format, true);
+}
+
+/**
+ * melo_airplay_http_push:
+ * @http: the HTTP server
+ * @buffer: the buffer to stream
+ *
+ * Add a reference of @buffer to the shared ring and wake up clients. This
+ * function never waits for clients.
+ */
+void
+melo_airplay_http_push (MeloAirplayHttp *http, GstBuffer *buffer)
+{
+  GstBuffer *old;
+  unsigned int i;
+
+  /* Replace oldest buffer */
+  g_mutex_lock (&http->mutex);
+  i = http->seq % MELO_AIRPLAY_HTTP_RING_SIZE;
+  old = http->ring[i];
+  http->ring[i] = gst_buffer_ref (buffer);
+  http->seq++;
+
+  /* Wake up clients from main context */
+  if (!http->kick && g_atomic_int_get (&http->client_count)) {
+    http->kick = g_idle_source_new ();
+    g_source_set_callback (http->kick, kick_cb, http, NULL);
+    g_source_attach (http->kick, http->context);
+  }
+  g_mutex_unlock (&http->mutex);
+
+  if (old)
+    gst_buffer_unref (old);
+}
+
+/**
+ * melo_airplay_http_dump:
+ * @http: the HTTP server
+ * @str: the string to append to
+ *
+ * Append HTTP restreaming statistics to @str.
+ */
+void
+melo_airplay_http_dump (MeloAirplayHttp *http, GString *str)
+{
+  g_string_append_printf (str, "http: clients=%u served=%u dropped=%u\n",
+      http->client_count, http->served, http->dropped);
+}
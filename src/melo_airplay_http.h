@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#ifndef _MELO_AIRPLAY_HTTP_H_
+#define _MELO_AIRPLAY_HTTP_H_
+
+#include <stdbool.h>
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct _MeloAirplayHttp MeloAirplayHttp;
+
+MeloAirplayHttp *melo_airplay_http_new (unsigned int port);
+void melo_airplay_http_free (MeloAirplayHttp *http);
+
+void melo_airplay_http_set_format (MeloAirplayHttp *http, unsigned int rate,
+    unsigned int channels, unsigned int bits, bool is_float);
+void melo_airplay_http_push (MeloAirplayHttp *http, GstBuffer *buffer);
+
+void melo_airplay_http_dump (MeloAirplayHttp *http, GString *str);
+
+G_END_DECLS
+
+#endif /* !_MELO_AIRPLAY_HTTP_H_ */
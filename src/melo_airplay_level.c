@@ -0,0 +1,394 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "melo_airplay_level.h"
+
+/* Levels are clamped to -144 dBFS, as the player volume */
+#define MELO_AIRPLAY_LEVEL_MIN_DB -14400
+
+/* Samples are accumulated in 4 lanes: lane n handles samples n, n + 4, ... */
+#define MELO_AIRPLAY_LEVEL_LANES 4
+
+static void
+level_kernel_s16 (const int16_t *data, size_t count, float *peak, float *sum)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128 mask = _mm_castsi128_ps (_mm_set1_epi32 (0x7fffffff));
+  __m128 vpeak = _mm_setzero_ps ();
+  __m128 vsum = _mm_setzero_ps ();
+
+  for (; i + 8 <= count; i += 8) {
+    __m128i v = _mm_loadu_si128 ((const __m128i *) (data + i));
+    __m128 lo, hi;
+
+    /* Sign extend and convert to float */
+    lo = _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpacklo_epi16 (v, v), 16));
+    hi = _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpackhi_epi16 (v, v), 16));
+
+    vpeak = _mm_max_ps (vpeak, _mm_and_ps (lo, mask));
+    vpeak = _mm_max_ps (vpeak, _mm_and_ps (hi, mask));
+    vsum = _mm_add_ps (vsum, _mm_mul_ps (lo, lo));
+    vsum = _mm_add_ps (vsum, _mm_mul_ps (hi, hi));
+  }
+  _mm_storeu_ps (peak, vpeak);
+  _mm_storeu_ps (sum, vsum);
+#elif defined(__ARM_NEON)
+  float32x4_t vpeak = vdupq_n_f32 (0.f);
+  float32x4_t vsum = vdupq_n_f32 (0.f);
+
+  for (; i + 8 <= count; i += 8) {
+    int16x8_t v = vld1q_s16 (data + i);
+    float32x4_t lo, hi;
+
+    /* Sign extend and convert to float */
+    lo = vcvtq_f32_s32 (vmovl_s16 (vget_low_s16 (v)));
+    hi = vcvtq_f32_s32 (vmovl_s16 (vget_high_s16 (v)));
+
+    vpeak = vmaxq_f32 (vpeak, vabsq_f32 (lo));
+    vpeak = vmaxq_f32 (vpeak, vabsq_f32 (hi));
+    vsum = vmlaq_f32 (vsum, lo, lo);
+    vsum = vmlaq_f32 (vsum, hi, hi);
+  }
+  vst1q_f32 (peak, vpeak);
+  vst1q_f32 (sum, vsum);
+#endif
+
+  /* Remaining samples */
+  for (; i < count; i++) {
+    float v = fabsf ((float) data[i]);
+    unsigned int lane = i % MELO_AIRPLAY_LEVEL_LANES;
+
+    if (v > peak[lane])
+      peak[lane] = v;
+    sum[lane] += v * v;
+  }
+}
+
+static void
+level_kernel_s32 (const int32_t *data, size_t count, float *peak, float *sum)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128 mask = _mm_castsi128_ps (_mm_set1_epi32 (0x7fffffff));
+  __m128 vpeak = _mm_setzero_ps ();
+  __m128 vsum = _mm_setzero_ps ();
+
+  for (; i + 4 <= count; i += 4) {
+    __m128 v = _mm_cvtepi32_ps (_mm_loadu_si128 ((const __m128i *) (data + i)));
+
+    vpeak = _mm_max_ps (vpeak, _mm_and_ps (v, mask));
+    vsum = _mm_add_ps (vsum, _mm_mul_ps (v, v));
+  }
+  _mm_storeu_ps (peak, vpeak);
+  _mm_storeu_ps (sum, vsum);
+#elif defined(__ARM_NEON)
+  float32x4_t vpeak = vdupq_n_f32 (0.f);
+  float32x4_t vsum = vdupq_n_f32 (0.f);
+
+  for (; i + 4 <= count; i += 4) {
+    float32x4_t v = vcvtq_f32_s32 (vld1q_s32 (data + i));
+
+    vpeak = vmaxq_f32 (vpeak, vabsq_f32 (v));
+    vsum = vmlaq_f32 (vsum, v, v);
+  }
+  vst1q_f32 (peak, vpeak);
+  vst1q_f32 (sum, vsum);
+#endif
+
+  /* Remaining samples */
+  for (; i < count; i++) {
+    float v = fabsf ((float) data[i]);
+    unsigned int lane = i % MELO_AIRPLAY_LEVEL_LANES;
+
+    if (v > peak[lane])
+      peak[lane] = v;
+    sum[lane] += v * v;
+  }
+}
+
+static void
+level_kernel_f32 (const float *data, size_t count, float *peak, float *sum)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128 mask = _mm_castsi128_ps (_mm_set1_epi32 (0x7fffffff));
+  __m128 vpeak = _mm_setzero_ps ();
+  __m128 vsum = _mm_setzero_ps ();
+
+  for (; i + 4 <= count; i += 4) {
+    __m128 v = _mm_loadu_ps (data + i);
+
+    vpeak = _mm_max_ps (vpeak, _mm_and_ps (v, mask));
+    vsum = _mm_add_ps (vsum, _mm_mul_ps (v, v));
+  }
+  _mm_storeu_ps (peak, vpeak);
+  _mm_storeu_ps (sum, vsum);
+#elif defined(__ARM_NEON)
+  float32x4_t vpeak = vdupq_n_f32 (0.f);
+  float32x4_t vsum = vdupq_n_f32 (0.f);
+
+  for (; i + 4 <= count; i += 4) {
+    float32x4_t v = vld1q_f32 (data + i);
+
+    vpeak = vmaxq_f32 (vpeak, vabsq_f32 (v));
+    vsum = vmlaq_f32 (vsum, v, v);
+  }
+  vst1q_f32 (peak, vpeak);
+  vst1q_f32 (sum, vsum);
+#endif
+
+  /* Remaining samples */
+  for (; i < count; i++) {
+    float v = fabsf (data[i]);
+    unsigned int lane = i % MELO_AIRPLAY_LEVEL_LANES;
+
+    if (v > peak[lane])
+      peak[lane] = v;
+    sum[lane] += v * v;
+  }
+}
+
+static void
+level_accumulate (MeloAirplayLevel *level, const void *data, size_t count,
+    unsigned int first, unsigned int channels)
+{
+  float peak[MELO_AIRPLAY_LEVEL_LANES] = {0};
+  float sum[MELO_AIRPLAY_LEVEL_LANES] = {0};
+  unsigned int i;
+
+  /* Accumulate samples in lanes */
+  if (level->format == MELO_AIRPLAY_LEVEL_FORMAT_S16)
+    level_kernel_s16 (data, count, peak, sum);
+  else if (level->format == MELO_AIRPLAY_LEVEL_FORMAT_S32)
+    level_kernel_s32 (data, count, peak, sum);
+  else
+    level_kernel_f32 (data, count, peak, sum);
+
+  /* Fold lanes into channels */
+  for (i = 0; i < MELO_AIRPLAY_LEVEL_LANES; i++) {
+    unsigned int c = first + i % channels;
+
+    if (peak[i] > level->peak[c])
+      level->peak[c] = peak[i];
+    level->sum[c] += sum[i];
+  }
+}
+
+static void
+level_accumulate_generic (
+    MeloAirplayLevel *level, const void *data, size_t count)
+{
+  const int16_t *s16 = data;
+  const int32_t *s32 = data;
+  const float *f32 = data;
+  size_t i;
+
+  /* Channel count is not a divisor of lane count */
+  for (i = 0; i < count; i++) {
+    unsigned int c = i % level->channels;
+    float v;
+
+    if (level->format == MELO_AIRPLAY_LEVEL_FORMAT_S16)
+      v = fabsf ((float) s16[i]);
+    else if (level->format == MELO_AIRPLAY_LEVEL_FORMAT_S32)
+      v = fabsf ((float) s32[i]);
+    else
+      v = fabsf (f32[i]);
+
+    if (v > level->peak[c])
+      level->peak[c] = v;
+    level->sum[c] += v * v;
+  }
+}
+
+static int
+level_to_db (double value)
+{
+  double db;
+
+  if (value <= 0.0)
+    return MELO_AIRPLAY_LEVEL_MIN_DB;
+
+  /* Convert to 1/100 dB */
+  db = 2000.0 * log10 (value);
+  if (db < MELO_AIRPLAY_LEVEL_MIN_DB)
+    return MELO_AIRPLAY_LEVEL_MIN_DB;
+  return (int) db;
+}
+
+static void
+level_publish (MeloAirplayLevel *level)
+{
+  double scale = 1.0;
+  unsigned int c;
+
+  /* Normalize to full scale */
+  if (level->format == MELO_AIRPLAY_LEVEL_FORMAT_S16)
+    scale = 1.0 / 32768.0;
+  else if (level->format == MELO_AIRPLAY_LEVEL_FORMAT_S32)
+    scale = 1.0 / 2147483648.0;
+
+  /* Odd sequence while levels are updated */
+  g_atomic_int_inc (&level->seq);
+  g_atomic_int_set (&level->count, level->channels);
+  for (c = 0; c < level->channels; c++) {
+    double rms = sqrt (level->sum[c] / level->frames) * scale;
+
+    g_atomic_int_set (&level->peak_db[c], level_to_db (level->peak[c] * scale));
+    g_atomic_int_set (&level->rms_db[c], level_to_db (rms));
+  }
+  g_atomic_int_inc (&level->seq);
+
+  /* Restart accumulation */
+  memset (level->peak, 0, sizeof (level->peak));
+  memset (level->sum, 0, sizeof (level->sum));
+  level->frames = 0;
+}
+
+/**
+ * melo_airplay_level_reset:
+ * @level: the level meter
+ *
+ * Reset the level meter format, accumulators and published levels. It must
+ * not be called while samples are processed.
+ */
+void
+melo_airplay_level_reset (MeloAirplayLevel *level)
+{
+  memset (level, 0, sizeof (*level));
+}
+
+/**
+ * melo_airplay_level_set_format:
+ * @level: the level meter
+ * @format: the sample format
+ * @channels: the channel count
+ * @planar: set to %true if channels are not interleaved
+ * @interval: the frame count between two level updates
+ *
+ * Set the format of the samples passed to melo_airplay_level_process(). When
+ * the format is not supported, the samples are ignored.
+ */
+void
+melo_airplay_level_set_format (MeloAirplayLevel *level,
+    MeloAirplayLevelFormat format, unsigned int channels, bool planar,
+    unsigned int interval)
+{
+  /* Unsupported format */
+  if (!channels || channels > MELO_AIRPLAY_LEVEL_MAX_CHANNELS || !interval)
+    format = MELO_AIRPLAY_LEVEL_FORMAT_NONE;
+
+  level->format = format;
+  level->channels = channels;
+  level->planar = planar;
+  level->interval = interval;
+
+  /* Restart accumulation */
+  memset (level->peak, 0, sizeof (level->peak));
+  memset (level->sum, 0, sizeof (level->sum));
+  level->frames = 0;
+}
+
+/**
+ * melo_airplay_level_process:
+ * @level: the level meter
+ * @planes: the samples of each channel when planar, or all interleaved
+ *     samples in the first plane
+ * @frames: the frame count in @planes
+ *
+ * Accumulate samples and publish new levels when the interval is reached.
+ */
+void
+melo_airplay_level_process (
+    MeloAirplayLevel *level, const void *const *planes, size_t frames)
+{
+  unsigned int c;
+
+  if (level->format == MELO_AIRPLAY_LEVEL_FORMAT_NONE)
+    return;
+
+  /* Accumulate samples */
+  if (level->planar) {
+    for (c = 0; c < level->channels; c++)
+      level_accumulate (level, planes[c], frames, c, 1);
+  } else if (MELO_AIRPLAY_LEVEL_LANES % level->channels == 0) {
+    level_accumulate (
+        level, planes[0], frames * level->channels, 0, level->channels);
+  } else {
+    level_accumulate_generic (level, planes[0], frames * level->channels);
+  }
+
+  /* Publish levels */
+  level->frames += frames;
+  if (level->frames >= level->interval)
+    level_publish (level);
+}
+
+/**
+ * melo_airplay_level_get:
+ * @level: the level meter
+ * @channel: the channel index
+ * @peak: a pointer to store the peak level (in dBFS)
+ * @rms: a pointer to store the RMS level (in dBFS)
+ *
+ * Get the last levels published for a channel. This function can be called
+ * from any thread.
+ *
+ * Returns: %true if levels are available, %false otherwise.
+ */
+bool
+melo_airplay_level_get (
+    MeloAirplayLevel *level, unsigned int channel, float *peak, float *rms)
+{
+  unsigned int count;
+  int seq, peak_db, rms_db;
+
+  if (channel >= MELO_AIRPLAY_LEVEL_MAX_CHANNELS)
+    return false;
+
+  /* Retry while levels are updated */
+  do {
+    seq = g_atomic_int_get (&level->seq);
+    count = g_atomic_int_get (&level->count);
+    peak_db = g_atomic_int_get (&level->peak_db[channel]);
+    rms_db = g_atomic_int_get (&level->rms_db[channel]);
+  } while ((seq & 1) || seq != g_atomic_int_get (&level->seq));
+
+  /* Nothing published yet */
+  if (!seq || channel >= count)
+    return false;
+
+  if (peak)
+    *peak = peak_db / 100.f;
+  if (rms)
+    *rms = rms_db / 100.f;
+
+  return true;
+}
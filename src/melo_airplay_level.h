@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#ifndef _MELO_AIRPLAY_LEVEL_H_
+#define _MELO_AIRPLAY_LEVEL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define MELO_AIRPLAY_LEVEL_MAX_CHANNELS 8
+
+/**
+ * MeloAirplayLevelFormat:
+ * @MELO_AIRPLAY_LEVEL_FORMAT_NONE: unsupported format, levels are not computed
+ * @MELO_AIRPLAY_LEVEL_FORMAT_S16: signed 16-bits samples in native endianness
+ * @MELO_AIRPLAY_LEVEL_FORMAT_S32: signed 32-bits samples in native endianness
+ * @MELO_AIRPLAY_LEVEL_FORMAT_F32: 32-bits float samples in native endianness
+ *
+ * Sample format handled by the level meter.
+ */
+typedef enum {
+  MELO_AIRPLAY_LEVEL_FORMAT_NONE = 0,
+  MELO_AIRPLAY_LEVEL_FORMAT_S16,
+  MELO_AIRPLAY_LEVEL_FORMAT_S32,
+  MELO_AIRPLAY_LEVEL_FORMAT_F32,
+} MeloAirplayLevelFormat;
+
+/**
+ * MeloAirplayLevel:
+ *
+ * A peak / RMS level meter: samples are accumulated from the streaming thread
+ * and levels are published every interval, without lock nor allocation, for
+ * any other thread.
+ */
+typedef struct {
+  /*< private >*/
+  MeloAirplayLevelFormat format;
+  unsigned int channels;
+  bool planar;
+  unsigned int interval;
+
+  /* Accumulators */
+  unsigned int frames;
+  float peak[MELO_AIRPLAY_LEVEL_MAX_CHANNELS];
+  double sum[MELO_AIRPLAY_LEVEL_MAX_CHANNELS];
+
+  /* Published levels (in 1/100 dBFS) */
+  int seq;
+  unsigned int count;
+  int peak_db[MELO_AIRPLAY_LEVEL_MAX_CHANNELS];
+  int rms_db[MELO_AIRPLAY_LEVEL_MAX_CHANNELS];
+} MeloAirplayLevel;
+
+void melo_airplay_level_reset (MeloAirplayLevel *level);
+void melo_airplay_level_set_format (MeloAirplayLevel *level,
+    MeloAirplayLevelFormat format, unsigned int channels, bool planar,
+    unsigned int interval);
+
+void melo_airplay_level_process (
+    MeloAirplayLevel *level, const void *const *planes, size_t frames);
+
+bool melo_airplay_level_get (
+    MeloAirplayLevel *level, unsigned int channel, float *peak, float *rms);
+
+G_END_DECLS
+
+#endif /* !_MELO_AIRPLAY_LEVEL_H_ */
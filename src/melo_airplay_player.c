@@ -15,19 +15,125 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
  */
 
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
 #include <gio/gio.h>
+#include <gst/audio/audio.h>
 
 #define MELO_LOG_TAG "airplay_player"
 #include <melo/melo_log.h>
 
+#include "gstraopallocator.h"
+#include "gstraopeq.h"
+#include "gstraoploudness.h"
+#include "gstraopmeta.h"
+#include "gstraopqueue.h"
+#include "gstraopresample.h"
+#include "gstraoptracer.h"
 #include "gstrtpraop.h"
 #include "gstrtpraopdepay.h"
 #include "gsttcpraop.h"
 
+#include "melo_airplay_drift.h"
+#include "melo_airplay_http.h"
+#include "melo_airplay_level.h"
 #include "melo_airplay_player.h"
+#include "melo_airplay_recorder.h"
+#include "melo_airplay_relay.h"
+#include "melo_airplay_rt.h"
+#include "melo_airplay_shm.h"
+#include "melo_airplay_stats.h"
+
+/* Size of shared memory PCM ring (about 3 seconds of 44.1kHz float stereo) */
+#define MELO_AIRPLAY_PLAYER_SHM_SIZE (1024 * 1024)
+
+/* Maximum packet blocks in session slabs (about 8 seconds of ALAC packets) */
+#define MELO_AIRPLAY_PLAYER_PACKET_BLOCKS 1024
+
+/* Interval between two merged status updates (in ms) */
+#define MELO_AIRPLAY_PLAYER_STATUS_INTERVAL 40
+
+/* Position extrapolation when rendered buffer has no duration (in us) */
+#define MELO_AIRPLAY_PLAYER_MAX_EXTRAPOLATION 100000
+
+/* RTP header size of audio packets, before encrypted frame */
+#define MELO_AIRPLAY_PLAYER_RTP_HEADER_SIZE 12
+
+/* RTP time / time pair published lock-free with a sequence counter: time is a
+ * wrapping 32-bit value in microseconds, so only differences are meaningful.
+ */
+typedef struct {
+  int seq;
+  uint32_t rtptime;
+  uint32_t time;
+  uint32_t duration;
+} MeloAirplayPosition;
+
+/* Pipeline stages measured with latency histograms */
+typedef enum {
+  MELO_AIRPLAY_STAGE_NETWORK = 0,
+  MELO_AIRPLAY_STAGE_JITTER,
+  MELO_AIRPLAY_STAGE_DECRYPT,
+  MELO_AIRPLAY_STAGE_DECODE,
+  MELO_AIRPLAY_STAGE_SINK,
+  MELO_AIRPLAY_STAGE_TOTAL,
+
+  MELO_AIRPLAY_STAGE_COUNT,
+} MeloAirplayStage;
+
+static const char *melo_airplay_stage_names[MELO_AIRPLAY_STAGE_COUNT] = {
+    [MELO_AIRPLAY_STAGE_NETWORK] = "network",
+    [MELO_AIRPLAY_STAGE_JITTER] = "jitter",
+    [MELO_AIRPLAY_STAGE_DECRYPT] = "decrypt",
+    [MELO_AIRPLAY_STAGE_DECODE] = "decode",
+    [MELO_AIRPLAY_STAGE_SINK] = "sink",
+    [MELO_AIRPLAY_STAGE_TOTAL] = "total",
+};
+
+typedef struct {
+  MeloAirplayPlayer *player;
+  MeloAirplayStage stage;
+} MeloAirplayStageProbe;
+
+/* Reason of idle suspend, which sets how the pipeline is resumed */
+typedef enum {
+  MELO_AIRPLAY_IDLE_NONE = 0,
+  MELO_AIRPLAY_IDLE_NO_PACKET,
+  MELO_AIRPLAY_IDLE_SILENCE,
+  MELO_AIRPLAY_IDLE_PAUSED,
+} MeloAirplayIdle;
+
+static const char *melo_airplay_idle_names[] = {
+    [MELO_AIRPLAY_IDLE_NONE] = "none",
+    [MELO_AIRPLAY_IDLE_NO_PACKET] = "no packet",
+    [MELO_AIRPLAY_IDLE_SILENCE] = "silence",
+    [MELO_AIRPLAY_IDLE_PAUSED] = "sender paused",
+};
+
+/* Status changes waiting for next merged update */
+typedef struct {
+  bool has_state;
+  MeloPlayerState state;
+  bool has_stream_state;
+  MeloPlayerStreamState stream_state;
+  unsigned int stream_value;
+  bool has_duration;
+  unsigned int pos;
+  unsigned int dur;
+  MeloTags *tags;
+  bool tags_reset;
+  unsigned int tags_flags;
+  bool has_volume;
+  double volume;
+} MeloAirplayPlayerStatus;
+
+/* Status sent from main loop */
+typedef struct {
+  MeloAirplayPlayer *player;
+  MeloAirplayPlayerStatus status;
+} MeloAirplayPlayerStatusJob;
 
 struct _MeloAirplayPlayer {
   GObject parent_instance;
@@ -39,7 +145,11 @@ struct _MeloAirplayPlayer {
   GstElement *pipeline;
   GstElement *src;
   GstElement *raop_depay;
-  guint bus_id;
+  GstElement *resample;
+  GstElement *eq;
+  GstElement *loudness;
+  GMainContext *context;
+  GSource *bus_source;
 
   /* Server settings */
   MeloSettingsEntry *name;
@@ -50,7 +160,25 @@ struct _MeloAirplayPlayer {
   MeloSettingsEntry *latency;
   MeloSettingsEntry *rtx_delay;
   MeloSettingsEntry *rtx_retry_period;
+  MeloSettingsEntry *stage_queue;
+  MeloSettingsEntry *rt_policy;
+  MeloSettingsEntry *rt_priority;
+  MeloSettingsEntry *rt_cpus;
+  MeloSettingsEntry *rt_mlock;
   MeloSettingsEntry *disable_sync;
+  MeloSettingsEntry *tracer_enable;
+  MeloSettingsEntry *level_interval;
+  MeloSettingsEntry *drift_correction;
+  MeloSettingsEntry *record;
+  MeloSettingsEntry *record_path;
+  MeloSettingsEntry *record_size;
+  MeloSettingsEntry *http_port;
+  MeloSettingsEntry *relay_targets;
+  MeloSettingsEntry *shm_path;
+  MeloSettingsEntry *eq_bands;
+  MeloSettingsEntry *loudness_enable;
+  MeloSettingsEntry *loudness_target;
+  MeloSettingsEntry *idle_suspend;
 
   /* Format */
   unsigned int samplerate;
@@ -60,6 +188,97 @@ struct _MeloAirplayPlayer {
   unsigned int start_rtptime;
   double volume;
 
+  /* Merged status updates (protected by status mutex) */
+  GMutex status_mutex;
+  GMainContext *status_context;
+  GSource *status_source;
+  MeloAirplayPlayerStatus status;
+  int status_last_state;
+  int status_last_stream_state;
+  unsigned int status_requests;
+  unsigned int status_emitted;
+  unsigned int status_merged;
+  unsigned int status_skipped;
+
+  /* Position */
+  MeloAirplayPosition anchor;
+  MeloAirplayPosition render;
+  bool sync;
+
+  /* Latency histograms (in us) */
+  MeloAirplayStageProbe stage_probes[MELO_AIRPLAY_STAGE_COUNT];
+  MeloAirplayHistogram stage_latency[MELO_AIRPLAY_STAGE_COUNT];
+
+  /* Queues feeding the thread of each stage */
+  GstElement *stage_queues[MELO_AIRPLAY_STAGE_COUNT];
+  unsigned int stage_queue_size;
+
+  /* Time to first audio (in us) */
+  GMutex timing_mutex;
+  MeloAirplayTiming timing;
+  int first_audio;
+  MeloAirplayHistogram ttfa;
+
+  /* Clock drift compensation */
+  MeloAirplayDrift drift;
+  int drift_ppm;
+  int drift_phase;
+
+  /* Session recording */
+  MeloAirplayRecorder *recorder;
+
+  /* HTTP restreaming */
+  MeloAirplayHttp *http;
+
+  /* Relay to other receivers */
+  MeloAirplayRelay *relay;
+
+  /* Shared memory PCM export */
+  MeloAirplayShm *shm;
+
+  /* Decoded audio format and levels */
+  GstAudioInfo tap_info;
+  MeloAirplayLevel level;
+  unsigned int level_interval_ms;
+
+  /* Per-element processing cost */
+  GstRaopTracer *tracer;
+
+  /* Packet memory slabs */
+  GstAllocator *allocator;
+
+  /* Idle suspend */
+  GstElement *udp_src;
+  unsigned int idle_timeout;
+  int activity;
+  int sound;
+  int paused;
+  bool watch_silence;
+  int frame_size;
+  int silence_size;
+  int sound_size;
+  GSource *idle_source;
+  GSource *wake_source;
+  MeloAirplayIdle idle;
+  bool suspended;
+  unsigned int suspend_count;
+  gint64 resume_time;
+  int resume_pending;
+  MeloAirplayHistogram resume;
+
+  /* Real-time streaming threads */
+  MeloAirplayRt rt;
+  bool rt_enabled;
+
+  /* Wake-ups of streaming threads per state */
+  MeloAirplayThreads threads;
+  gint64 state_time;
+  uint64_t state_wakeups;
+  gint64 active_time;
+  gint64 suspended_time;
+  uint64_t active_wakeups;
+  uint64_t suspended_wakeups;
+
   /* Settings callback */
   MeloAirplayPlayerSettingsCb settings_cb;
   void *settings_user_data;
@@ -81,7 +300,13 @@ melo_airplay_player_finalize (GObject *object)
   /* Stop pipeline */
   melo_airplay_player_teardown (player);
 
-  /* Clear mutex */
+  /* Clear real-time configuration */
+  melo_airplay_rt_clear (&player->rt);
+  melo_airplay_threads_clear (&player->threads);
+  g_mutex_clear (&player->timing_mutex);
+
+  /* Clear mutexes */
+  g_mutex_clear (&player->status_mutex);
   g_mutex_clear (&player->mutex);
 
   /* Chain finalize */
@@ -101,6 +326,18 @@ melo_airplay_player_class_init (MeloAirplayPlayerClass *klass)
   gst_rtp_raop_plugin_init (NULL);
   gst_rtp_raop_depay_plugin_init (NULL);
 
+  /* Register RAOP drift resampler */
+  gst_raop_resample_plugin_init (NULL);
+
+  /* Register RAOP equalizer */
+  gst_raop_eq_plugin_init (NULL);
+
+  /* Register RAOP loudness normalizer */
+  gst_raop_loudness_plugin_init (NULL);
+
+  /* Register RAOP stage queue */
+  gst_raop_queue_plugin_init (NULL);
+
   /* Setup callbacks */
   parent_class->settings = melo_airplay_player_settings;
   parent_class->set_state = melo_airplay_player_set_state;
@@ -113,8 +350,24 @@ melo_airplay_player_class_init (MeloAirplayPlayerClass *klass)
 static void
 melo_airplay_player_init (MeloAirplayPlayer *self)
 {
-  /* Init player mutex */
+  unsigned int i;
+
+  /* Init player mutexes */
   g_mutex_init (&self->mutex);
+  g_mutex_init (&self->status_mutex);
+  self->status_last_state = -1;
+  self->status_last_stream_state = -1;
+
+  /* Init real-time configuration */
+  melo_airplay_rt_init (&self->rt);
+  melo_airplay_threads_init (&self->threads);
+  g_mutex_init (&self->timing_mutex);
+
+  /* Init stage probes */
+  for (i = 0; i < MELO_AIRPLAY_STAGE_COUNT; i++) {
+    self->stage_probes[i].player = self;
+    self->stage_probes[i].stage = i;
+  }
 }
 
 MeloAirplayPlayer *
@@ -125,25 +378,50 @@ melo_airplay_player_new ()
       MELO_AIRPLAY_PLAYER_ICON, NULL);
 }
 
+static void melo_airplay_player_take_status (
+    MeloAirplayPlayer *player, MeloAirplayPlayerStatus *status);
+static void melo_airplay_player_send_status (
+    MeloAirplayPlayer *player, MeloAirplayPlayerStatus *status);
+static void melo_airplay_player_post_state (
+    MeloAirplayPlayer *player, MeloPlayerState state);
+static char *melo_airplay_player_dump_stats (MeloAirplayPlayer *player);
+
 static gboolean
 bus_cb (GstBus *bus, GstMessage *msg, gpointer user_data)
 {
   MeloAirplayPlayer *aplayer = MELO_AIRPLAY_PLAYER (user_data);
   MeloPlayer *player = MELO_PLAYER (aplayer);
 
+  /* Stop pipeline on end of stream or error, unless the session has been torn
+   * down from another thread meanwhile.
+   */
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_EOS ||
+      GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+    g_mutex_lock (&aplayer->mutex);
+    if (g_source_is_destroyed (g_main_current_source ())) {
+      g_mutex_unlock (&aplayer->mutex);
+      return G_SOURCE_REMOVE;
+    }
+    gst_element_set_state (aplayer->pipeline, GST_STATE_NULL);
+    g_mutex_unlock (&aplayer->mutex);
+  }
+
   /* Process bus message */
   switch (GST_MESSAGE_TYPE (msg)) {
   case GST_MESSAGE_EOS:
     /* Stop playing */
-    gst_element_set_state (aplayer->pipeline, GST_STATE_NULL);
     melo_player_eos (player);
     break;
   case GST_MESSAGE_ERROR: {
+    MeloAirplayPlayerStatus status;
     GError *error;
 
-    /* Stop pipeline on error */
-    gst_element_set_state (aplayer->pipeline, GST_STATE_NULL);
-    melo_player_update_state (player, MELO_PLAYER_STATE_STOPPED);
+    /* Stop pipeline on error: send pending status before error */
+    g_mutex_lock (&aplayer->status_mutex);
+    melo_airplay_player_post_state (aplayer, MELO_PLAYER_STATE_STOPPED);
+    melo_airplay_player_take_status (aplayer, &status);
+    g_mutex_unlock (&aplayer->status_mutex);
+    melo_airplay_player_send_status (aplayer, &status);
 
     /* Set error message */
     gst_message_parse_error (msg, &error, NULL);
@@ -157,11 +435,67 @@ bus_cb (GstBus *bus, GstMessage *msg, gpointer user_data)
   return true;
 }
 
+static GstBusSyncReply
+bus_sync_cb (GstBus *bus, GstMessage *msg, gpointer user_data)
+{
+  MeloAirplayPlayer *player = MELO_AIRPLAY_PLAYER (user_data);
+  GstStreamStatusType type;
+  const char *klass;
+  GstElement *owner;
+  int offset = 1;
+  char *name;
+
+  /* Account and configure streaming threads from themselves, when they
+   * start, and restore them when they go back to the shared task pool.
+   */
+  if (GST_MESSAGE_TYPE (msg) != GST_MESSAGE_STREAM_STATUS)
+    return GST_BUS_PASS;
+  gst_message_parse_stream_status (msg, &type, &owner);
+  if (type == GST_STREAM_STATUS_TYPE_LEAVE) {
+    melo_airplay_threads_leave (&player->threads);
+    if (player->rt_enabled)
+      melo_airplay_rt_restore (&player->rt);
+    return GST_BUS_PASS;
+  }
+  if (type != GST_STREAM_STATUS_TYPE_ENTER)
+    return GST_BUS_PASS;
+  melo_airplay_threads_enter (&player->threads);
+  if (!player->rt_enabled)
+    return GST_BUS_PASS;
+
+  /* Audio output first, then jitter buffer and network sources */
+  klass = gst_element_class_get_metadata (
+      GST_ELEMENT_GET_CLASS (owner), GST_ELEMENT_METADATA_KLASS);
+  if (klass && strstr (klass, "Sink"))
+    offset = 2;
+  else if (klass && strstr (klass, "Source"))
+    offset = 0;
+
+  name = gst_object_get_name (GST_OBJECT (owner));
+  melo_airplay_rt_apply (&player->rt, name, offset);
+  g_free (name);
+
+  return GST_BUS_PASS;
+}
+
 static bool
 melo_airplay_player_settings_update_cb (MeloSettings *settings,
     MeloSettingsGroup *group, char **error, void *user_data)
 {
   MeloAirplayPlayer *player = MELO_AIRPLAY_PLAYER (user_data);
+  const char *bands;
+  uint32_t target;
+
+  /* Update equalizer and loudness target of current session */
+  g_mutex_lock (&player->mutex);
+  if (player->eq &&
+      melo_settings_entry_get_string (player->eq_bands, &bands, NULL))
+    g_object_set (player->eq, "bands", bands, NULL);
+  if (player->loudness &&
+      melo_settings_entry_get_uint32 (player->loudness_target, &target, NULL))
+    g_object_set (player->loudness, "target", -(gdouble) MIN (target, 70),
+        NULL);
+  g_mutex_unlock (&player->mutex);
 
   if (player->settings_cb)
     player->settings_cb (player, player->settings_user_data);
@@ -199,9 +533,81 @@ melo_airplay_player_settings (MeloPlayer *player, MeloSettings *settings)
       melo_settings_group_add_uint32 (group, "rtx_retry_period",
           "RTX retry delay", "Delay between two retransmit request (in ms)",
           100, NULL, MELO_SETTINGS_FLAG_NONE);
+  aplayer->stage_queue = melo_settings_group_add_uint32 (group, "stage_queue",
+      "Stage queue size",
+      "Packets queued before decrypt and decode threads (0 to run them on "
+      "the receive thread, recommended on single core devices)",
+      0, NULL, MELO_SETTINGS_FLAG_NONE);
+  aplayer->rt_policy = melo_settings_group_add_string (group, "rt_policy",
+      "Thread policy",
+      "Scheduling policy of streaming threads: other, fifo or rr", "other",
+      NULL, MELO_SETTINGS_FLAG_NONE);
+  aplayer->rt_priority = melo_settings_group_add_uint32 (group, "rt_priority",
+      "Thread priority",
+      "Real-time priority of network threads, jitter buffer and audio output "
+      "get 1 and 2 more",
+      20, NULL, MELO_SETTINGS_FLAG_NONE);
+  aplayer->rt_cpus = melo_settings_group_add_string (group, "rt_cpus",
+      "Thread CPUs", "Comma separated list of CPUs for streaming threads",
+      NULL, NULL, MELO_SETTINGS_FLAG_NONE);
+  aplayer->rt_mlock = melo_settings_group_add_boolean (group, "rt_mlock",
+      "Lock memory", "Lock packet memory during sessions to avoid page faults",
+      false, NULL, MELO_SETTINGS_FLAG_NONE);
   aplayer->disable_sync = melo_settings_group_add_boolean (group, "hack_sync",
       "Disable sync", "[HACK] Disable sync on audio output sink", false, NULL,
       MELO_SETTINGS_FLAG_NONE);
+  aplayer->tracer_enable = melo_settings_group_add_boolean (group, "tracer",
+      "Element tracer", "Measure processing time of each pipeline element",
+      false, NULL, MELO_SETTINGS_FLAG_NONE);
+  aplayer->level_interval = melo_settings_group_add_uint32 (group,
+      "level_interval", "Level interval",
+      "Update interval of audio levels (in ms, 0 to disable)", 0, NULL,
+      MELO_SETTINGS_FLAG_NONE);
+  aplayer->drift_correction = melo_settings_group_add_boolean (group, "drift",
+      "Drift correction", "Resample audio to follow sender clock", false, NULL,
+      MELO_SETTINGS_FLAG_NONE);
+  aplayer->record = melo_settings_group_add_boolean (group, "record",
+      "Record sessions", "Save received audio to WAV files", false, NULL,
+      MELO_SETTINGS_FLAG_NONE);
+  aplayer->record_path = melo_settings_group_add_string (group, "record_path",
+      "Recording path", "Directory where recordings are saved", NULL, NULL,
+      MELO_SETTINGS_FLAG_NONE);
+  aplayer->record_size = melo_settings_group_add_uint32 (group, "record_size",
+      "Recording buffer", "Size of recording buffer (in KiB)", 1024, NULL,
+      MELO_SETTINGS_FLAG_NONE);
+  aplayer->http_port = melo_settings_group_add_uint32 (group, "http_port",
+      "HTTP port", "Port to restream audio over HTTP (0 to disable)", 0, NULL,
+      MELO_SETTINGS_FLAG_NONE);
+  aplayer->relay_targets = melo_settings_group_add_string (group, "relay",
+      "Relay targets",
+      "Comma separated list of AirPlay receivers to relay audio to "
+      "(host[:port])",
+      NULL, NULL, MELO_SETTINGS_FLAG_NONE);
+  aplayer->shm_path = melo_settings_group_add_string (group, "shm_path",
+      "PCM export socket",
+      "Unix socket path to export decoded audio in shared memory", NULL, NULL,
+      MELO_SETTINGS_FLAG_NONE);
+  aplayer->eq_bands = melo_settings_group_add_string (group, "eq",
+      "Equalizer",
+      "Biquad sections as type:freq:gain:q separated by commas, with type in "
+      "peak, lowshelf, highshelf, lowpass and highpass (sections are updated "
+      "live, enabling or disabling applies from next session)",
+      NULL, NULL, MELO_SETTINGS_FLAG_NONE);
+  aplayer->loudness_enable = melo_settings_group_add_boolean (group,
+      "loudness", "Loudness normalization",
+      "Slowly adjust gain to reach a target loudness (EBU R128), applies from "
+      "next session",
+      false, NULL, MELO_SETTINGS_FLAG_NONE);
+  aplayer->loudness_target = melo_settings_group_add_uint32 (group,
+      "loudness_target", "Target loudness",
+      "Target loudness below full scale (in LU, 18 for -18 LUFS)", 18, NULL,
+      MELO_SETTINGS_FLAG_NONE);
+  aplayer->idle_suspend = melo_settings_group_add_uint32 (group,
+      "idle_suspend", "Idle suspend",
+      "Suspend playback pipeline when no audio is received, only digital "
+      "silence is decoded or sender is paused during this delay (in s, 0 to "
+      "disable)",
+      0, NULL, MELO_SETTINGS_FLAG_NONE);
 }
 
 static bool
@@ -213,32 +619,503 @@ melo_airplay_player_set_state (MeloPlayer *player, MeloPlayerState state)
   return melo_airplay_player_teardown (MELO_AIRPLAY_PLAYER (player));
 }
 
+static void
+melo_airplay_position_publish (MeloAirplayPosition *pos, uint32_t rtptime,
+    uint32_t time, uint32_t duration)
+{
+  /* Odd sequence while pair is updated */
+  g_atomic_int_inc (&pos->seq);
+  g_atomic_int_set (&pos->rtptime, rtptime);
+  g_atomic_int_set (&pos->time, time);
+  g_atomic_int_set (&pos->duration, duration);
+  g_atomic_int_inc (&pos->seq);
+}
+
+static bool
+melo_airplay_position_read (MeloAirplayPosition *pos, uint32_t *rtptime,
+    uint32_t *time, uint32_t *duration)
+{
+  int seq;
+
+  do {
+    /* Wait for writer to complete */
+    seq = g_atomic_int_get (&pos->seq);
+    if (seq & 1)
+      continue;
+
+    /* Nothing published */
+    if (!seq)
+      return false;
+
+    /* Get pair */
+    *rtptime = g_atomic_int_get (&pos->rtptime);
+    *time = g_atomic_int_get (&pos->time);
+    *duration = g_atomic_int_get (&pos->duration);
+  } while ((seq & 1) || seq != g_atomic_int_get (&pos->seq));
+
+  return true;
+}
+
+static void
+melo_airplay_position_reset (MeloAirplayPosition *pos)
+{
+  g_atomic_int_set (&pos->seq, 0);
+}
+
+static GstPadProbeReturn
+anchor_probe_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  MeloAirplayPlayer *player = MELO_AIRPLAY_PLAYER (user_data);
+  GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER (info);
+
+  /* Save RTP time of depayloaded buffer with its timestamp */
+  if (GST_BUFFER_OFFSET_IS_VALID (buf) && GST_BUFFER_PTS_IS_VALID (buf))
+    melo_airplay_position_publish (&player->anchor, GST_BUFFER_OFFSET (buf),
+        GST_TIME_AS_USECONDS (GST_BUFFER_PTS (buf)), 0);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+relay_probe_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  MeloAirplayPlayer *player = MELO_AIRPLAY_PLAYER (user_data);
+  GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstMapInfo map;
+
+  /* Forward decrypted frame with its RTP time */
+  if (GST_BUFFER_OFFSET_IS_VALID (buf) &&
+      gst_buffer_map (buf, &map, GST_MAP_READ)) {
+    melo_airplay_relay_push (
+        player->relay, GST_BUFFER_OFFSET (buf), map.data, map.size);
+    gst_buffer_unmap (buf, &map);
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+arrival_probe_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  MeloAirplayPlayer *player = MELO_AIRPLAY_PLAYER (user_data);
+  GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER (info);
+  gint64 now = g_get_monotonic_time ();
+
+  /* Save last activity for idle suspend */
+  g_atomic_int_set (&player->activity, now / G_USEC_PER_SEC);
+
+  /* Tag packet with its arrival time */
+  buf = gst_buffer_make_writable (buf);
+  gst_buffer_add_raop_latency_meta (buf, now);
+  GST_PAD_PROBE_INFO_DATA (info) = buf;
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+stage_probe_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  MeloAirplayStageProbe *probe = user_data;
+  GstRaopLatencyMeta *meta;
+  gint64 now;
+
+  /* Packet not tagged at arrival (retransmitted) */
+  meta = gst_buffer_get_raop_latency_meta (GST_PAD_PROBE_INFO_BUFFER (info));
+  if (!meta)
+    return GST_PAD_PROBE_OK;
+
+  /* Add time spent since previous stage */
+  now = g_get_monotonic_time ();
+  melo_airplay_histogram_add (
+      &probe->player->stage_latency[probe->stage], now - meta->stamp);
+  meta->stamp = now;
+
+  return GST_PAD_PROBE_OK;
+}
+
+static bool
+melo_airplay_player_get_rtptime (
+    MeloAirplayPlayer *player, GstBuffer *buf, uint32_t *rtptime)
+{
+  GstClockTime pts = GST_BUFFER_PTS (buf);
+  uint32_t anchor_time, duration;
+
+  /* Get RTP time of buffer from last depayloaded buffer */
+  if (!GST_CLOCK_TIME_IS_VALID (pts) ||
+      !melo_airplay_position_read (
+          &player->anchor, rtptime, &anchor_time, &duration))
+    return false;
+  *rtptime += (gint64) (gint32) (GST_TIME_AS_USECONDS (pts) - anchor_time) *
+              player->samplerate / G_USEC_PER_SEC;
+
+  return true;
+}
+
+static void
+melo_airplay_player_set_level_format (
+    MeloAirplayPlayer *player, GstAudioInfo *audio_info)
+{
+  MeloAirplayLevelFormat format = MELO_AIRPLAY_LEVEL_FORMAT_NONE;
+
+  if (GST_AUDIO_INFO_FORMAT (audio_info) == GST_AUDIO_FORMAT_S16)
+    format = MELO_AIRPLAY_LEVEL_FORMAT_S16;
+  else if (GST_AUDIO_INFO_FORMAT (audio_info) == GST_AUDIO_FORMAT_S32)
+    format = MELO_AIRPLAY_LEVEL_FORMAT_S32;
+  else if (GST_AUDIO_INFO_FORMAT (audio_info) == GST_AUDIO_FORMAT_F32)
+    format = MELO_AIRPLAY_LEVEL_FORMAT_F32;
+
+  melo_airplay_level_set_format (&player->level, format,
+      GST_AUDIO_INFO_CHANNELS (audio_info),
+      GST_AUDIO_INFO_LAYOUT (audio_info) == GST_AUDIO_LAYOUT_NON_INTERLEAVED,
+      GST_AUDIO_INFO_RATE (audio_info) * player->level_interval_ms / 1000);
+}
+
+static GstPadProbeReturn
+frame_probe_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  MeloAirplayPlayer *player = MELO_AIRPLAY_PLAYER (user_data);
+
+  /* Save size of frame being decoded, for silence detection on tap */
+  g_atomic_int_set (&player->frame_size,
+      gst_buffer_get_size (GST_PAD_PROBE_INFO_BUFFER (info)));
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+melo_airplay_player_watch_silence (
+    MeloAirplayPlayer *player, const guint8 *data, size_t size)
+{
+  int frame_size = g_atomic_int_get (&player->frame_size);
+
+  if (!size || !frame_size)
+    return;
+
+  /* Keep largest frame decoded as digital silence, and smallest frame with
+   * sound: while suspended on silence, packets are told apart by their size
+   */
+  if (!data[0] && !memcmp (data, data + 1, size - 1)) {
+    if (frame_size > g_atomic_int_get (&player->silence_size))
+      g_atomic_int_set (&player->silence_size, frame_size);
+  } else {
+    g_atomic_int_set (
+        &player->sound, g_get_monotonic_time () / G_USEC_PER_SEC);
+    if (!g_atomic_int_get (&player->sound_size) ||
+        frame_size < g_atomic_int_get (&player->sound_size))
+      g_atomic_int_set (&player->sound_size, frame_size);
+  }
+}
+
+static GstPadProbeReturn
+tap_probe_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  MeloAirplayPlayer *player = MELO_AIRPLAY_PLAYER (user_data);
+  GstAudioInfo *audio_info = &player->tap_info;
+
+  /* Set tap format from decoded audio format */
+  if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+    unsigned int rate, channels, bits;
+    GstCaps *caps;
+    bool is_float;
+
+    if (GST_EVENT_TYPE (event) != GST_EVENT_CAPS)
+      return GST_PAD_PROBE_OK;
+
+    gst_event_parse_caps (event, &caps);
+    if (!gst_audio_info_from_caps (audio_info, caps))
+      return GST_PAD_PROBE_OK;
+
+    /* Configure level meter */
+    if (player->level_interval_ms)
+      melo_airplay_player_set_level_format (player, audio_info);
+
+    if (!player->recorder && !player->http && !player->shm)
+      return GST_PAD_PROBE_OK;
+
+    if (GST_AUDIO_INFO_LAYOUT (audio_info) != GST_AUDIO_LAYOUT_INTERLEAVED ||
+        (GST_AUDIO_INFO_FORMAT (audio_info) != GST_AUDIO_FORMAT_S16LE &&
+            GST_AUDIO_INFO_FORMAT (audio_info) != GST_AUDIO_FORMAT_S32LE &&
+            GST_AUDIO_INFO_FORMAT (audio_info) != GST_AUDIO_FORMAT_F32LE)) {
+      MELO_LOGW ("unsupported format for recording / restreaming");
+      return GST_PAD_PROBE_OK;
+    }
+
+    rate = GST_AUDIO_INFO_RATE (audio_info);
+    channels = GST_AUDIO_INFO_CHANNELS (audio_info);
+    bits = GST_AUDIO_INFO_WIDTH (audio_info);
+    is_float = GST_AUDIO_INFO_IS_FLOAT (audio_info);
+    if (player->recorder)
+      melo_airplay_recorder_set_format (
+          player->recorder, rate, channels, bits, is_float);
+    if (player->http)
+      melo_airplay_http_set_format (
+          player->http, rate, channels, bits, is_float);
+    if (player->shm)
+      melo_airplay_shm_set_format (player->shm, rate, channels, bits, is_float);
+  } else {
+    GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER (info);
+    bool planar = GST_AUDIO_INFO_LAYOUT (audio_info) ==
+                  GST_AUDIO_LAYOUT_NON_INTERLEAVED;
+    bool level = player->level_interval_ms && GST_AUDIO_INFO_BPF (audio_info);
+    GstMapInfo map;
+
+    /* Share decoded buffer with HTTP clients */
+    if (player->http)
+      melo_airplay_http_push (player->http, buf);
+
+    /* Map decoded samples once for all consumers */
+    if ((player->recorder || player->shm || player->watch_silence ||
+            (level && !planar)) &&
+        gst_buffer_map (buf, &map, GST_MAP_READ)) {
+      /* Detect digital silence for idle suspend */
+      if (player->watch_silence)
+        melo_airplay_player_watch_silence (player, map.data, map.size);
+
+      /* Copy decoded samples to recorder */
+      if (player->recorder)
+        melo_airplay_recorder_push (player->recorder, map.data, map.size);
+
+      /* Publish decoded samples in shared memory with their RTP time */
+      if (player->shm) {
+        uint32_t rtptime;
+        bool has_rtptime;
+
+        has_rtptime = melo_airplay_player_get_rtptime (player, buf, &rtptime);
+        melo_airplay_shm_push (
+            player->shm, rtptime, has_rtptime, map.data, map.size);
+      }
+
+      /* Measure levels while samples are still in cache */
+      if (level && !planar) {
+        const void *planes[1] = {map.data};
+
+        melo_airplay_level_process (&player->level, planes,
+            map.size / GST_AUDIO_INFO_BPF (audio_info));
+      }
+      gst_buffer_unmap (buf, &map);
+    }
+
+    /* Measure levels of planar samples, with plane offsets of audio meta */
+    if (level && planar) {
+      GstAudioBuffer abuf;
+
+      if (gst_audio_buffer_map (&abuf, audio_info, buf, GST_MAP_READ)) {
+        melo_airplay_level_process (&player->level,
+            (const void *const *) abuf.planes, abuf.n_samples);
+        gst_audio_buffer_unmap (&abuf);
+      }
+    }
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+static bool
+melo_airplay_player_get_render (MeloAirplayPlayer *player, uint32_t *rtptime)
+{
+  uint32_t render, duration;
+  unsigned int samplerate;
+  gint32 delta;
+
+  /* Get last rendered RTP time */
+  if (!melo_airplay_position_read (
+          &player->render, rtptime, &render, &duration))
+    return false;
+
+  /* Interpolate to now, up to the end of last rendered buffer */
+  samplerate = g_atomic_int_get (&player->samplerate);
+  delta = (uint32_t) g_get_monotonic_time () - render;
+  if (delta > (gint32) duration)
+    delta = duration;
+  *rtptime += (gint64) delta * samplerate / G_USEC_PER_SEC;
+
+  return true;
+}
+
+static void
+sync_cb (GstElement *raop, guint rtptime, guint64 ntp, guint64 time,
+    gpointer user_data)
+{
+  MeloAirplayPlayer *player = MELO_AIRPLAY_PLAYER (user_data);
+  uint32_t position;
+  bool rendering;
+  double ratio;
+
+  /* Get RTP time rendered at reception, for phase error */
+  rendering = melo_airplay_player_get_render (player, &position);
+
+  /* Update resampling ratio with new drift estimation */
+  if (melo_airplay_drift_add (&player->drift, rtptime,
+          GST_TIME_AS_USECONDS (time), rendering ? &position : NULL,
+          &ratio)) {
+    g_object_set (player->resample, "ratio", ratio, NULL);
+    g_atomic_int_set (&player->drift_ppm, (ratio - 1.0) * 1000000.0);
+    g_atomic_int_set (&player->drift_phase,
+        melo_airplay_drift_get_phase (&player->drift) * G_USEC_PER_SEC /
+            player->samplerate);
+  }
+}
+
+static int64_t
+melo_airplay_timing_diff (int64_t start, int64_t end)
+{
+  return start && end ? end - start : -1;
+}
+
+static void
+melo_airplay_timing_dump (const MeloAirplayTiming *timing, GString *str)
+{
+  g_string_append_printf (str,
+      "total=%" G_GINT64_FORMAT " options>announce=%" G_GINT64_FORMAT
+      " announce=%" G_GINT64_FORMAT " announce>setup=%" G_GINT64_FORMAT
+      " setup=%" G_GINT64_FORMAT " setup>record=%" G_GINT64_FORMAT
+      " record>audio=%" G_GINT64_FORMAT "\n",
+      melo_airplay_timing_diff (timing->options, timing->first_audio),
+      melo_airplay_timing_diff (timing->options, timing->announce),
+      melo_airplay_timing_diff (timing->announce, timing->announce_done),
+      melo_airplay_timing_diff (timing->announce_done, timing->setup),
+      melo_airplay_timing_diff (timing->setup, timing->setup_done),
+      melo_airplay_timing_diff (timing->setup_done, timing->record),
+      melo_airplay_timing_diff (timing->record, timing->first_audio));
+}
+
+static void
+melo_airplay_player_first_audio (MeloAirplayPlayer *player, gint64 now)
+{
+  MeloAirplayTiming timing;
+  GString *str;
+
+  /* Get session timing, written from RTSP thread */
+  g_mutex_lock (&player->timing_mutex);
+  player->timing.first_audio = now;
+  timing = player->timing;
+  g_mutex_unlock (&player->timing_mutex);
+
+  /* Session timing not provided */
+  if (!timing.options)
+    return;
+
+  /* Add time to first audio */
+  melo_airplay_histogram_add (&player->ttfa, now - timing.options);
+
+  /* Log breakdown */
+  str = g_string_new (NULL);
+  melo_airplay_timing_dump (&timing, str);
+  MELO_LOGI ("time to first audio (us): %s", str->str);
+  g_string_free (str, TRUE);
+}
+
+static GstPadProbeReturn
+render_probe_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  MeloAirplayPlayer *player = MELO_AIRPLAY_PLAYER (user_data);
+  GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstClockTime pts = GST_BUFFER_PTS (buf);
+  uint32_t rtptime, duration;
+  gint64 render = g_get_monotonic_time ();
+  GstRaopLatencyMeta *meta;
+
+  /* First buffer of session */
+  if (g_atomic_int_compare_and_exchange (&player->first_audio, 0, 1))
+    melo_airplay_player_first_audio (player, render);
+
+  /* First buffer after resume */
+  if (g_atomic_int_compare_and_exchange (&player->resume_pending, 1, 0))
+    melo_airplay_histogram_add (&player->resume, render - player->resume_time);
+
+  /* Get RTP time of buffer */
+  if (!melo_airplay_player_get_rtptime (player, buf, &rtptime))
+    return GST_PAD_PROBE_OK;
+
+  /* Add input samples skipped or repeated by drift resampler */
+  if (player->resample) {
+    gdouble offset;
+
+    g_object_get (player->resample, "offset", &offset, NULL);
+    rtptime += (int32_t) lrint (offset);
+  }
+
+  /* Calculate when buffer will be rendered from pipeline clock */
+  if (player->sync) {
+    GstClockTime running_time, base_time, latency, now;
+    const GstSegment *segment;
+    GstEvent *event;
+    GstClock *clock;
+
+    /* Get running time of buffer */
+    event = gst_pad_get_sticky_event (pad, GST_EVENT_SEGMENT, 0);
+    if (!event)
+      return GST_PAD_PROBE_OK;
+    gst_event_parse_segment (event, &segment);
+    running_time = gst_segment_to_running_time (segment, GST_FORMAT_TIME, pts);
+    gst_event_unref (event);
+
+    /* Get pipeline clock */
+    clock = gst_element_get_clock (player->pipeline);
+    if (!clock || !GST_CLOCK_TIME_IS_VALID (running_time)) {
+      if (clock)
+        gst_object_unref (clock);
+      return GST_PAD_PROBE_OK;
+    }
+
+    /* Buffer is rendered at base time + running time + latency */
+    base_time = gst_element_get_base_time (player->pipeline);
+    latency = gst_pipeline_get_latency (GST_PIPELINE (player->pipeline));
+    if (!GST_CLOCK_TIME_IS_VALID (latency))
+      latency = 0;
+    now = gst_clock_get_time (clock);
+    gst_object_unref (clock);
+
+    render += GST_CLOCK_DIFF (now, base_time + running_time + latency) /
+              GST_USECOND;
+  }
+
+  /* Get buffer duration */
+  duration = GST_BUFFER_DURATION_IS_VALID (buf)
+                 ? GST_TIME_AS_USECONDS (GST_BUFFER_DURATION (buf))
+                 : MELO_AIRPLAY_PLAYER_MAX_EXTRAPOLATION;
+
+  /* Publish rendered position */
+  melo_airplay_position_publish (
+      &player->render, rtptime, (uint32_t) render, duration);
+  if (player->shm)
+    melo_airplay_shm_set_playout (player->shm, rtptime, render);
+  if (player->relay)
+    melo_airplay_relay_set_render (player->relay, rtptime, render);
+
+  /* Add sink and end-to-end latencies */
+  meta = gst_buffer_get_raop_latency_meta (buf);
+  if (meta) {
+    MeloAirplayHistogram *hist = player->stage_latency;
+
+    melo_airplay_histogram_add (
+        &hist[MELO_AIRPLAY_STAGE_SINK], render - meta->stamp);
+    melo_airplay_histogram_add (
+        &hist[MELO_AIRPLAY_STAGE_TOTAL], render - meta->arrival);
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
 static unsigned int
 melo_airplay_player_get_position (MeloPlayer *player)
 {
   MeloAirplayPlayer *aplayer = MELO_AIRPLAY_PLAYER (player);
-  guint32 pos = 0;
+  unsigned int samplerate;
+  uint32_t rtptime, start;
 
-  if (!aplayer->pipeline)
-    return pos;
+  /* Get rendered RTP time */
+  if (!melo_airplay_player_get_render (aplayer, &rtptime))
+    return 0;
 
-  /* Lock player mutex */
-  g_mutex_lock (&aplayer->mutex);
-
-  /* Get RTP time */
-  if (gst_rtp_raop_depay_query_rtptime (
-          GST_RTP_RAOP_DEPAY (aplayer->raop_depay), &pos)) {
-    if (pos > aplayer->start_rtptime)
-      pos = ((pos - aplayer->start_rtptime) * G_GUINT64_CONSTANT (1000)) /
-            aplayer->samplerate;
-    else
-      pos = 0;
-  }
-
-  /* Unlock player mutex */
-  g_mutex_unlock (&aplayer->mutex);
+  /* Convert to position from stream start */
+  samplerate = g_atomic_int_get (&aplayer->samplerate);
+  start = g_atomic_int_get (&aplayer->start_rtptime);
+  if ((gint32) (rtptime - start) <= 0 || !samplerate)
+    return 0;
 
-  return pos;
+  return ((rtptime - start) * G_GUINT64_CONSTANT (1000)) / samplerate;
 }
 
 void
@@ -337,6 +1214,544 @@ melo_airplay_player_parse_format (MeloAirplayPlayer *player,
   return ret;
 }
 
+static void
+melo_airplay_player_add_probe (GstElement *element, const char *name,
+    GstPadProbeCallback cb, GstPadProbeType mask, MeloAirplayPlayer *player)
+{
+  GstPad *pad;
+
+  /* Add probe on static pad */
+  pad = gst_element_get_static_pad (element, name);
+  if (!pad)
+    return;
+  gst_pad_add_probe (pad, mask, cb, player, NULL);
+  gst_object_unref (pad);
+}
+
+static void
+melo_airplay_player_add_stage_probe (GstElement *element, const char *name,
+    MeloAirplayPlayer *player, MeloAirplayStage stage)
+{
+  GstPad *pad;
+
+  /* Add latency probe on static pad */
+  pad = gst_element_get_static_pad (element, name);
+  if (!pad)
+    return;
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, stage_probe_cb,
+      &player->stage_probes[stage], NULL);
+  gst_object_unref (pad);
+}
+
+static void
+melo_airplay_player_link_stage (MeloAirplayPlayer *player, GstElement *prev,
+    GstElement *next, MeloAirplayStage stage)
+{
+  GstElement *queue;
+
+  /* Run stage on the same thread */
+  if (!player->stage_queue_size) {
+    gst_element_link (prev, next);
+    return;
+  }
+
+  /* Run stage on a new thread fed by a lock-free queue */
+  queue =
+      gst_element_factory_make ("raopqueue", melo_airplay_stage_names[stage]);
+  g_object_set (queue, "size", player->stage_queue_size, NULL);
+  gst_bin_add (GST_BIN (player->pipeline), queue);
+  gst_element_link_many (prev, queue, next, NULL);
+  player->stage_queues[stage] = queue;
+}
+
+static void
+melo_airplay_player_link_output (
+    MeloAirplayPlayer *player, GstElement *dec, GstElement *sink)
+{
+  GstElement *prev = dec;
+
+  /* Decoder -> [equalizer] -> [loudness] -> [resampler] -> sink */
+  if (player->eq) {
+    gst_element_link (prev, player->eq);
+    prev = player->eq;
+  }
+  if (player->loudness) {
+    gst_element_link (prev, player->loudness);
+    prev = player->loudness;
+  }
+  if (player->resample) {
+    gst_element_link (prev, player->resample);
+    prev = player->resample;
+  }
+  gst_element_link (prev, sink);
+}
+
+static void
+tracer_add_element (const GValue *item, gpointer user_data)
+{
+  GstRaopTracer *tracer = user_data;
+  GstElement *element = g_value_get_object (item);
+
+  if (!gst_raop_tracer_add_element (tracer, element))
+    MELO_LOGW ("too many elements to trace: %s ignored",
+        GST_ELEMENT_NAME (element));
+}
+
+static void
+melo_airplay_player_trace (MeloAirplayPlayer *player)
+{
+  GstIterator *it;
+  bool enable;
+
+  /* Tracer is disabled */
+  if (!melo_settings_entry_get_boolean (player->tracer_enable, &enable, NULL) ||
+      !enable) {
+    player->tracer = NULL;
+    return;
+  }
+
+  /* Register all pipeline elements */
+  player->tracer = gst_raop_tracer_get ();
+  it = gst_bin_iterate_elements (GST_BIN (player->pipeline));
+  gst_iterator_foreach (it, tracer_add_element, player->tracer);
+  gst_iterator_free (it);
+}
+
+static void
+melo_airplay_player_account_wakeups (MeloAirplayPlayer *player)
+{
+  uint64_t wakeups = melo_airplay_threads_get_wakeups (&player->threads);
+  gint64 now = g_get_monotonic_time ();
+
+  /* Add wake-ups and duration of current state */
+  if (player->suspended) {
+    player->suspended_time += now - player->state_time;
+    player->suspended_wakeups += wakeups - player->state_wakeups;
+  } else {
+    player->active_time += now - player->state_time;
+    player->active_wakeups += wakeups - player->state_wakeups;
+  }
+  player->state_time = now;
+  player->state_wakeups = wakeups;
+}
+
+static gboolean idle_cb (gpointer user_data);
+
+static GSource *
+melo_airplay_player_add_source (
+    MeloAirplayPlayer *player, GSource *source, GSourceFunc func)
+{
+  /* Attach to the context of the thread which set up the session */
+  g_source_set_callback (source, func, player, NULL);
+  g_source_attach (source, player->context);
+
+  return source;
+}
+
+static void
+melo_airplay_player_remove_source (GSource **source)
+{
+  if (!*source)
+    return;
+
+  g_source_destroy (*source);
+  g_source_unref (*source);
+  *source = NULL;
+}
+
+static void
+melo_airplay_player_take_status (
+    MeloAirplayPlayer *player, MeloAirplayPlayerStatus *status)
+{
+  /* Move pending status out, to send it without status mutex */
+  *status = player->status;
+  memset (&player->status, 0, sizeof (player->status));
+
+  /* Account sent status */
+  if (status->tags)
+    player->status_emitted++;
+  if (status->has_state) {
+    player->status_last_state = status->state;
+    player->status_emitted++;
+  }
+  if (status->has_stream_state) {
+    player->status_last_stream_state = status->stream_state;
+    player->status_emitted++;
+  }
+  if (status->has_duration)
+    player->status_emitted++;
+}
+
+static void
+melo_airplay_player_update_status (
+    MeloAirplayPlayer *player, MeloAirplayPlayerStatus *status)
+{
+  /* Tags first: a new media resets previous status */
+  if (status->tags) {
+    if (status->tags_reset)
+      melo_player_update_media (
+          MELO_PLAYER (player), NULL, status->tags, status->tags_flags);
+    else
+      melo_player_update_tags (
+          MELO_PLAYER (player), status->tags, status->tags_flags);
+  }
+  if (status->has_state)
+    melo_player_update_state (MELO_PLAYER (player), status->state);
+  if (status->has_stream_state)
+    melo_player_update_stream_state (
+        MELO_PLAYER (player), status->stream_state, status->stream_value);
+  if (status->has_duration)
+    melo_player_update_duration (
+        MELO_PLAYER (player), status->pos, status->dur);
+  if (status->has_volume)
+    melo_player_update_volume (MELO_PLAYER (player), status->volume, false);
+}
+
+static gboolean
+melo_airplay_player_status_job_cb (gpointer user_data)
+{
+  MeloAirplayPlayerStatusJob *job = user_data;
+
+  melo_airplay_player_update_status (job->player, &job->status);
+  job->status.tags = NULL;
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+melo_airplay_player_status_job_free (gpointer user_data)
+{
+  MeloAirplayPlayerStatusJob *job = user_data;
+
+  if (job->status.tags)
+    melo_tags_unref (job->status.tags);
+  g_object_unref (job->player);
+  g_slice_free (MeloAirplayPlayerStatusJob, job);
+}
+
+static void
+melo_airplay_player_send_status (
+    MeloAirplayPlayer *player, MeloAirplayPlayerStatus *status)
+{
+  MeloAirplayPlayerStatusJob *job;
+
+  /* Nothing to send */
+  if (!status->tags && !status->has_state && !status->has_stream_state &&
+      !status->has_duration && !status->has_volume)
+    return;
+
+  /* Melo player is only updated from main loop: status from RTSP or
+   * streaming threads is sent from there, in order.
+   */
+  if (g_main_context_is_owner (g_main_context_default ())) {
+    melo_airplay_player_update_status (player, status);
+    return;
+  }
+  job = g_slice_new (MeloAirplayPlayerStatusJob);
+  job->player = g_object_ref (player);
+  job->status = *status;
+  g_main_context_invoke_full (NULL, G_PRIORITY_DEFAULT,
+      melo_airplay_player_status_job_cb, job,
+      melo_airplay_player_status_job_free);
+}
+
+static gboolean
+status_cb (gpointer user_data)
+{
+  MeloAirplayPlayer *player = MELO_AIRPLAY_PLAYER (user_data);
+  MeloAirplayPlayerStatus status = {0};
+
+  /* Take merged status, unless the session has been torn down meanwhile */
+  g_mutex_lock (&player->status_mutex);
+  if (!g_source_is_destroyed (g_main_current_source ())) {
+    melo_airplay_player_take_status (player, &status);
+    g_source_unref (player->status_source);
+    player->status_source = NULL;
+  }
+  g_mutex_unlock (&player->status_mutex);
+
+  /* Send it */
+  melo_airplay_player_send_status (player, &status);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+melo_airplay_player_schedule_status (
+    MeloAirplayPlayer *player, MeloAirplayPlayerStatus *status)
+{
+  GSource *source;
+
+  /* No session: take status to send it now */
+  if (!player->status_context) {
+    melo_airplay_player_take_status (player, status);
+    return;
+  }
+  memset (status, 0, sizeof (*status));
+
+  /* Send with next merged update */
+  if (player->status_source)
+    return;
+  source = g_timeout_source_new (MELO_AIRPLAY_PLAYER_STATUS_INTERVAL);
+  g_source_set_callback (source, status_cb, player, NULL);
+  g_source_attach (source, player->status_context);
+  player->status_source = source;
+}
+
+static void
+melo_airplay_player_post_state (
+    MeloAirplayPlayer *player, MeloPlayerState state)
+{
+  player->status_requests++;
+
+  /* Already sent */
+  if (!player->status.has_state && player->status_last_state == (int) state) {
+    player->status_skipped++;
+    return;
+  }
+
+  /* Replace pending state */
+  if (player->status.has_state)
+    player->status_merged++;
+  player->status.has_state = true;
+  player->status.state = state;
+}
+
+static void
+melo_airplay_player_post_stream_state (MeloAirplayPlayer *player,
+    MeloPlayerStreamState state, unsigned int value)
+{
+  player->status_requests++;
+
+  /* Already sent */
+  if (!player->status.has_stream_state &&
+      player->status_last_stream_state == (int) state && !value) {
+    player->status_skipped++;
+    return;
+  }
+
+  /* Replace pending stream state */
+  if (player->status.has_stream_state)
+    player->status_merged++;
+  player->status.has_stream_state = true;
+  player->status.stream_state = state;
+  player->status.stream_value = value;
+}
+
+static void
+melo_airplay_player_post_duration (
+    MeloAirplayPlayer *player, unsigned int pos, unsigned int dur)
+{
+  player->status_requests++;
+
+  /* Replace pending position */
+  if (player->status.has_duration)
+    player->status_merged++;
+  player->status.has_duration = true;
+  player->status.pos = pos;
+  player->status.dur = dur;
+}
+
+static void
+melo_airplay_player_post_tags (MeloAirplayPlayer *player, MeloTags *tags,
+    bool reset, unsigned int flags, MeloAirplayPlayerStatus *prev)
+{
+  player->status_requests++;
+  memset (prev, 0, sizeof (*prev));
+
+  /* Pending tags are replaced by a new media, or sent before new tags */
+  if (player->status.tags) {
+    if (reset) {
+      melo_tags_unref (player->status.tags);
+      player->status_merged++;
+    } else {
+      prev->tags = player->status.tags;
+      prev->tags_reset = player->status.tags_reset;
+      prev->tags_flags = player->status.tags_flags;
+      player->status_emitted++;
+    }
+    player->status.tags = NULL;
+  }
+
+  player->status.tags = tags;
+  player->status.tags_reset = reset;
+  player->status.tags_flags = flags;
+}
+
+static void
+melo_airplay_player_start_status (MeloAirplayPlayer *player)
+{
+  /* Send status updates from main loop */
+  g_mutex_lock (&player->status_mutex);
+  player->status_context = g_main_context_ref (g_main_context_default ());
+  player->status_last_state = -1;
+  player->status_last_stream_state = -1;
+  player->status_requests = 0;
+  player->status_emitted = 0;
+  player->status_merged = 0;
+  player->status_skipped = 0;
+  g_mutex_unlock (&player->status_mutex);
+}
+
+static void
+melo_airplay_player_stop_status (MeloAirplayPlayer *player,
+    MeloPlayerState state, MeloAirplayPlayerStatus *status)
+{
+  /* Take final state with pending status, and send next ones directly */
+  g_mutex_lock (&player->status_mutex);
+  melo_airplay_player_remove_source (&player->status_source);
+  melo_airplay_player_post_state (player, state);
+  melo_airplay_player_take_status (player, status);
+  if (player->status_context)
+    g_main_context_unref (player->status_context);
+  player->status_context = NULL;
+  player->status_last_state = -1;
+  player->status_last_stream_state = -1;
+  g_mutex_unlock (&player->status_mutex);
+}
+
+static void
+melo_airplay_player_resume (MeloAirplayPlayer *player)
+{
+  gint64 start = g_get_monotonic_time ();
+
+  if (!player->suspended)
+    return;
+
+  /* Stop watching data socket */
+  melo_airplay_player_remove_source (&player->wake_source);
+  melo_airplay_player_account_wakeups (player);
+  player->suspended = false;
+
+  /* Restart decoder and sink: resume time is measured until next buffer
+   * reaches the sink
+   */
+  g_atomic_int_set (&player->activity, start / G_USEC_PER_SEC);
+  g_atomic_int_set (&player->sound, start / G_USEC_PER_SEC);
+  player->idle = MELO_AIRPLAY_IDLE_NONE;
+  player->resume_time = start;
+  g_atomic_int_set (&player->resume_pending, 1);
+  gst_element_set_state (player->pipeline, GST_STATE_PLAYING);
+  MELO_LOGD ("pipeline resumed");
+
+  /* Watch activity again */
+  player->idle_source = melo_airplay_player_add_source (
+      player, g_timeout_source_new_seconds (1), idle_cb);
+}
+
+static gboolean
+wake_cb (GSocket *sock, GIOCondition condition, gpointer user_data)
+{
+  MeloAirplayPlayer *player = MELO_AIRPLAY_PLAYER (user_data);
+  gssize size;
+
+  g_mutex_lock (&player->mutex);
+
+  /* Session torn down from another thread */
+  if (g_source_is_destroyed (g_main_current_source ())) {
+    g_mutex_unlock (&player->mutex);
+    return G_SOURCE_REMOVE;
+  }
+
+  /* Drop packets of digital silence: no larger than any silent frame */
+  if (player->idle == MELO_AIRPLAY_IDLE_SILENCE) {
+    size = g_socket_get_available_bytes (sock);
+    if (size > 0 && size <= MELO_AIRPLAY_PLAYER_RTP_HEADER_SIZE +
+                                g_atomic_int_get (&player->silence_size)) {
+      char buf[MELO_AIRPLAY_PLAYER_RTP_HEADER_SIZE];
+
+      /* Whole datagram is discarded, even with a smaller buffer */
+      g_socket_receive (sock, buf, sizeof (buf), NULL, NULL);
+      g_mutex_unlock (&player->mutex);
+      return G_SOURCE_CONTINUE;
+    }
+  }
+
+  /* Packet received: resume pipeline */
+  melo_airplay_player_resume (player);
+  g_mutex_unlock (&player->mutex);
+
+  return G_SOURCE_REMOVE;
+}
+
+static MeloAirplayIdle
+melo_airplay_player_get_idle (MeloAirplayPlayer *player)
+{
+  gint64 now = g_get_monotonic_time () / G_USEC_PER_SEC;
+  gint64 timeout = player->idle_timeout;
+  int paused = g_atomic_int_get (&player->paused);
+  int silence_size, sound_size;
+
+  /* Sender reports paused */
+  if (paused && now - paused >= timeout)
+    return MELO_AIRPLAY_IDLE_PAUSED;
+
+  /* No packet received */
+  if (now - g_atomic_int_get (&player->activity) >= timeout)
+    return MELO_AIRPLAY_IDLE_NO_PACKET;
+
+  /* Only digital silence decoded, and packets can be told apart by size */
+  silence_size = g_atomic_int_get (&player->silence_size);
+  sound_size = g_atomic_int_get (&player->sound_size);
+  if (silence_size && silence_size < sound_size &&
+      now - g_atomic_int_get (&player->sound) >= timeout)
+    return MELO_AIRPLAY_IDLE_SILENCE;
+
+  return MELO_AIRPLAY_IDLE_NONE;
+}
+
+static gboolean
+idle_cb (gpointer user_data)
+{
+  MeloAirplayPlayer *player = MELO_AIRPLAY_PLAYER (user_data);
+  MeloAirplayIdle idle = MELO_AIRPLAY_IDLE_NONE;
+  GSocket *sock = NULL;
+
+  g_mutex_lock (&player->mutex);
+
+  /* Session torn down from another thread */
+  if (g_source_is_destroyed (g_main_current_source ())) {
+    g_mutex_unlock (&player->mutex);
+    return G_SOURCE_REMOVE;
+  }
+
+  /* Only suspend a playing pipeline idle for a while */
+  if (GST_STATE (player->pipeline) == GST_STATE_PLAYING)
+    idle = melo_airplay_player_get_idle (player);
+  if (idle == MELO_AIRPLAY_IDLE_NONE) {
+    g_mutex_unlock (&player->mutex);
+    return G_SOURCE_CONTINUE;
+  }
+
+  /* Get data socket */
+  g_object_get (player->udp_src, "used-socket", &sock, NULL);
+  if (!sock) {
+    g_mutex_unlock (&player->mutex);
+    return G_SOURCE_CONTINUE;
+  }
+
+  /* Pause pipeline: sockets and session state are kept, and packets are
+   * queued in socket until resume.
+   */
+  melo_airplay_player_account_wakeups (player);
+  gst_element_set_state (player->pipeline, GST_STATE_PAUSED);
+  player->suspended = true;
+  player->suspend_count++;
+  player->idle = idle;
+  MELO_LOGD ("pipeline suspended: %s", melo_airplay_idle_names[idle]);
+
+  /* Resume on next packet, or when sender plays again */
+  if (idle != MELO_AIRPLAY_IDLE_PAUSED)
+    player->wake_source = melo_airplay_player_add_source (player,
+        g_socket_create_source (sock, G_IO_IN, NULL), (GSourceFunc) wake_cb);
+  g_object_unref (sock);
+  melo_airplay_player_remove_source (&player->idle_source);
+
+  g_mutex_unlock (&player->mutex);
+
+  return G_SOURCE_REMOVE;
+}
+
 bool
 melo_airplay_player_setup (MeloAirplayPlayer *player,
     MeloAirplayTransport transport, const char *ip, unsigned int *port,
@@ -345,9 +1760,13 @@ melo_airplay_player_setup (MeloAirplayPlayer *player,
     size_t key_len, const unsigned char *iv, size_t iv_len)
 {
   unsigned int max_port = *port + 100;
-  GstElement *src, *sink;
+  GstElement *src, *dec, *sink;
+  const char *shm_path, *bands, *rt_policy, *rt_cpus;
+  uint32_t http_port, rt_priority;
+  bool record, loudness, rt_mlock;
   GstState next_state = GST_STATE_READY;
   const char *encoding;
+  unsigned int i;
   GstBus *bus;
 
   /* Lock player mutex */
@@ -356,20 +1775,119 @@ melo_airplay_player_setup (MeloAirplayPlayer *player,
   if (player->pipeline)
     goto failed;
 
+  /* Reset position and latency histograms */
+  melo_airplay_position_reset (&player->anchor);
+  melo_airplay_position_reset (&player->render);
+  player->sync = true;
+  for (i = 0; i < MELO_AIRPLAY_STAGE_COUNT; i++)
+    melo_airplay_histogram_reset (&player->stage_latency[i]);
+
+  /* Reset stage queues */
+  memset (player->stage_queues, 0, sizeof (player->stage_queues));
+  if (!melo_settings_entry_get_uint32 (
+          player->stage_queue, &player->stage_queue_size, NULL))
+    player->stage_queue_size = 0;
+
+  /* Reset session timing */
+  g_mutex_lock (&player->timing_mutex);
+  memset (&player->timing, 0, sizeof (player->timing));
+  g_mutex_unlock (&player->timing_mutex);
+  g_atomic_int_set (&player->first_audio, 0);
+
+  /* Reset idle suspend and wake-ups */
+  player->udp_src = NULL;
+  player->suspended = false;
+  player->suspend_count = 0;
+  melo_airplay_histogram_reset (&player->resume);
+  player->active_time = player->suspended_time = 0;
+  player->active_wakeups = player->suspended_wakeups = 0;
+  g_atomic_int_set (&player->resume_pending, 0);
+  melo_airplay_threads_reset (&player->threads);
+  player->state_time = g_get_monotonic_time ();
+  player->state_wakeups = 0;
+  g_atomic_int_set (&player->activity, player->state_time / G_USEC_PER_SEC);
+  g_atomic_int_set (&player->sound, player->state_time / G_USEC_PER_SEC);
+  g_atomic_int_set (&player->paused, 0);
+  g_atomic_int_set (&player->frame_size, 0);
+  g_atomic_int_set (&player->silence_size, 0);
+  g_atomic_int_set (&player->sound_size, 0);
+  player->idle = MELO_AIRPLAY_IDLE_NONE;
+  if (!melo_settings_entry_get_uint32 (
+          player->idle_suspend, &player->idle_timeout, NULL))
+    player->idle_timeout = 0;
+
+  /* Setup real-time streaming threads and packet memory locking */
+  if (!melo_settings_entry_get_string (player->rt_policy, &rt_policy, NULL))
+    rt_policy = NULL;
+  if (!melo_settings_entry_get_uint32 (player->rt_priority, &rt_priority, NULL))
+    rt_priority = 0;
+  if (!melo_settings_entry_get_string (player->rt_cpus, &rt_cpus, NULL))
+    rt_cpus = NULL;
+  if (!melo_settings_entry_get_boolean (player->rt_mlock, &rt_mlock, NULL))
+    rt_mlock = false;
+  player->rt_enabled =
+      melo_airplay_rt_setup (&player->rt, rt_policy, rt_priority, rt_cpus);
+
+  /* Reset decoded format and audio levels */
+  gst_audio_info_init (&player->tap_info);
+  melo_airplay_level_reset (&player->level);
+  if (!melo_settings_entry_get_uint32 (
+          player->level_interval, &player->level_interval_ms, NULL))
+    player->level_interval_ms = 0;
+
   /* Parse format */
   if (!melo_airplay_player_parse_format (player, codec, format, &encoding))
     goto failed;
 
+  /* Reset drift estimation */
+  melo_airplay_drift_reset (&player->drift, player->samplerate);
+  g_atomic_int_set (&player->drift_ppm, 0);
+  g_atomic_int_set (&player->drift_phase, 0);
+  player->resample = NULL;
+
+  /* Run idle suspend sources in the caller thread context */
+  player->context = g_main_context_ref_thread_default ();
+  melo_airplay_player_start_status (player);
+
   /* Create pipeline */
   player->pipeline = gst_pipeline_new (MELO_AIRPLAY_PLAYER_ID "_pipeline");
 
+  /* Create packet allocator for the session */
+  player->allocator =
+      gst_raop_allocator_new (MELO_AIRPLAY_PLAYER_PACKET_BLOCKS, rt_mlock);
+
+  /* Create equalizer */
+  player->eq = NULL;
+  if (melo_settings_entry_get_string (player->eq_bands, &bands, NULL) &&
+      bands && *bands) {
+    player->eq = gst_element_factory_make ("raopeq", NULL);
+    g_object_set (player->eq, "bands", bands, NULL);
+    gst_bin_add (GST_BIN (player->pipeline), player->eq);
+  }
+
+  /* Create loudness normalizer */
+  player->loudness = NULL;
+  if (melo_settings_entry_get_boolean (
+          player->loudness_enable, &loudness, NULL) &&
+      loudness) {
+    uint32_t target;
+
+    if (!melo_settings_entry_get_uint32 (
+            player->loudness_target, &target, NULL))
+      target = 18;
+    player->loudness = gst_element_factory_make ("raoploudness", NULL);
+    g_object_set (player->loudness, "target", -(gdouble) MIN (target, 70),
+        NULL);
+    gst_bin_add (GST_BIN (player->pipeline), player->loudness);
+  }
+
   /* Create melo audio sink */
   sink = melo_player_get_sink (
       MELO_PLAYER (player), MELO_AIRPLAY_PLAYER_ID "_sink");
 
   /* Create source */
   if (transport == MELO_AIRPLAY_TRANSPORT_UDP) {
-    GstElement *src_caps, *raop, *rtp, *rtp_caps, *depay, *dec;
+    GstElement *src_caps, *raop, *rtp, *rtp_caps, *depay;
     uint32_t value_u32;
     int32_t value_i32;
     bool value_bool;
@@ -377,6 +1895,7 @@ melo_airplay_player_setup (MeloAirplayPlayer *player,
 
     /* Add an UDP source and a RTP jitter buffer to pipeline */
     src = gst_element_factory_make ("udpsrc", NULL);
+    player->udp_src = src;
     src_caps = gst_element_factory_make ("capsfilter", NULL);
     raop = gst_element_factory_make ("rtpraop", NULL);
     rtp = gst_element_factory_make ("rtpjitterbuffer", NULL);
@@ -392,6 +1911,11 @@ melo_airplay_player_setup (MeloAirplayPlayer *player,
     /* Save RAOP depay element */
     player->raop_depay = depay;
 
+    /* Allocate packets from session slabs */
+    gst_rtp_raop_set_allocator (GST_RTP_RAOP (raop), player->allocator);
+    gst_rtp_raop_depay_set_allocator (
+        GST_RTP_RAOP_DEPAY (depay), player->allocator);
+
     /* Set caps for UDP source -> RTP jitter buffer link */
     caps = gst_caps_new_simple ("application/x-rtp", "payload", G_TYPE_INT, 96,
         "clock-rate", G_TYPE_INT, player->samplerate, NULL);
@@ -416,17 +1940,43 @@ melo_airplay_player_setup (MeloAirplayPlayer *player,
     /* Disable synchronization on sink */
     if (melo_settings_entry_get_boolean (
             player->disable_sync, &value_bool, NULL) &&
-        value_bool)
+        value_bool) {
       g_object_set (sink, "sync", FALSE, NULL);
+      player->sync = false;
+    }
 
     /* Set latency in jitter buffer */
     if (melo_settings_entry_get_uint32 (player->latency, &value_u32, NULL) &&
         value_u32)
       g_object_set (G_OBJECT (rtp), "latency", (guint) value_u32, NULL);
 
+    /* Compensate sender clock drift with sync packets */
+    if (*control_port &&
+        melo_settings_entry_get_boolean (
+            player->drift_correction, &value_bool, NULL) &&
+        value_bool) {
+      player->resample = gst_element_factory_make ("raopresample", NULL);
+      gst_bin_add (GST_BIN (player->pipeline), player->resample);
+      g_signal_connect (raop, "sync", G_CALLBACK (sync_cb), player);
+    }
+
     /* Link all elements */
-    gst_element_link_many (
-        src, src_caps, raop, rtp, rtp_caps, depay, dec, sink, NULL);
+    gst_element_link_many (src, src_caps, raop, rtp, rtp_caps, NULL);
+    melo_airplay_player_link_stage (
+        player, rtp_caps, depay, MELO_AIRPLAY_STAGE_DECRYPT);
+    melo_airplay_player_link_stage (
+        player, depay, dec, MELO_AIRPLAY_STAGE_DECODE);
+    melo_airplay_player_link_output (player, dec, sink);
+
+    /* Measure time spent in each stage */
+    melo_airplay_player_add_stage_probe (
+        rtp, "sink", player, MELO_AIRPLAY_STAGE_NETWORK);
+    melo_airplay_player_add_stage_probe (
+        rtp, "src", player, MELO_AIRPLAY_STAGE_JITTER);
+    melo_airplay_player_add_stage_probe (
+        depay, "src", player, MELO_AIRPLAY_STAGE_DECRYPT);
+    melo_airplay_player_add_stage_probe (
+        dec, "src", player, MELO_AIRPLAY_STAGE_DECODE);
 
     /* Add sync / retransmit support to pipeline */
     if (*control_port) {
@@ -499,7 +2049,7 @@ melo_airplay_player_setup (MeloAirplayPlayer *player,
       gst_object_unref (udp_pad);
     }
   } else {
-    GstElement *rtp_caps, *raop, *depay, *dec;
+    GstElement *rtp_caps, *raop, *depay;
     GstCaps *caps;
 
     /* Create pipeline for TCP streaming */
@@ -514,6 +2064,11 @@ melo_airplay_player_setup (MeloAirplayPlayer *player,
     /* Save RAOP depay element */
     player->raop_depay = depay;
 
+    /* Allocate packets from session slabs */
+    gst_tcp_raop_set_allocator (GST_TCP_RAOP (raop), player->allocator);
+    gst_rtp_raop_depay_set_allocator (
+        GST_RTP_RAOP_DEPAY (depay), player->allocator);
+
     /* Set caps for TCP source -> TCP RAOP depayloader link */
     caps = gst_caps_new_simple ("application/x-rtp-stream", "clock-rate",
         G_TYPE_INT, player->samplerate, "encoding-name", G_TYPE_STRING, "ALAC",
@@ -533,15 +2088,106 @@ melo_airplay_player_setup (MeloAirplayPlayer *player,
     next_state = GST_STATE_PLAYING;
 
     /* Link all elements */
-    gst_element_link_many (src, rtp_caps, raop, depay, dec, sink, NULL);
+    gst_element_link_many (src, rtp_caps, raop, NULL);
+    melo_airplay_player_link_stage (
+        player, raop, depay, MELO_AIRPLAY_STAGE_DECRYPT);
+    melo_airplay_player_link_stage (
+        player, depay, dec, MELO_AIRPLAY_STAGE_DECODE);
+    melo_airplay_player_link_output (player, dec, sink);
+
+    /* Measure time spent in each stage */
+    melo_airplay_player_add_stage_probe (
+        depay, "sink", player, MELO_AIRPLAY_STAGE_NETWORK);
+    melo_airplay_player_add_stage_probe (
+        depay, "src", player, MELO_AIRPLAY_STAGE_DECRYPT);
+    melo_airplay_player_add_stage_probe (
+        dec, "src", player, MELO_AIRPLAY_STAGE_DECODE);
   }
 
   /* Set server port */
   g_object_set (src, "port", *port, NULL);
 
-  /* Add a message handler */
+  /* Tag packets at arrival */
+  melo_airplay_player_add_probe (
+      src, "src", arrival_probe_cb, GST_PAD_PROBE_TYPE_BUFFER, player);
+
+  /* Track RTP time from depayloader to rendering */
+  melo_airplay_player_add_probe (player->raop_depay, "src", anchor_probe_cb,
+      GST_PAD_PROBE_TYPE_BUFFER, player);
+  melo_airplay_player_add_probe (
+      sink, "sink", render_probe_cb, GST_PAD_PROBE_TYPE_BUFFER, player);
+
+  /* Record decoded samples */
+  if (melo_settings_entry_get_boolean (player->record, &record, NULL) &&
+      record) {
+    const char *path;
+    uint32_t size;
+
+    if (!melo_settings_entry_get_string (player->record_path, &path, NULL))
+      path = NULL;
+    if (!melo_settings_entry_get_uint32 (player->record_size, &size, NULL))
+      size = 1024;
+
+    /* Buffer size is in KiB: compute in bytes without wrapping */
+    if (size)
+      player->recorder = melo_airplay_recorder_new (path, (size_t) size * 1024);
+    else
+      MELO_LOGW ("empty recording buffer: recording disabled");
+  }
+
+  /* Restream decoded samples over HTTP */
+  if (melo_settings_entry_get_uint32 (player->http_port, &http_port, NULL) &&
+      http_port)
+    player->http = melo_airplay_http_new (http_port);
+
+  /* Relay decrypted ALAC frames to other receivers */
+  if (transport == MELO_AIRPLAY_TRANSPORT_UDP &&
+      codec == MELO_AIRPLAY_CODEC_ALAC) {
+    const char *targets;
+
+    if (melo_settings_entry_get_string (player->relay_targets, &targets, NULL))
+      player->relay =
+          melo_airplay_relay_new (targets, format, player->samplerate);
+    if (player->relay)
+      melo_airplay_player_add_probe (player->raop_depay, "src",
+          relay_probe_cb, GST_PAD_PROBE_TYPE_BUFFER, player);
+  }
+
+  /* Export decoded samples in shared memory */
+  if (melo_settings_entry_get_string (player->shm_path, &shm_path, NULL))
+    player->shm =
+        melo_airplay_shm_new (shm_path, MELO_AIRPLAY_PLAYER_SHM_SIZE);
+
+  /* Watch decoded frames for digital silence (only UDP source is watched) */
+  player->watch_silence = player->udp_src && player->idle_timeout;
+  if (player->watch_silence)
+    melo_airplay_player_add_probe (
+        dec, "sink", frame_probe_cb, GST_PAD_PROBE_TYPE_BUFFER, player);
+
+  /* Tap decoded samples, and measure their levels */
+  if (player->recorder || player->http || player->shm ||
+      player->level_interval_ms || player->watch_silence)
+    melo_airplay_player_add_probe (dec, "src", tap_probe_cb,
+        GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+        player);
+
+  /* Trace processing time of elements */
+  melo_airplay_player_trace (player);
+
+  /* Suspend pipeline when idle (only UDP source is watched) */
+  if (player->udp_src && player->idle_timeout)
+    player->idle_source = melo_airplay_player_add_source (
+        player, g_timeout_source_new_seconds (1), idle_cb);
+
+  /* Add a message handler, in main loop since it updates Melo player */
   bus = gst_pipeline_get_bus (GST_PIPELINE (player->pipeline));
-  player->bus_id = gst_bus_add_watch (bus, bus_cb, player);
+  player->bus_source = gst_bus_create_watch (bus);
+  g_source_set_callback (
+      player->bus_source, (GSourceFunc) bus_cb, player, NULL);
+  g_source_attach (player->bus_source, NULL);
+
+  /* Track and configure streaming threads */
+  gst_bus_set_sync_handler (bus, bus_sync_cb, player, NULL);
   gst_object_unref (bus);
 
   /* Start the pipeline */
@@ -565,35 +2211,85 @@ failed:
   return false;
 }
 
+void
+melo_airplay_player_set_timing (
+    MeloAirplayPlayer *player, const MeloAirplayTiming *timing)
+{
+  if (!player || !timing)
+    return;
+
+  /* Set session timing, until setup */
+  g_mutex_lock (&player->timing_mutex);
+  player->timing = *timing;
+  player->timing.record = 0;
+  player->timing.first_audio = 0;
+  g_mutex_unlock (&player->timing_mutex);
+}
+
 bool
 melo_airplay_player_record (MeloAirplayPlayer *player, unsigned int seq)
 {
-  if (!player || !player->pipeline)
+  MeloAirplayPlayerStatus status;
+
+  if (!player)
     return false;
 
-  /* Lock player mutex */
+  /* Lock player mutex: session can be torn down from main thread */
   g_mutex_lock (&player->mutex);
+  if (!player->pipeline) {
+    g_mutex_unlock (&player->mutex);
+    return false;
+  }
+
+  /* Save record time */
+  g_mutex_lock (&player->timing_mutex);
+  if (!player->timing.record)
+    player->timing.record = g_get_monotonic_time ();
+  g_mutex_unlock (&player->timing_mutex);
+
+  /* Resume suspended pipeline */
+  melo_airplay_player_resume (player);
 
   /* Set playing */
   gst_element_set_state (player->pipeline, GST_STATE_PLAYING);
-  melo_player_update_state (MELO_PLAYER (player), MELO_PLAYER_STATE_PLAYING);
-  melo_player_update_stream_state (
-      MELO_PLAYER (player), MELO_PLAYER_STREAM_STATE_NONE, 0);
+  g_mutex_lock (&player->status_mutex);
+  melo_airplay_player_post_state (player, MELO_PLAYER_STATE_PLAYING);
+  melo_airplay_player_post_stream_state (
+      player, MELO_PLAYER_STREAM_STATE_NONE, 0);
+  melo_airplay_player_schedule_status (player, &status);
+  g_mutex_unlock (&player->status_mutex);
 
   /* Unlock player mutex */
   g_mutex_unlock (&player->mutex);
 
+  /* Send status without lock */
+  melo_airplay_player_send_status (player, &status);
+
   return true;
 }
 
 bool
 melo_airplay_player_flush (MeloAirplayPlayer *player, unsigned int seq)
 {
+  MeloAirplayPlayerStatus status;
+
   if (!player)
     return false;
 
+  /* No session */
+  g_mutex_lock (&player->mutex);
+  if (!player->pipeline) {
+    g_mutex_unlock (&player->mutex);
+    return false;
+  }
+  g_mutex_unlock (&player->mutex);
+
   /* Set paused */
-  melo_player_update_state (MELO_PLAYER (player), MELO_PLAYER_STATE_PAUSED);
+  g_mutex_lock (&player->status_mutex);
+  melo_airplay_player_post_state (player, MELO_PLAYER_STATE_PAUSED);
+  melo_airplay_player_schedule_status (player, &status);
+  g_mutex_unlock (&player->status_mutex);
+  melo_airplay_player_send_status (player, &status);
 
   return true;
 }
@@ -601,6 +2297,9 @@ melo_airplay_player_flush (MeloAirplayPlayer *player, unsigned int seq)
 bool
 melo_airplay_player_teardown (MeloAirplayPlayer *player)
 {
+  MeloAirplayPlayerStatus status;
+  char *stats;
+
   if (!player)
     return false;
 
@@ -613,26 +2312,79 @@ melo_airplay_player_teardown (MeloAirplayPlayer *player)
     return false;
   }
 
+  /* Stop idle suspend */
+  melo_airplay_player_remove_source (&player->idle_source);
+  melo_airplay_player_remove_source (&player->wake_source);
+  melo_airplay_player_account_wakeups (player);
+  player->suspended = false;
+  player->udp_src = NULL;
+
   /* Stop pipeline */
   gst_element_set_state (player->pipeline, GST_STATE_NULL);
-  melo_player_update_state (MELO_PLAYER (player), MELO_PLAYER_STATE_NONE);
+  melo_airplay_player_stop_status (player, MELO_PLAYER_STATE_NONE, &status);
+
+  /* Dump session statistics */
+  stats = melo_airplay_player_dump_stats (player);
+  MELO_LOGI ("session statistics:\n%s", stats);
+  g_free (stats);
+
+  /* Forget pipeline elements before they are freed */
+  if (player->tracer) {
+    gst_raop_tracer_clear (player->tracer);
+    player->tracer = NULL;
+  }
 
   /* Remove message handler */
-  g_source_remove (player->bus_id);
+  melo_airplay_player_remove_source (&player->bus_source);
+  g_main_context_unref (player->context);
+  player->context = NULL;
 
   /* Free gstreamer pipeline */
   g_object_unref (player->pipeline);
   player->pipeline = NULL;
 
+  /* Release packet slabs once last packet is freed */
+  gst_object_unref (player->allocator);
+  player->allocator = NULL;
+
+  /* Finalize recording */
+  melo_airplay_recorder_free (player->recorder);
+  player->recorder = NULL;
+
+  /* Stop HTTP restreaming */
+  melo_airplay_http_free (player->http);
+  player->http = NULL;
+
+  /* Stop relay */
+  melo_airplay_relay_free (player->relay);
+  player->relay = NULL;
+
+  /* Stop shared memory export */
+  melo_airplay_shm_free (player->shm);
+  player->shm = NULL;
+
+  /* Reset position */
+  player->resample = NULL;
+  player->eq = NULL;
+  player->loudness = NULL;
+  memset (player->stage_queues, 0, sizeof (player->stage_queues));
+  melo_airplay_position_reset (&player->render);
+  melo_airplay_position_reset (&player->anchor);
+
   /* Unlock player mutex */
   g_mutex_unlock (&player->mutex);
 
+  /* Send final status */
+  melo_airplay_player_send_status (player, &status);
+
   return true;
 }
 
 bool
 melo_airplay_player_set_volume (MeloAirplayPlayer *player, double volume)
 {
+  MeloAirplayPlayerStatus status = {0};
+
   if (!player)
     return false;
 
@@ -643,7 +2395,9 @@ melo_airplay_player_set_volume (MeloAirplayPlayer *player, double volume)
     player->volume = 0.0;
 
   /* Update status volume */
-  melo_player_update_volume (MELO_PLAYER (player), player->volume, false);
+  status.has_volume = true;
+  status.volume = player->volume;
+  melo_airplay_player_send_status (player, &status);
 
   return true;
 }
@@ -652,24 +2406,82 @@ bool
 melo_airplay_player_set_progress (MeloAirplayPlayer *player, unsigned int start,
     unsigned int cur, unsigned int end)
 {
-  unsigned int pos, dur;
+  MeloAirplayPlayerStatus status;
+  unsigned int pos, dur, samplerate;
 
   if (!player)
     return false;
 
+  /* Get sample rate of current session */
+  g_mutex_lock (&player->mutex);
+  samplerate = player->pipeline ? player->samplerate : 0;
+  g_mutex_unlock (&player->mutex);
+  if (!samplerate)
+    return false;
+
   /* Calculate position and duration */
   if (cur > start)
-    pos = (cur - start) * G_GUINT64_CONSTANT (1000) / player->samplerate;
+    pos = (cur - start) * G_GUINT64_CONSTANT (1000) / samplerate;
   else
     pos = 0;
-  dur = (end - start) * G_GUINT64_CONSTANT (1000) / player->samplerate;
+  dur = (end - start) * G_GUINT64_CONSTANT (1000) / samplerate;
 
   /* Set progression */
-  player->start_rtptime = start;
-  melo_player_update_state (MELO_PLAYER (player), MELO_PLAYER_STATE_PLAYING);
-  melo_player_update_stream_state (
-      MELO_PLAYER (player), MELO_PLAYER_STREAM_STATE_NONE, 0);
-  melo_player_update_duration (MELO_PLAYER (player), pos, dur);
+  g_atomic_int_set (&player->start_rtptime, start);
+  g_mutex_lock (&player->status_mutex);
+  melo_airplay_player_post_state (player, MELO_PLAYER_STATE_PLAYING);
+  melo_airplay_player_post_stream_state (
+      player, MELO_PLAYER_STREAM_STATE_NONE, 0);
+  melo_airplay_player_post_duration (player, pos, dur);
+  melo_airplay_player_schedule_status (player, &status);
+  g_mutex_unlock (&player->status_mutex);
+  melo_airplay_player_send_status (player, &status);
+
+  return true;
+}
+
+bool
+melo_airplay_player_set_duration (
+    MeloAirplayPlayer *player, unsigned int duration)
+{
+  MeloAirplayPlayerStatus status;
+
+  if (!player)
+    return false;
+
+  /* Set duration from item metadata, until next progress update */
+  g_mutex_lock (&player->status_mutex);
+  melo_airplay_player_post_duration (player, 0, duration);
+  melo_airplay_player_schedule_status (player, &status);
+  g_mutex_unlock (&player->status_mutex);
+  melo_airplay_player_send_status (player, &status);
+
+  return true;
+}
+
+bool
+melo_airplay_player_set_paused (MeloAirplayPlayer *player, bool paused)
+{
+  MeloAirplayPlayerStatus status;
+
+  if (!player)
+    return false;
+
+  /* Suspend when paused for a while, resume as soon as sender plays */
+  g_mutex_lock (&player->mutex);
+  g_atomic_int_set (&player->paused,
+      paused ? MAX (g_get_monotonic_time () / G_USEC_PER_SEC, 1) : 0);
+  if (!paused && player->pipeline)
+    melo_airplay_player_resume (player);
+  g_mutex_unlock (&player->mutex);
+
+  /* Set play status reported by sender */
+  g_mutex_lock (&player->status_mutex);
+  melo_airplay_player_post_state (
+      player, paused ? MELO_PLAYER_STATE_PAUSED : MELO_PLAYER_STATE_PLAYING);
+  melo_airplay_player_schedule_status (player, &status);
+  g_mutex_unlock (&player->status_mutex);
+  melo_airplay_player_send_status (player, &status);
 
   return true;
 }
@@ -678,24 +2490,37 @@ void
 melo_airplay_player_take_tags (
     MeloAirplayPlayer *player, MeloTags *tags, bool reset)
 {
+  MeloAirplayPlayerStatus prev, status;
+
   if (!player) {
     melo_tags_unref (tags);
     return;
   }
 
-  if (reset)
-    melo_player_update_media (
-        MELO_PLAYER (player), NULL, tags, MELO_TAGS_MERGE_FLAG_NONE);
-  else
-    melo_player_update_tags (
-        MELO_PLAYER (player), tags, MELO_TAGS_MERGE_FLAG_NONE);
+  g_mutex_lock (&player->status_mutex);
+  melo_airplay_player_post_tags (
+      player, tags, reset, MELO_TAGS_MERGE_FLAG_NONE, &prev);
+  melo_airplay_player_schedule_status (player, &status);
+  g_mutex_unlock (&player->status_mutex);
+  melo_airplay_player_send_status (player, &prev);
+  melo_airplay_player_send_status (player, &status);
 }
 
 void
 melo_airplay_player_reset_cover (MeloAirplayPlayer *player)
 {
-  melo_player_update_tags (
-      MELO_PLAYER (player), melo_tags_new (), MELO_TAGS_MERGE_FLAG_SKIP_COVER);
+  MeloAirplayPlayerStatus prev, status;
+
+  if (!player)
+    return;
+
+  g_mutex_lock (&player->status_mutex);
+  melo_airplay_player_post_tags (player, melo_tags_new (), false,
+      MELO_TAGS_MERGE_FLAG_SKIP_COVER, &prev);
+  melo_airplay_player_schedule_status (player, &status);
+  g_mutex_unlock (&player->status_mutex);
+  melo_airplay_player_send_status (player, &prev);
+  melo_airplay_player_send_status (player, &status);
 }
 
 double
@@ -705,3 +2530,166 @@ melo_airplay_player_get_volume (MeloAirplayPlayer *player)
     return -144.0;
   return (player->volume - 1.0) * 30.0;
 }
+
+bool
+melo_airplay_player_get_level (MeloAirplayPlayer *player, unsigned int channel,
+    float *peak, float *rms)
+{
+  if (!player)
+    return false;
+  return melo_airplay_level_get (&player->level, channel, peak, rms);
+}
+
+/* Must be called with player mutex locked, while a session is running */
+static char *
+melo_airplay_player_dump_stats (MeloAirplayPlayer *player)
+{
+  GString *str;
+  unsigned int i;
+
+  /* Add latency histograms */
+  str = g_string_new ("latency (us):\n");
+  for (i = 0; i < MELO_AIRPLAY_STAGE_COUNT; i++)
+    melo_airplay_histogram_dump (
+        &player->stage_latency[i], melo_airplay_stage_names[i], str);
+
+  /* Add stage queues occupancy */
+  if (player->stage_queue_size) {
+    g_string_append (str, "queues:\n");
+    for (i = 0; i < MELO_AIRPLAY_STAGE_COUNT; i++) {
+      guint size, level, peak;
+      guint64 full, empty;
+
+      if (!player->stage_queues[i])
+        continue;
+
+      g_object_get (player->stage_queues[i], "size", &size, "level", &level,
+          "peak", &peak, "full-waits", &full, "empty-waits", &empty, NULL);
+      g_string_append_printf (str,
+          "%s: size=%u level=%u peak=%u full=%" G_GUINT64_FORMAT
+          " empty=%" G_GUINT64_FORMAT "\n",
+          melo_airplay_stage_names[i], size, level, peak, full, empty);
+    }
+  }
+
+  /* Add merged status updates */
+  g_string_append_printf (str,
+      "status: requested=%u emitted=%u merged=%u skipped=%u\n",
+      player->status_requests, player->status_emitted, player->status_merged,
+      player->status_skipped);
+
+  /* Add audio levels */
+  if (player->level_interval_ms) {
+    float peak, rms;
+
+    g_string_append (str, "levels (dBFS):\n");
+    for (i = 0; melo_airplay_level_get (&player->level, i, &peak, &rms); i++)
+      g_string_append_printf (
+          str, "channel %u: peak=%.2f rms=%.2f\n", i, peak, rms);
+  }
+
+  /* Add time to first audio */
+  g_string_append (str, "time to first audio (us):\n");
+  if (g_atomic_int_get (&player->first_audio)) {
+    MeloAirplayTiming timing;
+
+    g_mutex_lock (&player->timing_mutex);
+    timing = player->timing;
+    g_mutex_unlock (&player->timing_mutex);
+    g_string_append (str, "last: ");
+    melo_airplay_timing_dump (&timing, str);
+  }
+  melo_airplay_histogram_dump (&player->ttfa, "sessions", str);
+
+  /* Add recording cost */
+  if (player->recorder)
+    melo_airplay_recorder_dump (player->recorder, str);
+
+  /* Add HTTP restreaming */
+  if (player->http)
+    melo_airplay_http_dump (player->http, str);
+
+  /* Add relay */
+  if (player->relay)
+    melo_airplay_relay_dump (player->relay, str);
+
+  /* Add shared memory export */
+  if (player->shm)
+    melo_airplay_shm_dump (player->shm, str);
+
+  /* Add clock drift */
+  g_string_append_printf (str, "drift: %d ppm phase=%d us\n",
+      g_atomic_int_get (&player->drift_ppm),
+      g_atomic_int_get (&player->drift_phase));
+
+  /* Add wake-ups per second of streaming threads, while active and
+   * suspended
+   */
+  g_string_append_printf (str,
+      "pipeline wakeups: active=%.1f/s suspended=%.1f/s suspends=%u\n",
+      player->active_time
+          ? player->active_wakeups * (gdouble) G_USEC_PER_SEC /
+                player->active_time
+          : 0.0,
+      player->suspended_time
+          ? player->suspended_wakeups * (gdouble) G_USEC_PER_SEC /
+                player->suspended_time
+          : 0.0,
+      player->suspend_count);
+  melo_airplay_histogram_dump (
+      &player->resume, "resume to sink (us)", str);
+
+  /* Add effective policy of streaming threads */
+  if (player->rt_enabled)
+    melo_airplay_rt_dump (&player->rt, str);
+
+  /* Add equalizer cost */
+  if (player->eq) {
+    gdouble cost;
+
+    g_object_get (player->eq, "cost", &cost, NULL);
+    g_string_append_printf (str, "eq: %.2f ns/sample/section\n", cost);
+  }
+
+  /* Add loudness */
+  if (player->loudness) {
+    gdouble integrated, gain, cost;
+
+    g_object_get (player->loudness, "integrated", &integrated, "gain", &gain,
+        "cost", &cost, NULL);
+    g_string_append_printf (str,
+        "loudness: %.1f LUFS gain=%.1f dB cost=%.2f ns/sample\n", integrated,
+        gain, cost);
+  }
+
+  /* Add packet allocator usage */
+  if (player->allocator) {
+    g_string_append (str, "allocator:\n");
+    gst_raop_allocator_dump (GST_RAOP_ALLOCATOR (player->allocator), str);
+  }
+
+  /* Add per-element processing time */
+  if (player->tracer) {
+    g_string_append (str, "elements:\n");
+    gst_raop_tracer_dump (player->tracer, str);
+  }
+
+  return g_string_free (str, FALSE);
+}
+
+char *
+melo_airplay_player_get_stats (MeloAirplayPlayer *player)
+{
+  char *stats = NULL;
+
+  if (!player)
+    return NULL;
+
+  /* Statistics of current session */
+  g_mutex_lock (&player->mutex);
+  if (player->pipeline)
+    stats = melo_airplay_player_dump_stats (player);
+  g_mutex_unlock (&player->mutex);
+
+  return stats;
+}
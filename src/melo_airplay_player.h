@@ -52,6 +52,30 @@ typedef enum {
   MELO_AIRPLAY_TRANSPORT_UDP,
 } MeloAirplayTransport;
 
+/**
+ * MeloAirplayTiming:
+ * @options: first request of the session: first request received on
+ *     connection, or ANNOUNCE on a reused connection
+ * @announce: ANNOUNCE request received
+ * @announce_done: ANNOUNCE body parsed (AES key decrypted)
+ * @setup: SETUP request received
+ * @setup_done: SETUP handled (pipeline created)
+ * @record: RECORD request received
+ * @first_audio: first buffer received by the sink
+ *
+ * Monotonic timestamps (in us) of each step of an AirPlay session until the
+ * first audio buffer reaches the sink. A step not done is set to 0.
+ */
+typedef struct {
+  int64_t options;
+  int64_t announce;
+  int64_t announce_done;
+  int64_t setup;
+  int64_t setup_done;
+  int64_t record;
+  int64_t first_audio;
+} MeloAirplayTiming;
+
 typedef void (*MeloAirplayPlayerSettingsCb) (
     MeloAirplayPlayer *player, void *user_data);
 
@@ -68,6 +92,8 @@ bool melo_airplay_player_setup (MeloAirplayPlayer *player,
     unsigned int *control_port, unsigned int *timing_port,
     MeloAirplayCodec codec, const char *format, const unsigned char *key,
     size_t key_len, const unsigned char *iv, size_t iv_len);
+void melo_airplay_player_set_timing (
+    MeloAirplayPlayer *player, const MeloAirplayTiming *timing);
 bool melo_airplay_player_record (MeloAirplayPlayer *player, unsigned int seq);
 bool melo_airplay_player_flush (MeloAirplayPlayer *player, unsigned int seq);
 bool melo_airplay_player_teardown (MeloAirplayPlayer *player);
@@ -75,11 +101,18 @@ bool melo_airplay_player_teardown (MeloAirplayPlayer *player);
 bool melo_airplay_player_set_volume (MeloAirplayPlayer *player, double volume);
 bool melo_airplay_player_set_progress (MeloAirplayPlayer *player,
     unsigned int start, unsigned int cur, unsigned int end);
+bool melo_airplay_player_set_duration (
+    MeloAirplayPlayer *player, unsigned int duration);
+bool melo_airplay_player_set_paused (MeloAirplayPlayer *player, bool paused);
 void melo_airplay_player_take_tags (
     MeloAirplayPlayer *player, MeloTags *tags, bool reset);
 void melo_airplay_player_reset_cover (MeloAirplayPlayer *player);
 
 double melo_airplay_player_get_volume (MeloAirplayPlayer *player);
+bool melo_airplay_player_get_level (MeloAirplayPlayer *player,
+    unsigned int channel, float *peak, float *rms);
+
+char *melo_airplay_player_get_stats (MeloAirplayPlayer *player);
 
 G_END_DECLS
 
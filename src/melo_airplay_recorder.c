@@ -0,0 +1,348 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define MELO_LOG_TAG "airplay_recorder"
+#include <melo/melo_log.h>
+
+#include "melo_airplay_recorder.h"
+
+/* Polling period of writer thread (in us) */
+#define MELO_AIRPLAY_RECORDER_PERIOD 50000
+
+/* Ring size limits (in bytes) */
+#define MELO_AIRPLAY_RECORDER_MIN_SIZE (64 * 1024)
+#define MELO_AIRPLAY_RECORDER_MAX_SIZE (64 * 1024 * 1024)
+
+struct _MeloAirplayRecorder {
+  char *path;
+  GThread *thread;
+  int running;
+
+  /* Ring buffer: single producer (streaming thread), single consumer */
+  uint8_t *ring;
+  unsigned int size;
+  unsigned int head;
+  unsigned int tail;
+
+  /* Format, set once before first data */
+  unsigned int rate;
+  unsigned int channels;
+  unsigned int bits;
+  bool is_float;
+  int has_format;
+
+  /* Statistics */
+  unsigned int overruns;
+  uint64_t pushed;
+  uint64_t written;
+  int64_t push_time;
+  int64_t writer_time;
+};
+
+static inline void
+write_u16 (uint8_t *data, uint16_t value)
+{
+  value = GUINT16_TO_LE (value);
+  memcpy (data, &value, sizeof (value));
+}
+
+static inline void
+write_u32 (uint8_t *data, uint32_t value)
+{
+  value = GUINT32_TO_LE (value);
+  memcpy (data, &value, sizeof (value));
+}
+
+/**
+ * melo_airplay_wav_header:
+ * @header: a buffer of #MELO_AIRPLAY_WAV_HEADER_SIZE bytes
+ * @rate: the sample rate
+ * @channels: the channel count
+ * @bits: the sample size, in bits
+ * @is_float: set to %true for float samples
+ * @size: the data size, in bytes
+ *
+ * Fill a canonical WAV header.
+ */
+void
+melo_airplay_wav_header (uint8_t *header, unsigned int rate,
+    unsigned int channels, unsigned int bits, bool is_float, uint32_t size)
+{
+  unsigned int block_align = channels * bits / 8;
+
+  memcpy (header, "RIFF", 4);
+  write_u32 (header + 4, size + MELO_AIRPLAY_WAV_HEADER_SIZE - 8);
+  memcpy (header + 8, "WAVEfmt ", 8);
+  write_u32 (header + 16, 16);
+  write_u16 (header + 20, is_float ? 3 : 1);
+  write_u16 (header + 22, channels);
+  write_u32 (header + 24, rate);
+  write_u32 (header + 28, rate * block_align);
+  write_u16 (header + 32, block_align);
+  write_u16 (header + 34, bits);
+  memcpy (header + 36, "data", 4);
+  write_u32 (header + 40, size);
+}
+
+static FILE *
+melo_airplay_recorder_open (MeloAirplayRecorder *recorder)
+{
+  uint8_t header[MELO_AIRPLAY_WAV_HEADER_SIZE];
+  char *name, *filename;
+  GDateTime *date;
+  FILE *fp;
+
+  /* Generate file name from current date */
+  date = g_date_time_new_now_local ();
+  name = g_date_time_format (date, "airplay-%Y%m%d-%H%M%S.wav");
+  filename = g_build_filename (recorder->path, name, NULL);
+  g_date_time_unref (date);
+  g_free (name);
+
+  /* Create file */
+  fp = fopen (filename, "wb");
+  if (!fp) {
+    MELO_LOGE ("failed to create %s", filename);
+    g_free (filename);
+    return NULL;
+  }
+  MELO_LOGI ("recording to %s", filename);
+  g_free (filename);
+
+  /* Write header: sizes are updated when file is closed */
+  melo_airplay_wav_header (header, recorder->rate, recorder->channels,
+      recorder->bits, recorder->is_float, 0);
+  fwrite (header, 1, sizeof (header), fp);
+
+  return fp;
+}
+
+static void
+melo_airplay_recorder_close (MeloAirplayRecorder *recorder, FILE *fp)
+{
+  uint8_t header[MELO_AIRPLAY_WAV_HEADER_SIZE];
+  uint32_t size;
+
+  /* Update header with final size */
+  size = MIN (recorder->written, G_MAXUINT32 - MELO_AIRPLAY_WAV_HEADER_SIZE);
+  melo_airplay_wav_header (header, recorder->rate, recorder->channels,
+      recorder->bits, recorder->is_float, size);
+  if (!fseek (fp, 0, SEEK_SET))
+    fwrite (header, 1, sizeof (header), fp);
+  fclose (fp);
+}
+
+static gpointer
+melo_airplay_recorder_thread (gpointer user_data)
+{
+  MeloAirplayRecorder *recorder = user_data;
+  struct timespec ts;
+  bool failed = false;
+  FILE *fp = NULL;
+  bool running;
+
+  do {
+    unsigned int head, tail, offset, len;
+
+    /* Get data available: read running before to flush last data */
+    running = g_atomic_int_get (&recorder->running);
+    head = g_atomic_int_get (&recorder->head);
+    tail = recorder->tail;
+    if (head == tail) {
+      if (running)
+        g_usleep (MELO_AIRPLAY_RECORDER_PERIOD);
+      continue;
+    }
+
+    /* Open file on first data, drop data on failure */
+    if (!fp && (failed || !(fp = melo_airplay_recorder_open (recorder)))) {
+      g_atomic_int_set (&recorder->tail, head);
+      failed = true;
+      continue;
+    }
+
+    /* Write until end of ring, then from its start */
+    while (tail != head) {
+      offset = tail & (recorder->size - 1);
+      len = MIN (head - tail, recorder->size - offset);
+      if (fwrite (recorder->ring + offset, 1, len, fp) != len)
+        MELO_LOGW ("failed to write recorded data");
+      recorder->written += len;
+      tail += len;
+      g_atomic_int_set (&recorder->tail, tail);
+    }
+
+    /* Update CPU time used by writer */
+    if (!clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts))
+      recorder->writer_time = ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+  } while (running);
+
+  /* Finalize file */
+  if (fp)
+    melo_airplay_recorder_close (recorder, fp);
+
+  return NULL;
+}
+
+/**
+ * melo_airplay_recorder_new:
+ * @path: the directory where to save recordings
+ * @size: the size of the ring buffer, in bytes
+ *
+ * Create a new recorder: samples pushed with melo_airplay_recorder_push() are
+ * stored in a fixed-size ring buffer and written to a WAV file by a dedicated
+ * thread, so disk stalls never block the caller.
+ *
+ * Returns: (transfer full): a new #MeloAirplayRecorder.
+ */
+MeloAirplayRecorder *
+melo_airplay_recorder_new (const char *path, size_t size)
+{
+  MeloAirplayRecorder *recorder;
+
+  /* Allocate recorder */
+  recorder = g_slice_new0 (MeloAirplayRecorder);
+  if (!recorder)
+    return NULL;
+
+  /* Use a power of two size to wrap indexes */
+  size = CLAMP (
+      size, MELO_AIRPLAY_RECORDER_MIN_SIZE, MELO_AIRPLAY_RECORDER_MAX_SIZE);
+  recorder->size = 1U << (g_bit_storage (size - 1));
+  recorder->ring = g_malloc (recorder->size);
+  recorder->path = g_strdup (path && *path ? path : g_get_tmp_dir ());
+
+  /* Start writer thread */
+  recorder->running = true;
+  recorder->thread = g_thread_new (
+      "airplay_recorder", melo_airplay_recorder_thread, recorder);
+
+  return recorder;
+}
+
+/**
+ * melo_airplay_recorder_free:
+ * @recorder: the recorder
+ *
+ * Flush remaining data, finalize the current file and free the recorder. The
+ * caller must ensure melo_airplay_recorder_push() is not called anymore.
+ */
+void
+melo_airplay_recorder_free (MeloAirplayRecorder *recorder)
+{
+  if (!recorder)
+    return;
+
+  /* Stop writer thread */
+  g_atomic_int_set (&recorder->running, false);
+  g_thread_join (recorder->thread);
+
+  /* Free recorder */
+  g_free (recorder->path);
+  g_free (recorder->ring);
+  g_slice_free (MeloAirplayRecorder, recorder);
+}
+
+/**
+ * melo_airplay_recorder_set_format:
+ * @recorder: the recorder
+ * @rate: the sample rate
+ * @channels: the channel count
+ * @bits: the sample size, in bits
+ * @is_float: set to %true for float samples
+ *
+ * Set format of interleaved samples to record. Only the first format is kept
+ * since it is written in the file header.
+ */
+void
+melo_airplay_recorder_set_format (MeloAirplayRecorder *recorder,
+    unsigned int rate, unsigned int channels, unsigned int bits,
+    bool is_float)
+{
+  if (g_atomic_int_get (&recorder->has_format))
+    return;
+
+  /* Publish format before first data */
+  recorder->rate = rate;
+  recorder->channels = channels;
+  recorder->bits = bits;
+  recorder->is_float = is_float;
+  g_atomic_int_set (&recorder->has_format, true);
+}
+
+/**
+ * melo_airplay_recorder_push:
+ * @recorder: the recorder
+ * @data: the samples
+ * @size: the size of @data, in bytes
+ *
+ * Copy samples to the ring buffer. This function never blocks: when the ring
+ * buffer is full, samples are dropped and an overrun is counted.
+ */
+void
+melo_airplay_recorder_push (
+    MeloAirplayRecorder *recorder, const void *data, size_t size)
+{
+  unsigned int head, offset, len;
+  int64_t start;
+
+  if (!g_atomic_int_get (&recorder->has_format))
+    return;
+
+  start = g_get_monotonic_time ();
+
+  /* Drop whole buffer to keep frames aligned */
+  head = recorder->head;
+  if (size > recorder->size - (head - g_atomic_int_get (&recorder->tail))) {
+    g_atomic_int_inc (&recorder->overruns);
+    return;
+  }
+
+  /* Copy until end of ring, then from its start */
+  offset = head & (recorder->size - 1);
+  len = MIN (size, recorder->size - offset);
+  memcpy (recorder->ring + offset, data, len);
+  memcpy (recorder->ring, (const uint8_t *) data + len, size - len);
+
+  /* Publish data */
+  g_atomic_int_set (&recorder->head, head + size);
+  recorder->pushed += size;
+  recorder->push_time += g_get_monotonic_time () - start;
+}
+
+/**
+ * melo_airplay_recorder_dump:
+ * @recorder: the recorder
+ * @str: the string to append to
+ *
+ * Append recorder statistics, with its memory and CPU costs, to @str.
+ */
+void
+melo_airplay_recorder_dump (MeloAirplayRecorder *recorder, GString *str)
+{
+  g_string_append_printf (str,
+      "record: ring=%u KiB pushed=%" G_GUINT64_FORMAT
+      " written=%" G_GUINT64_FORMAT " overruns=%u push=%" G_GINT64_FORMAT
+      " us writer=%" G_GINT64_FORMAT " us\n",
+      recorder->size / 1024, recorder->pushed, recorder->written,
+      g_atomic_int_get (&recorder->overruns), recorder->push_time,
+      recorder->writer_time);
+}
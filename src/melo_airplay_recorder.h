@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#ifndef _MELO_AIRPLAY_RECORDER_H_
+#define _MELO_AIRPLAY_RECORDER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define MELO_AIRPLAY_WAV_HEADER_SIZE 44
+
+typedef struct _MeloAirplayRecorder MeloAirplayRecorder;
+
+MeloAirplayRecorder *melo_airplay_recorder_new (const char *path, size_t size);
+void melo_airplay_recorder_free (MeloAirplayRecorder *recorder);
+
+void melo_airplay_recorder_set_format (MeloAirplayRecorder *recorder,
+    unsigned int rate, unsigned int channels, unsigned int bits,
+    bool is_float);
+void melo_airplay_recorder_push (
+    MeloAirplayRecorder *recorder, const void *data, size_t size);
+
+void melo_airplay_recorder_dump (MeloAirplayRecorder *recorder, GString *str);
+
+void melo_airplay_wav_header (uint8_t *header, unsigned int rate,
+    unsigned int channels, unsigned int bits, bool is_float, uint32_t size);
+
+G_END_DECLS
+
+#endif /* !_MELO_AIRPLAY_RECORDER_H_ */
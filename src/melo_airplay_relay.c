@@ -0,0 +1,830 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <gio/gio.h>
+
+#include <openssl/aes.h>
+#include <openssl/bio.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+
+#define MELO_LOG_TAG "airplay_relay"
+#include <melo/melo_log.h>
+
+#include "melo_airplay_pkey.h"
+#include "melo_airplay_relay.h"
+
+#define MELO_AIRPLAY_RELAY_DEFAULT_PORT 5000
+#define MELO_AIRPLAY_RELAY_MAX_TARGETS 16
+
+/* Count of packets kept per target for retransmission (power of two) */
+#define MELO_AIRPLAY_RELAY_RTX_SIZE 256
+#define MELO_AIRPLAY_RELAY_PACKET_SIZE 1536
+
+/* RTSP timeout (in s) and control polling period (in ms) */
+#define MELO_AIRPLAY_RELAY_TIMEOUT 5
+#define MELO_AIRPLAY_RELAY_POLL_PERIOD 200
+
+/* Seconds between 1900 (NTP) and 1970 (Unix) */
+#define MELO_AIRPLAY_RELAY_NTP_OFFSET G_GUINT64_CONSTANT (2208988800)
+
+typedef enum {
+  MELO_AIRPLAY_RELAY_STATE_CONNECTING = 0,
+  MELO_AIRPLAY_RELAY_STATE_READY,
+  MELO_AIRPLAY_RELAY_STATE_FAILED,
+} MeloAirplayRelayState;
+
+static const char *melo_airplay_relay_state_names[] = {
+    "connecting",
+    "ready",
+    "failed",
+};
+
+typedef struct {
+  uint16_t seq;
+  uint16_t len;
+  uint8_t data[MELO_AIRPLAY_RELAY_PACKET_SIZE];
+} MeloAirplayRelayPacket;
+
+typedef struct {
+  MeloAirplayRelay *relay;
+  GSocketConnectable *addr;
+  char *name;
+  GThread *thread;
+  int state;
+
+  /* RTSP client */
+  GSocketConnection *conn;
+  char *url;
+  char *session;
+  unsigned int cseq;
+
+  /* Local control and timing sockets */
+  GSocket *sock;
+  GSocket *timing;
+  GSocketAddress *data_addr;
+  GSocketAddress *ctrl_addr;
+
+  /* Encryption */
+  AES_KEY key;
+  uint8_t aes_key[16];
+  uint8_t iv[16];
+
+  /* Stream and retransmission buffer, protected by mutex */
+  GMutex mutex;
+  MeloAirplayRelayPacket *packets;
+  uint16_t seq;
+  uint32_t ssrc;
+  bool first;
+
+  /* Statistics */
+  unsigned int sent;
+  unsigned int retransmitted;
+  unsigned int errors;
+} MeloAirplayRelayTarget;
+
+struct _MeloAirplayRelay {
+  char *fmtp;
+  unsigned int samplerate;
+  RSA *pkey;
+  GCancellable *cancellable;
+
+  /* Last RTP time received, set once first frame is pushed */
+  unsigned int rtptime;
+  int started;
+
+  /* Local render anchor: RTP time played at monotonic time */
+  GMutex lock;
+  uint32_t render_rtptime;
+  gint64 render_time;
+
+  MeloAirplayRelayTarget targets[MELO_AIRPLAY_RELAY_MAX_TARGETS];
+  unsigned int count;
+};
+
+static inline void
+put_be16 (uint8_t *data, uint16_t value)
+{
+  value = GUINT16_TO_BE (value);
+  memcpy (data, &value, sizeof (value));
+}
+
+static inline void
+put_be32 (uint8_t *data, uint32_t value)
+{
+  value = GUINT32_TO_BE (value);
+  memcpy (data, &value, sizeof (value));
+}
+
+static inline void
+put_be64 (uint8_t *data, uint64_t value)
+{
+  value = GUINT64_TO_BE (value);
+  memcpy (data, &value, sizeof (value));
+}
+
+static inline uint16_t
+get_be16 (const uint8_t *data)
+{
+  return data[0] << 8 | data[1];
+}
+
+static uint64_t
+melo_airplay_relay_ntp_now (void)
+{
+  gint64 now = g_get_real_time ();
+  uint64_t sec, frac;
+
+  sec = now / G_USEC_PER_SEC + MELO_AIRPLAY_RELAY_NTP_OFFSET;
+  frac = ((uint64_t) (now % G_USEC_PER_SEC) << 32) / G_USEC_PER_SEC;
+
+  return sec << 32 | frac;
+}
+
+static char *
+get_header (const char *response, const char *name)
+{
+  size_t len = strlen (name);
+  const char *line = response;
+
+  /* Find header line, after status line */
+  while ((line = strstr (line, "\r\n"))) {
+    const char *end;
+
+    line += 2;
+    if (g_ascii_strncasecmp (line, name, len) || line[len] != ':')
+      continue;
+
+    /* Get value */
+    line += len + 1;
+    while (*line == ' ')
+      line++;
+    end = strstr (line, "\r\n");
+    return g_strndup (line, end ? (size_t) (end - line) : strlen (line));
+  }
+
+  return NULL;
+}
+
+static unsigned int
+get_port (const char *transport, const char *name)
+{
+  const char *p = strstr (transport, name);
+
+  return p ? strtoul (p + strlen (name), NULL, 10) : 0;
+}
+
+static int
+target_request (MeloAirplayRelayTarget *target, const char *method,
+    const char *headers, const char *sdp, GCancellable *cancellable,
+    char **response)
+{
+  GInputStream *in;
+  GOutputStream *out;
+  char buf[2048], *body, *length;
+  size_t len = 0, left;
+  int code = -1;
+  GString *req;
+
+  /* Generate request */
+  req = g_string_new (NULL);
+  g_string_append_printf (req,
+      "%s %s RTSP/1.0\r\nCSeq: %u\r\nUser-Agent: Melo/1.0\r\n", method,
+      target->url, ++target->cseq);
+  if (target->session)
+    g_string_append_printf (req, "Session: %s\r\n", target->session);
+  if (headers)
+    g_string_append (req, headers);
+  if (sdp)
+    g_string_append_printf (req,
+        "Content-Type: application/sdp\r\nContent-Length: %zu\r\n",
+        strlen (sdp));
+  g_string_append (req, "\r\n");
+  if (sdp)
+    g_string_append (req, sdp);
+
+  /* Send request */
+  out = g_io_stream_get_output_stream (G_IO_STREAM (target->conn));
+  if (!g_output_stream_write_all (
+          out, req->str, req->len, NULL, cancellable, NULL))
+    goto end;
+
+  /* Read response header */
+  in = g_io_stream_get_input_stream (G_IO_STREAM (target->conn));
+  while (len < sizeof (buf) - 1) {
+    gssize n;
+
+    n = g_input_stream_read (
+        in, buf + len, sizeof (buf) - 1 - len, cancellable, NULL);
+    if (n <= 0)
+      goto end;
+    len += n;
+    buf[len] = '\0';
+
+    if (strstr (buf, "\r\n\r\n"))
+      break;
+  }
+
+  /* Header must be complete */
+  body = strstr (buf, "\r\n\r\n");
+  if (!body)
+    goto end;
+  body += 4;
+
+  /* Discard body, not to parse it as next response */
+  length = get_header (buf, "Content-Length");
+  left = length ? strtoul (length, NULL, 10) : 0;
+  g_free (length);
+  left -= MIN (left, len - (body - buf));
+  while (left) {
+    char discard[512];
+    gssize n;
+
+    n = g_input_stream_read (
+        in, discard, MIN (left, sizeof (discard)), cancellable, NULL);
+    if (n <= 0)
+      goto end;
+    left -= n;
+  }
+  *body = '\0';
+
+  /* Parse status */
+  if (sscanf (buf, "RTSP/1.0 %d", &code) != 1)
+    code = -1;
+  if (response)
+    *response = g_strdup (buf);
+
+end:
+  g_string_free (req, TRUE);
+  return code;
+}
+
+static GSocket *
+target_bind (GSocketFamily family, unsigned int *port)
+{
+  GSocketAddress *addr;
+  GInetAddress *any;
+  GSocket *sock;
+
+  /* Create UDP socket */
+  sock = g_socket_new (
+      family, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, NULL);
+  if (!sock)
+    return NULL;
+
+  /* Bind on any free port */
+  any = g_inet_address_new_any (family);
+  addr = g_inet_socket_address_new (any, 0);
+  g_object_unref (any);
+  if (!g_socket_bind (sock, addr, TRUE, NULL)) {
+    g_object_unref (addr);
+    g_object_unref (sock);
+    return NULL;
+  }
+  g_object_unref (addr);
+
+  /* Get port */
+  addr = g_socket_get_local_address (sock, NULL);
+  *port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (addr));
+  g_object_unref (addr);
+
+  /* Never block the streaming thread */
+  g_socket_set_blocking (sock, FALSE);
+
+  return sock;
+}
+
+static bool
+target_connect (MeloAirplayRelayTarget *target)
+{
+  MeloAirplayRelay *relay = target->relay;
+  unsigned int ctrl_port, timing_port, server_port, control_port;
+  GSocketAddress *local, *remote;
+  GInetAddress *remote_addr;
+  unsigned char rsa[512];
+  char *local_ip, *remote_ip, *key64, *iv64, *sdp, *headers;
+  char *response = NULL, *transport;
+  GSocketClient *client;
+  GError *error = NULL;
+  bool ret = false;
+  uint32_t rtptime;
+  int len;
+
+  /* Connect to receiver */
+  client = g_socket_client_new ();
+  g_socket_client_set_timeout (client, MELO_AIRPLAY_RELAY_TIMEOUT);
+  target->conn = g_socket_client_connect (
+      client, target->addr, relay->cancellable, &error);
+  g_object_unref (client);
+  if (!target->conn) {
+    MELO_LOGW ("failed to connect to %s: %s", target->name, error->message);
+    g_error_free (error);
+    return false;
+  }
+
+  /* Get addresses */
+  local = g_socket_connection_get_local_address (target->conn, NULL);
+  remote = g_socket_connection_get_remote_address (target->conn, NULL);
+  if (!local || !remote)
+    goto end;
+  remote_addr =
+      g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (remote));
+  local_ip = g_inet_address_to_string (
+      g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (local)));
+  remote_ip = g_inet_address_to_string (remote_addr);
+
+  /* Create control and timing sockets */
+  target->sock =
+      target_bind (g_inet_address_get_family (remote_addr), &ctrl_port);
+  target->timing =
+      target_bind (g_inet_address_get_family (remote_addr), &timing_port);
+  if (!target->sock || !target->timing)
+    goto free_ip;
+
+  /* Generate stream keys and identifiers */
+  RAND_bytes (target->aes_key, sizeof (target->aes_key));
+  RAND_bytes (target->iv, sizeof (target->iv));
+  RAND_bytes ((unsigned char *) &target->ssrc, sizeof (target->ssrc));
+  RAND_bytes ((unsigned char *) &target->seq, sizeof (target->seq));
+  AES_set_encrypt_key (target->aes_key, 128, &target->key);
+  target->first = true;
+
+  /* Encrypt AES key for receiver */
+  len = RSA_public_encrypt (sizeof (target->aes_key), target->aes_key, rsa,
+      relay->pkey, RSA_PKCS1_OAEP_PADDING);
+  if (len <= 0)
+    goto free_ip;
+  key64 = g_base64_encode (rsa, len);
+  iv64 = g_base64_encode (target->iv, sizeof (target->iv));
+  g_strdelimit (key64, "=", '\0');
+  g_strdelimit (iv64, "=", '\0');
+
+  /* Announce stream */
+  target->url = g_strdup_printf ("rtsp://%s/%u", local_ip, target->ssrc);
+  sdp = g_strdup_printf ("v=0\r\n"
+                         "o=iTunes %u 0 IN IP4 %s\r\n"
+                         "s=iTunes\r\n"
+                         "c=IN IP4 %s\r\n"
+                         "t=0 0\r\n"
+                         "m=audio 0 RTP/AVP 96\r\n"
+                         "a=rtpmap:96 AppleLossless\r\n"
+                         "a=fmtp:96 %s\r\n"
+                         "a=rsaaeskey:%s\r\n"
+                         "a=aesiv:%s\r\n",
+      target->ssrc, local_ip, remote_ip, relay->fmtp, key64, iv64);
+  len = target_request (
+      target, "ANNOUNCE", NULL, sdp, relay->cancellable, NULL);
+  g_free (sdp);
+  g_free (key64);
+  g_free (iv64);
+  if (len != 200) {
+    MELO_LOGW ("ANNOUNCE rejected by %s: %d", target->name, len);
+    goto free_ip;
+  }
+
+  /* Setup transport */
+  headers = g_strdup_printf (
+      "Transport: RTP/AVP/UDP;unicast;interleaved=0-1;mode=record;"
+      "control_port=%u;timing_port=%u\r\n",
+      ctrl_port, timing_port);
+  len = target_request (
+      target, "SETUP", headers, NULL, relay->cancellable, &response);
+  g_free (headers);
+  if (len != 200) {
+    MELO_LOGW ("SETUP rejected by %s: %d", target->name, len);
+    goto free_ip;
+  }
+
+  /* Get session and receiver ports */
+  target->session = get_header (response, "Session");
+  if (target->session)
+    g_strdelimit (target->session, ";", '\0');
+  transport = get_header (response, "Transport");
+  server_port = transport ? get_port (transport, "server_port=") : 0;
+  control_port = transport ? get_port (transport, "control_port=") : 0;
+  g_free (transport);
+  if (!server_port)
+    goto free_ip;
+  target->data_addr = g_inet_socket_address_new (remote_addr, server_port);
+  target->ctrl_addr = g_inet_socket_address_new (
+      remote_addr, control_port ? control_port : server_port + 1);
+
+  /* Wait for first frame to start at its RTP time */
+  while (!g_atomic_int_get (&relay->started)) {
+    if (g_cancellable_is_cancelled (relay->cancellable))
+      goto free_ip;
+    g_usleep (MELO_AIRPLAY_RELAY_POLL_PERIOD * 1000);
+  }
+
+  /* Start streaming */
+  rtptime = g_atomic_int_get (&relay->rtptime);
+  headers = g_strdup_printf (
+      "Range: npt=0-\r\nRTP-Info: seq=%u;rtptime=%u\r\n", target->seq, rtptime);
+  len = target_request (
+      target, "RECORD", headers, NULL, relay->cancellable, NULL);
+  g_free (headers);
+  if (len != 200) {
+    MELO_LOGW ("RECORD rejected by %s: %d", target->name, len);
+    goto free_ip;
+  }
+
+  MELO_LOGI ("relay to %s started", target->name);
+  ret = true;
+
+free_ip:
+  g_free (local_ip);
+  g_free (remote_ip);
+end:
+  g_free (response);
+  if (local)
+    g_object_unref (local);
+  if (remote)
+    g_object_unref (remote);
+
+  return ret;
+}
+
+static void
+target_send_sync (MeloAirplayRelayTarget *target, bool first)
+{
+  MeloAirplayRelay *relay = target->relay;
+  uint32_t rtptime;
+  gint64 time;
+  uint8_t buf[20];
+
+  /* Get RTP time played locally now, from render anchor */
+  g_mutex_lock (&relay->lock);
+  rtptime = relay->render_rtptime;
+  time = relay->render_time;
+  g_mutex_unlock (&relay->lock);
+  if (time)
+    rtptime += (g_get_monotonic_time () - time) * relay->samplerate /
+               G_USEC_PER_SEC;
+  else
+    rtptime = g_atomic_int_get (&relay->rtptime) - 2 * relay->samplerate;
+
+  /* Receivers play RTP time now, packets are sent 2 seconds ahead */
+  buf[0] = first ? 0x90 : 0x80;
+  buf[1] = 0xd4;
+  put_be16 (buf + 2, 7);
+  put_be32 (buf + 4, rtptime);
+  put_be64 (buf + 8, melo_airplay_relay_ntp_now ());
+  put_be32 (buf + 16, rtptime + 2 * relay->samplerate);
+
+  g_socket_send_to (
+      target->sock, target->ctrl_addr, (gchar *) buf, sizeof (buf), NULL, NULL);
+}
+
+static void
+target_retransmit (
+    MeloAirplayRelayTarget *target, uint16_t seq, uint16_t count)
+{
+  uint8_t buf[4 + MELO_AIRPLAY_RELAY_PACKET_SIZE];
+  MeloAirplayRelayPacket *packet;
+  unsigned int i, len;
+
+  count = MIN (count, MELO_AIRPLAY_RELAY_RTX_SIZE);
+  for (i = 0; i < count; i++, seq++) {
+    /* Get packet from retransmission buffer */
+    g_mutex_lock (&target->mutex);
+    packet = &target->packets[seq % MELO_AIRPLAY_RELAY_RTX_SIZE];
+    if (packet->seq != seq || !packet->len) {
+      g_mutex_unlock (&target->mutex);
+      continue;
+    }
+    buf[0] = 0x80;
+    buf[1] = 0xd6;
+    put_be16 (buf + 2, 1);
+    memcpy (buf + 4, packet->data, packet->len);
+    len = packet->len + 4;
+    g_mutex_unlock (&target->mutex);
+
+    /* Send retransmit reply */
+    g_socket_send_to (
+        target->sock, target->ctrl_addr, (gchar *) buf, len, NULL, NULL);
+    target->retransmitted++;
+  }
+}
+
+static void
+target_reply_timing (MeloAirplayRelayTarget *target)
+{
+  GSocketAddress *addr = NULL;
+  uint8_t buf[32];
+  uint64_t now;
+  gssize len;
+
+  /* Get timing request */
+  len = g_socket_receive_from (
+      target->timing, &addr, (gchar *) buf, sizeof (buf), NULL, NULL);
+  if (len < (gssize) sizeof (buf) || (buf[1] & 0x7f) != 0x52)
+    goto end;
+
+  /* Reply with request send time as reference */
+  now = melo_airplay_relay_ntp_now ();
+  buf[0] = 0x80;
+  buf[1] = 0xd3;
+  memcpy (buf + 8, buf + 24, 8);
+  put_be64 (buf + 16, now);
+  put_be64 (buf + 24, now);
+  g_socket_send_to (target->timing, addr, (gchar *) buf, len, NULL, NULL);
+
+end:
+  if (addr)
+    g_object_unref (addr);
+}
+
+static gpointer
+target_thread (gpointer user_data)
+{
+  MeloAirplayRelayTarget *target = user_data;
+  MeloAirplayRelay *relay = target->relay;
+  gint64 next_sync = 0;
+  GPollFD fds[2];
+
+  /* Setup stream on receiver */
+  if (!target_connect (target)) {
+    g_atomic_int_set (&target->state, MELO_AIRPLAY_RELAY_STATE_FAILED);
+    return NULL;
+  }
+  g_atomic_int_set (&target->state, MELO_AIRPLAY_RELAY_STATE_READY);
+
+  /* Handle control and timing requests */
+  fds[0].fd = g_socket_get_fd (target->sock);
+  fds[0].events = G_IO_IN;
+  fds[1].fd = g_socket_get_fd (target->timing);
+  fds[1].events = G_IO_IN;
+  while (!g_cancellable_is_cancelled (relay->cancellable)) {
+    gint64 now = g_get_monotonic_time ();
+
+    /* Send sync packet every second */
+    if (now >= next_sync) {
+      target_send_sync (target, !next_sync);
+      next_sync = now + G_USEC_PER_SEC;
+    }
+
+    if (g_poll (fds, 2, MELO_AIRPLAY_RELAY_POLL_PERIOD) <= 0)
+      continue;
+
+    /* Retransmit request */
+    if (fds[0].revents & G_IO_IN) {
+      uint8_t buf[64];
+      gssize len;
+
+      len = g_socket_receive (
+          target->sock, (gchar *) buf, sizeof (buf), NULL, NULL);
+      if (len >= 8 && (buf[1] & 0x7f) == 0x55)
+        target_retransmit (target, get_be16 (buf + 4), get_be16 (buf + 6));
+    }
+
+    /* Timing request */
+    if (fds[1].revents & G_IO_IN)
+      target_reply_timing (target);
+  }
+
+  /* Stop stream on receiver */
+  g_socket_set_timeout (g_socket_connection_get_socket (target->conn), 1);
+  target_request (target, "TEARDOWN", NULL, NULL, NULL, NULL);
+
+  return NULL;
+}
+
+/**
+ * melo_airplay_relay_new:
+ * @targets: a comma separated list of receivers, as "host[:port]"
+ * @fmtp: the ALAC format parameters of the stream
+ * @samplerate: the sample rate of the stream
+ *
+ * Create a new relay to forward a decrypted ALAC stream to other RAOP
+ * receivers. A thread is started for each receiver to setup the stream over
+ * RTSP, send sync packets and handle retransmit and timing requests. Each
+ * receiver gets its own AES key and retransmission buffer.
+ *
+ * Returns: (transfer full): a new #MeloAirplayRelay or %NULL.
+ */
+MeloAirplayRelay *
+melo_airplay_relay_new (
+    const char *targets, const char *fmtp, unsigned int samplerate)
+{
+  MeloAirplayRelay *relay;
+  char **list;
+  BIO *temp_bio;
+  unsigned int i;
+
+  if (!targets || !*targets || !fmtp)
+    return NULL;
+
+  /* Allocate relay */
+  relay = g_slice_new0 (MeloAirplayRelay);
+  if (!relay)
+    return NULL;
+  relay->fmtp = g_strdup (fmtp);
+  relay->samplerate = samplerate;
+  relay->cancellable = g_cancellable_new ();
+  g_mutex_init (&relay->lock);
+
+  /* Load RSA key: public part is used to encrypt AES keys */
+  temp_bio = BIO_new_mem_buf (AIRPORT_PRIVATE_KEY, -1);
+  relay->pkey = PEM_read_bio_RSAPrivateKey (temp_bio, NULL, NULL, NULL);
+  BIO_free (temp_bio);
+  if (!relay->pkey) {
+    melo_airplay_relay_free (relay);
+    return NULL;
+  }
+
+  /* Create targets */
+  list = g_strsplit (targets, ",", -1);
+  for (i = 0; list[i] && relay->count < MELO_AIRPLAY_RELAY_MAX_TARGETS; i++) {
+    MeloAirplayRelayTarget *target = &relay->targets[relay->count];
+    char *name = g_strstrip (list[i]);
+
+    if (!*name)
+      continue;
+
+    target->addr =
+        g_network_address_parse (name, MELO_AIRPLAY_RELAY_DEFAULT_PORT, NULL);
+    if (!target->addr) {
+      MELO_LOGW ("invalid relay target: %s", name);
+      continue;
+    }
+    target->relay = relay;
+    target->name = g_strdup (name);
+    target->packets =
+        g_new0 (MeloAirplayRelayPacket, MELO_AIRPLAY_RELAY_RTX_SIZE);
+    g_mutex_init (&target->mutex);
+    target->thread = g_thread_new ("airplay_relay", target_thread, target);
+    relay->count++;
+  }
+  g_strfreev (list);
+
+  return relay;
+}
+
+/**
+ * melo_airplay_relay_free:
+ * @relay: the relay
+ *
+ * Stop streams on all receivers and free the relay. The caller must ensure
+ * melo_airplay_relay_push() is not called anymore.
+ */
+void
+melo_airplay_relay_free (MeloAirplayRelay *relay)
+{
+  unsigned int i;
+
+  if (!relay)
+    return;
+
+  /* Stop target threads */
+  g_cancellable_cancel (relay->cancellable);
+  for (i = 0; i < relay->count; i++) {
+    MeloAirplayRelayTarget *target = &relay->targets[i];
+
+    g_thread_join (target->thread);
+    if (target->conn)
+      g_object_unref (target->conn);
+    if (target->sock)
+      g_object_unref (target->sock);
+    if (target->timing)
+      g_object_unref (target->timing);
+    if (target->data_addr)
+      g_object_unref (target->data_addr);
+    if (target->ctrl_addr)
+      g_object_unref (target->ctrl_addr);
+    g_object_unref (target->addr);
+    g_mutex_clear (&target->mutex);
+    g_free (target->packets);
+    g_free (target->session);
+    g_free (target->url);
+    g_free (target->name);
+  }
+
+  /* Free relay */
+  if (relay->pkey)
+    RSA_free (relay->pkey);
+  g_object_unref (relay->cancellable);
+  g_mutex_clear (&relay->lock);
+  g_free (relay->fmtp);
+  g_slice_free (MeloAirplayRelay, relay);
+}
+
+/**
+ * melo_airplay_relay_push:
+ * @relay: the relay
+ * @rtptime: the RTP time of the frame
+ * @data: the decrypted ALAC frame
+ * @size: the size of @data
+ *
+ * Encrypt and send an ALAC frame to all ready receivers. This function never
+ * blocks on network.
+ */
+void
+melo_airplay_relay_push (MeloAirplayRelay *relay, uint32_t rtptime,
+    const uint8_t *data, size_t size)
+{
+  unsigned int i;
+
+  g_atomic_int_set (&relay->rtptime, rtptime);
+  g_atomic_int_set (&relay->started, 1);
+  if (size > MELO_AIRPLAY_RELAY_PACKET_SIZE - 12)
+    return;
+
+  for (i = 0; i < relay->count; i++) {
+    MeloAirplayRelayTarget *target = &relay->targets[i];
+    MeloAirplayRelayPacket *packet;
+    size_t aes_len;
+    uint8_t iv[16];
+    uint8_t *p;
+
+    if (g_atomic_int_get (&target->state) != MELO_AIRPLAY_RELAY_STATE_READY)
+      continue;
+
+    /* Build RTP packet in retransmission buffer */
+    g_mutex_lock (&target->mutex);
+    packet = &target->packets[target->seq % MELO_AIRPLAY_RELAY_RTX_SIZE];
+    p = packet->data;
+    p[0] = 0x80;
+    p[1] = target->first ? 0xe0 : 0x60;
+    put_be16 (p + 2, target->seq);
+    put_be32 (p + 4, rtptime);
+    put_be32 (p + 8, target->ssrc);
+    target->first = false;
+
+    /* Encrypt full blocks with receiver key */
+    aes_len = size & ~0xf;
+    memcpy (iv, target->iv, sizeof (iv));
+    AES_cbc_encrypt (data, p + 12, aes_len, &target->key, iv, AES_ENCRYPT);
+    memcpy (p + 12 + aes_len, data + aes_len, size - aes_len);
+    packet->seq = target->seq++;
+    packet->len = size + 12;
+
+    /* Send packet */
+    if (g_socket_send_to (target->sock, target->data_addr, (gchar *) p,
+            packet->len, NULL, NULL) < 0)
+      target->errors++;
+    else
+      target->sent++;
+    g_mutex_unlock (&target->mutex);
+  }
+}
+
+/**
+ * melo_airplay_relay_set_render:
+ * @relay: the relay
+ * @rtptime: the RTP time of the frame rendered locally
+ * @time: the monotonic time at which @rtptime is rendered (in us)
+ *
+ * Update the local render anchor used by sync packets, so receivers play the
+ * same frame as the local output at the same time. Frames are pushed from the
+ * depayloader, ahead of the local output, which is fine since receivers buffer
+ * them until their RTP time is reached.
+ */
+void
+melo_airplay_relay_set_render (
+    MeloAirplayRelay *relay, uint32_t rtptime, gint64 time)
+{
+  g_mutex_lock (&relay->lock);
+  relay->render_rtptime = rtptime;
+  relay->render_time = time;
+  g_mutex_unlock (&relay->lock);
+}
+
+/**
+ * melo_airplay_relay_dump:
+ * @relay: the relay
+ * @str: the string to append to
+ *
+ * Append relay statistics of each receiver to @str.
+ */
+void
+melo_airplay_relay_dump (MeloAirplayRelay *relay, GString *str)
+{
+  unsigned int i;
+
+  for (i = 0; i < relay->count; i++) {
+    MeloAirplayRelayTarget *target = &relay->targets[i];
+
+    g_string_append_printf (str,
+        "relay %s: %s sent=%u retransmitted=%u errors=%u\n", target->name,
+        melo_airplay_relay_state_names[g_atomic_int_get (&target->state)],
+        target->sent, target->retransmitted, target->errors);
+  }
+}
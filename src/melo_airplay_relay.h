@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#ifndef _MELO_AIRPLAY_RELAY_H_
+#define _MELO_AIRPLAY_RELAY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _MeloAirplayRelay MeloAirplayRelay;
+
+MeloAirplayRelay *melo_airplay_relay_new (
+    const char *targets, const char *fmtp, unsigned int samplerate);
+void melo_airplay_relay_free (MeloAirplayRelay *relay);
+
+void melo_airplay_relay_push (MeloAirplayRelay *relay, uint32_t rtptime,
+    const uint8_t *data, size_t size);
+void melo_airplay_relay_set_render (
+    MeloAirplayRelay *relay, uint32_t rtptime, gint64 time);
+
+void melo_airplay_relay_dump (MeloAirplayRelay *relay, GString *str);
+
+G_END_DECLS
+
+#endif /* !_MELO_AIRPLAY_RELAY_H_ */
@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MELO_LOG_TAG "airplay_rt"
+#include <melo/melo_log.h>
+
+#include "melo_airplay_rt.h"
+
+/**
+ * melo_airplay_rt_init:
+ * @rt: the real-time configuration
+ *
+ * Initialize a real-time configuration, disabled.
+ */
+void
+melo_airplay_rt_init (MeloAirplayRt *rt)
+{
+  memset (rt, 0, sizeof (*rt));
+  rt->policy = SCHED_OTHER;
+  g_mutex_init (&rt->mutex);
+}
+
+/**
+ * melo_airplay_rt_clear:
+ * @rt: the real-time configuration
+ *
+ * Release resources of a real-time configuration.
+ */
+void
+melo_airplay_rt_clear (MeloAirplayRt *rt)
+{
+  g_mutex_clear (&rt->mutex);
+}
+
+/**
+ * melo_airplay_rt_setup:
+ * @rt: the real-time configuration
+ * @policy: the scheduling policy: "fifo", "rr" or "other"
+ * @priority: the base real-time priority
+ * @cpus: a comma separated list of CPUs to run on, or %NULL for all
+ *
+ * Set the configuration of a new session, to use with
+ * melo_airplay_rt_apply() and melo_airplay_rt_restore().
+ *
+ * Returns: %true if threads should be configured, %false otherwise.
+ */
+bool
+melo_airplay_rt_setup (MeloAirplayRt *rt, const char *policy,
+    unsigned int priority, const char *cpus)
+{
+  g_mutex_lock (&rt->mutex);
+  rt->count = 0;
+  g_mutex_unlock (&rt->mutex);
+
+  /* Get scheduling policy */
+  if (policy && !g_ascii_strcasecmp (policy, "fifo"))
+    rt->policy = SCHED_FIFO;
+  else if (policy && !g_ascii_strcasecmp (policy, "rr"))
+    rt->policy = SCHED_RR;
+  else
+    rt->policy = SCHED_OTHER;
+  rt->priority = CLAMP ((int) priority, sched_get_priority_min (rt->policy),
+      sched_get_priority_max (rt->policy));
+
+  /* Parse CPU list */
+  rt->cpus = 0;
+  if (cpus) {
+    char **list = g_strsplit (cpus, ",", -1);
+    unsigned int i;
+
+    for (i = 0; list[i]; i++) {
+      char *end;
+      guint64 cpu = g_ascii_strtoull (g_strstrip (list[i]), &end, 10);
+
+      if (end != list[i] && cpu < 64)
+        rt->cpus |= G_GUINT64_CONSTANT (1) << cpu;
+    }
+    g_strfreev (list);
+  }
+
+  return rt->policy != SCHED_OTHER || rt->cpus;
+}
+
+/**
+ * melo_airplay_rt_apply:
+ * @rt: the real-time configuration
+ * @name: the name of the thread, for statistics
+ * @offset: the offset to add to base priority
+ *
+ * Apply the scheduling policy, priority and CPU affinity to the calling
+ * thread, and save the effective policy.
+ */
+void
+melo_airplay_rt_apply (MeloAirplayRt *rt, const char *name, int offset)
+{
+  pthread_t thread = pthread_self ();
+  struct sched_param param = {0};
+  int policy, error = 0;
+
+  /* Set CPU affinity */
+  if (rt->cpus) {
+    cpu_set_t set;
+    unsigned int i;
+
+    CPU_ZERO (&set);
+    for (i = 0; i < 64; i++)
+      if (rt->cpus & (G_GUINT64_CONSTANT (1) << i))
+        CPU_SET (i, &set);
+    error = pthread_setaffinity_np (thread, sizeof (set), &set);
+  }
+
+  /* Set scheduling policy */
+  if (rt->policy != SCHED_OTHER) {
+    int ret;
+
+    param.sched_priority =
+        MIN (rt->priority + offset, sched_get_priority_max (rt->policy));
+    ret = pthread_setschedparam (thread, rt->policy, &param);
+    if (ret)
+      error = ret;
+  }
+  if (error)
+    MELO_LOGW ("failed to configure thread %s: %s", name, strerror (error));
+
+  /* Save effective policy */
+  if (pthread_getschedparam (thread, &policy, &param))
+    policy = -1;
+  g_mutex_lock (&rt->mutex);
+  if (rt->count < MELO_AIRPLAY_RT_MAX_THREADS) {
+    g_strlcpy (rt->threads[rt->count].name, name,
+        sizeof (rt->threads[rt->count].name));
+    rt->threads[rt->count].policy = policy;
+    rt->threads[rt->count].priority = param.sched_priority;
+    rt->threads[rt->count].error = error;
+    rt->count++;
+  }
+  g_mutex_unlock (&rt->mutex);
+}
+
+/**
+ * melo_airplay_rt_restore:
+ * @rt: the real-time configuration
+ *
+ * Restore the default scheduling policy and the CPU affinity of the process
+ * on the calling thread. Streaming threads come from a process-wide pool and
+ * are reused by other pipelines, so this must be called when they leave the
+ * session.
+ */
+void
+melo_airplay_rt_restore (MeloAirplayRt *rt)
+{
+  pthread_t thread = pthread_self ();
+  struct sched_param param = {0};
+  cpu_set_t set;
+
+  /* Restore CPU affinity of main thread */
+  if (rt->cpus && !sched_getaffinity (getpid (), sizeof (set), &set))
+    pthread_setaffinity_np (thread, sizeof (set), &set);
+
+  /* Restore default scheduling policy */
+  if (rt->policy != SCHED_OTHER)
+    pthread_setschedparam (thread, SCHED_OTHER, &param);
+}
+
+static const char *
+melo_airplay_rt_policy_name (int policy)
+{
+  switch (policy) {
+  case SCHED_FIFO:
+    return "fifo";
+  case SCHED_RR:
+    return "rr";
+  case SCHED_OTHER:
+    return "other";
+  default:
+    return "unknown";
+  }
+}
+
+/**
+ * melo_airplay_rt_dump:
+ * @rt: the real-time configuration
+ * @str: the string to append to
+ *
+ * Append the effective policy of each configured thread to @str.
+ */
+void
+melo_airplay_rt_dump (MeloAirplayRt *rt, GString *str)
+{
+  unsigned int i;
+
+  g_string_append_printf (str, "realtime: %s/%d cpus=%#" G_GINT64_MODIFIER
+                               "x\n",
+      melo_airplay_rt_policy_name (rt->policy), rt->priority, rt->cpus);
+
+  g_mutex_lock (&rt->mutex);
+  for (i = 0; i < rt->count; i++)
+    g_string_append_printf (str, " %s: %s/%d%s%s\n", rt->threads[i].name,
+        melo_airplay_rt_policy_name (rt->threads[i].policy),
+        rt->threads[i].priority, rt->threads[i].error ? " error: " : "",
+        rt->threads[i].error ? strerror (rt->threads[i].error) : "");
+  g_mutex_unlock (&rt->mutex);
+}
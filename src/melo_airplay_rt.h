@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#ifndef _MELO_AIRPLAY_RT_H_
+#define _MELO_AIRPLAY_RT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define MELO_AIRPLAY_RT_MAX_THREADS 16
+
+/**
+ * MeloAirplayRt:
+ *
+ * Real-time configuration of streaming threads of a session: scheduling
+ * policy, base priority and CPU affinity. The effective policy of each
+ * configured thread is saved for statistics.
+ */
+typedef struct {
+  /* Configuration */
+  int policy;
+  int priority;
+  uint64_t cpus;
+
+  /* Configured threads, protected by mutex */
+  GMutex mutex;
+  struct {
+    char name[32];
+    int policy;
+    int priority;
+    int error;
+  } threads[MELO_AIRPLAY_RT_MAX_THREADS];
+  unsigned int count;
+} MeloAirplayRt;
+
+void melo_airplay_rt_init (MeloAirplayRt *rt);
+void melo_airplay_rt_clear (MeloAirplayRt *rt);
+
+bool melo_airplay_rt_setup (MeloAirplayRt *rt, const char *policy,
+    unsigned int priority, const char *cpus);
+
+void melo_airplay_rt_apply (MeloAirplayRt *rt, const char *name, int offset);
+void melo_airplay_rt_restore (MeloAirplayRt *rt);
+
+void melo_airplay_rt_dump (MeloAirplayRt *rt, GString *str);
+
+G_END_DECLS
+
+#endif /* !_MELO_AIRPLAY_RT_H_ */
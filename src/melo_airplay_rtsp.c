@@ -24,7 +24,8 @@
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 
-#include <gst/sdp/sdp.h>
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
 
 #include <melo/melo_cover.h>
 #include <melo/melo_mdns.h>
@@ -34,39 +35,125 @@
 #define MELO_LOG_TAG "airplay_rtsp"
 #include <melo/melo_log.h>
 
+#include "melo_airplay_arena.h"
+#include "melo_airplay_dmap.h"
 #include "melo_airplay_pkey.h"
 #include "melo_airplay_player.h"
 #include "melo_airplay_rtsp.h"
+#include "melo_airplay_sdp.h"
+#include "melo_airplay_stats.h"
 
+/* Worker threads for RSA private key operations */
+#define MELO_AIRPLAY_RTSP_RSA_THREADS 2
+
+/* Worker thread for cover art persistence */
+#define MELO_AIRPLAY_RTSP_COVER_THREADS 1
+
+/* Largest cover art accepted (in bytes) */
+#define MELO_AIRPLAY_RTSP_COVER_MAX_SIZE (4 * 1024 * 1024)
+#define MELO_AIRPLAY_RTSP_COVER_CHUNK_SIZE (64 * 1024)
+
+/* Cover art thumbnail: largest side (in pixels) and longest generation */
+#define MELO_AIRPLAY_RTSP_COVER_THUMB_SIZE 512
+#define MELO_AIRPLAY_RTSP_COVER_THUMB_TIMEOUT (5 * GST_SECOND)
+
+/* Recent covers remembered by content */
+#define MELO_AIRPLAY_RTSP_COVER_LRU_SIZE 8
+#define MELO_AIRPLAY_RTSP_COVER_DIGEST_SIZE 32
+
+/* AES key decrypted by a worker thread */
+typedef struct {
+  int ref_count;
+  GMutex mutex;
+  GCond cond;
+  bool done;
+
+  unsigned char *in;
+  size_t in_len;
+  unsigned char *out;
+  size_t out_len;
+  int ret;
+} MeloAirplayRsaJob;
+
+typedef struct _MeloAirplayClient MeloAirplayClient;
+
+/* Cover art known by its SHA-256 digest */
+typedef struct {
+  unsigned char digest[MELO_AIRPLAY_RTSP_COVER_DIGEST_SIZE];
+  char *cover;
+} MeloAirplayCoverEntry;
+
+/* Cover art saved to cache by a worker thread */
 typedef struct {
+  int ref_count;
+  GMainContext *context;
+  MeloAirplayRtsp *rtsp;
+
+  /* Owner, cleared when the cover is replaced or the connection closed */
+  MeloAirplayClient *client;
+
+  unsigned char *data;
+  size_t len;
+  MeloCoverType type;
+  unsigned char digest[MELO_AIRPLAY_RTSP_COVER_DIGEST_SIZE];
+  char *cover;
+} MeloAirplayCoverJob;
+
+struct _MeloAirplayClient {
   /* Connection */
   MeloRtspServerConnection *conn;
 
+  /* Session and request memory */
+  MeloAirplayArena arena;
+  MeloAirplayArena request_arena;
+
   /* Authentication */
   bool is_auth;
 
+  /* Last Apple-Challenge and its signed response */
+  char *challenge;
+  unsigned char challenge_ip[4];
+  char *challenge_response;
+  unsigned int challenge_hits;
+
   /* Content type */
   char *type;
 
   /* Item status */
   uint64_t mper;
+  unsigned int track;
   char *cover;
 
+  /* Metadata parser */
+  MeloAirplayDmapParser dmap;
+  MeloTags *dmap_tags;
+  bool dmap_reset;
+  unsigned int dmap_duration;
+  bool dmap_stream;
+
   /* Cover art */
   unsigned char *img;
   size_t img_size;
+  size_t img_alloc;
   size_t img_len;
+  bool img_skip;
+  GChecksum *img_checksum;
+  MeloAirplayCoverJob *cover_job;
 
   /* Format */
   MeloAirplayCodec codec;
   char *format;
 
   /* AES key and IV */
+  MeloAirplayRsaJob *key_job;
   unsigned char *key;
   size_t key_len;
   unsigned char *iv;
   size_t iv_len;
 
+  /* Session timing */
+  MeloAirplayTiming timing;
+
   /* RAOP configuration */
   MeloAirplayTransport transport;
   unsigned int port;
@@ -78,7 +165,7 @@ typedef struct {
 
   /* Airplay player */
   MeloAirplayPlayer *player;
-} MeloAirplayClient;
+};
 
 struct _MeloAirplayRtsp {
   /* Parent instance */
@@ -90,9 +177,30 @@ struct _MeloAirplayRtsp {
   unsigned int port;
   bool is_started;
 
+  /* RTSP thread */
+  GMainContext *context;
+  GMainLoop *loop;
+  GThread *thread;
+
   /* Authentication */
   RSA *pkey;
   char *password;
+  GThreadPool *rsa_pool;
+
+  /* Cover art persistence (LRU is only used from RTSP thread) */
+  GThreadPool *cover_pool;
+  MeloAirplayCoverEntry cover_lru[MELO_AIRPLAY_RTSP_COVER_LRU_SIZE];
+  unsigned int cover_lru_len;
+  unsigned int cover_hits;
+  unsigned int cover_misses;
+  uint64_t cover_bytes_avoided;
+
+  /* Time spent in RTSP callbacks, RSA operations and key waits (in us) */
+  MeloAirplayHistogram callback_time;
+  MeloAirplayHistogram sign_time;
+  MeloAirplayHistogram decrypt_time;
+  MeloAirplayHistogram key_wait_time;
+  MeloAirplayHistogram cover_time;
 
   /* Service */
   char *name;
@@ -100,7 +208,7 @@ struct _MeloAirplayRtsp {
   MeloMdns *mdns;
   const MeloMdnsService *service;
 
-  /* Player */
+  /* Player (current client is protected by mutex) */
   MeloAirplayPlayer *player;
   MeloAirplayClient *current_client;
 };
@@ -116,7 +224,7 @@ static void melo_airplay_rtsp_close_cb (
     MeloRtspServerConnection *connection, void *user_data, void **conn_data);
 
 static unsigned char *melo_airplay_rtsp_base64_decode (
-    const char *text, size_t *out_len);
+    MeloAirplayArena *arena, const char *text, size_t len, size_t *out_len);
 
 static void
 melo_airplay_rtsp_finalize (GObject *gobject)
@@ -135,6 +243,14 @@ melo_airplay_rtsp_finalize (GObject *gobject)
 
   g_object_unref (rtsp->server);
 
+  /* Wait end of pending RSA and cover operations */
+  g_thread_pool_free (rtsp->rsa_pool, FALSE, TRUE);
+  g_thread_pool_free (rtsp->cover_pool, FALSE, TRUE);
+
+  /* Free recent covers */
+  while (rtsp->cover_lru_len)
+    g_free (rtsp->cover_lru[--rtsp->cover_lru_len].cover);
+
   /* Free private key */
   if (rtsp->pkey)
     RSA_free (rtsp->pkey);
@@ -195,6 +311,259 @@ default_hw:
   memcpy (rtsp->hw_addr, default_hw_addr, 6);
 }
 
+static void
+melo_airplay_rsa_job_unref (MeloAirplayRsaJob *job)
+{
+  if (!g_atomic_int_dec_and_test (&job->ref_count))
+    return;
+
+  g_free (job->in);
+  if (job->out)
+    g_slice_free1 (job->out_len, job->out);
+  g_cond_clear (&job->cond);
+  g_mutex_clear (&job->mutex);
+  g_slice_free (MeloAirplayRsaJob, job);
+}
+
+static void
+melo_airplay_rtsp_rsa_func (gpointer data, gpointer user_data)
+{
+  MeloAirplayRtsp *rtsp = user_data;
+  MeloAirplayRsaJob *job = data;
+  gint64 start = g_get_monotonic_time ();
+  int ret;
+
+  /* Decrypt AES key */
+  ret = RSA_private_decrypt (job->in_len, job->in, job->out, rtsp->pkey,
+      RSA_PKCS1_OAEP_PADDING);
+  melo_airplay_histogram_add (
+      &rtsp->decrypt_time, g_get_monotonic_time () - start);
+
+  /* Signal completion */
+  g_mutex_lock (&job->mutex);
+  job->ret = ret;
+  job->done = true;
+  g_cond_signal (&job->cond);
+  g_mutex_unlock (&job->mutex);
+
+  melo_airplay_rsa_job_unref (job);
+}
+
+static void
+melo_airplay_cover_job_unref (MeloAirplayCoverJob *job)
+{
+  if (!g_atomic_int_dec_and_test (&job->ref_count))
+    return;
+
+  if (job->context)
+    g_main_context_unref (job->context);
+  g_free (job->data);
+  g_free (job->cover);
+  g_slice_free (MeloAirplayCoverJob, job);
+}
+
+static void
+melo_airplay_cover_job_detach (MeloAirplayCoverJob **job)
+{
+  if (!*job)
+    return;
+
+  (*job)->client = NULL;
+  melo_airplay_cover_job_unref (*job);
+  *job = NULL;
+}
+
+static const char *
+melo_airplay_rtsp_cover_lookup (
+    MeloAirplayRtsp *rtsp, const unsigned char *digest)
+{
+  MeloAirplayCoverEntry entry;
+  unsigned int i;
+
+  for (i = 0; i < rtsp->cover_lru_len; i++) {
+    if (memcmp (rtsp->cover_lru[i].digest, digest,
+            MELO_AIRPLAY_RTSP_COVER_DIGEST_SIZE))
+      continue;
+
+    /* Move to front */
+    entry = rtsp->cover_lru[i];
+    memmove (rtsp->cover_lru + 1, rtsp->cover_lru, i * sizeof (entry));
+    rtsp->cover_lru[0] = entry;
+
+    return entry.cover;
+  }
+
+  return NULL;
+}
+
+static void
+melo_airplay_rtsp_cover_insert (
+    MeloAirplayRtsp *rtsp, const unsigned char *digest, const char *cover)
+{
+  /* Evict least recently used cover */
+  if (rtsp->cover_lru_len == MELO_AIRPLAY_RTSP_COVER_LRU_SIZE)
+    g_free (rtsp->cover_lru[--rtsp->cover_lru_len].cover);
+
+  /* Add at front */
+  memmove (rtsp->cover_lru + 1, rtsp->cover_lru,
+      rtsp->cover_lru_len++ * sizeof (*rtsp->cover_lru));
+  memcpy (rtsp->cover_lru[0].digest, digest,
+      MELO_AIRPLAY_RTSP_COVER_DIGEST_SIZE);
+  rtsp->cover_lru[0].cover = g_strdup (cover);
+}
+
+static void
+melo_airplay_rtsp_set_cover (MeloAirplayClient *client, char *cover)
+{
+  MeloTags *tags;
+
+  /* Same cover */
+  if (!g_strcmp0 (client->cover, cover)) {
+    g_free (cover);
+    return;
+  }
+
+  /* Set new cover */
+  g_free (client->cover);
+  client->cover = cover;
+
+  /* Update cover only if meta have been received once */
+  if (client->mper) {
+    /* Create new tags */
+    tags = melo_tags_new ();
+    if (tags) {
+      /* Attach cover to tags */
+      melo_tags_set_cover (tags, NULL, client->cover);
+
+      /* Send cover to player */
+      melo_airplay_player_take_tags (client->player, tags, false);
+    }
+  }
+}
+
+static gboolean
+melo_airplay_rtsp_cover_done_cb (gpointer user_data)
+{
+  MeloAirplayCoverJob *job = user_data;
+  MeloAirplayClient *client = job->client;
+
+  /* Remember cover for next senders */
+  if (job->cover)
+    melo_airplay_rtsp_cover_insert (job->rtsp, job->digest, job->cover);
+
+  /* Cover replaced or connection closed */
+  if (!client)
+    return G_SOURCE_REMOVE;
+
+  /* Set new cover */
+  melo_airplay_rtsp_set_cover (client, job->cover);
+  job->cover = NULL;
+  melo_airplay_cover_job_detach (&client->cover_job);
+
+  return G_SOURCE_REMOVE;
+}
+
+static bool
+melo_airplay_rtsp_cover_scale (MeloAirplayCoverJob *job)
+{
+#define THUMB_SIZE G_STRINGIFY (MELO_AIRPLAY_RTSP_COVER_THUMB_SIZE)
+  GstElement *pipeline, *src, *sink;
+  GstSample *sample = NULL;
+  GstMessage *msg;
+  GError *error = NULL;
+  GstBuffer *buffer;
+  gpointer data;
+  gsize len;
+
+  /* Decode, fit in thumbnail size keeping aspect ratio and encode to JPEG */
+  pipeline = gst_parse_launch (
+      "appsrc name=src ! decodebin ! videoconvert ! videoscale ! "
+      "video/x-raw,width=[1," THUMB_SIZE "],height=[1," THUMB_SIZE "],"
+      "pixel-aspect-ratio=1/1 ! jpegenc ! appsink name=sink sync=false",
+      &error);
+  if (error) {
+    MELO_LOGW ("failed to create cover pipeline: %s", error->message);
+    g_error_free (error);
+    if (pipeline)
+      gst_object_unref (pipeline);
+    return false;
+  }
+  src = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+
+  /* Push image: data is kept by job until pipeline is stopped */
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  buffer = gst_buffer_new_wrapped_full (
+      GST_MEMORY_FLAG_READONLY, job->data, job->len, 0, job->len, NULL, NULL);
+  gst_app_src_push_buffer (GST_APP_SRC (src), buffer);
+  gst_app_src_end_of_stream (GST_APP_SRC (src));
+
+  /* Wait for thumbnail */
+  msg = gst_bus_timed_pop_filtered (GST_ELEMENT_BUS (pipeline),
+      MELO_AIRPLAY_RTSP_COVER_THUMB_TIMEOUT,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  if (msg && GST_MESSAGE_TYPE (msg) == GST_MESSAGE_EOS)
+    sample = gst_app_sink_pull_sample (GST_APP_SINK (sink));
+  else
+    MELO_LOGW ("failed to scale cover of %zu bytes", job->len);
+  if (msg)
+    gst_message_unref (msg);
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (sink);
+  gst_object_unref (src);
+  gst_object_unref (pipeline);
+  if (!sample)
+    return false;
+
+  /* Keep original image when it is not larger */
+  buffer = gst_sample_get_buffer (sample);
+  if (!buffer || gst_buffer_get_size (buffer) >= job->len) {
+    gst_sample_unref (sample);
+    return false;
+  }
+
+  /* Replace image by thumbnail */
+  gst_buffer_extract_dup (buffer, 0, gst_buffer_get_size (buffer), &data, &len);
+  gst_sample_unref (sample);
+  g_free (job->data);
+  job->data = data;
+  job->len = len;
+  job->type = MELO_COVER_TYPE_JPEG;
+
+  return true;
+#undef THUMB_SIZE
+}
+
+static void
+melo_airplay_rtsp_cover_func (gpointer data, gpointer user_data)
+{
+  MeloAirplayRtsp *rtsp = user_data;
+  MeloAirplayCoverJob *job = data;
+  gint64 start = g_get_monotonic_time ();
+  GMainContext *context;
+  GSource *source;
+
+  /* Replace large image by a thumbnail */
+  melo_airplay_rtsp_cover_scale (job);
+
+  /* Save cover to cache: data is released by the cache */
+  job->cover = melo_cover_cache_save (
+      job->data, job->len, job->type, g_free, job->data);
+  job->data = NULL;
+  melo_airplay_histogram_add (
+      &rtsp->cover_time, g_get_monotonic_time () - start);
+
+  /* Post result to RTSP thread: the source is dropped with the context */
+  context = job->context;
+  job->context = NULL;
+  source = g_idle_source_new ();
+  g_source_set_callback (source, melo_airplay_rtsp_cover_done_cb, job,
+      (GDestroyNotify) melo_airplay_cover_job_unref);
+  g_source_attach (source, context);
+  g_source_unref (source);
+  g_main_context_unref (context);
+}
+
 static void
 melo_airplay_rtsp_init (MeloAirplayRtsp *self)
 {
@@ -208,6 +577,14 @@ melo_airplay_rtsp_init (MeloAirplayRtsp *self)
   self->pkey = PEM_read_bio_RSAPrivateKey (temp_bio, NULL, NULL, NULL);
   BIO_free (temp_bio);
 
+  /* Create RSA worker threads */
+  self->rsa_pool = g_thread_pool_new (melo_airplay_rtsp_rsa_func, self,
+      MELO_AIRPLAY_RTSP_RSA_THREADS, FALSE, NULL);
+
+  /* Create cover worker thread */
+  self->cover_pool = g_thread_pool_new (melo_airplay_rtsp_cover_func, self,
+      MELO_AIRPLAY_RTSP_COVER_THREADS, FALSE, NULL);
+
   /* Set hardware address */
   melo_airplay_rtsp_set_hardware_address (self);
 
@@ -275,6 +652,9 @@ melo_airplay_rtsp_settings_cb (MeloAirplayPlayer *player, void *user_data)
 {
   MeloAirplayRtsp *rtsp = MELO_AIRPLAY_RTSP (user_data);
 
+  /* Lock mutex: name and password are used by RTSP thread */
+  g_mutex_lock (&rtsp->mutex);
+
   /* Update name */
   g_free (rtsp->name);
   rtsp->name = g_strdup (melo_airplay_player_get_name (rtsp->player));
@@ -289,6 +669,9 @@ melo_airplay_rtsp_settings_cb (MeloAirplayPlayer *player, void *user_data)
   /* Update service */
   if (rtsp->is_started)
     melo_airplay_rtsp_update_service (rtsp);
+
+  /* Unlock mutex */
+  g_mutex_unlock (&rtsp->mutex);
 }
 
 void
@@ -303,6 +686,38 @@ melo_airplay_rtsp_set_player (MeloAirplayRtsp *rtsp, MeloAirplayPlayer *player)
         player, melo_airplay_rtsp_settings_cb, rtsp);
 }
 
+static gpointer
+melo_airplay_rtsp_thread_func (gpointer user_data)
+{
+  MeloAirplayRtsp *rtsp = user_data;
+
+  /* Run RTSP server and player sessions */
+  g_main_context_push_thread_default (rtsp->context);
+  g_main_loop_run (rtsp->loop);
+  g_main_context_pop_thread_default (rtsp->context);
+
+  return NULL;
+}
+
+static gboolean
+melo_airplay_rtsp_quit_cb (gpointer user_data)
+{
+  MeloAirplayRtsp *rtsp = user_data;
+  MeloAirplayClient *client;
+
+  /* Stop current session while its player sources are still dispatched */
+  g_mutex_lock (&rtsp->mutex);
+  client = rtsp->current_client;
+  rtsp->current_client = NULL;
+  g_mutex_unlock (&rtsp->mutex);
+  if (client)
+    melo_airplay_player_teardown (client->player);
+
+  g_main_loop_quit (rtsp->loop);
+
+  return G_SOURCE_REMOVE;
+}
+
 bool
 melo_airplay_rtsp_start (MeloAirplayRtsp *rtsp)
 {
@@ -322,9 +737,13 @@ melo_airplay_rtsp_start (MeloAirplayRtsp *rtsp)
     rtsp->port = 5000;
   }
 
-  /* Start RTSP server */
+  /* Start RTSP server in its own thread */
+  rtsp->context = g_main_context_new ();
+  rtsp->loop = g_main_loop_new (rtsp->context, FALSE);
   melo_rtsp_server_start (rtsp->server, rtsp->port);
-  melo_rtsp_server_attach (rtsp->server, g_main_context_default ());
+  melo_rtsp_server_attach (rtsp->server, rtsp->context);
+  rtsp->thread =
+      g_thread_new ("airplay_rtsp", melo_airplay_rtsp_thread_func, rtsp);
 
   /* Update mDNS service */
   melo_airplay_rtsp_update_service (rtsp);
@@ -336,6 +755,8 @@ melo_airplay_rtsp_start (MeloAirplayRtsp *rtsp)
 bool
 melo_airplay_rtsp_stop (MeloAirplayRtsp *rtsp)
 {
+  GSource *source;
+
   if (!rtsp || !rtsp->is_started)
     return false;
 
@@ -344,21 +765,38 @@ melo_airplay_rtsp_stop (MeloAirplayRtsp *rtsp)
     melo_mdns_remove_service (rtsp->mdns, rtsp->service);
   rtsp->service = NULL;
 
+  /* Stop current session and RTSP thread: quit from loop since it may not be
+   * running yet */
+  source = g_idle_source_new ();
+  g_source_set_callback (source, melo_airplay_rtsp_quit_cb, rtsp, NULL);
+  g_source_attach (source, rtsp->context);
+  g_source_unref (source);
+  g_thread_join (rtsp->thread);
+  rtsp->thread = NULL;
+
   /* Stop RTSP server */
   melo_rtsp_server_stop (rtsp->server);
   rtsp->is_started = false;
 
+  /* Release RTSP context */
+  g_main_loop_unref (rtsp->loop);
+  g_main_context_unref (rtsp->context);
+  rtsp->loop = NULL;
+  rtsp->context = NULL;
+
   return true;
 }
 
 static bool
-melo_airplay_rtsp_init_apple_response (
-    MeloAirplayRtsp *rtsp, MeloRtspServerConnection *connection)
+melo_airplay_rtsp_init_apple_response (MeloAirplayRtsp *rtsp,
+    MeloRtspServerConnection *connection, MeloAirplayClient *client)
 {
+  const unsigned char *server_ip;
   const char *challenge;
   unsigned char *rsa_response;
   char *response;
   char tmp[32];
+  gint64 start;
   size_t len;
 
   /* Get Apple challenge */
@@ -366,14 +804,28 @@ melo_airplay_rtsp_init_apple_response (
       melo_rtsp_server_connection_get_header (connection, "Apple-Challenge");
   if (!challenge)
     return false;
+  server_ip = (const unsigned char *)
+      melo_rtsp_server_connection_get_server_ip (connection);
+
+  /* Same challenge on same address: reuse signed response */
+  if (client->challenge_response && !strcmp (client->challenge, challenge) &&
+      !memcmp (client->challenge_ip, server_ip, 4)) {
+    client->challenge_hits++;
+    melo_rtsp_server_connection_add_header (
+        connection, "Apple-Response", client->challenge_response);
+    return true;
+  }
+
+  /* Challenge is 16 bytes encoded in base64 */
+  len = strlen (challenge);
+  if (len < 22 || len > 24)
+    return false;
 
   /* Copy string and padd with '=' if missing */
-  strcpy (tmp, challenge);
-  if (tmp[22] == '\0') {
-    tmp[22] = '=';
-    tmp[23] = '=';
-  } else if (tmp[23] == '\0')
-    tmp[23] = '=';
+  memcpy (tmp, challenge, len);
+  while (len < 24)
+    tmp[len++] = '=';
+  tmp[len] = '\0';
 
   /* Decode base64 string */
   g_base64_decode_inplace (tmp, &len);
@@ -381,15 +833,18 @@ melo_airplay_rtsp_init_apple_response (
     return false;
 
   /* Make the response */
-  memcpy (tmp + 16, melo_rtsp_server_connection_get_server_ip (connection), 4);
+  memcpy (tmp + 16, server_ip, 4);
   memcpy (tmp + 20, rtsp->hw_addr, 6);
   memset (tmp + 26, 0, 6);
 
   /* Sign response with private key */
+  start = g_get_monotonic_time ();
   len = RSA_size (rtsp->pkey);
   rsa_response = g_slice_alloc (len);
   RSA_private_encrypt (
       32, (unsigned char *) tmp, rsa_response, rtsp->pkey, RSA_PKCS1_PADDING);
+  melo_airplay_histogram_add (
+      &rtsp->sign_time, g_get_monotonic_time () - start);
 
   /* Encode response in base64 */
   response = g_base64_encode (rsa_response, len);
@@ -405,15 +860,100 @@ melo_airplay_rtsp_init_apple_response (
   /* Add Apple-response to RTSP response */
   melo_rtsp_server_connection_add_header (
       connection, "Apple-Response", response);
-  g_free (response);
+
+  /* Keep response for next identical challenge */
+  g_free (client->challenge);
+  g_free (client->challenge_response);
+  client->challenge = g_strdup (challenge);
+  memcpy (client->challenge_ip, server_ip, 4);
+  client->challenge_response = response;
 
   return true;
 }
 
+static bool
+melo_airplay_rtsp_wait_key (MeloAirplayRtsp *rtsp, MeloAirplayClient *client)
+{
+  MeloAirplayRsaJob *job = client->key_job;
+  gint64 start = g_get_monotonic_time ();
+  bool ret;
+
+  if (!job)
+    return true;
+
+  /* Wait for AES key decryption: this blocks the RTSP loop if the worker has
+   * not finished yet.
+   */
+  g_mutex_lock (&job->mutex);
+  while (!job->done)
+    g_cond_wait (&job->cond, &job->mutex);
+  g_mutex_unlock (&job->mutex);
+  melo_airplay_histogram_add (
+      &rtsp->key_wait_time, g_get_monotonic_time () - start);
+
+  /* Replace AES key */
+  ret = job->ret > 0;
+  if (ret) {
+    client->key = melo_airplay_arena_memdup (
+        &client->arena, job->out, job->out_len);
+    client->key_len = job->out_len;
+  } else {
+    MELO_LOGE ("failed to decrypt AES key");
+    client->key = NULL;
+    client->key_len = 0;
+  }
+
+  client->key_job = NULL;
+  melo_airplay_rsa_job_unref (job);
+
+  return ret;
+}
+
+typedef struct {
+  char *name;
+  MeloTags *tags;
+} MeloAirplayMediaJob;
+
+static gboolean
+melo_airplay_rtsp_play_media_cb (gpointer user_data)
+{
+  MeloAirplayMediaJob *job = user_data;
+
+  melo_playlist_play_media (MELO_AIRPLAY_PLAYER_ID, NULL, job->name, job->tags);
+  job->tags = NULL;
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+melo_airplay_rtsp_media_job_free (gpointer user_data)
+{
+  MeloAirplayMediaJob *job = user_data;
+
+  if (job->tags)
+    melo_tags_unref (job->tags);
+  g_free (job->name);
+  g_slice_free (MeloAirplayMediaJob, job);
+}
+
+static void
+melo_airplay_rtsp_play_media (char *name, MeloTags *tags)
+{
+  MeloAirplayMediaJob *job;
+
+  /* Playlist is only used from main loop, not from RTSP thread */
+  job = g_slice_new (MeloAirplayMediaJob);
+  job->name = name;
+  job->tags = tags;
+  g_main_context_invoke_full (NULL, G_PRIORITY_DEFAULT,
+      melo_airplay_rtsp_play_media_cb, job, melo_airplay_rtsp_media_job_free);
+}
+
 static bool
 melo_airplay_rtsp_request_setup (MeloAirplayRtsp *rtsp,
     MeloRtspServerConnection *connection, MeloAirplayClient *client)
 {
+  MeloAirplayClient *prev;
   const char *header, *h;
   const char *hostname;
   char *transport;
@@ -425,6 +965,13 @@ melo_airplay_rtsp_request_setup (MeloAirplayRtsp *rtsp,
   if (!header)
     return false;
 
+  /* Get AES key from worker thread */
+  if (!melo_airplay_rtsp_wait_key (rtsp, client)) {
+    melo_rtsp_server_connection_init_response (
+        connection, 500, "Internal error");
+    return false;
+  }
+
   /* Get transport type */
   if (strstr (header, "TCP"))
     client->transport = MELO_AIRPLAY_TRANSPORT_TCP;
@@ -441,10 +988,10 @@ melo_airplay_rtsp_request_setup (MeloAirplayRtsp *rtsp,
   if (h)
     client->timing_port = strtoul (h + 12, NULL, 10);
 
-  /* Set client IP and ports */
-  g_free (client->client_ip);
-  client->client_ip =
-      g_strdup (melo_rtsp_server_connection_get_ip_string (connection));
+  /* Set client IP, once per session, and ports */
+  if (!client->client_ip)
+    client->client_ip = melo_airplay_arena_strdup (&client->arena,
+        melo_rtsp_server_connection_get_ip_string (connection));
   client->client_control_port = client->control_port;
   client->client_timing_port = client->timing_port;
 
@@ -457,19 +1004,23 @@ melo_airplay_rtsp_request_setup (MeloAirplayRtsp *rtsp,
   tags = melo_tags_new ();
   melo_tags_set_cover (tags, NULL, MELO_AIRPLAY_PLAYER_ICON);
 
-  /* Set player */
-  melo_playlist_play_media (MELO_AIRPLAY_PLAYER_ID, NULL, player_name, tags);
-  g_free (player_name);
-
-  /* Close current client */
-  if (rtsp->current_client && rtsp->current_client != client) {
-    melo_rtsp_server_connection_close (rtsp->current_client->conn);
-    rtsp->current_client->player = NULL;
-  }
+  /* Set player from main loop */
+  melo_airplay_rtsp_play_media (player_name, tags);
 
   /* Replace client */
+  g_mutex_lock (&rtsp->mutex);
+  prev = rtsp->current_client != client ? rtsp->current_client : NULL;
+  if (prev)
+    prev->player = NULL;
   client->player = rtsp->player;
   rtsp->current_client = client;
+  g_mutex_unlock (&rtsp->mutex);
+
+  /* Stop and close previous client */
+  if (prev) {
+    melo_airplay_player_teardown (client->player);
+    melo_rtsp_server_connection_close (prev->conn);
+  }
 
   /* Setup player */
   client->port = 6000;
@@ -482,6 +1033,10 @@ melo_airplay_rtsp_request_setup (MeloAirplayRtsp *rtsp,
     return false;
   }
 
+  /* Pass session timing to player */
+  client->timing.setup_done = g_get_monotonic_time ();
+  melo_airplay_player_set_timing (client->player, &client->timing);
+
   /* Prepare response */
   melo_rtsp_server_connection_add_header (
       connection, "Audio-Jack-Status", "connected; type=analog");
@@ -522,21 +1077,44 @@ melo_airplay_rtsp_get_rtp_info (MeloRtspServerConnection *connection,
     *timestamp = strtoul (h + 8, NULL, 10);
 }
 
+static bool
+melo_airplay_rtsp_release_client (
+    MeloAirplayRtsp *rtsp, MeloAirplayClient *client)
+{
+  bool ret = false;
+
+  /* Forget client if it is the current one */
+  g_mutex_lock (&rtsp->mutex);
+  if (rtsp->current_client == client) {
+    rtsp->current_client = NULL;
+    ret = true;
+  }
+  g_mutex_unlock (&rtsp->mutex);
+
+  return ret;
+}
+
 static void
 melo_airplay_rtsp_request_cb (MeloRtspServerConnection *connection,
     MeloRtspMethod method, const char *url, void *user_data, void **conn_data)
 {
   MeloAirplayRtsp *rtsp = MELO_AIRPLAY_RTSP (user_data);
   MeloAirplayClient *client = (MeloAirplayClient *) *conn_data;
+  gint64 now = g_get_monotonic_time ();
   unsigned int seq = 0;
 
   /* Create new client */
   if (!client) {
     client = g_slice_new0 (MeloAirplayClient);
     client->conn = connection;
+    client->timing.options = now;
     *conn_data = client;
   }
 
+  /* Release memory of previous request */
+  melo_airplay_arena_reset (&client->request_arena);
+  client->type = NULL;
+
   /* Lock mutex */
   g_mutex_lock (&rtsp->mutex);
 
@@ -556,7 +1134,7 @@ melo_airplay_rtsp_request_cb (MeloRtspServerConnection *connection,
   g_mutex_unlock (&rtsp->mutex);
 
   /* Prepare Apple response */
-  melo_airplay_rtsp_init_apple_response (rtsp, connection);
+  melo_airplay_rtsp_init_apple_response (rtsp, connection, client);
 
   /* Set common headers */
   melo_rtsp_server_connection_add_header (connection, "Server", "Melo/1.0");
@@ -572,8 +1150,28 @@ melo_airplay_rtsp_request_cb (MeloRtspServerConnection *connection,
         "FLUSH, TEARDOWN, OPTIONS, "
         "GET_PARAMETER, SET_PARAMETER");
     break;
+  case MELO_RTSP_METHOD_ANNOUNCE:
+    /* New session: release previous session memory */
+    melo_airplay_arena_reset (&client->arena);
+    client->format = NULL;
+    client->key = NULL;
+    client->key_len = 0;
+    client->iv = NULL;
+    client->iv_len = 0;
+    client->client_ip = NULL;
+
+    /* New session on a reused connection: measure from ANNOUNCE */
+    if (client->timing.announce) {
+      memset (&client->timing, 0, sizeof (client->timing));
+      client->timing.options = now;
+    }
+
+    /* Body is parsed in read callback */
+    client->timing.announce = now;
+    break;
   case MELO_RTSP_METHOD_SETUP:
     /* Setup client and player */
+    client->timing.setup = now;
     melo_airplay_rtsp_request_setup (rtsp, connection, client);
     break;
   case MELO_RTSP_METHOD_RECORD:
@@ -584,10 +1182,8 @@ melo_airplay_rtsp_request_cb (MeloRtspServerConnection *connection,
     melo_airplay_player_record (client->player, seq);
     break;
   case MELO_RTSP_METHOD_TEARDOWN:
-    if (rtsp->current_client == client) {
+    if (melo_airplay_rtsp_release_client (rtsp, client))
       melo_airplay_player_teardown (client->player);
-      rtsp->current_client = NULL;
-    }
     client->player = NULL;
     break;
   case MELO_RTSP_METHOD_UNKNOWN:
@@ -603,13 +1199,13 @@ melo_airplay_rtsp_request_cb (MeloRtspServerConnection *connection,
   case MELO_RTSP_METHOD_SET_PARAMETER:
   case MELO_RTSP_METHOD_GET_PARAMETER:
     /* Save content type */
-    g_free (client->type);
-    client->type = g_strdup (
+    client->type = melo_airplay_arena_strdup (&client->request_arena,
         melo_rtsp_server_connection_get_header (connection, "Content-Type"));
 
     /* Reset cover */
     if (!g_strcmp0 (client->type, "image/none")) {
-      /* Remove cover */
+      /* Remove cover and drop pending one */
+      melo_airplay_cover_job_detach (&client->cover_job);
       g_free (client->cover);
       client->cover = NULL;
 
@@ -620,106 +1216,83 @@ melo_airplay_rtsp_request_cb (MeloRtspServerConnection *connection,
     break;
   default:;
   }
+
+  /* Account time spent in main loop */
+  melo_airplay_histogram_add (
+      &rtsp->callback_time, g_get_monotonic_time () - now);
 }
 
 static bool
 melo_airplay_rtsp_read_announce (MeloAirplayRtsp *rtsp,
     MeloAirplayClient *client, unsigned char *buffer, size_t size)
 {
-  const GstSDPMedia *media = NULL;
-  GstSDPMessage *sdp;
-  const char *rtpmap = NULL;
-  unsigned int i, count;
-  size_t len;
-  bool ret = false;
-
-  /* Init SDP message */
-  gst_sdp_message_new (&sdp);
-  gst_sdp_message_init (sdp);
+  MeloAirplaySdp sdp;
 
   /* Parse SDP packet */
-  if (gst_sdp_message_parse_buffer (buffer, size, sdp) != GST_SDP_OK)
-    goto end;
-
-  /* Get audio media */
-  count = gst_sdp_message_medias_len (sdp);
-  for (i = 0; i < count; i++) {
-    const GstSDPMedia *m = gst_sdp_message_get_media (sdp, i);
-    if (!g_strcmp0 (gst_sdp_media_get_media (m), "audio")) {
-      media = m;
-      break;
+  if (!melo_airplay_sdp_parse (&sdp, buffer, size))
+    return false;
+
+  /* Get codec from rtpmap: "<payload> <codec>/..." */
+  if (sdp.rtpmap.str) {
+    const char *codec = memchr (sdp.rtpmap.str, ' ', sdp.rtpmap.len);
+    size_t len = 0;
+
+    if (codec) {
+      codec++;
+      len = sdp.rtpmap.str + sdp.rtpmap.len - codec;
     }
+
+    /* Find codec */
+    if (len >= 3 && !memcmp (codec, "L16", 3))
+      client->codec = MELO_AIRPLAY_CODEC_PCM;
+    else if (len >= 13 && !memcmp (codec, "AppleLossless", 13))
+      client->codec = MELO_AIRPLAY_CODEC_ALAC;
+    else if (len >= 13 && !memcmp (codec, "mpeg4-generic", 13))
+      client->codec = MELO_AIRPLAY_CODEC_AAC;
+    else
+      return false;
   }
-  if (!media)
-    goto end;
-
-  /* Parse all attributes */
-  count = gst_sdp_media_attributes_len (media);
-  for (i = 0; i < count; i++) {
-    const GstSDPAttribute *attr = gst_sdp_media_get_attribute (media, i);
-
-    /* Find rtpmap, ftmp, rsaaeskey and aesiv */
-    if (!g_strcmp0 (attr->key, "rtpmap")) {
-      /* Get codec */
-      rtpmap = attr->value;
-      const char *codec = attr->value + 3;
-
-      /* Find codec */
-      if (!strncmp (codec, "L16", 3))
-        client->codec = MELO_AIRPLAY_CODEC_PCM;
-      else if (!strncmp (codec, "AppleLossless", 13))
-        client->codec = MELO_AIRPLAY_CODEC_ALAC;
-      else if (!strncmp (codec, "mpeg4-generic", 13))
-        client->codec = MELO_AIRPLAY_CODEC_AAC;
-      else
-        goto end;
-    } else if (!g_strcmp0 (attr->key, "fmtp")) {
-      /* Get format string */
-      g_free (client->format);
-      client->format = g_strdup (attr->value);
-    } else if (!g_strcmp0 (attr->key, "rsaaeskey")) {
-      unsigned char *key;
-
-      /* Decode AES key from base64 */
-      key = melo_airplay_rtsp_base64_decode (attr->value, &len);
-
-      /* Allocate new AES key */
-      client->key_len = RSA_size (rtsp->pkey);
-      if (!client->key)
-        client->key = g_slice_alloc (client->key_len);
-      if (!client->key) {
-        g_free (key);
-        goto end;
-      }
-
-      /* Decrypt AES key */
-      if (!RSA_private_decrypt (len, (unsigned char *) key,
-              (unsigned char *) client->key, rtsp->pkey,
-              RSA_PKCS1_OAEP_PADDING)) {
-        g_free (key);
-        goto end;
-      }
-      g_free (key);
-    } else if (!g_strcmp0 (attr->key, "aesiv")) {
-      /* Get AES IV */
-      g_free (client->iv);
-      client->iv =
-          melo_airplay_rtsp_base64_decode (attr->value, &client->iv_len);
-    }
+
+  /* Get format string */
+  if (sdp.fmtp.str) {
+    client->format = melo_airplay_arena_strndup (
+        &client->arena, sdp.fmtp.str, sdp.fmtp.len);
+  }
+
+  /* Get AES key */
+  if (sdp.rsaaeskey.str) {
+    MeloAirplayRsaJob *job;
+
+    /* Decode AES key from base64 */
+    job = g_slice_new0 (MeloAirplayRsaJob);
+    job->ref_count = 2;
+    g_mutex_init (&job->mutex);
+    g_cond_init (&job->cond);
+    job->in = melo_airplay_rtsp_base64_decode (
+        NULL, sdp.rsaaeskey.str, sdp.rsaaeskey.len, &job->in_len);
+    job->out_len = RSA_size (rtsp->pkey);
+    job->out = g_slice_alloc (job->out_len);
+
+    /* Decrypt AES key in a worker thread, until SETUP */
+    if (client->key_job)
+      melo_airplay_rsa_job_unref (client->key_job);
+    client->key_job = job;
+    g_thread_pool_push (rtsp->rsa_pool, job, NULL);
+  }
+
+  /* Get AES IV */
+  if (sdp.aesiv.str) {
+    client->iv = melo_airplay_rtsp_base64_decode (
+        &client->arena, sdp.aesiv.str, sdp.aesiv.len, &client->iv_len);
   }
 
   /* Add a pseudo format for PCM */
   if (client->codec == MELO_AIRPLAY_CODEC_PCM && !client->format)
-    client->format = g_strdup (rtpmap);
+    client->format = melo_airplay_arena_strndup (
+        &client->arena, sdp.rtpmap.str, sdp.rtpmap.len);
 
   /* A format and a key has been found */
-  if (client->format && client->key)
-    ret = true;
-end:
-  /* Free SDP message */
-  gst_sdp_message_free (sdp);
-
-  return ret;
+  return client->format && (client->key_job || client->key);
 }
 
 static bool
@@ -759,125 +1332,235 @@ melo_airplay_rtsp_read_params (
   return true;
 }
 
-static bool
-melo_airplay_rtsp_read_tags (
-    MeloAirplayClient *client, unsigned char *buffer, size_t size)
+static void
+melo_airplay_rtsp_set_tag (MeloTags *tags, uint32_t code,
+    const unsigned char *data, size_t len)
 {
-  bool reset = !client->mper;
-  MeloTags *tags;
-  size_t len;
-
-  /* Skip first header */
-  if (size > 8 && !memcmp (buffer, "mlit", 4)) {
-    buffer += 8;
-    size -= 8;
+  char buf[256], *value = buf;
+
+  /* Terminate string value */
+  if (len >= sizeof (buf))
+    value = g_malloc (len + 1);
+  memcpy (value, data, len);
+  value[len] = '\0';
+
+  /* Set tag */
+  switch (code) {
+  case MELO_AIRPLAY_DMAP_MINM:
+    melo_tags_set_title (tags, value);
+    break;
+  case MELO_AIRPLAY_DMAP_ASAR:
+    melo_tags_set_artist (tags, value);
+    break;
+  case MELO_AIRPLAY_DMAP_ASAL:
+    melo_tags_set_album (tags, value);
+    break;
+  case MELO_AIRPLAY_DMAP_ASGN:
+    melo_tags_set_genre (tags, value);
+    break;
   }
 
-  /* Create a new tags */
-  tags = melo_tags_new ();
-  if (!tags) {
-    MELO_LOGE ("failed to create tags");
-    return false;
-  }
+  if (value != buf)
+    g_free (value);
+}
 
-  /* Parse all buffer */
-  while (size > 8) {
-    char *tmp = (char *) (buffer + 8);
-
-    /* Get tag length */
-    len = buffer[4] << 24 | buffer[5] << 16 | buffer[6] << 8 | buffer[7];
-
-    /* Get values */
-    if (!memcmp (buffer, "minm", 4)) {
-      tmp = g_strndup (tmp, len);
-      melo_tags_set_title (tags, tmp);
-      g_free (tmp);
-    } else if (!memcmp (buffer, "asar", 4)) {
-      tmp = g_strndup (tmp, len);
-      melo_tags_set_artist (tags, tmp);
-      g_free (tmp);
-    } else if (!memcmp (buffer, "asal", 4)) {
-      tmp = g_strndup (tmp, len);
-      melo_tags_set_album (tags, tmp);
-      g_free (tmp);
-    } else if (!memcmp (buffer, "asgn", 4)) {
-      tmp = g_strndup (tmp, len);
-      melo_tags_set_genre (tags, tmp);
-      g_free (tmp);
-    } else if (!memcmp (buffer, "mper", 4) && len == 8) {
-      uint64_t mper = *((uint64_t *) tmp);
-
-      /* Item has changed */
-      if (client->mper != mper)
-        reset = true;
-      client->mper = mper;
+static void
+melo_airplay_rtsp_dmap_cb (
+    uint32_t code, const unsigned char *data, size_t len, void *user_data)
+{
+  MeloAirplayClient *client = user_data;
+  uint64_t mper;
+
+  switch (code) {
+  case MELO_AIRPLAY_DMAP_MINM:
+  case MELO_AIRPLAY_DMAP_ASAR:
+  case MELO_AIRPLAY_DMAP_ASAL:
+  case MELO_AIRPLAY_DMAP_ASGN:
+    melo_airplay_rtsp_set_tag (client->dmap_tags, code, data, len);
+    break;
+  case MELO_AIRPLAY_DMAP_MPER:
+    mper = melo_airplay_dmap_get_uint (data, len);
+
+    /* Item has changed */
+    if (client->mper != mper)
+      client->dmap_reset = true;
+    client->mper = mper;
+    break;
+  case MELO_AIRPLAY_DMAP_ASTM:
+    /* Duration in ms */
+    client->dmap_duration = melo_airplay_dmap_get_uint (data, len);
+    break;
+  case MELO_AIRPLAY_DMAP_ASTN:
+    client->track = melo_airplay_dmap_get_uint (data, len);
+    break;
+  case MELO_AIRPLAY_DMAP_ASDK:
+    /* Data kind: 1 is a radio stream with no duration */
+    client->dmap_stream = melo_airplay_dmap_get_uint (data, len) == 1;
+    break;
+  case MELO_AIRPLAY_DMAP_CAPS:
+    /* Play status: 3 is paused, 4 is playing */
+    switch (melo_airplay_dmap_get_uint (data, len)) {
+    case 3:
+      melo_airplay_player_set_paused (client->player, true);
+      break;
+    case 4:
+      melo_airplay_player_set_paused (client->player, false);
+      break;
     }
+    break;
+  }
+}
 
-    /* Go to next block */
-    buffer += len + 8;
-    size -= len + 8;
+static bool
+melo_airplay_rtsp_read_tags (
+    MeloAirplayClient *client, unsigned char *buffer, size_t size, bool last)
+{
+  /* First chunk: create a new tags */
+  if (!client->dmap_tags) {
+    client->dmap_tags = melo_tags_new ();
+    if (!client->dmap_tags) {
+      MELO_LOGE ("failed to create tags");
+      return false;
+    }
+    melo_airplay_dmap_parser_reset (&client->dmap);
+    client->dmap_reset = !client->mper;
+    client->dmap_duration = 0;
+    client->dmap_stream = false;
   }
 
+  /* Parse chunk */
+  melo_airplay_dmap_parser_feed (
+      &client->dmap, buffer, size, melo_airplay_rtsp_dmap_cb, client);
+  if (!last)
+    return true;
+
+  /* Check body */
+  if (!melo_airplay_dmap_parser_is_complete (&client->dmap))
+    MELO_LOGW ("truncated metadata");
+
   /* Set current cover */
-  melo_tags_set_cover (tags, NULL, client->cover);
+  melo_tags_set_cover (client->dmap_tags, NULL, client->cover);
 
   /* Update tags in player */
-  melo_airplay_player_take_tags (client->player, tags, reset);
+  melo_airplay_player_take_tags (
+      client->player, client->dmap_tags, client->dmap_reset);
+  client->dmap_tags = NULL;
+
+  /* Set duration of new item */
+  if (client->dmap_reset && client->dmap_duration && !client->dmap_stream)
+    melo_airplay_player_set_duration (client->player, client->dmap_duration);
 
   return true;
 }
 
 static bool
-melo_airplay_rtsp_read_image (MeloRtspServerConnection *connection,
-    MeloAirplayClient *client, unsigned char *buffer, size_t size, bool last)
+melo_airplay_rtsp_read_image (MeloAirplayRtsp *rtsp,
+    MeloRtspServerConnection *connection, MeloAirplayClient *client,
+    unsigned char *buffer, size_t size, bool last)
 {
+  MeloAirplayCoverJob *job;
+  unsigned char digest[MELO_AIRPLAY_RTSP_COVER_DIGEST_SIZE];
+  gsize digest_len = sizeof (digest);
+  const char *cover;
+
   /* First packet */
-  if (!client->img) {
+  if (!client->img && !client->img_skip) {
     client->img_len = 0;
     client->img_size =
         melo_rtsp_server_connection_get_content_length (connection);
-    client->img = g_malloc (client->img_size);
-    if (!client->img)
-      return false;
+
+    /* Drop oversized cover */
+    if (!client->img_size ||
+        client->img_size > MELO_AIRPLAY_RTSP_COVER_MAX_SIZE) {
+      MELO_LOGW ("cover of %zu bytes dropped", client->img_size);
+      client->img_skip = true;
+    } else {
+      client->img_alloc =
+          MIN (client->img_size, MELO_AIRPLAY_RTSP_COVER_CHUNK_SIZE);
+      client->img = g_malloc (client->img_alloc);
+      if (client->img_checksum)
+        g_checksum_reset (client->img_checksum);
+      else
+        client->img_checksum = g_checksum_new (G_CHECKSUM_SHA256);
+    }
   }
 
-  /* Copy data */
-  memcpy (client->img + client->img_len, buffer, size);
-  client->img_len += size;
-
-  /* Last packet */
-  if (last) {
-    MeloTags *tags;
-
-    /* Save cover to cache */
-    g_free (client->cover);
-    client->cover = melo_cover_cache_save (client->img, client->img_size,
-        melo_cover_type_from_mime_type (client->type), g_free, client->img);
-
-    /* Update cover only if meta have been received once */
-    if (client->mper) {
-      /* Create new tags */
-      tags = melo_tags_new ();
-      if (tags) {
-        /* Attach cover to tags */
-        melo_tags_set_cover (tags, NULL, client->cover);
-
-        /* Send cover to player */
-        melo_airplay_player_take_tags (client->player, tags, false);
-      }
+  /* Copy and hash data: buffer grows with received data, up to announced
+   * length */
+  if (client->img) {
+    size = MIN (size, client->img_size - client->img_len);
+    if (client->img_len + size > client->img_alloc) {
+      client->img_alloc = MAX (client->img_alloc * 2, client->img_len + size);
+      client->img_alloc = MIN (client->img_alloc, client->img_size);
+      client->img = g_realloc (client->img, client->img_alloc);
     }
+    memcpy (client->img + client->img_len, buffer, size);
+    g_checksum_update (client->img_checksum, buffer, size);
+    client->img_len += size;
+  }
+
+  if (!last)
+    return true;
+
+  /* Last packet: skip end of dropped cover */
+  if (!client->img) {
+    client->img_skip = false;
+    return true;
+  }
+
+  /* Drop truncated cover */
+  if (client->img_len < client->img_size) {
+    MELO_LOGW ("truncated cover dropped: %zu / %zu bytes", client->img_len,
+        client->img_size);
+    g_free (client->img);
+    client->img_size = 0;
+    client->img = NULL;
+    return true;
+  }
+
+  /* Replace pending cover */
+  melo_airplay_cover_job_detach (&client->cover_job);
+
+  /* Cover already saved: reuse it */
+  g_checksum_get_digest (client->img_checksum, digest, &digest_len);
+  cover = melo_airplay_rtsp_cover_lookup (rtsp, digest);
+  if (cover) {
+    rtsp->cover_hits++;
+    rtsp->cover_bytes_avoided += client->img_len;
+    melo_airplay_rtsp_set_cover (client, g_strdup (cover));
 
     /* Free cover */
+    g_free (client->img);
     client->img_size = 0;
     client->img = NULL;
+    return true;
   }
+  rtsp->cover_misses++;
+
+  /* Save cover in background */
+  job = g_slice_new0 (MeloAirplayCoverJob);
+  job->ref_count = 2;
+  job->context = g_main_context_ref (rtsp->context);
+  job->rtsp = rtsp;
+  job->client = client;
+  job->data = client->img;
+  job->len = client->img_len;
+  job->type = melo_cover_type_from_mime_type (client->type);
+  memcpy (job->digest, digest, sizeof (digest));
+  client->cover_job = job;
+  g_thread_pool_push (rtsp->cover_pool, job, NULL);
+
+  /* Buffer is now owned by job */
+  client->img_size = 0;
+  client->img = NULL;
 
   return true;
 }
 
 static bool
-melo_airplay_rtsp_write_params (MeloRtspServerConnection *connection,
-    MeloAirplayClient *client, unsigned char *buffer, size_t size)
+melo_airplay_rtsp_write_params (MeloAirplayRtsp *rtsp,
+    MeloRtspServerConnection *connection, MeloAirplayClient *client,
+    unsigned char *buffer, size_t size)
 {
   char *req = (char *) buffer;
 
@@ -899,6 +1582,21 @@ melo_airplay_rtsp_write_params (MeloRtspServerConnection *connection,
     len = strlen (packet);
     melo_rtsp_server_connection_set_packet (
         connection, (unsigned char *) packet, len, (GDestroyNotify) g_free);
+  } else if (size >= 5 && !strncmp (req, "stats", 5)) {
+    char *stats;
+
+    /* Get statistics of running session, from any connection */
+    stats = melo_airplay_player_get_stats (rtsp->player);
+    if (!stats)
+      return false;
+
+    /* Add headers for content type and length */
+    melo_rtsp_server_connection_add_header (
+        connection, "Content-Type", "text/plain");
+
+    /* Add statistics as response body */
+    melo_rtsp_server_connection_set_packet (connection,
+        (unsigned char *) stats, strlen (stats), (GDestroyNotify) g_free);
   } else
     return false;
 
@@ -912,11 +1610,13 @@ melo_airplay_rtsp_read_cb (MeloRtspServerConnection *connection,
 {
   MeloAirplayRtsp *rtsp = MELO_AIRPLAY_RTSP (user_data);
   MeloAirplayClient *client = (MeloAirplayClient *) *conn_data;
+  gint64 start = g_get_monotonic_time ();
 
   /* Parse method */
   switch (melo_rtsp_server_connection_get_method (connection)) {
   case MELO_RTSP_METHOD_ANNOUNCE:
     melo_airplay_rtsp_read_announce (rtsp, client, buffer, size);
+    client->timing.announce_done = g_get_monotonic_time ();
     break;
   case MELO_RTSP_METHOD_SET_PARAMETER:
     /* Get content type */
@@ -929,10 +1629,11 @@ melo_airplay_rtsp_read_cb (MeloRtspServerConnection *connection,
       melo_airplay_rtsp_read_params (client, buffer, size);
     else if (!g_strcmp0 (client->type, "application/x-dmap-tagged"))
       /* Get media tags */
-      melo_airplay_rtsp_read_tags (client, buffer, size);
+      melo_airplay_rtsp_read_tags (client, buffer, size, last);
     else if (g_str_has_prefix (client->type, "image/"))
       /* Get cover art */
-      melo_airplay_rtsp_read_image (connection, client, buffer, size, last);
+      melo_airplay_rtsp_read_image (
+          rtsp, connection, client, buffer, size, last);
     break;
   case MELO_RTSP_METHOD_GET_PARAMETER:
     /* Get content type */
@@ -941,10 +1642,14 @@ melo_airplay_rtsp_read_cb (MeloRtspServerConnection *connection,
 
     /* Get volume */
     if (!g_strcmp0 (client->type, "text/parameters"))
-      melo_airplay_rtsp_write_params (connection, client, buffer, size);
+      melo_airplay_rtsp_write_params (rtsp, connection, client, buffer, size);
     break;
   default:;
   }
+
+  /* Account time spent in main loop */
+  melo_airplay_histogram_add (
+      &rtsp->callback_time, g_get_monotonic_time () - start);
 }
 
 static void
@@ -953,41 +1658,73 @@ melo_airplay_rtsp_close_cb (
 {
   MeloAirplayRtsp *rtsp = (MeloAirplayRtsp *) user_data;
   MeloAirplayClient *client = (MeloAirplayClient *) *conn_data;
+  GString *str;
 
   if (!client)
     return;
 
-  /* Not current client */
-  if (rtsp->current_client == client) {
+  /* Stop player of current client */
+  if (melo_airplay_rtsp_release_client (rtsp, client))
     melo_airplay_player_teardown (client->player);
-    rtsp->current_client = NULL;
-  }
 
   /* Free AES key */
-  if (client->key)
-    g_slice_free1 (client->key_len, client->key);
-  g_free (client->iv);
+  if (client->key_job)
+    melo_airplay_rsa_job_unref (client->key_job);
+
+  /* Dump main loop stall, RSA and cover timings */
+  str = g_string_new ("RTSP timings (us):\n");
+  melo_airplay_histogram_dump (&rtsp->callback_time, "callbacks", str);
+  melo_airplay_histogram_dump (&rtsp->sign_time, "rsa sign", str);
+  melo_airplay_histogram_dump (&rtsp->decrypt_time, "rsa decrypt", str);
+  melo_airplay_histogram_dump (&rtsp->key_wait_time, "key wait", str);
+  melo_airplay_histogram_dump (&rtsp->cover_time, "cover save", str);
+  MELO_LOGD ("%s", str->str);
+  g_string_free (str, TRUE);
+
+  /* Dump and free session memory */
+  str = g_string_new ("RTSP session memory:\n");
+  melo_airplay_arena_dump (&client->arena, "session", str);
+  melo_airplay_arena_dump (&client->request_arena, "requests", str);
+  MELO_LOGD ("%s", str->str);
+  g_string_free (str, TRUE);
+  melo_airplay_arena_clear (&client->request_arena);
+  melo_airplay_arena_clear (&client->arena);
+
+  /* Dump cover deduplication */
+  MELO_LOGD ("covers: %u hits, %u misses, %" G_GUINT64_FORMAT
+             " bytes not saved",
+      rtsp->cover_hits, rtsp->cover_misses, rtsp->cover_bytes_avoided);
+
+  /* Free Apple-Challenge response */
+  if (client->challenge_hits)
+    MELO_LOGD ("Apple-Challenge: %u cached responses", client->challenge_hits);
+  g_free (client->challenge_response);
+  g_free (client->challenge);
 
   /* Free client data */
-  g_free (client->client_ip);
-  g_free (client->format);
-  g_free (client->type);
   g_free (client->img);
+  if (client->img_checksum)
+    g_checksum_free (client->img_checksum);
+  melo_airplay_cover_job_detach (&client->cover_job);
   g_free (client->cover);
+  if (client->dmap_tags)
+    melo_tags_unref (client->dmap_tags);
   g_slice_free (MeloAirplayClient, client);
 }
 
 static unsigned char *
-melo_airplay_rtsp_base64_decode (const char *text, size_t *out_len)
+melo_airplay_rtsp_base64_decode (
+    MeloAirplayArena *arena, const char *text, size_t len, size_t *out_len)
 {
   gint state = 0;
   guint save = 0;
   unsigned char *out;
-  size_t len;
 
   /* Allocate output buffer */
-  len = strlen (text);
-  out = g_malloc ((len * 3 / 4) + 3);
+  if (arena)
+    out = melo_airplay_arena_alloc (arena, (len * 3 / 4) + 3);
+  else
+    out = g_malloc ((len * 3 / 4) + 3);
 
   /* Decode string */
   len = g_base64_decode_step (text, len, out, &state, &save);
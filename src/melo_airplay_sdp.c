@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#include <string.h>
+
+#include "melo_airplay_sdp.h"
+
+static bool
+melo_airplay_sdp_match (
+    const char *line, size_t len, const char *key, MeloAirplaySdpValue *value)
+{
+  size_t key_len = strlen (key);
+
+  /* Match "key:" */
+  if (len <= key_len || memcmp (line, key, key_len) || line[key_len] != ':')
+    return false;
+
+  /* Keep first occurrence */
+  if (!value->str) {
+    value->str = line + key_len + 1;
+    value->len = len - key_len - 1;
+  }
+
+  return true;
+}
+
+/**
+ * melo_airplay_sdp_parse:
+ * @sdp: the attributes to fill
+ * @buffer: the SDP body
+ * @size: the size of the body
+ *
+ * Parse a RAOP ANNOUNCE body in a single pass and extract the attributes of
+ * the first audio media. The values point into @buffer, so nothing is
+ * allocated and @buffer must be kept while @sdp is used. Lines can end with
+ * CRLF or LF, and lines which are not needed are skipped without validation.
+ *
+ * Returns: %true if an audio media has been found, %false otherwise.
+ */
+bool
+melo_airplay_sdp_parse (
+    MeloAirplaySdp *sdp, const unsigned char *buffer, size_t size)
+{
+  const char *p = (const char *) buffer, *end = p + size;
+  bool found = false, in_audio = false;
+
+  memset (sdp, 0, sizeof (*sdp));
+
+  while (p < end) {
+    const char *eol = memchr (p, '\n', end - p);
+    const char *line = p;
+    size_t len;
+
+    /* Get line without CRLF */
+    if (!eol)
+      eol = end;
+    len = eol - line;
+    if (len && line[len - 1] == '\r')
+      len--;
+    p = eol + 1;
+
+    /* Skip invalid line */
+    if (len < 2 || line[1] != '=')
+      continue;
+
+    /* New media: only first audio media is used */
+    if (line[0] == 'm') {
+      if (found)
+        break;
+      in_audio = len > 8 && !memcmp (line + 2, "audio ", 6);
+      found = in_audio;
+      continue;
+    }
+
+    /* Media attribute */
+    if (line[0] != 'a' || !in_audio)
+      continue;
+    line += 2;
+    len -= 2;
+
+    if (!melo_airplay_sdp_match (line, len, "rtpmap", &sdp->rtpmap) &&
+        !melo_airplay_sdp_match (line, len, "fmtp", &sdp->fmtp) &&
+        !melo_airplay_sdp_match (line, len, "rsaaeskey", &sdp->rsaaeskey))
+      melo_airplay_sdp_match (line, len, "aesiv", &sdp->aesiv);
+  }
+
+  return found;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#ifndef _MELO_AIRPLAY_SDP_H_
+#define _MELO_AIRPLAY_SDP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * MeloAirplaySdpValue:
+ * @str: the start of the value in the parsed buffer, not NUL-terminated
+ * @len: the length of the value
+ *
+ * A view into the body passed to melo_airplay_sdp_parse().
+ */
+typedef struct {
+  const char *str;
+  size_t len;
+} MeloAirplaySdpValue;
+
+/**
+ * MeloAirplaySdp:
+ * @rtpmap: the rtpmap attribute of the audio media
+ * @fmtp: the fmtp attribute of the audio media
+ * @rsaaeskey: the rsaaeskey attribute of the audio media
+ * @aesiv: the aesiv attribute of the audio media
+ *
+ * The attributes used from a RAOP ANNOUNCE body. An attribute which is not
+ * found is left with a %NULL @str.
+ */
+typedef struct {
+  MeloAirplaySdpValue rtpmap;
+  MeloAirplaySdpValue fmtp;
+  MeloAirplaySdpValue rsaaeskey;
+  MeloAirplaySdpValue aesiv;
+} MeloAirplaySdp;
+
+bool melo_airplay_sdp_parse (
+    MeloAirplaySdp *sdp, const unsigned char *buffer, size_t size);
+
+G_END_DECLS
+
+#endif /* !_MELO_AIRPLAY_SDP_H_ */
@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+#include <gio/gunixconnection.h>
+#include <gio/gunixsocketaddress.h>
+
+#define MELO_LOG_TAG "airplay_shm"
+#include <melo/melo_log.h>
+
+#include "melo_airplay_shm.h"
+
+/* PCM ring starts on its own page */
+#define MELO_AIRPLAY_SHM_DATA_OFFSET 4096
+#define MELO_AIRPLAY_SHM_MIN_SIZE (64 * 1024)
+
+struct _MeloAirplayShm {
+  int fd;
+  MeloAirplayShmHeader *header;
+  uint8_t *data;
+  size_t map_size;
+  uint32_t mask;
+
+  /* Unix socket exporting the memfd */
+  char *path;
+  GSocketService *service;
+
+  /* Statistics */
+  unsigned int consumers;
+  guint64 written;
+};
+
+static gboolean
+incoming_cb (GSocketService *service, GSocketConnection *conn,
+    GObject *source_object, gpointer user_data)
+{
+  MeloAirplayShm *shm = user_data;
+  GError *error = NULL;
+  char proc[64];
+  int fd;
+
+  /* Share a read-only descriptor when possible */
+  snprintf (proc, sizeof (proc), "/proc/self/fd/%d", shm->fd);
+  fd = open (proc, O_RDONLY | O_CLOEXEC);
+
+  /* Send descriptor and close connection */
+  if (!g_unix_connection_send_fd (
+          G_UNIX_CONNECTION (conn), fd >= 0 ? fd : shm->fd, NULL, &error)) {
+    MELO_LOGW ("failed to send PCM memfd: %s", error->message);
+    g_error_free (error);
+  } else
+    shm->consumers++;
+  if (fd >= 0)
+    close (fd);
+
+  return TRUE;
+}
+
+static bool
+melo_airplay_shm_unlink (const char *path)
+{
+  struct stat st;
+
+  /* Never remove anything else than a stale socket */
+  if (lstat (path, &st))
+    return true;
+  if (!S_ISSOCK (st.st_mode))
+    return false;
+
+  return !unlink (path);
+}
+
+/**
+ * melo_airplay_shm_new:
+ * @path: the path of the Unix socket to export the shared memory on
+ * @size: the size of the PCM ring, rounded up to a power of two
+ *
+ * Create a new shared memory PCM export. The ring and its header (see
+ * #MeloAirplayShmHeader) are stored in a sealed memfd, and each connection
+ * on the Unix socket at @path receives its descriptor as ancillary data,
+ * then is closed. Consumers map it and poll the write position, so no copy
+ * nor syscall is done per block.
+ *
+ * The socket service runs on the thread-default main context of the caller.
+ *
+ * Returns: (transfer full): a new #MeloAirplayShm or %NULL.
+ */
+MeloAirplayShm *
+melo_airplay_shm_new (const char *path, size_t size)
+{
+  GSocketAddress *addr;
+  MeloAirplayShm *shm;
+  GError *error = NULL;
+  void *map;
+
+  if (!path || !*path)
+    return NULL;
+
+  /* Allocate export */
+  shm = g_slice_new0 (MeloAirplayShm);
+  if (!shm)
+    return NULL;
+  shm->fd = -1;
+  shm->path = g_strdup (path);
+
+  /* Round ring size to a power of two */
+  size = MAX (size, MELO_AIRPLAY_SHM_MIN_SIZE);
+  size = (size_t) 1 << g_bit_storage (size - 1);
+  shm->mask = size - 1;
+  shm->map_size = MELO_AIRPLAY_SHM_DATA_OFFSET + size;
+
+  /* Create sealed memfd */
+  shm->fd = memfd_create ("melo_airplay_pcm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (shm->fd < 0 || ftruncate (shm->fd, shm->map_size) < 0) {
+    MELO_LOGE ("failed to create PCM memfd");
+    goto failed;
+  }
+  fcntl (shm->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+  /* Map ring */
+  map = mmap (NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd,
+      0);
+  if (map == MAP_FAILED) {
+    MELO_LOGE ("failed to map PCM memfd");
+    goto failed;
+  }
+  shm->header = map;
+  shm->data = (uint8_t *) map + MELO_AIRPLAY_SHM_DATA_OFFSET;
+
+  /* Initialize header */
+  shm->header->magic = MELO_AIRPLAY_SHM_MAGIC;
+  shm->header->version = MELO_AIRPLAY_SHM_VERSION;
+  shm->header->data_offset = MELO_AIRPLAY_SHM_DATA_OFFSET;
+  shm->header->data_size = size;
+
+  /* Create Unix socket service */
+  if (!melo_airplay_shm_unlink (path)) {
+    MELO_LOGE ("%s exists and is not a socket", path);
+    goto failed;
+  }
+  shm->service = g_socket_service_new ();
+  addr = g_unix_socket_address_new (path);
+  if (!g_socket_listener_add_address (G_SOCKET_LISTENER (shm->service), addr,
+          G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL,
+          &error)) {
+    MELO_LOGE ("failed to listen on %s: %s", path, error->message);
+    g_error_free (error);
+    g_object_unref (addr);
+    goto failed;
+  }
+  g_object_unref (addr);
+  g_signal_connect (shm->service, "incoming", G_CALLBACK (incoming_cb), shm);
+  g_socket_service_start (shm->service);
+
+  MELO_LOGI ("PCM exported on %s (%zu bytes)", path, size);
+
+  return shm;
+
+failed:
+  melo_airplay_shm_free (shm);
+  return NULL;
+}
+
+/**
+ * melo_airplay_shm_free:
+ * @shm: the shared memory export
+ *
+ * Remove the Unix socket, mark the ring as closed and free the export.
+ * Consumers keep their mapping until they unmap it.
+ */
+void
+melo_airplay_shm_free (MeloAirplayShm *shm)
+{
+  if (!shm)
+    return;
+
+  /* Stop service */
+  if (shm->service) {
+    g_socket_service_stop (shm->service);
+    g_socket_listener_close (G_SOCKET_LISTENER (shm->service));
+    g_object_unref (shm->service);
+    melo_airplay_shm_unlink (shm->path);
+  }
+
+  /* Notify consumers and release memfd */
+  if (shm->header) {
+    g_atomic_int_set (&shm->header->closed, 1);
+    munmap (shm->header, shm->map_size);
+  }
+  if (shm->fd >= 0)
+    close (shm->fd);
+
+  g_free (shm->path);
+  g_slice_free (MeloAirplayShm, shm);
+}
+
+/**
+ * melo_airplay_shm_set_format:
+ * @shm: the shared memory export
+ * @rate: the sample rate
+ * @channels: the channel count
+ * @bits: the sample width
+ * @is_float: %true for floating point samples
+ *
+ * Publish the format of the next pushed samples.
+ */
+void
+melo_airplay_shm_set_format (MeloAirplayShm *shm, unsigned int rate,
+    unsigned int channels, unsigned int bits, bool is_float)
+{
+  MeloAirplayShmHeader *header = shm->header;
+
+  /* Odd sequence while format is updated */
+  g_atomic_int_inc (&header->seq);
+  header->rate = rate;
+  header->channels = channels;
+  header->bits = bits;
+  header->is_float = is_float;
+  g_atomic_int_inc (&header->seq);
+}
+
+/**
+ * melo_airplay_shm_push:
+ * @shm: the shared memory export
+ * @rtptime: the RTP time of the first sample
+ * @has_rtptime: %true if @rtptime is valid
+ * @data: the interleaved samples
+ * @size: the size of @data
+ *
+ * Write samples into the ring and publish the new write position. This
+ * function never blocks and never waits for consumers.
+ */
+void
+melo_airplay_shm_push (MeloAirplayShm *shm, uint32_t rtptime,
+    bool has_rtptime, const uint8_t *data, size_t size)
+{
+  MeloAirplayShmHeader *header = shm->header;
+  uint32_t pos = header->write_pos;
+  size_t off, len;
+
+  /* Anchor RTP time on first sample */
+  if (has_rtptime) {
+    g_atomic_int_inc (&header->seq);
+    header->anchor_pos = pos;
+    header->anchor_rtptime = rtptime;
+    g_atomic_int_inc (&header->seq);
+  }
+
+  /* Keep only the end of an oversized block */
+  if (size > header->data_size) {
+    pos += size - header->data_size;
+    data += size - header->data_size;
+    size = header->data_size;
+  }
+
+  /* Copy samples, with wrap */
+  off = pos & shm->mask;
+  len = MIN (size, header->data_size - off);
+  memcpy (shm->data + off, data, len);
+  memcpy (shm->data, data + len, size - len);
+
+  /* Publish samples */
+  g_atomic_int_set (&header->write_pos, pos + size);
+  shm->written += size;
+}
+
+/**
+ * melo_airplay_shm_set_playout:
+ * @shm: the shared memory export
+ * @rtptime: an RTP time
+ * @time: the playout time of @rtptime (in us of CLOCK_MONOTONIC)
+ *
+ * Publish when a sample is played by the local audio sink.
+ */
+void
+melo_airplay_shm_set_playout (
+    MeloAirplayShm *shm, uint32_t rtptime, uint64_t time)
+{
+  MeloAirplayShmHeader *header = shm->header;
+
+  g_atomic_int_inc (&header->playout_seq);
+  header->playout_rtptime = rtptime;
+  header->playout_time = time;
+  g_atomic_int_inc (&header->playout_seq);
+}
+
+/**
+ * melo_airplay_shm_dump:
+ * @shm: the shared memory export
+ * @str: the string to append to
+ *
+ * Append export statistics to @str.
+ */
+void
+melo_airplay_shm_dump (MeloAirplayShm *shm, GString *str)
+{
+  g_string_append_printf (str,
+      "shm: path=%s size=%u consumers=%u written=%" G_GUINT64_FORMAT "\n",
+      shm->path, shm->header->data_size, shm->consumers, shm->written);
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#ifndef _MELO_AIRPLAY_SHM_H_
+#define _MELO_AIRPLAY_SHM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define MELO_AIRPLAY_SHM_MAGIC 0x4d504348 /* "MPCH" */
+#define MELO_AIRPLAY_SHM_VERSION 1
+
+/**
+ * MeloAirplayShmHeader:
+ *
+ * Header at the start of the shared memory, followed by the PCM ring at
+ * @data_offset. Samples are interleaved and little endian. All positions are
+ * in bytes, wrap at 2^32 and only their differences are meaningful.
+ *
+ * A consumer keeps its own read position, starting at @write_pos. The bytes
+ * between the read position and @write_pos are available, unless @write_pos
+ * is ahead by more than @data_size, in which case the consumer has been
+ * overrun and should restart from @write_pos. Since the writer never waits,
+ * a consumer must check @write_pos again after copying to detect overwrite.
+ *
+ * Format and timestamps are grouped behind sequence counters: a consumer
+ * reads the counter, the fields and the counter again, and retries when it
+ * has changed or is odd. @anchor_pos is the ring position of the sample with
+ * RTP time @anchor_rtptime; @playout_rtptime is played at @playout_time, in
+ * microseconds of CLOCK_MONOTONIC.
+ *
+ * @closed is set to 1 when the writer stops: the ring is not written anymore
+ * and the consumer should unmap it, then connect again to get the ring of the
+ * next session.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t data_offset;
+  uint32_t data_size;
+
+  /* Format and ring anchor */
+  uint32_t seq;
+  uint32_t rate;
+  uint32_t channels;
+  uint32_t bits;
+  uint32_t is_float;
+  uint32_t anchor_pos;
+  uint32_t anchor_rtptime;
+
+  /* Playout time */
+  uint32_t playout_seq;
+  uint32_t playout_rtptime;
+  uint32_t closed;
+  uint64_t playout_time;
+
+  /* Write position, on its own cache line */
+  uint32_t write_pos __attribute__ ((aligned (64)));
+} MeloAirplayShmHeader;
+
+typedef struct _MeloAirplayShm MeloAirplayShm;
+
+MeloAirplayShm *melo_airplay_shm_new (const char *path, size_t size);
+void melo_airplay_shm_free (MeloAirplayShm *shm);
+
+void melo_airplay_shm_set_format (MeloAirplayShm *shm, unsigned int rate,
+    unsigned int channels, unsigned int bits, bool is_float);
+void melo_airplay_shm_push (MeloAirplayShm *shm, uint32_t rtptime,
+    bool has_rtptime, const uint8_t *data, size_t size);
+void melo_airplay_shm_set_playout (
+    MeloAirplayShm *shm, uint32_t rtptime, uint64_t time);
+
+void melo_airplay_shm_dump (MeloAirplayShm *shm, GString *str);
+
+G_END_DECLS
+
+#endif /* !_MELO_AIRPLAY_SHM_H_ */
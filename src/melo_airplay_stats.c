@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "melo_airplay_stats.h"
+
+void
+melo_airplay_histogram_reset (MeloAirplayHistogram *hist)
+{
+  unsigned int i;
+
+  for (i = 0; i < MELO_AIRPLAY_HISTOGRAM_BUCKETS; i++)
+    g_atomic_int_set (&hist->buckets[i], 0);
+}
+
+void
+melo_airplay_histogram_add (MeloAirplayHistogram *hist, int64_t value)
+{
+  unsigned int i = 0;
+
+  /* Find bucket */
+  if (value > 1) {
+    i = g_bit_storage ((guint64) value) - 1;
+    if (i >= MELO_AIRPLAY_HISTOGRAM_BUCKETS)
+      i = MELO_AIRPLAY_HISTOGRAM_BUCKETS - 1;
+  }
+
+  g_atomic_int_inc (&hist->buckets[i]);
+}
+
+unsigned int
+melo_airplay_histogram_get_count (MeloAirplayHistogram *hist)
+{
+  unsigned int i, count = 0;
+
+  for (i = 0; i < MELO_AIRPLAY_HISTOGRAM_BUCKETS; i++)
+    count += g_atomic_int_get (&hist->buckets[i]);
+
+  return count;
+}
+
+int64_t
+melo_airplay_histogram_get_percentile (
+    MeloAirplayHistogram *hist, unsigned int percent)
+{
+  unsigned int i, count, target;
+
+  /* Empty histogram */
+  count = melo_airplay_histogram_get_count (hist);
+  if (!count)
+    return 0;
+
+  /* Find bucket */
+  target = ((uint64_t) count * MIN (percent, 100) + 99) / 100;
+  for (i = 0; i < MELO_AIRPLAY_HISTOGRAM_BUCKETS - 1; i++) {
+    unsigned int c = g_atomic_int_get (&hist->buckets[i]);
+
+    if (c >= target)
+      break;
+    target -= c;
+  }
+
+  return G_GINT64_CONSTANT (2) << i;
+}
+
+void
+melo_airplay_histogram_dump (
+    MeloAirplayHistogram *hist, const char *name, GString *str)
+{
+  unsigned int i;
+
+  /* Add summary */
+  g_string_append_printf (str,
+      "%s: count=%u p50<%" G_GINT64_FORMAT " p90<%" G_GINT64_FORMAT
+      " p99<%" G_GINT64_FORMAT " |",
+      name, melo_airplay_histogram_get_count (hist),
+      melo_airplay_histogram_get_percentile (hist, 50),
+      melo_airplay_histogram_get_percentile (hist, 90),
+      melo_airplay_histogram_get_percentile (hist, 99));
+
+  /* Add buckets */
+  for (i = 0; i < MELO_AIRPLAY_HISTOGRAM_BUCKETS; i++) {
+    unsigned int c = g_atomic_int_get (&hist->buckets[i]);
+
+    if (c)
+      g_string_append_printf (
+          str, " <%" G_GINT64_FORMAT ":%u", G_GINT64_CONSTANT (2) << i, c);
+  }
+  g_string_append_c (str, '\n');
+}
+
+static bool
+melo_airplay_get_task_wakeups (int tid, uint64_t *count)
+{
+  static const char tag[] = "\nvoluntary_ctxt_switches:";
+  char path[64], *status, *p;
+
+  /* Get voluntary context switches of thread */
+  snprintf (path, sizeof (path), "/proc/self/task/%d/status", tid);
+  if (!g_file_get_contents (path, &status, NULL, NULL))
+    return false;
+  p = strstr (status, tag);
+  if (p)
+    *count = g_ascii_strtoull (p + sizeof (tag) - 1, NULL, 10);
+  g_free (status);
+
+  return p != NULL;
+}
+
+void
+melo_airplay_threads_init (MeloAirplayThreads *threads)
+{
+  g_mutex_init (&threads->mutex);
+  threads->count = 0;
+}
+
+void
+melo_airplay_threads_clear (MeloAirplayThreads *threads)
+{
+  g_mutex_clear (&threads->mutex);
+}
+
+void
+melo_airplay_threads_reset (MeloAirplayThreads *threads)
+{
+  g_mutex_lock (&threads->mutex);
+  threads->count = 0;
+  g_mutex_unlock (&threads->mutex);
+}
+
+void
+melo_airplay_threads_enter (MeloAirplayThreads *threads)
+{
+  int tid = syscall (SYS_gettid);
+  uint64_t count = 0;
+  unsigned int i;
+
+  if (!melo_airplay_get_task_wakeups (tid, &count))
+    return;
+
+  g_mutex_lock (&threads->mutex);
+
+  /* Find thread */
+  for (i = 0; i < threads->count; i++)
+    if (threads->threads[i].tid == tid)
+      break;
+
+  /* Add thread, or skip wake-ups done while it was away */
+  if (i == threads->count) {
+    if (i == MELO_AIRPLAY_THREADS_MAX)
+      goto end;
+    threads->threads[i].tid = tid;
+    threads->threads[i].base = count;
+    threads->count++;
+  } else if (!threads->threads[i].active)
+    threads->threads[i].base += count - threads->threads[i].last;
+  threads->threads[i].active = true;
+  threads->threads[i].last = count;
+
+end:
+  g_mutex_unlock (&threads->mutex);
+}
+
+void
+melo_airplay_threads_leave (MeloAirplayThreads *threads)
+{
+  int tid = syscall (SYS_gettid);
+  uint64_t count;
+  unsigned int i;
+
+  if (!melo_airplay_get_task_wakeups (tid, &count))
+    return;
+
+  /* Freeze thread count while it runs for others */
+  g_mutex_lock (&threads->mutex);
+  for (i = 0; i < threads->count; i++) {
+    if (threads->threads[i].tid == tid && threads->threads[i].active) {
+      threads->threads[i].active = false;
+      threads->threads[i].last = count;
+      break;
+    }
+  }
+  g_mutex_unlock (&threads->mutex);
+}
+
+uint64_t
+melo_airplay_threads_get_wakeups (MeloAirplayThreads *threads)
+{
+  uint64_t total = 0;
+  unsigned int i;
+
+  g_mutex_lock (&threads->mutex);
+  for (i = 0; i < threads->count; i++) {
+    uint64_t count;
+
+    /* Keep last count of an exited thread */
+    if (threads->threads[i].active &&
+        melo_airplay_get_task_wakeups (threads->threads[i].tid, &count))
+      threads->threads[i].last = count;
+    total += threads->threads[i].last - threads->threads[i].base;
+  }
+  g_mutex_unlock (&threads->mutex);
+
+  return total;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#ifndef _MELO_AIRPLAY_STATS_H_
+#define _MELO_AIRPLAY_STATS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define MELO_AIRPLAY_HISTOGRAM_BUCKETS 24
+
+/**
+ * MeloAirplayHistogram:
+ * @buckets: the value count per bucket
+ *
+ * A lock-free histogram with power of two buckets: bucket n holds values in
+ * [2^n, 2^(n+1)[, the first one holds values lower than 2 and the last one
+ * all values greater than its lower bound.
+ */
+typedef struct {
+  unsigned int buckets[MELO_AIRPLAY_HISTOGRAM_BUCKETS];
+} MeloAirplayHistogram;
+
+void melo_airplay_histogram_reset (MeloAirplayHistogram *hist);
+void melo_airplay_histogram_add (MeloAirplayHistogram *hist, int64_t value);
+
+unsigned int melo_airplay_histogram_get_count (MeloAirplayHistogram *hist);
+int64_t melo_airplay_histogram_get_percentile (
+    MeloAirplayHistogram *hist, unsigned int percent);
+
+void melo_airplay_histogram_dump (
+    MeloAirplayHistogram *hist, const char *name, GString *str);
+
+#define MELO_AIRPLAY_THREADS_MAX 32
+
+/**
+ * MeloAirplayThreads:
+ *
+ * A set of threads whose wake-ups are counted, such as the streaming threads
+ * of a pipeline. Threads are taken from a shared pool, so a thread is only
+ * accounted between melo_airplay_threads_enter() and
+ * melo_airplay_threads_leave(), and threads above #MELO_AIRPLAY_THREADS_MAX
+ * are ignored.
+ */
+typedef struct {
+  /*< private >*/
+  GMutex mutex;
+  unsigned int count;
+  struct {
+    int tid;
+    bool active;
+    uint64_t base;
+    uint64_t last;
+  } threads[MELO_AIRPLAY_THREADS_MAX];
+} MeloAirplayThreads;
+
+void melo_airplay_threads_init (MeloAirplayThreads *threads);
+void melo_airplay_threads_clear (MeloAirplayThreads *threads);
+void melo_airplay_threads_reset (MeloAirplayThreads *threads);
+
+void melo_airplay_threads_enter (MeloAirplayThreads *threads);
+void melo_airplay_threads_leave (MeloAirplayThreads *threads);
+
+/**
+ * melo_airplay_threads_get_wakeups:
+ * @threads: the thread set
+ *
+ * Get the count of voluntary context switches of the threads of the set while
+ * they were accounted, which is the count of wake-ups after sleeping. It
+ * always returns 0 when /proc is not available.
+ *
+ * Returns: the current count of wake-ups.
+ */
+uint64_t melo_airplay_threads_get_wakeups (MeloAirplayThreads *threads);
+
+G_END_DECLS
+
+#endif /* !_MELO_AIRPLAY_STATS_H_ */
@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+/*
+ * Chunk boundaries of the DMAP parser: a SET_PARAMETER body as sent by iTunes
+ * is fed in two chunks split at every offset, then one byte at a time. Each
+ * item must be passed once, in order and with its exact value, except a value
+ * bigger than MELO_AIRPLAY_DMAP_MAX_VALUE which is skipped when it is split.
+ * A body truncated inside an item must be reported as incomplete.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "melo_airplay_dmap.h"
+
+typedef struct {
+  uint32_t code;
+  const char *value;
+  size_t len;
+} TestItem;
+
+#define TEST_STR(s) s, sizeof (s) - 1
+
+/* Items of a metadata listing item, in iTunes order */
+static const TestItem items[] = {
+    {MELO_AIRPLAY_DMAP_CODE ('m', 'i', 'k', 'd'), TEST_STR ("\x02")},
+    {MELO_AIRPLAY_DMAP_ASAL, TEST_STR ("Kind of Blue (Legacy Edition)")},
+    {MELO_AIRPLAY_DMAP_ASAR, TEST_STR ("Miles Davis")},
+    {MELO_AIRPLAY_DMAP_CODE ('a', 's', 'c', 'p'), TEST_STR ("")},
+    {MELO_AIRPLAY_DMAP_ASGN, TEST_STR ("Jazz")},
+    {MELO_AIRPLAY_DMAP_ASTM, TEST_STR ("\x00\x08\x50\xc8")},
+    {MELO_AIRPLAY_DMAP_ASTN, TEST_STR ("\x00\x01")},
+    {MELO_AIRPLAY_DMAP_CODE ('a', 's', 't', 'c'), TEST_STR ("\x00\x06")},
+    {MELO_AIRPLAY_DMAP_ASDK, TEST_STR ("\x00")},
+    {MELO_AIRPLAY_DMAP_MPER, TEST_STR ("\x8a\x3c\x52\x1e\x40\x77\x9f\x01")},
+    {MELO_AIRPLAY_DMAP_MINM, TEST_STR ("So What")},
+    {MELO_AIRPLAY_DMAP_CODE ('a', 's', 'c', 'm'), NULL,
+        MELO_AIRPLAY_DMAP_MAX_VALUE + 500},
+    {MELO_AIRPLAY_DMAP_CAPS, TEST_STR ("\x04")},
+    {MELO_AIRPLAY_DMAP_CODE ('a', 's', 'c', 't'), TEST_STR ("")},
+};
+
+typedef struct {
+  GByteArray *body;
+  size_t start[G_N_ELEMENTS (items)];
+  size_t end[G_N_ELEMENTS (items)];
+} TestBody;
+
+typedef struct {
+  const TestBody *test;
+  unsigned int count;
+  bool skipped[G_N_ELEMENTS (items)];
+  bool ok;
+} TestRun;
+
+static void
+test_append_uint (GByteArray *body, uint32_t value)
+{
+  unsigned char buf[4] = {value >> 24, value >> 16, value >> 8, value};
+
+  g_byte_array_append (body, buf, sizeof (buf));
+}
+
+static const unsigned char *
+test_value (const TestBody *test, unsigned int i)
+{
+  return test->body->data + test->start[i];
+}
+
+static void
+test_body_init (TestBody *test)
+{
+  unsigned int i;
+  size_t len = 0;
+
+  /* Container length */
+  for (i = 0; i < G_N_ELEMENTS (items); i++)
+    len += 8 + items[i].len;
+
+  /* Listing item with all items */
+  test->body = g_byte_array_new ();
+  test_append_uint (test->body, MELO_AIRPLAY_DMAP_MLIT);
+  test_append_uint (test->body, len);
+  for (i = 0; i < G_N_ELEMENTS (items); i++) {
+    test_append_uint (test->body, items[i].code);
+    test_append_uint (test->body, items[i].len);
+    test->start[i] = test->body->len;
+    if (items[i].value)
+      g_byte_array_append (
+          test->body, (const guint8 *) items[i].value, items[i].len);
+    else {
+      size_t n;
+
+      /* Generated long value */
+      g_byte_array_set_size (test->body, test->body->len + items[i].len);
+      for (n = 0; n < items[i].len; n++)
+        test->body->data[test->start[i] + n] = 'a' + n % 26;
+    }
+    test->end[i] = test->body->len;
+  }
+}
+
+static void
+test_func (
+    uint32_t code, const unsigned char *data, size_t len, void *user_data)
+{
+  TestRun *run = user_data;
+
+  /* Skip split values */
+  while (run->count < G_N_ELEMENTS (items) && run->skipped[run->count])
+    run->count++;
+
+  /* Check item */
+  if (run->count >= G_N_ELEMENTS (items) || code != items[run->count].code ||
+      len != items[run->count].len ||
+      memcmp (data, test_value (run->test, run->count), len)) {
+    run->ok = false;
+    return;
+  }
+  run->count++;
+}
+
+static bool
+test_feed (const TestBody *test, const size_t *splits, unsigned int count)
+{
+  MeloAirplayDmapParser parser;
+  TestRun run = {.test = test, .ok = true};
+  size_t prev = 0;
+  unsigned int i, j;
+
+  /* Values over maximum size are skipped when split */
+  for (i = 0; i < G_N_ELEMENTS (items); i++)
+    if (items[i].len > MELO_AIRPLAY_DMAP_MAX_VALUE)
+      for (j = 0; j < count; j++)
+        if (splits[j] > test->start[i] && splits[j] < test->end[i])
+          run.skipped[i] = true;
+
+  /* Feed chunks */
+  melo_airplay_dmap_parser_reset (&parser);
+  for (j = 0; j <= count; j++) {
+    size_t next = j < count ? splits[j] : test->body->len;
+
+    melo_airplay_dmap_parser_feed (&parser, test->body->data + prev,
+        next - prev, test_func, &run);
+    prev = next;
+  }
+
+  /* All items passed */
+  while (run.count < G_N_ELEMENTS (items) && run.skipped[run.count])
+    run.count++;
+
+  return run.ok && run.count == G_N_ELEMENTS (items) &&
+         melo_airplay_dmap_parser_is_complete (&parser);
+}
+
+static bool
+test_truncated (const TestBody *test, size_t size)
+{
+  MeloAirplayDmapParser parser;
+  TestRun run = {.test = test, .ok = true};
+  bool boundary = size == 0 || size == 8;
+  unsigned int i;
+
+  /* Truncated at an item boundary */
+  for (i = 0; i < G_N_ELEMENTS (items); i++)
+    if (test->end[i] == size)
+      boundary = true;
+
+  melo_airplay_dmap_parser_reset (&parser);
+  melo_airplay_dmap_parser_feed (
+      &parser, test->body->data, size, test_func, &run);
+
+  return run.ok && melo_airplay_dmap_parser_is_complete (&parser) == boundary;
+}
+
+int
+main (int argc, char *argv[])
+{
+  TestBody test;
+  size_t *splits;
+  size_t i;
+  int ret = 0;
+
+  test_body_init (&test);
+
+  /* Two chunks, split at every offset */
+  for (i = 0; i <= test.body->len; i++) {
+    if (!test_feed (&test, &i, 1)) {
+      fprintf (stderr, "split at %zu: unexpected items\n", i);
+      ret = 1;
+    }
+  }
+
+  /* One byte per chunk */
+  splits = g_new (size_t, test.body->len);
+  for (i = 0; i < test.body->len; i++)
+    splits[i] = i;
+  if (!test_feed (&test, splits, test.body->len)) {
+    fprintf (stderr, "byte chunks: unexpected items\n");
+    ret = 1;
+  }
+  g_free (splits);
+
+  /* Truncated bodies */
+  for (i = 0; i < test.body->len; i++) {
+    if (!test_truncated (&test, i)) {
+      fprintf (stderr, "truncated at %zu: unexpected state\n", i);
+      ret = 1;
+    }
+  }
+
+  printf ("%u items, %u bytes: %u splits\n",
+      (unsigned int) G_N_ELEMENTS (items), test.body->len, test.body->len + 1);
+  g_byte_array_unref (test.body);
+
+  return ret;
+}
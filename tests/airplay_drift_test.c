@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+/*
+ * Closed loop simulation of the drift estimator: a sender with a known clock
+ * offset sends a sync packet every second, received after a random network
+ * delay, while the output renders the resampled stream with its own clock
+ * offset from the local clock. The rendered RTP time must stay within a few
+ * milliseconds of the sender RTP time for hours, once the first minutes have
+ * passed.
+ */
+
+#include <stdio.h>
+
+#include <glib.h>
+
+#include "melo_airplay_drift.h"
+
+/* Simulated session and time before residual is checked (in s) */
+#define TEST_DURATION (4 * 3600)
+#define TEST_SETTLE 600
+
+/* Largest accepted residual phase error (in ms) */
+#define TEST_MAX_RESIDUAL 5.0
+
+#define TEST_SAMPLERATE 44100
+#define TEST_LATENCY (2 * TEST_SAMPLERATE)
+
+typedef struct {
+  const char *name;
+  double sender_ppm;
+  double output_ppm;
+  int jitter;
+} TestCase;
+
+static const TestCase cases[] = {
+    {"no drift", 0, 0, 10000},
+    {"sender fast", 100, 0, 10000},
+    {"sender slow", -250, 0, 10000},
+    {"output fast", 0, 60, 10000},
+    {"both", 500, -80, 10000},
+    {"high jitter", -120, 30, 40000},
+};
+
+static bool
+test_run (const TestCase *test, GRand *rand)
+{
+  double sender_rate = TEST_SAMPLERATE * (1.0 + test->sender_ppm / 1e6);
+  double output_rate = TEST_SAMPLERATE * (1.0 + test->output_ppm / 1e6);
+  double rtptime0 = 0xfff00000u, position, phase, ref = 0, max = 0;
+  double ratio = 1.0, next;
+  MeloAirplayDrift drift;
+  int64_t t, arrival;
+  uint32_t pos;
+
+  melo_airplay_drift_reset (&drift, TEST_SAMPLERATE);
+  position = rtptime0 - TEST_LATENCY;
+
+  for (t = 0; t < TEST_DURATION; t++) {
+    double rtptime = rtptime0 + sender_rate * t;
+
+    /* Render position drifts with output clock and resampling ratio */
+    phase = position - rtptime;
+    if (t == TEST_SETTLE)
+      ref = phase;
+    else if (t > TEST_SETTLE && ABS (phase - ref) > max)
+      max = ABS (phase - ref);
+
+    /* Sync packet received after network delay */
+    arrival = 2000 + g_rand_int_range (rand, 0, test->jitter);
+    position += output_rate / ratio * arrival / 1e6;
+    pos = (uint32_t) (int64_t) position;
+    if (melo_airplay_drift_add (&drift, (uint32_t) (int64_t) rtptime,
+            t * 1000000 + arrival, &pos, &next))
+      ratio = next;
+    position += output_rate / ratio * (1000000 - arrival) / 1e6;
+  }
+
+  /* Residual in ms */
+  max = max * 1000.0 / TEST_SAMPLERATE;
+  printf ("%-12s sender=%+5.0f ppm output=%+4.0f ppm: ratio=%+7.1f ppm "
+          "residual=%.2f ms\n",
+      test->name, test->sender_ppm, test->output_ppm, (ratio - 1.0) * 1e6,
+      max);
+
+  return max <= TEST_MAX_RESIDUAL;
+}
+
+int
+main (int argc, char *argv[])
+{
+  GRand *rand;
+  unsigned int i;
+  int ret = 0;
+
+  /* Reproducible network delays */
+  rand = g_rand_new_with_seed (0x1d7);
+
+  for (i = 0; i < G_N_ELEMENTS (cases); i++) {
+    if (!test_run (&cases[i], rand)) {
+      fprintf (stderr, "%s: residual too large\n", cases[i].name);
+      ret = 1;
+    }
+  }
+  g_rand_free (rand);
+
+  return ret;
+}
@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+/*
+ * Loopback load test of HTTP restreaming: hundreds of clients read the raw
+ * stream while a tap thread pushes numbered buffers. Every client must
+ * receive the exact same bytes, from first to last buffer, and a client which
+ * stops reading must be dropped while the tap never waits.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <gio/gio.h>
+#include <gst/gst.h>
+
+#include "melo_airplay_http.h"
+
+/* Longest accepted push, far above a mutex and a reference */
+#define TEST_MAX_PUSH_TIME 10000
+
+static int port = 18080;
+static int clients = 200;
+static int buffers = 800;
+static int buffer_size = 8192;
+static int period = 4;
+
+static GOptionEntry entries[] = {
+    {"port", 'p', 0, G_OPTION_ARG_INT, &port, "HTTP port", "PORT"},
+    {"clients", 'n', 0, G_OPTION_ARG_INT, &clients, "Client count", "N"},
+    {"buffers", 'b', 0, G_OPTION_ARG_INT, &buffers, "Pushed buffer count",
+        "N"},
+    {"size", 's', 0, G_OPTION_ARG_INT, &buffer_size, "Buffer size (in bytes)",
+        "SIZE"},
+    {"period", 'P', 0, G_OPTION_ARG_INT, &period,
+        "Period of pushed buffers (in ms)", "MS"},
+    {NULL},
+};
+
+typedef struct {
+  GMainContext *context;
+  MeloAirplayHttp *http;
+  int ready;
+  int done;
+  int failed;
+  int slow_dropped;
+  gint64 max_push;
+} TestRun;
+
+static inline guint8
+test_pattern (int seq, int offset)
+{
+  return (guint8) (seq * 131 + offset * 7 + (offset >> 8));
+}
+
+static void
+test_finish (TestRun *run, bool ok)
+{
+  if (!ok)
+    g_atomic_int_set (&run->failed, 1);
+  g_atomic_int_inc (&run->done);
+  g_main_context_wakeup (run->context);
+}
+
+static GSocket *
+test_connect (bool slow)
+{
+  GSocketAddress *addr;
+  GInetAddress *inet;
+  GSocket *sock;
+  int size = 4096;
+  const char *req = "GET /stream.raw HTTP/1.0\r\n\r\n";
+  char c, end[4] = {0};
+
+  sock = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM,
+      G_SOCKET_PROTOCOL_TCP, NULL);
+  if (!sock)
+    return NULL;
+
+  /* Keep slow client receive window small, so writes to it block soon */
+  if (slow)
+    g_socket_set_option (sock, SOL_SOCKET, SO_RCVBUF, size, NULL);
+  g_socket_set_timeout (sock, 10);
+
+  /* Connect and send request */
+  inet = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  addr = g_inet_socket_address_new (inet, port);
+  g_object_unref (inet);
+  if (!g_socket_connect (sock, addr, NULL, NULL) ||
+      g_socket_send (sock, req, strlen (req), NULL, NULL) !=
+          (gssize) strlen (req)) {
+    g_object_unref (addr);
+    g_object_unref (sock);
+    return NULL;
+  }
+  g_object_unref (addr);
+
+  /* Skip response header */
+  while (memcmp (end, "\r\n\r\n", 4)) {
+    if (g_socket_receive (sock, &c, 1, NULL, NULL) != 1) {
+      g_object_unref (sock);
+      return NULL;
+    }
+    memmove (end, end + 1, 3);
+    end[3] = c;
+  }
+
+  return sock;
+}
+
+static gpointer
+test_client (TestRun *run)
+{
+  size_t total = (size_t) buffers * buffer_size, pos = 0, i;
+  char *buf = g_malloc (buffer_size);
+  GSocket *sock;
+  gssize len;
+  bool ok = true;
+
+  sock = test_connect (false);
+  g_atomic_int_inc (&run->ready);
+  if (!sock) {
+    g_free (buf);
+    test_finish (run, false);
+    return NULL;
+  }
+
+  /* Check each byte of each buffer, from first to last */
+  while (ok && pos < total) {
+    len = g_socket_receive (sock, buf, MIN (total - pos, (size_t) buffer_size),
+        NULL, NULL);
+    if (len <= 0) {
+      fprintf (stderr, "client dropped after %zu bytes\n", pos);
+      ok = false;
+      break;
+    }
+    for (i = 0; i < (size_t) len; i++, pos++)
+      if ((guint8) buf[i] !=
+          test_pattern (pos / buffer_size, pos % buffer_size)) {
+        fprintf (stderr, "client data differs at %zu\n", pos);
+        ok = false;
+        break;
+      }
+  }
+
+  g_object_unref (sock);
+  g_free (buf);
+  test_finish (run, ok);
+
+  return NULL;
+}
+
+static gpointer
+test_slow_client (TestRun *run)
+{
+  size_t total = (size_t) buffers * buffer_size, pos = 0;
+  char buf[4096];
+  GSocket *sock;
+  gssize len;
+
+  sock = test_connect (true);
+  g_atomic_int_inc (&run->ready);
+  if (!sock) {
+    test_finish (run, false);
+    return NULL;
+  }
+
+  /* Stop reading until last buffer is pushed */
+  while (g_atomic_int_get (&run->done) < clients + 1)
+    g_usleep (10000);
+
+  /* Then stream must have been closed before its end */
+  while ((len = g_socket_receive (sock, buf, sizeof (buf), NULL, NULL)) > 0)
+    pos += len;
+  g_atomic_int_set (&run->slow_dropped, !len && pos < total);
+
+  g_object_unref (sock);
+  test_finish (run, true);
+
+  return NULL;
+}
+
+static gpointer
+test_tap (TestRun *run)
+{
+  GstBuffer *buffer;
+  GstMapInfo map;
+  gint64 start, next;
+  int seq, i;
+
+  /* Wait for all clients to be streaming */
+  while (g_atomic_int_get (&run->ready) < clients + 1)
+    g_usleep (1000);
+
+  /* Push numbered buffers at a steady rate */
+  next = g_get_monotonic_time ();
+  for (seq = 0; seq < buffers; seq++) {
+    buffer = gst_buffer_new_allocate (NULL, buffer_size, NULL);
+    gst_buffer_map (buffer, &map, GST_MAP_WRITE);
+    for (i = 0; i < buffer_size; i++)
+      map.data[i] = test_pattern (seq, i);
+    gst_buffer_unmap (buffer, &map);
+
+    start = g_get_monotonic_time ();
+    melo_airplay_http_push (run->http, buffer);
+    run->max_push = MAX (run->max_push, g_get_monotonic_time () - start);
+    gst_buffer_unref (buffer);
+
+    next += period * 1000;
+    if (next > g_get_monotonic_time ())
+      g_usleep (next - g_get_monotonic_time ());
+  }
+
+  test_finish (run, true);
+
+  return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+  TestRun run = {0};
+  GOptionContext *ctx;
+  GError *error = NULL;
+  GThread **threads;
+  GString *str;
+  int i, count;
+  bool ok;
+
+  /* Parse options */
+  ctx = g_option_context_new ("- AirPlay HTTP restreaming load test");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  if (!g_option_context_parse (ctx, &argc, &argv, &error)) {
+    fprintf (stderr, "%s\n", error->message);
+    g_error_free (error);
+    g_option_context_free (ctx);
+    return 1;
+  }
+  g_option_context_free (ctx);
+  if (clients < 1 || buffers < 1 || buffer_size < 1 || period < 0)
+    return 1;
+  gst_init (NULL, NULL);
+
+  /* Run server from this thread */
+  run.context = g_main_context_new ();
+  g_main_context_push_thread_default (run.context);
+  run.http = melo_airplay_http_new (port);
+  if (!run.http)
+    return 1;
+  melo_airplay_http_set_format (run.http, 44100, 2, 16, false);
+
+  /* Start clients and tap */
+  count = clients + 2;
+  threads = g_new (GThread *, count);
+  for (i = 0; i < clients; i++)
+    threads[i] = g_thread_new ("client", (GThreadFunc) test_client, &run);
+  threads[i++] =
+      g_thread_new ("slow_client", (GThreadFunc) test_slow_client, &run);
+  threads[i] = g_thread_new ("tap", (GThreadFunc) test_tap, &run);
+
+  /* Serve until all threads are done */
+  while (g_atomic_int_get (&run.done) < count)
+    g_main_context_iteration (run.context, TRUE);
+  for (i = 0; i < count; i++)
+    g_thread_join (threads[i]);
+  g_free (threads);
+
+  /* Print statistics */
+  str = g_string_new (NULL);
+  melo_airplay_http_dump (run.http, str);
+  printf ("%d clients, %d buffers of %d bytes: %slongest push %" G_GINT64_FORMAT
+          " us\n",
+      clients, buffers, buffer_size, str->str, run.max_push);
+  g_string_free (str, TRUE);
+
+  melo_airplay_http_free (run.http);
+  g_main_context_pop_thread_default (run.context);
+  g_main_context_unref (run.context);
+
+  /* Check results */
+  ok = !run.failed;
+  if (!run.slow_dropped) {
+    fprintf (stderr, "slow client not dropped\n");
+    ok = false;
+  }
+  if (run.max_push > TEST_MAX_PUSH_TIME) {
+    fprintf (stderr, "tap stalled\n");
+    ok = false;
+  }
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,574 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+/*
+ * Loopback test of the relay: fake RAOP receivers (RTSP server, UDP data and
+ * control sockets) are started on loopback, and a relay to all of them is fed
+ * with numbered frames. Each receiver decrypts every packet with the key
+ * announced to it and checks its content, drops some packets on purpose to
+ * request their retransmission, and counts sync packets. The stream must be
+ * complete on every receiver once the relay is freed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gio/gio.h>
+
+#include <openssl/aes.h>
+#include <openssl/bio.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include "melo_airplay_pkey.h"
+#include "melo_airplay_relay.h"
+
+/* Stream parameters */
+#define TEST_FMTP "96 352 0 16 40 10 14 2 255 0 0 44100"
+#define TEST_SAMPLERATE 44100
+#define TEST_FRAMES 352
+#define TEST_FRAME_SIZE 300
+
+/* Every Nth packet is dropped and its retransmission requested */
+#define TEST_DROP_PERIOD 50
+
+/* Maximum packets checked per receiver and receiver timeout (in s) */
+#define TEST_MAX_PACKETS 2048
+#define TEST_TIMEOUT 30
+
+typedef struct {
+  GThread *thread;
+  GSocket *listener;
+  GSocket *data;
+  GSocket *ctrl;
+  unsigned int port;
+  unsigned int data_port;
+  unsigned int ctrl_port;
+
+  /* Stream from relay */
+  RSA *pkey;
+  AES_KEY key;
+  uint8_t iv[16];
+  bool announced;
+  bool recording;
+  uint16_t start_seq;
+  unsigned int relay_ctrl_port;
+
+  /* Received packets, indexed from first sequence number */
+  uint8_t received[TEST_MAX_PACKETS];
+  unsigned int count;
+
+  /* Results */
+  unsigned int packets;
+  unsigned int requested;
+  unsigned int retransmitted;
+  unsigned int syncs;
+  unsigned int errors;
+  bool first_sync;
+  bool teardown;
+} TestReceiver;
+
+static int targets = 8;
+static int duration = 3;
+
+static GOptionEntry entries[] = {
+    {"targets", 'n', 0, G_OPTION_ARG_INT, &targets, "Receiver count (max 16)",
+        "N"},
+    {"duration", 'd', 0, G_OPTION_ARG_INT, &duration,
+        "Streaming duration (in s)", "S"},
+    {NULL},
+};
+
+static inline uint8_t
+test_pattern (uint32_t rtptime, unsigned int offset)
+{
+  return (uint8_t) (rtptime / TEST_FRAMES * 7 + offset * 13 + (offset >> 4));
+}
+
+static inline uint16_t
+get_be16 (const uint8_t *data)
+{
+  return data[0] << 8 | data[1];
+}
+
+static inline uint32_t
+get_be32 (const uint8_t *data)
+{
+  return (uint32_t) data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+static inline void
+put_be16 (uint8_t *data, uint16_t value)
+{
+  data[0] = value >> 8;
+  data[1] = value;
+}
+
+static GSocket *
+test_bind (GSocketType type, unsigned int *port)
+{
+  GSocketAddress *addr;
+  GInetAddress *inet;
+  GSocket *sock;
+
+  sock = g_socket_new (G_SOCKET_FAMILY_IPV4, type,
+      type == G_SOCKET_TYPE_STREAM ? G_SOCKET_PROTOCOL_TCP
+                                   : G_SOCKET_PROTOCOL_UDP,
+      NULL);
+  if (!sock)
+    return NULL;
+
+  /* Bind on any free loopback port */
+  inet = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  addr = g_inet_socket_address_new (inet, 0);
+  g_object_unref (inet);
+  if (!g_socket_bind (sock, addr, TRUE, NULL) ||
+      (type == G_SOCKET_TYPE_STREAM && !g_socket_listen (sock, NULL))) {
+    g_object_unref (addr);
+    g_object_unref (sock);
+    return NULL;
+  }
+  g_object_unref (addr);
+
+  /* Get port */
+  addr = g_socket_get_local_address (sock, NULL);
+  *port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (addr));
+  g_object_unref (addr);
+
+  return sock;
+}
+
+static char *
+test_get_header (const char *request, const char *name)
+{
+  size_t len = strlen (name);
+  const char *line = request;
+
+  /* Find header line, after request line */
+  while ((line = strstr (line, "\r\n"))) {
+    line += 2;
+    if (g_ascii_strncasecmp (line, name, len) || line[len] != ':')
+      continue;
+
+    line += len + 1;
+    while (*line == ' ')
+      line++;
+    return g_strndup (line, strcspn (line, "\r\n"));
+  }
+
+  return NULL;
+}
+
+static unsigned int
+test_get_value (const char *str, const char *name)
+{
+  const char *p = str ? strstr (str, name) : NULL;
+
+  return p ? strtoul (p + strlen (name), NULL, 10) : 0;
+}
+
+static guchar *
+test_get_base64 (const char *sdp, const char *name, gsize *len)
+{
+  const char *p = strstr (sdp, name);
+  char *str;
+  size_t n;
+
+  if (!p)
+    return NULL;
+  p += strlen (name);
+  n = strcspn (p, "\r\n");
+
+  /* Padding is stripped by senders */
+  str = g_malloc (n + 4);
+  memcpy (str, p, n);
+  while (n % 4)
+    str[n++] = '=';
+  str[n] = '\0';
+
+  return g_base64_decode_inplace (str, len);
+}
+
+static bool
+test_announce (TestReceiver *rcv, const char *sdp)
+{
+  unsigned char aes_key[256];
+  guchar *key, *iv;
+  gsize key_len = 0, iv_len = 0;
+  int len = -1;
+
+  /* Decrypt AES key with private key */
+  key = test_get_base64 (sdp, "a=rsaaeskey:", &key_len);
+  iv = test_get_base64 (sdp, "a=aesiv:", &iv_len);
+  if (key && iv && iv_len == sizeof (rcv->iv) && key_len <= sizeof (aes_key))
+    len = RSA_private_decrypt (
+        key_len, key, aes_key, rcv->pkey, RSA_PKCS1_OAEP_PADDING);
+  if (len == 16) {
+    AES_set_decrypt_key (aes_key, 128, &rcv->key);
+    memcpy (rcv->iv, iv, sizeof (rcv->iv));
+    rcv->announced = true;
+  }
+  g_free (key);
+  g_free (iv);
+
+  return len == 16 && strstr (sdp, "a=fmtp:" TEST_FMTP "\r\n");
+}
+
+static bool
+test_request (TestReceiver *rcv, GSocket *conn, const char *request,
+    const char *body)
+{
+  char *cseq, *value, *headers = NULL, *response;
+  bool ret = true;
+
+  cseq = test_get_header (request, "CSeq");
+
+  /* Handle request */
+  if (g_str_has_prefix (request, "ANNOUNCE ")) {
+    ret = test_announce (rcv, body);
+  } else if (g_str_has_prefix (request, "SETUP ")) {
+    value = test_get_header (request, "Transport");
+    rcv->relay_ctrl_port = test_get_value (value, "control_port=");
+    g_free (value);
+    ret = rcv->announced && rcv->relay_ctrl_port;
+    headers = g_strdup_printf (
+        "Transport: RTP/AVP/UDP;unicast;mode=record;server_port=%u;"
+        "control_port=%u\r\nSession: 1\r\n",
+        rcv->data_port, rcv->ctrl_port);
+  } else if (g_str_has_prefix (request, "RECORD ")) {
+    value = test_get_header (request, "RTP-Info");
+    rcv->start_seq = test_get_value (value, "seq=");
+    rcv->recording = value != NULL;
+    ret = rcv->recording;
+    g_free (value);
+  } else if (g_str_has_prefix (request, "TEARDOWN ")) {
+    rcv->teardown = true;
+  }
+  if (!ret)
+    rcv->errors++;
+
+  /* Send response */
+  response = g_strdup_printf ("RTSP/1.0 %s\r\nCSeq: %s\r\n%s\r\n",
+      ret ? "200 OK" : "400 Bad Request", cseq ? cseq : "0",
+      headers ? headers : "");
+  g_socket_send (conn, response, strlen (response), NULL, NULL);
+  g_free (response);
+  g_free (headers);
+  g_free (cseq);
+
+  return ret;
+}
+
+static void
+test_read_requests (TestReceiver *rcv, GSocket *conn, GString *in)
+{
+  char *end, *length, *request, *body;
+  size_t header, size;
+
+  /* Handle all complete requests */
+  while ((end = strstr (in->str, "\r\n\r\n"))) {
+    header = end + 4 - in->str;
+    length = test_get_header (in->str, "Content-Length");
+    size = length ? strtoul (length, NULL, 10) : 0;
+    g_free (length);
+    if (in->len < header + size)
+      break;
+
+    request = g_strndup (in->str, header);
+    body = g_strndup (in->str + header, size);
+    test_request (rcv, conn, request, body);
+    g_free (request);
+    g_free (body);
+    g_string_erase (in, 0, header + size);
+  }
+}
+
+static void
+test_request_retransmit (TestReceiver *rcv, uint16_t seq)
+{
+  GSocketAddress *addr;
+  GInetAddress *inet;
+  uint8_t buf[8];
+
+  /* Ask relay control socket for one packet */
+  buf[0] = 0x80;
+  buf[1] = 0xd5;
+  put_be16 (buf + 2, 1);
+  put_be16 (buf + 4, seq);
+  put_be16 (buf + 6, 1);
+
+  inet = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  addr = g_inet_socket_address_new (inet, rcv->relay_ctrl_port);
+  g_object_unref (inet);
+  g_socket_send_to (rcv->ctrl, addr, (gchar *) buf, sizeof (buf), NULL, NULL);
+  g_object_unref (addr);
+  rcv->requested++;
+}
+
+static void
+test_receive_packet (
+    TestReceiver *rcv, const uint8_t *p, size_t len, bool retransmit)
+{
+  uint8_t out[TEST_FRAME_SIZE], iv[16];
+  unsigned int idx, i;
+  uint32_t rtptime;
+  size_t aes_len;
+
+  if (!rcv->recording || len != 12 + TEST_FRAME_SIZE) {
+    rcv->errors++;
+    return;
+  }
+  idx = (uint16_t) (get_be16 (p + 2) - rcv->start_seq);
+  rtptime = get_be32 (p + 4);
+  if (idx >= TEST_MAX_PACKETS) {
+    rcv->errors++;
+    return;
+  }
+
+  if (!retransmit) {
+    /* Request lost packets */
+    for (i = rcv->count; i < idx; i++)
+      test_request_retransmit (rcv, rcv->start_seq + i);
+    rcv->count = MAX (rcv->count, idx + 1);
+
+    /* Drop packet on purpose */
+    if (idx % TEST_DROP_PERIOD == TEST_DROP_PERIOD - 1) {
+      test_request_retransmit (rcv, rcv->start_seq + idx);
+      return;
+    }
+  }
+
+  /* Decrypt full blocks, remaining bytes are in clear */
+  aes_len = TEST_FRAME_SIZE & ~0xf;
+  memcpy (iv, rcv->iv, sizeof (iv));
+  AES_cbc_encrypt (p + 12, out, aes_len, &rcv->key, iv, AES_DECRYPT);
+  memcpy (out + aes_len, p + 12 + aes_len, TEST_FRAME_SIZE - aes_len);
+
+  /* Check frame content */
+  for (i = 0; i < TEST_FRAME_SIZE; i++)
+    if (out[i] != test_pattern (rtptime, i)) {
+      rcv->errors++;
+      return;
+    }
+
+  if (retransmit)
+    rcv->retransmitted++;
+  else
+    rcv->packets++;
+  rcv->received[idx] = 1;
+}
+
+static void
+test_receive_control (TestReceiver *rcv)
+{
+  uint8_t buf[2048];
+  gssize len;
+
+  len = g_socket_receive (rcv->ctrl, (gchar *) buf, sizeof (buf), NULL, NULL);
+  if (len < 4)
+    return;
+
+  if ((buf[1] & 0x7f) == 0x54 && len == 20) {
+    /* Sync: next RTP time is 2 seconds ahead */
+    if (!rcv->syncs)
+      rcv->first_sync = buf[0] == 0x90;
+    if (get_be32 (buf + 16) - get_be32 (buf + 4) != 2 * TEST_SAMPLERATE)
+      rcv->errors++;
+    rcv->syncs++;
+  } else if ((buf[1] & 0x7f) == 0x56) {
+    /* Retransmit reply: original packet follows */
+    test_receive_packet (rcv, buf + 4, len - 4, true);
+  } else
+    rcv->errors++;
+}
+
+static gpointer
+test_receiver (TestReceiver *rcv)
+{
+  GSocket *conn;
+  GPollFD fds[3];
+  GString *in;
+  gint64 end;
+  char buf[4096];
+  gssize len;
+
+  /* Accept relay connection */
+  g_socket_set_timeout (rcv->listener, TEST_TIMEOUT);
+  conn = g_socket_accept (rcv->listener, NULL, NULL);
+  if (!conn) {
+    rcv->errors++;
+    return NULL;
+  }
+
+  /* Serve RTSP, data and control until stream is stopped */
+  fds[0].fd = g_socket_get_fd (conn);
+  fds[1].fd = g_socket_get_fd (rcv->data);
+  fds[2].fd = g_socket_get_fd (rcv->ctrl);
+  fds[0].events = fds[1].events = fds[2].events = G_IO_IN;
+  end = g_get_monotonic_time () + TEST_TIMEOUT * G_USEC_PER_SEC;
+  in = g_string_new (NULL);
+  while (!rcv->teardown && g_get_monotonic_time () < end) {
+    if (g_poll (fds, 3, 100) <= 0)
+      continue;
+
+    if (fds[0].revents & (G_IO_IN | G_IO_HUP)) {
+      len = g_socket_receive (conn, buf, sizeof (buf), NULL, NULL);
+      if (len <= 0)
+        break;
+      g_string_append_len (in, buf, len);
+      test_read_requests (rcv, conn, in);
+    }
+    if (fds[1].revents & G_IO_IN) {
+      len = g_socket_receive (rcv->data, buf, sizeof (buf), NULL, NULL);
+      if (len > 0)
+        test_receive_packet (rcv, (uint8_t *) buf, len, false);
+    }
+    if (fds[2].revents & G_IO_IN)
+      test_receive_control (rcv);
+  }
+  g_string_free (in, TRUE);
+  g_object_unref (conn);
+
+  return NULL;
+}
+
+static bool
+test_receiver_check (TestReceiver *rcv, unsigned int id)
+{
+  unsigned int i, missing = 0;
+  bool ret = true;
+
+  for (i = 0; i < rcv->count; i++)
+    if (!rcv->received[i])
+      missing++;
+
+  printf ("receiver %u: packets=%u requested=%u retransmitted=%u syncs=%u "
+          "errors=%u\n",
+      id, rcv->packets, rcv->requested, rcv->retransmitted, rcv->syncs,
+      rcv->errors);
+
+  if (!rcv->recording || rcv->count < TEST_DROP_PERIOD || missing) {
+    fprintf (stderr, "receiver %u: %u / %u packets missing\n", id, missing,
+        rcv->count);
+    ret = false;
+  }
+  if (!rcv->requested || rcv->retransmitted != rcv->requested) {
+    fprintf (stderr, "receiver %u: retransmits missing\n", id);
+    ret = false;
+  }
+  if (rcv->syncs < 2 || !rcv->first_sync) {
+    fprintf (stderr, "receiver %u: sync missing\n", id);
+    ret = false;
+  }
+  if (!rcv->teardown || rcv->errors) {
+    fprintf (stderr, "receiver %u: invalid stream\n", id);
+    ret = false;
+  }
+
+  return ret;
+}
+
+int
+main (int argc, char *argv[])
+{
+  MeloAirplayRelay *relay;
+  TestReceiver *rcvs;
+  GOptionContext *ctx;
+  GError *error = NULL;
+  GString *list, *str;
+  uint8_t frame[TEST_FRAME_SIZE];
+  uint32_t rtptime = 0;
+  gint64 next;
+  unsigned int i, j, count;
+  BIO *temp_bio;
+  bool ok = true;
+
+  /* Parse options */
+  ctx = g_option_context_new ("- AirPlay relay loopback test");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  if (!g_option_context_parse (ctx, &argc, &argv, &error)) {
+    fprintf (stderr, "%s\n", error->message);
+    g_error_free (error);
+    g_option_context_free (ctx);
+    return 1;
+  }
+  g_option_context_free (ctx);
+  if (targets < 1 || targets > 16 || duration < 1)
+    return 1;
+
+  /* Start receivers */
+  rcvs = g_new0 (TestReceiver, targets);
+  list = g_string_new (NULL);
+  for (i = 0; i < (unsigned int) targets; i++) {
+    TestReceiver *rcv = &rcvs[i];
+
+    temp_bio = BIO_new_mem_buf (AIRPORT_PRIVATE_KEY, -1);
+    rcv->pkey = PEM_read_bio_RSAPrivateKey (temp_bio, NULL, NULL, NULL);
+    BIO_free (temp_bio);
+    rcv->listener = test_bind (G_SOCKET_TYPE_STREAM, &rcv->port);
+    rcv->data = test_bind (G_SOCKET_TYPE_DATAGRAM, &rcv->data_port);
+    rcv->ctrl = test_bind (G_SOCKET_TYPE_DATAGRAM, &rcv->ctrl_port);
+    if (!rcv->pkey || !rcv->listener || !rcv->data || !rcv->ctrl)
+      return 1;
+    rcv->thread =
+        g_thread_new ("receiver", (GThreadFunc) test_receiver, rcv);
+    g_string_append_printf (list, "%s127.0.0.1:%u", i ? "," : "", rcv->port);
+  }
+
+  /* Relay numbered frames at stream rate */
+  relay = melo_airplay_relay_new (list->str, TEST_FMTP, TEST_SAMPLERATE);
+  g_string_free (list, TRUE);
+  if (!relay)
+    return 1;
+  count = duration * TEST_SAMPLERATE / TEST_FRAMES;
+  next = g_get_monotonic_time ();
+  for (i = 0; i < count; i++, rtptime += TEST_FRAMES) {
+    for (j = 0; j < TEST_FRAME_SIZE; j++)
+      frame[j] = test_pattern (rtptime, j);
+    if (!i)
+      melo_airplay_relay_set_render (relay, rtptime, next);
+    melo_airplay_relay_push (relay, rtptime, frame, sizeof (frame));
+
+    next += TEST_FRAMES * G_USEC_PER_SEC / TEST_SAMPLERATE;
+    if (next > g_get_monotonic_time ())
+      g_usleep (next - g_get_monotonic_time ());
+  }
+
+  /* Let last retransmits complete, then stop streams */
+  g_usleep (500000);
+  str = g_string_new (NULL);
+  melo_airplay_relay_dump (relay, str);
+  printf ("%s", str->str);
+  g_string_free (str, TRUE);
+  melo_airplay_relay_free (relay);
+
+  /* Check results */
+  for (i = 0; i < (unsigned int) targets; i++) {
+    TestReceiver *rcv = &rcvs[i];
+
+    g_thread_join (rcv->thread);
+    ok &= test_receiver_check (rcv, i);
+    g_object_unref (rcv->listener);
+    g_object_unref (rcv->data);
+    g_object_unref (rcv->ctrl);
+    RSA_free (rcv->pkey);
+  }
+  g_free (rcvs);
+
+  return ok ? 0 : 1;
+}
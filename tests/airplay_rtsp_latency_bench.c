@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+/*
+ * RTSP control latency under a synthetic main loop load: the default main
+ * context is kept busy by a callback blocking it periodically, as browsing,
+ * settings or cover writes would, while OPTIONS requests are timed.
+ *
+ * The same requests are sent first to a plain RTSP server attached to the
+ * default context, as the AirPlay server was before, then to the AirPlay
+ * server running on its dedicated thread and context.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gio/gio.h>
+
+#include <melo/melo_rtsp_server.h>
+
+#include "melo_airplay_player.h"
+#include "melo_airplay_rtsp.h"
+
+/* Default port of the AirPlay server, without player */
+#define BENCH_PORT 5000
+
+typedef struct {
+  GMainLoop *loop;
+  gint64 *times;
+  int count;
+} BenchRun;
+
+static int requests = 200;
+static int load = 20;
+static int period = 50;
+
+static GOptionEntry entries[] = {
+    {"requests", 'n', 0, G_OPTION_ARG_INT, &requests, "Request count", "N"},
+    {"load", 'l', 0, G_OPTION_ARG_INT, &load,
+        "Time the main loop is blocked by each load callback (in ms)", "MS"},
+    {"period", 'p', 0, G_OPTION_ARG_INT, &period,
+        "Period of load callbacks (in ms)", "MS"},
+    {NULL},
+};
+
+static gboolean
+bench_load_cb (gpointer user_data)
+{
+  gint64 end = g_get_monotonic_time () + (gint64) load * 1000;
+
+  /* Keep main loop busy */
+  while (g_get_monotonic_time () < end)
+    ;
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+bench_request_cb (MeloRtspServerConnection *connection, MeloRtspMethod method,
+    const char *url, void *user_data, void **conn_data)
+{
+  /* Same response as AirPlay server */
+  if (method == MELO_RTSP_METHOD_OPTIONS)
+    melo_rtsp_server_connection_add_header (connection, "Public",
+        "ANNOUNCE, SETUP, RECORD, PAUSE,"
+        "FLUSH, TEARDOWN, OPTIONS, "
+        "GET_PARAMETER, SET_PARAMETER");
+}
+
+static bool
+bench_request (GSocketConnection *conn, int cseq)
+{
+  GOutputStream *output;
+  GInputStream *input;
+  char buf[1024], *req;
+  gsize len = 0;
+  gssize size;
+  bool ret;
+
+  /* Send request */
+  req = g_strdup_printf ("OPTIONS * RTSP/1.0\r\nCSeq: %d\r\n\r\n", cseq);
+  output = g_io_stream_get_output_stream (G_IO_STREAM (conn));
+  ret = g_output_stream_write_all (output, req, strlen (req), NULL, NULL, NULL);
+  g_free (req);
+  if (!ret)
+    return false;
+
+  /* Read response headers */
+  input = g_io_stream_get_input_stream (G_IO_STREAM (conn));
+  while (len < sizeof (buf) - 1) {
+    size = g_input_stream_read (input, buf + len, sizeof (buf) - len - 1,
+        NULL, NULL);
+    if (size <= 0)
+      return false;
+    len += size;
+    buf[len] = '\0';
+    if (strstr (buf, "\r\n\r\n"))
+      return !strncmp (buf, "RTSP/1.0 200", 12);
+  }
+
+  return false;
+}
+
+static gpointer
+bench_client (BenchRun *run)
+{
+  GSocketClient *client;
+  GSocketConnection *conn;
+  GError *error = NULL;
+  gint64 start;
+  int i;
+
+  /* Connect to server */
+  client = g_socket_client_new ();
+  conn = g_socket_client_connect_to_host (
+      client, "127.0.0.1", BENCH_PORT, NULL, &error);
+  g_object_unref (client);
+  if (!conn) {
+    fprintf (stderr, "failed to connect: %s\n", error->message);
+    g_error_free (error);
+    g_main_loop_quit (run->loop);
+    return NULL;
+  }
+
+  /* Time requests, out of phase with load */
+  for (i = 0; i < requests; i++) {
+    start = g_get_monotonic_time ();
+    if (!bench_request (conn, i + 1)) {
+      fprintf (stderr, "request %d failed\n", i + 1);
+      break;
+    }
+    run->times[run->count++] = g_get_monotonic_time () - start;
+    g_usleep (g_random_int_range (1, period + 1) * 1000);
+  }
+
+  g_io_stream_close (G_IO_STREAM (conn), NULL, NULL);
+  g_object_unref (conn);
+  g_main_loop_quit (run->loop);
+
+  return NULL;
+}
+
+static int
+bench_cmp (const void *a, const void *b)
+{
+  gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static bool
+bench_run (GMainLoop *loop, const char *name)
+{
+  BenchRun run = {loop, NULL, 0};
+  GThread *thread;
+
+  /* Send requests while main loop is loaded */
+  run.times = g_new (gint64, requests);
+  thread = g_thread_new ("bench_client", (GThreadFunc) bench_client, &run);
+  g_main_loop_run (loop);
+  g_thread_join (thread);
+
+  /* Print percentiles */
+  if (run.count == requests) {
+    qsort (run.times, run.count, sizeof (*run.times), bench_cmp);
+    printf ("%-16s p50 %7" G_GINT64_FORMAT " us, p99 %7" G_GINT64_FORMAT
+            " us, max %7" G_GINT64_FORMAT " us\n",
+        name, run.times[run.count / 2], run.times[run.count * 99 / 100],
+        run.times[run.count - 1]);
+  }
+  g_free (run.times);
+
+  return run.count == requests;
+}
+
+int
+main (int argc, char *argv[])
+{
+  MeloRtspServer *server;
+  MeloAirplayRtsp *rtsp;
+  GOptionContext *ctx;
+  GError *error = NULL;
+  GMainLoop *loop;
+  bool ret;
+
+  /* Parse options */
+  ctx = g_option_context_new ("- AirPlay RTSP latency benchmark");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  if (!g_option_context_parse (ctx, &argc, &argv, &error)) {
+    fprintf (stderr, "%s\n", error->message);
+    g_error_free (error);
+    g_option_context_free (ctx);
+    return 1;
+  }
+  g_option_context_free (ctx);
+  if (requests < 1 || load < 0 || period < 1)
+    return 1;
+
+  /* Load default main loop */
+  loop = g_main_loop_new (NULL, FALSE);
+  g_timeout_add (period, bench_load_cb, NULL);
+  printf ("main loop blocked %d ms every %d ms, %d requests\n", load, period,
+      requests);
+
+  /* Server on default context */
+  server = melo_rtsp_server_new ();
+  melo_rtsp_server_set_request_callback (server, bench_request_cb, NULL);
+  melo_rtsp_server_start (server, BENCH_PORT);
+  melo_rtsp_server_attach (server, NULL);
+  ret = bench_run (loop, "default context");
+  melo_rtsp_server_stop (server);
+  g_object_unref (server);
+
+  /* AirPlay server on its own thread */
+  rtsp = melo_airplay_rtsp_new ();
+  melo_airplay_rtsp_start (rtsp);
+  ret &= bench_run (loop, "dedicated thread");
+  melo_airplay_rtsp_stop (rtsp);
+  g_object_unref (rtsp);
+
+  g_main_loop_unref (loop);
+
+  return ret ? 0 : 1;
+}
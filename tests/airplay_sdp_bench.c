@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+/*
+ * ANNOUNCE body parsing cost: each corpus entry is parsed in a loop by the
+ * single-pass parser and by the GStreamer SDP parser followed by the walk of
+ * the audio media attributes, as the ANNOUNCE handler did before. The whole
+ * loop is timed, and both parsers must find the same attributes.
+ *
+ * Files given on command line are added to the corpus.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gst/sdp/sdp.h>
+
+#include "melo_airplay_sdp.h"
+
+typedef struct {
+  const char *name;
+  const char *body;
+} BenchEntry;
+
+static const BenchEntry corpus[] = {
+    {"itunes alac",
+        "v=0\r\no=iTunes 3413821438 0 IN IP4 192.168.1.10\r\ns=iTunes\r\n"
+        "c=IN IP4 192.168.1.20\r\nt=0 0\r\nm=audio 0 RTP/AVP 96\r\n"
+        "a=rtpmap:96 AppleLossless\r\n"
+        "a=fmtp:96 352 0 16 40 10 14 2 255 0 0 44100\r\n"
+        "a=rsaaeskey:VjVbxWcmYgbBbhwBNlCh3K0CMNtWoB844BuiHGUJT51zQS7SDpMnlb"
+        "BIobsKbfEJ3SCgWHRXjYWf7VQWRYtEcfx7ejA8xDIk5PSBYTvXP5dU2QoGrSBv0le"
+        "DS7t3t3tYWEZeUaimeZcNexHlSFpB0o2mFZFZ6LhaUkIntdUahuHsRQ4QmjmOuz6f"
+        "u0gJrbSeqoCuWBUT7xMwVIhXFzNhD0pKLnlwcmN8M0XHDzmTcSyUOPz7OPcQAw7Wm"
+        "tjk1wqEphqVmzv4kH5NidF3Uu1dzmBzjTSvDG2DKGOkhl3PZh8xv1wjmBtw4IPHS"
+        "kyJUmLcKIRRqqCmF6n4IjdC8HeWw\r\n"
+        "a=aesiv:zcZmAZtqh7uGcEwPXk0QeA\r\n"
+        "a=min-latency:11025\r\na=max-latency:88200\r\n"},
+    {"pcm",
+        "v=0\r\no=AirTunes 7709564614789383330 0 IN IP4 172.16.1.2\r\n"
+        "s=AirTunes\r\nc=IN IP4 172.16.1.3\r\nt=0 0\r\n"
+        "m=audio 0 RTP/AVP 96\r\na=rtpmap:96 L16/44100/2\r\n"
+        "a=fmtp:96 L16/44100/2\r\na=min-latency:3750\r\n"},
+    {"aac eld",
+        "v=0\r\no=AirTunes 2134625783 0 IN IP4 10.0.0.4\r\ns=AirTunes\r\n"
+        "c=IN IP4 10.0.0.5\r\nt=0 0\r\nm=audio 0 RTP/AVP 96\r\n"
+        "a=rtpmap:96 mpeg4-generic/44100/2\r\n"
+        "a=fmtp:96 mode=AAC-eld; constantDuration=480\r\n"
+        "a=rsaaeskey:5QYIqmdZGTONY5SHjEJrqAhaa0W9wzDC5i6q221mdGZJ5ubO6Kg\r\n"
+        "a=aesiv:zcZmAZtqh7uGcEwPXk0QeA\r\n"},
+};
+
+typedef struct {
+  char *fmtp;
+  bool key;
+  bool iv;
+} BenchResult;
+
+static int iterations = 100000;
+
+static GOptionEntry entries[] = {
+    {"iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+        "Parses per corpus entry", "N"},
+    {NULL},
+};
+
+static void
+bench_sdp (const unsigned char *buffer, size_t size, BenchResult *res)
+{
+  MeloAirplaySdp sdp;
+
+  if (!melo_airplay_sdp_parse (&sdp, buffer, size) || !sdp.rtpmap.str ||
+      !sdp.fmtp.str)
+    return;
+
+  res->fmtp = g_strndup (sdp.fmtp.str, sdp.fmtp.len);
+  res->key = sdp.rsaaeskey.str != NULL;
+  res->iv = sdp.aesiv.str != NULL;
+}
+
+static void
+bench_gst_sdp (const unsigned char *buffer, size_t size, BenchResult *res)
+{
+  const GstSDPMedia *media = NULL;
+  const char *rtpmap = NULL, *fmtp = NULL, *key = NULL, *iv = NULL;
+  GstSDPMessage *sdp;
+  unsigned int i, count;
+
+  gst_sdp_message_new (&sdp);
+  gst_sdp_message_init (sdp);
+  if (gst_sdp_message_parse_buffer (buffer, size, sdp) != GST_SDP_OK)
+    goto end;
+
+  /* Get audio media */
+  count = gst_sdp_message_medias_len (sdp);
+  for (i = 0; i < count; i++) {
+    const GstSDPMedia *m = gst_sdp_message_get_media (sdp, i);
+    if (!g_strcmp0 (gst_sdp_media_get_media (m), "audio")) {
+      media = m;
+      break;
+    }
+  }
+  if (!media)
+    goto end;
+
+  /* Walk attributes */
+  count = gst_sdp_media_attributes_len (media);
+  for (i = 0; i < count; i++) {
+    const GstSDPAttribute *attr = gst_sdp_media_get_attribute (media, i);
+
+    if (!g_strcmp0 (attr->key, "rtpmap"))
+      rtpmap = attr->value;
+    else if (!g_strcmp0 (attr->key, "fmtp"))
+      fmtp = attr->value;
+    else if (!g_strcmp0 (attr->key, "rsaaeskey"))
+      key = attr->value;
+    else if (!g_strcmp0 (attr->key, "aesiv"))
+      iv = attr->value;
+  }
+  if (rtpmap && fmtp) {
+    res->fmtp = g_strdup (fmtp);
+    res->key = key != NULL;
+    res->iv = iv != NULL;
+  }
+
+end:
+  gst_sdp_message_free (sdp);
+}
+
+static double
+bench_time (void (*parse) (const unsigned char *, size_t, BenchResult *),
+    const unsigned char *buffer, size_t size)
+{
+  BenchResult res;
+  gint64 start;
+  int i;
+
+  /* Time the whole loop, a single parse is below clock resolution */
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    res.fmtp = NULL;
+    parse (buffer, size, &res);
+    g_free (res.fmtp);
+  }
+
+  return (g_get_monotonic_time () - start) * 1000.0 / iterations;
+}
+
+static bool
+bench_entry (const char *name, const unsigned char *body, size_t size)
+{
+  BenchResult res = {0}, gst_res = {0};
+  double cost, gst_cost;
+  bool ret;
+
+  /* Both parsers must agree */
+  bench_sdp (body, size, &res);
+  bench_gst_sdp (body, size, &gst_res);
+  ret = !g_strcmp0 (res.fmtp, gst_res.fmtp) && res.key == gst_res.key &&
+        res.iv == gst_res.iv;
+  if (!ret)
+    fprintf (stderr, "%s: results differ: '%s' / '%s'\n", name,
+        res.fmtp ? res.fmtp : "(none)",
+        gst_res.fmtp ? gst_res.fmtp : "(none)");
+  g_free (res.fmtp);
+  g_free (gst_res.fmtp);
+
+  cost = bench_time (bench_sdp, body, size);
+  gst_cost = bench_time (bench_gst_sdp, body, size);
+  printf ("%-16s %5zu bytes: %8.1f ns, gst-sdp %8.1f ns (x%.1f)\n", name,
+      size, cost, gst_cost, gst_cost / cost);
+
+  return ret;
+}
+
+int
+main (int argc, char *argv[])
+{
+  GOptionContext *ctx;
+  GError *error = NULL;
+  unsigned int i;
+  char *body;
+  gsize size;
+  int ret = 0;
+
+  /* Parse options */
+  ctx = g_option_context_new ("[FILE...] - SDP parser benchmark");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  if (!g_option_context_parse (ctx, &argc, &argv, &error)) {
+    fprintf (stderr, "%s\n", error->message);
+    g_error_free (error);
+    g_option_context_free (ctx);
+    return 1;
+  }
+  g_option_context_free (ctx);
+  if (iterations < 1)
+    return 1;
+
+  /* Built-in corpus */
+  for (i = 0; i < G_N_ELEMENTS (corpus); i++)
+    if (!bench_entry (corpus[i].name, (const unsigned char *) corpus[i].body,
+            strlen (corpus[i].body)))
+      ret = 1;
+
+  /* Corpus files */
+  for (i = 1; i < (unsigned int) argc; i++) {
+    if (!g_file_get_contents (argv[i], &body, &size, NULL)) {
+      fprintf (stderr, "%s: failed to read\n", argv[i]);
+      ret = 1;
+      continue;
+    }
+    if (!bench_entry (argv[i], (const unsigned char *) body, size))
+      ret = 1;
+    g_free (body);
+  }
+
+  return ret;
+}
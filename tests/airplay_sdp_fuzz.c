@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+/*
+ * Corpus and mutation run of the SDP parser: each corpus entry is parsed and
+ * checked against its expected result, then randomly mutated (bit flips,
+ * truncation, inserted line endings and separators). Every input is copied
+ * to a buffer of its exact size, so that an over-read is caught by an
+ * address sanitizer build, and all returned values must lie in the input.
+ *
+ * Files given on command line are added to the corpus, without expected
+ * result.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "melo_airplay_sdp.h"
+
+typedef struct {
+  const char *name;
+  const char *body;
+  bool found;
+  const char *fmtp;
+} SdpEntry;
+
+static const SdpEntry corpus[] = {
+    {"itunes",
+        "v=0\r\no=iTunes 3413821438 0 IN IP4 192.168.1.10\r\ns=iTunes\r\n"
+        "c=IN IP4 192.168.1.20\r\nt=0 0\r\nm=audio 0 RTP/AVP 96\r\n"
+        "a=rtpmap:96 AppleLossless\r\n"
+        "a=fmtp:96 352 0 16 40 10 14 2 255 0 0 44100\r\n"
+        "a=rsaaeskey:5QYIqmdZGTONY5SHjEJrqAhaa0W9wzDC5i6q221mdGZJ5ubO6Kg\r\n"
+        "a=aesiv:zcZmAZtqh7uGcEwPXk0QeA\r\n",
+        true, "96 352 0 16 40 10 14 2 255 0 0 44100"},
+    {"lf", "v=0\nm=audio 0 RTP/AVP 96\na=fmtp:96 352\n", true, "96 352"},
+    {"no newline", "m=audio 0 RTP/AVP 96\r\na=fmtp:96", true, "96"},
+    {"empty value", "m=audio 0 RTP/AVP 96\r\na=fmtp:\r\n", true, ""},
+    {"no value", "m=audio 0 RTP/AVP 96\r\na=fmtp\r\na=fmtpx:1\r\n", true,
+        NULL},
+    {"first kept", "m=audio 0 RTP/AVP 96\na=fmtp:1\na=fmtp:2\n", true, "1"},
+    {"video first", "m=video 0 RTP/AVP 97\na=fmtp:97\nm=audio 0 RTP/AVP 96\n"
+                    "a=fmtp:96\n",
+        true, "96"},
+    {"second audio", "m=audio 0 RTP/AVP 96\na=fmtp:96\nm=audio 0 RTP/AVP 97\n"
+                     "a=fmtp:97\n",
+        true, "96"},
+    {"before media", "a=fmtp:95\nm=audio 0 RTP/AVP 96\n", true, NULL},
+    {"no audio", "v=0\r\nm=video 0 RTP/AVP 96\r\na=fmtp:96\r\n", false, NULL},
+    {"short media", "m=audio\r\na=fmtp:96\r\n", false, NULL},
+    {"empty", "", false, NULL},
+    {"newlines", "\n\r\n\r\r\n\n", false, NULL},
+    {"no separator", "m audio 0\nafmtp:96\n=\n", false, NULL},
+};
+
+/* Mutations per corpus entry */
+#define SDP_MUTATIONS 20000
+
+static bool
+sdp_check_value (const MeloAirplaySdpValue *value, const unsigned char *buf,
+    size_t size)
+{
+  const unsigned char *str = (const unsigned char *) value->str;
+
+  if (!str)
+    return !value->len;
+
+  return str >= buf && str <= buf + size && value->len <= size - (str - buf);
+}
+
+static bool
+sdp_parse (const unsigned char *data, size_t size, MeloAirplaySdp *sdp,
+    bool *found)
+{
+  unsigned char *buf;
+  bool ret;
+
+  /* Parse a copy of exact size */
+  buf = g_malloc (size);
+  if (size)
+    memcpy (buf, data, size);
+  *found = melo_airplay_sdp_parse (sdp, buf, size);
+  ret = sdp_check_value (&sdp->rtpmap, buf, size) &&
+        sdp_check_value (&sdp->fmtp, buf, size) &&
+        sdp_check_value (&sdp->rsaaeskey, buf, size) &&
+        sdp_check_value (&sdp->aesiv, buf, size);
+  g_free (buf);
+
+  return ret;
+}
+
+static bool
+sdp_check_entry (const SdpEntry *entry)
+{
+  MeloAirplaySdp sdp;
+  size_t len = strlen (entry->fmtp ? entry->fmtp : "");
+  bool found;
+
+  if (!sdp_parse ((const unsigned char *) entry->body, strlen (entry->body),
+          &sdp, &found))
+    return false;
+
+  /* Values are not kept after parse: only check presence and length */
+  return found == entry->found && !sdp.fmtp.str == !entry->fmtp &&
+         (!entry->fmtp || sdp.fmtp.len == len);
+}
+
+static void
+sdp_mutate (GRand *rand, GByteArray *data)
+{
+  static const unsigned char tokens[] = {'\n', '\r', '=', ':', ' ', 'm', 'a'};
+  guint pos, i, count;
+
+  count = g_rand_int_range (rand, 1, 5);
+  for (i = 0; i < count && data->len; i++) {
+    pos = g_rand_int_range (rand, 0, data->len);
+    switch (g_rand_int_range (rand, 0, 4)) {
+    case 0:
+      /* Flip a bit */
+      data->data[pos] ^= 1 << g_rand_int_range (rand, 0, 8);
+      break;
+    case 1:
+      /* Truncate */
+      g_byte_array_set_size (data, pos);
+      break;
+    case 2:
+      /* Insert a token */
+      g_byte_array_insert (data, pos,
+          &tokens[g_rand_int_range (rand, 0, sizeof (tokens))], 1);
+      break;
+    default:
+      /* Remove a byte */
+      g_byte_array_remove_index (data, pos);
+    }
+  }
+}
+
+static bool
+sdp_fuzz (GRand *rand, const unsigned char *body, size_t size)
+{
+  GByteArray *data;
+  MeloAirplaySdp sdp;
+  bool found;
+  int i;
+
+  data = g_byte_array_new ();
+  for (i = 0; i < SDP_MUTATIONS; i++) {
+    g_byte_array_set_size (data, 0);
+    g_byte_array_append (data, body, size);
+    sdp_mutate (rand, data);
+    if (!sdp_parse (data->data, data->len, &sdp, &found)) {
+      g_byte_array_unref (data);
+      return false;
+    }
+  }
+  g_byte_array_unref (data);
+
+  return true;
+}
+
+int
+main (int argc, char *argv[])
+{
+  GRand *rand;
+  char *body;
+  gsize size;
+  unsigned int i;
+  int ret = 0;
+
+  /* Reproducible mutations */
+  rand = g_rand_new_with_seed (0x5d9);
+
+  /* Built-in corpus */
+  for (i = 0; i < G_N_ELEMENTS (corpus); i++) {
+    if (!sdp_check_entry (&corpus[i])) {
+      fprintf (stderr, "%s: unexpected result\n", corpus[i].name);
+      ret = 1;
+    }
+    if (!sdp_fuzz (rand, (const unsigned char *) corpus[i].body,
+            strlen (corpus[i].body))) {
+      fprintf (stderr, "%s: value out of input\n", corpus[i].name);
+      ret = 1;
+    }
+  }
+
+  /* Corpus files */
+  for (i = 1; i < (unsigned int) argc; i++) {
+    if (!g_file_get_contents (argv[i], &body, &size, NULL)) {
+      fprintf (stderr, "%s: failed to read\n", argv[i]);
+      ret = 1;
+      continue;
+    }
+    if (!sdp_fuzz (rand, (const unsigned char *) body, size)) {
+      fprintf (stderr, "%s: value out of input\n", argv[i]);
+      ret = 1;
+    }
+    g_free (body);
+  }
+  g_rand_free (rand);
+
+  printf ("%u corpus entries, %d mutations each\n",
+      (unsigned int) G_N_ELEMENTS (corpus) + argc - 1, SDP_MUTATIONS);
+
+  return ret;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+/*
+ * Loopback benchmark of the time to first audio: sessions are started on a
+ * running Melo AirPlay receiver with the relay sender, then the receiver
+ * statistics are fetched with GET_PARAMETER to print the p50 / p99 of the
+ * time from first request to first audio buffer in the sink.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <gio/gio.h>
+
+#include "melo_airplay_relay.h"
+
+/* Default ALAC parameters: 352 frames, 16 bits, stereo, 44100 Hz */
+#define BENCH_FMTP "96 352 0 16 40 10 14 2 255 0 0 44100"
+#define BENCH_FRAMES 352
+#define BENCH_RATE 44100
+
+/* Uncompressed ALAC frame of silence: header, samples and end tag */
+#define BENCH_FRAME_SIZE 1412
+
+static char *host = "127.0.0.1";
+static int port = 5000;
+static int sessions = 20;
+static int duration = 5;
+
+static GOptionEntry entries[] = {
+    {"host", 'H', 0, G_OPTION_ARG_STRING, &host, "Receiver host", "HOST"},
+    {"port", 'p', 0, G_OPTION_ARG_INT, &port, "Receiver RTSP port", "PORT"},
+    {"sessions", 'n', 0, G_OPTION_ARG_INT, &sessions, "Session count", "N"},
+    {"duration", 'd', 0, G_OPTION_ARG_INT, &duration,
+        "Streaming duration of a session (in s)", "S"},
+    {NULL},
+};
+
+static void
+bench_silence_frame (uint8_t *frame)
+{
+  memset (frame, 0, BENCH_FRAME_SIZE);
+
+  /* Stereo element, no size, escape flag set: samples are not compressed */
+  frame[0] = 0x20;
+  frame[2] = 0x02;
+
+  /* End tag, after 23 header bits and 352 * 2 * 16 sample bits */
+  frame[1410] = 0x01;
+  frame[1411] = 0xc0;
+}
+
+static gpointer
+bench_stream (uint8_t *frame)
+{
+  MeloAirplayRelay *relay;
+  char *target;
+  gint64 next;
+  uint32_t rtptime = 0;
+  int i, count;
+
+  /* Start session */
+  target = g_strdup_printf ("%s:%d", host, port);
+  relay = melo_airplay_relay_new (target, BENCH_FMTP, BENCH_RATE);
+  g_free (target);
+  if (!relay)
+    return NULL;
+
+  /* Send frames in real time */
+  count = duration * BENCH_RATE / BENCH_FRAMES;
+  next = g_get_monotonic_time ();
+  for (i = 0; i < count; i++) {
+    gint64 now;
+
+    melo_airplay_relay_push (relay, rtptime, frame, BENCH_FRAME_SIZE);
+    rtptime += BENCH_FRAMES;
+
+    next += (gint64) BENCH_FRAMES * G_USEC_PER_SEC / BENCH_RATE;
+    now = g_get_monotonic_time ();
+    if (next > now)
+      g_usleep (next - now);
+  }
+
+  /* Stop session */
+  melo_airplay_relay_free (relay);
+
+  return NULL;
+}
+
+static char *
+bench_get_stats (void)
+{
+  static const char req[] = "GET_PARAMETER rtsp://localhost/stats RTSP/1.0\r\n"
+                            "CSeq: 1\r\n"
+                            "Content-Type: text/parameters\r\n"
+                            "Content-Length: 7\r\n"
+                            "\r\n"
+                            "stats\r\n";
+  GSocketConnection *conn;
+  GSocketClient *client;
+  GString *resp;
+  char buf[4096];
+  gssize n;
+
+  /* Connect to receiver */
+  client = g_socket_client_new ();
+  g_socket_client_set_timeout (client, 5);
+  conn = g_socket_client_connect_to_host (client, host, port, NULL, NULL);
+  g_object_unref (client);
+  if (!conn)
+    return NULL;
+
+  /* Send request and read response until receiver closes or stops */
+  resp = g_string_new (NULL);
+  if (g_output_stream_write_all (
+          g_io_stream_get_output_stream (G_IO_STREAM (conn)), req,
+          sizeof (req) - 1, NULL, NULL, NULL)) {
+    GInputStream *in = g_io_stream_get_input_stream (G_IO_STREAM (conn));
+
+    while ((n = g_input_stream_read (in, buf, sizeof (buf), NULL, NULL)) > 0) {
+      g_string_append_len (resp, buf, n);
+      if (strstr (resp->str, "\r\n\r\n") && strstr (resp->str, "sessions:"))
+        break;
+    }
+  }
+  g_object_unref (conn);
+
+  return g_string_free (resp, FALSE);
+}
+
+int
+main (int argc, char *argv[])
+{
+  uint8_t frame[BENCH_FRAME_SIZE];
+  GOptionContext *ctx;
+  GError *error = NULL;
+  char *stats, *line, *end;
+  GThread *thread;
+  int i;
+
+  /* Parse options */
+  ctx = g_option_context_new ("- AirPlay time to first audio benchmark");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  if (!g_option_context_parse (ctx, &argc, &argv, &error)) {
+    fprintf (stderr, "%s\n", error->message);
+    g_error_free (error);
+    g_option_context_free (ctx);
+    return 1;
+  }
+  g_option_context_free (ctx);
+  if (sessions < 1 || duration < 1)
+    return 1;
+
+  /* Run sessions, and get statistics while last one is streaming */
+  bench_silence_frame (frame);
+  for (i = 0; i < sessions - 1; i++)
+    bench_stream (frame);
+  thread =
+      g_thread_new ("bench_stream", (GThreadFunc) bench_stream, frame);
+  g_usleep ((gulong) duration * G_USEC_PER_SEC / 2);
+  stats = bench_get_stats ();
+  g_thread_join (thread);
+
+  /* Print time to first audio histogram */
+  line = stats ? strstr (stats, "time to first audio") : NULL;
+  line = line ? strstr (line, "sessions:") : NULL;
+  if (!line) {
+    fprintf (stderr, "no statistics from %s:%d\n", host, port);
+    g_free (stats);
+    return 1;
+  }
+  end = strchr (line, '\n');
+  if (end)
+    *end = '\0';
+  printf ("time to first audio (us) over %d sessions: %s\n", sessions,
+      line + 10);
+  g_free (stats);
+
+  return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * raop_eq_bench.c: Benchmark of the RAOP equalizer
+ *
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * A test tone is run through the equalizer in stereo (paired SIMD path) and
+ * in mono (generic scalar path): the processing cost per sample and section
+ * is printed for both, and each stereo channel is checked against the mono
+ * output.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gst/gst.h>
+#include <gst/audio/audio.h>
+
+#include "gstraopeq.h"
+
+/* Maximum difference between the stereo and mono outputs */
+#define BENCH_TOLERANCE 1e-5
+
+static int buffers = 10000;
+static double mhz;
+static char *bands =
+    "lowshelf:80:4:0.7,peak:250:-3:1.4,peak:1000:2:2,peak:4000:-4:1,"
+    "highshelf:10000:-2:0.7";
+
+static GOptionEntry entries[] = {
+    {"buffers", 'n', 0, G_OPTION_ARG_INT, &buffers,
+        "Count of 352 frames buffers", "N"},
+    {"mhz", 'm', 0, G_OPTION_ARG_DOUBLE, &mhz,
+        "CPU frequency to print cycles (in MHz, read from /proc by default)",
+        "MHZ"},
+    {"bands", 'b', 0, G_OPTION_ARG_STRING, &bands, "Equalizer sections",
+        "BANDS"},
+    {NULL},
+};
+
+static double
+bench_get_mhz (void)
+{
+  char *cpuinfo, *line;
+  double freq = 0;
+
+  if (!g_file_get_contents ("/proc/cpuinfo", &cpuinfo, NULL, NULL))
+    return 0;
+
+  line = strstr (cpuinfo, "cpu MHz");
+  if (line && (line = strchr (line, ':')))
+    freq = strtod (line + 1, NULL);
+  g_free (cpuinfo);
+
+  return freq;
+}
+
+static void
+bench_handoff_cb (GstElement *sink, GstBuffer *buffer, GstPad *pad,
+    GByteArray *out)
+{
+  GstMapInfo map;
+
+  if (gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+    g_byte_array_append (out, map.data, map.size);
+    gst_buffer_unmap (buffer, &map);
+  }
+}
+
+static GByteArray *
+bench_run (const char *format, int channels, double *cost)
+{
+  GstElement *pipeline, *eq, *sink;
+  GstMessage *msg;
+  GByteArray *out;
+  GError *error = NULL;
+  char *desc;
+
+  /* Create pipeline */
+  desc = g_strdup_printf ("audiotestsrc num-buffers=%d samplesperbuffer=352 "
+                          "wave=sine freq=997 ! audio/x-raw,format=%s,"
+                          "rate=44100,channels=%d,layout=interleaved ! "
+                          "raopeq name=eq ! fakesink name=sink sync=false "
+                          "signal-handoffs=true",
+      buffers, format, channels);
+  pipeline = gst_parse_launch (desc, &error);
+  g_free (desc);
+  if (!pipeline) {
+    fprintf (stderr, "failed to create pipeline: %s\n", error->message);
+    g_error_free (error);
+    return NULL;
+  }
+
+  /* Set sections and collect output */
+  out = g_byte_array_new ();
+  eq = gst_bin_get_by_name (GST_BIN (pipeline), "eq");
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+  g_object_set (eq, "bands", bands, NULL);
+  g_signal_connect (sink, "handoff", G_CALLBACK (bench_handoff_cb), out);
+
+  /* Run until end of stream */
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  msg = gst_bus_timed_pop_filtered (GST_ELEMENT_BUS (pipeline),
+      GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+    gst_message_parse_error (msg, &error, NULL);
+    fprintf (stderr, "pipeline error: %s\n", error->message);
+    g_error_free (error);
+    g_byte_array_unref (out);
+    out = NULL;
+  }
+  gst_message_unref (msg);
+  g_object_get (eq, "cost", cost, NULL);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (sink);
+  gst_object_unref (eq);
+  gst_object_unref (pipeline);
+
+  return out;
+}
+
+static void
+bench_print (const char *name, double cost)
+{
+  if (mhz > 0)
+    printf ("%-12s %6.2f ns, %6.1f cycles per sample and section\n", name,
+        cost, cost * mhz / 1000.0);
+  else
+    printf ("%-12s %6.2f ns per sample and section\n", name, cost);
+}
+
+int
+main (int argc, char *argv[])
+{
+  GByteArray *stereo, *mono, *s16;
+  GOptionContext *ctx;
+  GError *error = NULL;
+  const float *s, *m;
+  double cost, diff = 0;
+  size_t i, frames;
+  int ret = 1;
+
+  /* Parse options */
+  ctx = g_option_context_new ("- RAOP equalizer benchmark");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  g_option_context_add_group (ctx, gst_init_get_option_group ());
+  if (!g_option_context_parse (ctx, &argc, &argv, &error)) {
+    fprintf (stderr, "%s\n", error->message);
+    g_error_free (error);
+    g_option_context_free (ctx);
+    return 1;
+  }
+  g_option_context_free (ctx);
+  if (buffers < 1)
+    return 1;
+  if (mhz <= 0)
+    mhz = bench_get_mhz ();
+
+  /* Register element */
+  gst_raop_eq_plugin_init (NULL);
+
+  /* Run paired, generic and 16 bits paths */
+  stereo = bench_run (GST_AUDIO_NE (F32), 2, &cost);
+  if (!stereo)
+    return 1;
+  bench_print ("F32 stereo", cost);
+  mono = bench_run (GST_AUDIO_NE (F32), 1, &cost);
+  if (!mono)
+    goto end;
+  bench_print ("F32 mono", cost);
+  s16 = bench_run (GST_AUDIO_NE (S16), 2, &cost);
+  if (!s16)
+    goto end;
+  bench_print ("S16 stereo", cost);
+  g_byte_array_unref (s16);
+
+  /* Compare both stereo channels with mono output */
+  frames = mono->len / sizeof (float);
+  if (stereo->len != frames * 2 * sizeof (float)) {
+    fprintf (stderr, "output size mismatch: %u / %u\n", stereo->len,
+        mono->len);
+    goto end;
+  }
+  s = (const float *) stereo->data;
+  m = (const float *) mono->data;
+  for (i = 0; i < frames; i++) {
+    diff = MAX (diff, fabs (s[i * 2] - m[i]));
+    diff = MAX (diff, fabs (s[i * 2 + 1] - m[i]));
+  }
+  printf ("stereo / mono max difference: %g\n", diff);
+  ret = diff > BENCH_TOLERANCE;
+
+end:
+  if (mono)
+    g_byte_array_unref (mono);
+  g_byte_array_unref (stereo);
+
+  return ret;
+}
@@ -0,0 +1,166 @@
+/*
+ * raop_loudness_bench.c: Benchmark of the RAOP loudness normalizer
+ *
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * A 997 Hz sine at -20 dBFS on both channels is run through the loudness
+ * normalizer: the integrated loudness must read -20 LUFS (ITU-R BS.1770) and
+ * the processing cost per sample is printed.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gst/gst.h>
+#include <gst/audio/audio.h>
+
+#include "gstraoploudness.h"
+
+/* Expected integrated loudness and tolerance (in LUFS) */
+#define BENCH_LOUDNESS -20.0
+#define BENCH_TOLERANCE 0.1
+
+static int duration = 30;
+static double mhz;
+
+static GOptionEntry entries[] = {
+    {"duration", 'd', 0, G_OPTION_ARG_INT, &duration,
+        "Duration of the test tone (in s)", "S"},
+    {"mhz", 'm', 0, G_OPTION_ARG_DOUBLE, &mhz,
+        "CPU frequency to print cycles (in MHz, read from /proc by default)",
+        "MHZ"},
+    {NULL},
+};
+
+static double
+bench_get_mhz (void)
+{
+  char *cpuinfo, *line;
+  double freq = 0;
+
+  if (!g_file_get_contents ("/proc/cpuinfo", &cpuinfo, NULL, NULL))
+    return 0;
+
+  line = strstr (cpuinfo, "cpu MHz");
+  if (line && (line = strchr (line, ':')))
+    freq = strtod (line + 1, NULL);
+  g_free (cpuinfo);
+
+  return freq;
+}
+
+static bool
+bench_run (const char *format, double *loudness, double *cost)
+{
+  GstElement *pipeline, *meter;
+  GstMessage *msg;
+  GError *error = NULL;
+  bool ret = true;
+  char *desc;
+
+  /* Create pipeline: -20 dBFS is an amplitude of 0.1 */
+  desc = g_strdup_printf ("audiotestsrc num-buffers=%d samplesperbuffer=352 "
+                          "wave=sine freq=997 volume=0.1 ! audio/x-raw,"
+                          "format=%s,rate=44100,channels=2,"
+                          "layout=interleaved ! raoploudness name=meter ! "
+                          "fakesink sync=false",
+      duration * 44100 / 352, format);
+  pipeline = gst_parse_launch (desc, &error);
+  g_free (desc);
+  if (!pipeline) {
+    fprintf (stderr, "failed to create pipeline: %s\n", error->message);
+    g_error_free (error);
+    return false;
+  }
+  meter = gst_bin_get_by_name (GST_BIN (pipeline), "meter");
+
+  /* Run until end of stream */
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  msg = gst_bus_timed_pop_filtered (GST_ELEMENT_BUS (pipeline),
+      GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+    gst_message_parse_error (msg, &error, NULL);
+    fprintf (stderr, "pipeline error: %s\n", error->message);
+    g_error_free (error);
+    ret = false;
+  }
+  gst_message_unref (msg);
+  g_object_get (meter, "integrated", loudness, "cost", cost, NULL);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (meter);
+  gst_object_unref (pipeline);
+
+  return ret;
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const char *formats[] = {GST_AUDIO_NE (F32), GST_AUDIO_NE (S16)};
+  GOptionContext *ctx;
+  GError *error = NULL;
+  double loudness, cost;
+  int ret = 0;
+  unsigned int i;
+
+  /* Parse options */
+  ctx = g_option_context_new ("- RAOP loudness normalizer benchmark");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  g_option_context_add_group (ctx, gst_init_get_option_group ());
+  if (!g_option_context_parse (ctx, &argc, &argv, &error)) {
+    fprintf (stderr, "%s\n", error->message);
+    g_error_free (error);
+    g_option_context_free (ctx);
+    return 1;
+  }
+  g_option_context_free (ctx);
+  if (duration < 1)
+    return 1;
+  if (mhz <= 0)
+    mhz = bench_get_mhz ();
+
+  /* Register element */
+  gst_raop_loudness_plugin_init (NULL);
+
+  /* Measure both formats */
+  for (i = 0; i < G_N_ELEMENTS (formats); i++) {
+    if (!bench_run (formats[i], &loudness, &cost))
+      return 1;
+
+    if (mhz > 0)
+      printf ("%-6s %6.2f LUFS, %6.2f ns, %6.1f cycles per sample\n",
+          formats[i], loudness, cost, cost * mhz / 1000.0);
+    else
+      printf ("%-6s %6.2f LUFS, %6.2f ns per sample\n", formats[i], loudness,
+          cost);
+
+    if (fabs (loudness - BENCH_LOUDNESS) > BENCH_TOLERANCE) {
+      fprintf (stderr, "%s: integrated loudness is not %.1f LUFS\n",
+          formats[i], BENCH_LOUDNESS);
+      ret = 1;
+    }
+  }
+
+  return ret;
+}
@@ -0,0 +1,364 @@
+/*
+ * raop_queue_bench.c: Benchmark of the RAOP stage queues
+ *
+ * Copyright (C) 2020 Alexandre Dilly <dillya@sparod.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * An encrypted ALAC stream is pushed at its real rate through the decrypt and
+ * decode stages of the player, first on the streaming thread, then with a
+ * raopqueue before each stage as the stage_queue setting does. The CPU time
+ * used by the process, its context switches and the latency from push to sink
+ * are printed for each run.
+ *
+ * Without --cpus, the benchmark runs itself on 1, 2 and 4 CPUs (as taskset
+ * would), for each count available on the system.
+ *
+ * Frames are uncompressed ALAC frames, as sent by some senders, so the stream
+ * is built without an encoder.
+ */
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/rtp/gstrtpbuffer.h>
+
+#include <openssl/aes.h>
+
+#include "gstraopqueue.h"
+#include "gstrtpraopdepay.h"
+
+/* Stream format */
+#define BENCH_RATE 44100
+#define BENCH_FRAMES 352
+#define BENCH_CONFIG "96 352 0 16 40 10 14 2 255 0 0 44100"
+
+/* Uncompressed stereo frame: header, samples and end tag */
+#define BENCH_FRAME_BITS (23 + 32 + BENCH_FRAMES * 2 * 16 + 3)
+#define BENCH_FRAME_SIZE ((BENCH_FRAME_BITS + 7) / 8)
+
+typedef struct {
+  gint64 *pushed;
+  gint64 *latency;
+  int count;
+} BenchRun;
+
+static int duration = 5;
+static int cpus;
+static int queue_size;
+static int size = 32;
+
+static GOptionEntry entries[] = {
+    {"duration", 'd', 0, G_OPTION_ARG_INT, &duration,
+        "Duration of each run (in s)", "S"},
+    {"cpus", 'c', 0, G_OPTION_ARG_INT, &cpus,
+        "Run once on the first CPUs (all combinations by default)", "N"},
+    {"queue", 'q', 0, G_OPTION_ARG_INT, &queue_size,
+        "Stage queue size of single run (0 to disable)", "SIZE"},
+    {"size", 's', 0, G_OPTION_ARG_INT, &size,
+        "Stage queue size compared to no queue", "SIZE"},
+    {NULL},
+};
+
+static const guint8 bench_key[16] = {0x14, 0x49, 0x7d, 0xa2, 0x0c, 0xf5, 0x8b,
+    0x61, 0xd3, 0x3e, 0x90, 0x27, 0xbc, 0x58, 0xe1, 0x06};
+static const guint8 bench_iv[16] = {0x7a, 0x02, 0xc4, 0x91, 0x5e, 0xb8, 0x33,
+    0x0f, 0x66, 0xd9, 0x4a, 0x1c, 0xe7, 0x85, 0x20, 0xfb};
+
+static void
+bench_put_bits (guint8 *data, size_t *pos, guint32 value, int bits)
+{
+  while (bits--) {
+    if (value >> bits & 1)
+      data[*pos / 8] |= 0x80 >> (*pos % 8);
+    (*pos)++;
+  }
+}
+
+static GstBuffer *
+bench_packet (AES_KEY *key, guint16 seq)
+{
+  guint8 frame[BENCH_FRAME_SIZE] = {0}, iv[16];
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+  guint32 rtptime = (guint32) seq * BENCH_FRAMES;
+  GstBuffer *buf;
+  size_t pos = 0, aes_len;
+  guint8 *payload;
+  gint16 sample;
+  int i;
+
+  /* Stereo element, with size, not compressed */
+  bench_put_bits (frame, &pos, 1, 3);
+  bench_put_bits (frame, &pos, 0, 4 + 12);
+  bench_put_bits (frame, &pos, 1, 1);
+  bench_put_bits (frame, &pos, 0, 2);
+  bench_put_bits (frame, &pos, 1, 1);
+  bench_put_bits (frame, &pos, BENCH_FRAMES, 32);
+
+  /* Interleaved 16 bits samples of a 997 Hz tone, then end tag */
+  for (i = 0; i < BENCH_FRAMES; i++) {
+    sample = 8000 * sin (2 * G_PI * 997 * (rtptime + i) / BENCH_RATE);
+    bench_put_bits (frame, &pos, (guint16) sample, 16);
+    bench_put_bits (frame, &pos, (guint16) -sample, 16);
+  }
+  bench_put_bits (frame, &pos, 7, 3);
+
+  /* Build RTP packet with encrypted payload */
+  buf = gst_rtp_buffer_new_allocate (sizeof (frame), 0, 0);
+  gst_rtp_buffer_map (buf, GST_MAP_WRITE, &rtp);
+  gst_rtp_buffer_set_payload_type (&rtp, 96);
+  gst_rtp_buffer_set_seq (&rtp, seq);
+  gst_rtp_buffer_set_timestamp (&rtp, rtptime);
+  payload = gst_rtp_buffer_get_payload (&rtp);
+  aes_len = sizeof (frame) & ~0xf;
+  memcpy (iv, bench_iv, sizeof (iv));
+  AES_cbc_encrypt (frame, payload, aes_len, key, iv, AES_ENCRYPT);
+  memcpy (payload + aes_len, frame + aes_len, sizeof (frame) - aes_len);
+  gst_rtp_buffer_unmap (&rtp);
+
+  GST_BUFFER_PTS (buf) =
+      gst_util_uint64_scale_int (rtptime, GST_SECOND, BENCH_RATE);
+
+  return buf;
+}
+
+static void
+bench_handoff_cb (
+    GstElement *sink, GstBuffer *buffer, GstPad *pad, BenchRun *run)
+{
+  guint64 idx;
+
+  /* Packet index from timestamp */
+  idx = gst_util_uint64_scale_round (
+      GST_BUFFER_PTS (buffer), BENCH_RATE, GST_SECOND * BENCH_FRAMES);
+  if (idx < (guint64) run->count && run->pushed[idx])
+    run->latency[idx] = g_get_monotonic_time () - run->pushed[idx];
+}
+
+static int
+bench_cmp (const void *a, const void *b)
+{
+  gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static GstElement *
+bench_pipeline (int queue)
+{
+  GstElement *pipeline;
+  GError *error = NULL;
+  char *desc, *key, *iv, *q;
+
+  /* Same stages as the player, with an optional queue before each */
+  key = g_base64_encode (bench_key, sizeof (bench_key));
+  iv = g_base64_encode (bench_iv, sizeof (bench_iv));
+  q = queue ? g_strdup_printf ("raopqueue size=%d !", queue) : g_strdup ("");
+  desc = g_strdup_printf (
+      "appsrc name=src is-live=true format=time "
+      "caps=\"application/x-rtp,payload=96,clock-rate=%d,"
+      "encoding-name=ALAC,config=(string)\\\"%s\\\",key=(string)%s,"
+      "iv=(string)%s\" ! %s rtpraopdepay ! %s avdec_alac ! "
+      "fakesink name=sink sync=false signal-handoffs=true",
+      BENCH_RATE, BENCH_CONFIG, key, iv, q, q);
+  g_free (key);
+  g_free (iv);
+  g_free (q);
+
+  pipeline = gst_parse_launch (desc, &error);
+  g_free (desc);
+  if (!pipeline) {
+    fprintf (stderr, "failed to create pipeline: %s\n", error->message);
+    g_error_free (error);
+  }
+
+  return pipeline;
+}
+
+static gint64
+bench_usage (const struct rusage *start, const struct rusage *end, long *csw)
+{
+  *csw = end->ru_nvcsw - start->ru_nvcsw + end->ru_nivcsw - start->ru_nivcsw;
+
+  return (gint64) (end->ru_utime.tv_sec - start->ru_utime.tv_sec +
+                      end->ru_stime.tv_sec - start->ru_stime.tv_sec) *
+             G_USEC_PER_SEC +
+         end->ru_utime.tv_usec - start->ru_utime.tv_usec +
+         end->ru_stime.tv_usec - start->ru_stime.tv_usec;
+}
+
+static bool
+bench_run (int queue)
+{
+  GstElement *pipeline, *src, *sink;
+  struct rusage start_usage, end_usage;
+  GstBuffer **packets;
+  BenchRun run;
+  AES_KEY key;
+  gint64 start, next, wall, cpu;
+  long csw;
+  int i, done = 0;
+
+  pipeline = bench_pipeline (queue);
+  if (!pipeline)
+    return false;
+
+  /* Build packets before run, not to measure it */
+  run.count = duration * BENCH_RATE / BENCH_FRAMES;
+  packets = g_new (GstBuffer *, run.count);
+  AES_set_encrypt_key (bench_key, 128, &key);
+  for (i = 0; i < run.count; i++)
+    packets[i] = bench_packet (&key, i);
+
+  /* Collect latency on sink */
+  run.pushed = g_new0 (gint64, run.count);
+  run.latency = g_new (gint64, run.count);
+  for (i = 0; i < run.count; i++)
+    run.latency[i] = -1;
+  src = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+  g_signal_connect (sink, "handoff", G_CALLBACK (bench_handoff_cb), &run);
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  /* Push packets at stream rate */
+  getrusage (RUSAGE_SELF, &start_usage);
+  start = g_get_monotonic_time ();
+  for (i = 0; i < run.count; i++) {
+    run.pushed[i] = g_get_monotonic_time ();
+    if (gst_app_src_push_buffer (GST_APP_SRC (src), packets[i]) !=
+        GST_FLOW_OK)
+      break;
+
+    next = start +
+           (gint64) (i + 1) * BENCH_FRAMES * G_USEC_PER_SEC / BENCH_RATE;
+    if (next > g_get_monotonic_time ())
+      g_usleep (next - g_get_monotonic_time ());
+  }
+  for (i++; i < run.count; i++)
+    gst_buffer_unref (packets[i]);
+  gst_app_src_end_of_stream (GST_APP_SRC (src));
+  gst_message_unref (gst_bus_timed_pop_filtered (GST_ELEMENT_BUS (pipeline),
+      GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+  getrusage (RUSAGE_SELF, &end_usage);
+  wall = g_get_monotonic_time () - start;
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+
+  /* Print CPU time, context switches and latency */
+  cpu = bench_usage (&start_usage, &end_usage, &csw);
+  for (i = 0; i < run.count; i++)
+    if (run.latency[i] >= 0)
+      run.latency[done++] = run.latency[i];
+  if (done) {
+    qsort (run.latency, done, sizeof (*run.latency), bench_cmp);
+    printf ("%d cpu, queue %3d: cpu %5.2f %% (%5.1f us per packet), "
+            "%5.2f switches per packet, latency p50 %5" G_GINT64_FORMAT
+            " us, p99 %5" G_GINT64_FORMAT " us, max %6" G_GINT64_FORMAT
+            " us\n",
+        cpus, queue, cpu * 100.0 / wall, (double) cpu / run.count,
+        (double) csw / run.count, run.latency[done / 2],
+        run.latency[done * 99 / 100], run.latency[done - 1]);
+  }
+
+  gst_object_unref (sink);
+  gst_object_unref (src);
+  gst_object_unref (pipeline);
+  g_free (packets);
+  g_free (run.pushed);
+  g_free (run.latency);
+
+  return done == run.count;
+}
+
+static bool
+bench_spawn (const char *prog, int n, int queue)
+{
+  char d[16], c[16], q[16];
+  char *argv[] = {(char *) prog, "-d", d, "-c", c, "-q", q, NULL};
+  GError *error = NULL;
+  int status;
+
+  g_snprintf (d, sizeof (d), "%d", duration);
+  g_snprintf (c, sizeof (c), "%d", n);
+  g_snprintf (q, sizeof (q), "%d", queue);
+
+  /* Run in a new process, so all its threads are bound to the CPUs */
+  fflush (stdout);
+  if (!g_spawn_sync (NULL, argv, NULL, G_SPAWN_DEFAULT, NULL, NULL, NULL,
+          NULL, &status, &error)) {
+    fprintf (stderr, "failed to run benchmark: %s\n", error->message);
+    g_error_free (error);
+    return false;
+  }
+
+  return g_spawn_check_exit_status (status, NULL);
+}
+
+int
+main (int argc, char *argv[])
+{
+  GOptionContext *ctx;
+  GError *error = NULL;
+  cpu_set_t set;
+  bool ret = true;
+  int i;
+
+  /* Parse options */
+  ctx = g_option_context_new ("- RAOP stage queues benchmark");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  if (!g_option_context_parse (ctx, &argc, &argv, &error)) {
+    fprintf (stderr, "%s\n", error->message);
+    g_error_free (error);
+    g_option_context_free (ctx);
+    return 1;
+  }
+  g_option_context_free (ctx);
+  if (duration < 1 || cpus < 0 || queue_size < 0 || size < 2)
+    return 1;
+
+  /* Run all combinations */
+  if (!cpus) {
+    for (i = 1; i <= 4 && i <= (int) g_get_num_processors (); i *= 2) {
+      ret &= bench_spawn (argv[0], i, 0);
+      ret &= bench_spawn (argv[0], i, size);
+    }
+    return ret ? 0 : 1;
+  }
+
+  /* Bind process to first CPUs, before any thread is created */
+  CPU_ZERO (&set);
+  for (i = 0; i < cpus; i++)
+    CPU_SET (i, &set);
+  if (sched_setaffinity (0, sizeof (set), &set)) {
+    perror ("sched_setaffinity");
+    return 1;
+  }
+
+  /* Register elements */
+  gst_init (NULL, NULL);
+  gst_raop_queue_plugin_init (NULL);
+  gst_rtp_raop_depay_plugin_init (NULL);
+
+  return bench_run (queue_size) ? 0 : 1;
+}